@@ -15,6 +15,56 @@ static int split_line(char *cfgline, size_t size, char **name, char **value)
 	return 0;
 }
 
+/**
+ * parse_int_list - parse a comma separated list of integer between min and max
+ * @value: string to parse
+ * @list: where to store the malloc(2) allocated list
+ * @n: where to store the number of element of the list
+ */
+static int parse_int_list(char *value, int min, int max, int **list, size_t *n)
+{
+	char **tokens = NULL;
+	char *errptr = NULL;
+	size_t ntokens = 0;
+	tokens = string_split_char_token(value, ',');
+	if (tokens == NULL)
+		return -1;
+	ntokens = string_count_string_list_size(tokens);
+	free(*list);
+	*list = calloc(ntokens, sizeof(**list));
+	if (*list == NULL) {
+		string_free_string_list(tokens);
+		return -1;
+	}
+	for (*n = 0; *n < ntokens; ++(*n)) {
+		(*list)[*n] = strtol(tokens[*n], &errptr, 10);
+		if (*errptr != '\0' || (*list)[*n] < min || (*list)[*n] > max) {
+			string_free_string_list(tokens);
+			return -1;
+		}
+	}
+	string_free_string_list(tokens);
+	return 0;
+}
+
+/**
+ * add_cache_rule - append the rule in value to the caching policies
+ * @cfg: config being parsed
+ * @value: rule written as pattern=max_age[:immutable]
+ */
+static int add_cache_rule(struct config *cfg, char *value)
+{
+	struct cache_rule *rules = NULL;
+	rules = realloc(cfg->cache_rules, (cfg->cache_rules_n + 1) * sizeof(*rules));
+	if (rules == NULL)
+		return -1;
+	cfg->cache_rules = rules;
+	if (cache_rule_parse(value, &rules[cfg->cache_rules_n]) < 0)
+		return -1;
+	cfg->cache_rules_n++;
+	return 0;
+}
+
 static int parse_value(struct config *cfg, char *name, char *value)
 {
 	char *errptr = NULL;
@@ -46,6 +96,22 @@ static int parse_value(struct config *cfg, char *name, char *value)
 		cfg->timeout = strtol(value, &errptr, 10);
 		if (*errptr != '\0' || cfg->thread_number < 0)
 			return -1;
+	} else if (strcmp(name, "keepalive_timeout") == 0) {
+		cfg->keepalive_timeout = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->keepalive_timeout < 0)
+			return -1;
+	} else if (strcmp(name, "header_timeout") == 0) {
+		cfg->header_timeout = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->header_timeout < 0)
+			return -1;
+	} else if (strcmp(name, "send_timeout") == 0) {
+		cfg->send_timeout = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->send_timeout < 0)
+			return -1;
+	} else if (strcmp(name, "request_deadline") == 0) {
+		cfg->request_deadline = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->request_deadline < 0)
+			return -1;
 	} else if (strcmp(name, "port") == 0) {
 		cfg->port = strdup(value);
 		if (cfg->port == NULL)
@@ -54,6 +120,10 @@ static int parse_value(struct config *cfg, char *name, char *value)
 		cfg->backlog = strtol(value, &errptr, 10);
 		if (*errptr != '\0' || cfg->backlog < 0)
 			return -1;
+	} else if (strcmp(name, "accept_queue_size") == 0) {
+		cfg->accept_queue_size = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->accept_queue_size < 0)
+			return -1;
 	} else if (strcmp(name, "http_max_request_size") == 0) {
 		cfg->http_max_request_size = strtol(value, &errptr, 10);
 		if (*errptr != '\0') 
@@ -62,6 +132,104 @@ static int parse_value(struct config *cfg, char *name, char *value)
 		cfg->http_max_response_size = strtol(value, &errptr, 10);
 		if (*errptr != '\0')
 			return -1;
+	} else if (strcmp(name, "image_variants") == 0) {
+		if (parse_int_list(value, 1, 99, &cfg->image_variants,
+				   &cfg->image_variants_n) < 0)
+			return -1;
+	} else if (strcmp(name, "image_decode_cache_size") == 0) {
+		cfg->image_decode_cache_size = strtoul(value, &errptr, 10);
+		if (*errptr != '\0')
+			return -1;
+	} else if (strcmp(name, "image_decode_cache_ttl") == 0) {
+		cfg->image_decode_cache_ttl = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->image_decode_cache_ttl < 0)
+			return -1;
+	} else if (strcmp(name, "image_quality_mode") == 0) {
+		if (strcmp(value, "qvalue") == 0)
+			cfg->image_quality_mode = QUALITY_QVALUE;
+		else if (strcmp(value, "bytes") == 0)
+			cfg->image_quality_mode = QUALITY_BYTES;
+		else if (strcmp(value, "ssim") == 0)
+			cfg->image_quality_mode = QUALITY_SSIM;
+		else
+			return -1;
+	} else if (strcmp(name, "image_target_ratio") == 0) {
+		cfg->image_target_ratio = strtod(value, &errptr);
+		if (*errptr != '\0' || cfg->image_target_ratio <= 0.0 ||
+		    cfg->image_target_ratio > 1.0)
+			return -1;
+	} else if (strcmp(name, "image_min_ssim") == 0) {
+		cfg->image_min_ssim = strtod(value, &errptr);
+		if (*errptr != '\0' || cfg->image_min_ssim <= 0.0 ||
+		    cfg->image_min_ssim > 1.0)
+			return -1;
+	} else if (strcmp(name, "image_max_trials") == 0) {
+		cfg->image_max_trials = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->image_max_trials < 0)
+			return -1;
+	} else if (strcmp(name, "image_min_quality") == 0) {
+		cfg->image_min_quality = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->image_min_quality < 0 ||
+		    cfg->image_min_quality > 95)
+			return -1;
+	} else if (strcmp(name, "image_degrade_jobs") == 0) {
+		cfg->image_degrade_jobs = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->image_degrade_jobs < 0)
+			return -1;
+	} else if (strcmp(name, "image_degrade_utilization") == 0) {
+		cfg->image_degrade_utilization = strtod(value, &errptr);
+		if (*errptr != '\0' || cfg->image_degrade_utilization <= 0.0 ||
+		    cfg->image_degrade_utilization > 1.0)
+			return -1;
+	} else if (strcmp(name, "image_helpers") == 0) {
+		cfg->image_helpers = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->image_helpers < 0)
+			return -1;
+	} else if (strcmp(name, "image_helper_memory") == 0) {
+		cfg->image_helper_memory = strtoul(value, &errptr, 10);
+		if (*errptr != '\0')
+			return -1;
+	} else if (strcmp(name, "cache_index_memory") == 0) {
+		cfg->cache_index_memory = strtoul(value, &errptr, 10);
+		if (*errptr != '\0')
+			return -1;
+	} else if (strcmp(name, "negative_cache_ttl") == 0) {
+		cfg->negative_cache_ttl = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->negative_cache_ttl < 0)
+			return -1;
+	} else if (strcmp(name, "server_manifest") == 0) {
+		free(cfg->server_manifest);
+		cfg->server_manifest = strdup(value);
+		if (cfg->server_manifest == NULL)
+			return -1;
+	} else if (strcmp(name, "cache_policy") == 0) {
+		if (add_cache_rule(cfg, value) < 0)
+			return -1;
+	} else if (strcmp(name, "tls_certificate") == 0) {
+		free(cfg->tls_certificate);
+		cfg->tls_certificate = strdup(value);
+		if (cfg->tls_certificate == NULL)
+			return -1;
+	} else if (strcmp(name, "tls_private_key") == 0) {
+		free(cfg->tls_private_key);
+		cfg->tls_private_key = strdup(value);
+		if (cfg->tls_private_key == NULL)
+			return -1;
+	} else if (strcmp(name, "tls_ktls") == 0) {
+		if (strcmp(value, "on") == 0)
+			cfg->tls_disable_ktls = false;
+		else if (strcmp(value, "off") == 0)
+			cfg->tls_disable_ktls = true;
+		else
+			return -1;
+	} else if (strcmp(name, "tls_session_cache") == 0) {
+		cfg->tls_session_cache = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->tls_session_cache < 0)
+			return -1;
+	} else if (strcmp(name, "tls_session_timeout") == 0) {
+		cfg->tls_session_timeout = strtol(value, &errptr, 10);
+		if (*errptr != '\0' || cfg->tls_session_timeout < 0)
+			return -1;
 	} else {
 		return -1;
 	}
@@ -81,6 +249,14 @@ static void clean_cfg(struct config *cfg)
 		free(cfg->port);
 	if (cfg->server_index)
 		free(cfg->server_index);
+	free(cfg->server_manifest);
+	if (cfg->image_variants)
+		free(cfg->image_variants);
+	for (size_t i = 0; i < cfg->cache_rules_n; ++i)
+		cache_rule_free(&cfg->cache_rules[i]);
+	free(cfg->cache_rules);
+	free(cfg->tls_certificate);
+	free(cfg->tls_private_key);
 }
 
 static int cfg_set_default(struct config *cfg)
@@ -95,12 +271,49 @@ static int cfg_set_default(struct config *cfg)
 		cfg->thread_number = 1;
 	if (cfg->backlog == 0)
 		cfg->backlog = 10;
+	if (cfg->accept_queue_size == 0)
+		cfg->accept_queue_size = 64;
 	if (cfg->http_max_request_size == 0)
 		cfg->http_max_request_size = 8192;
 	if (cfg->http_max_response_size == 0)
 		cfg->http_max_response_size = 8192;
 	if (cfg->timeout == 0)
 		cfg->timeout = 5;
+	if (cfg->keepalive_timeout == 0)
+		cfg->keepalive_timeout = 15;
+	if (cfg->header_timeout == 0)
+		cfg->header_timeout = 10;
+	if (cfg->send_timeout == 0)
+		cfg->send_timeout = 30;
+	if (cfg->request_deadline == 0)
+		cfg->request_deadline = 30;
+	if (cfg->cache_index_memory == 0)
+		cfg->cache_index_memory = 16 * 1024 * 1024;
+	if (cfg->negative_cache_ttl == 0)
+		cfg->negative_cache_ttl = 5;
+	if (cfg->image_decode_cache_size == 0)
+		cfg->image_decode_cache_size = 64 * 1024 * 1024;
+	if (cfg->image_decode_cache_ttl == 0)
+		cfg->image_decode_cache_ttl = 10;
+	if (cfg->image_target_ratio == 0.0)
+		cfg->image_target_ratio = 0.5;
+	if (cfg->image_min_ssim == 0.0)
+		cfg->image_min_ssim = 0.95;
+	if (cfg->image_max_trials == 0)
+		cfg->image_max_trials = 6;
+	if (cfg->image_min_quality == 0)
+		cfg->image_min_quality = 20;
+	if (cfg->image_degrade_jobs == 0)
+		cfg->image_degrade_jobs = (cfg->thread_number > 1) ?
+			cfg->thread_number / 2 : 1;
+	if (cfg->image_degrade_utilization == 0.0)
+		cfg->image_degrade_utilization = 0.8;
+	if (cfg->image_helper_memory == 0)
+		cfg->image_helper_memory = 1024 * 1024 * 1024;
+	if (cfg->tls_session_cache == 0)
+		cfg->tls_session_cache = 20480;
+	if (cfg->tls_session_timeout == 0)
+		cfg->tls_session_timeout = 7200;
 	if (cfg->server_root == NULL) {
 		cfg->server_root = strdup("root");
 		if (cfg->server_root == NULL) {
@@ -131,6 +344,16 @@ static int cfg_set_default(struct config *cfg)
 			return -1;
 		}
 	}
+	if (cfg->server_manifest == NULL) {
+		cfg->server_manifest = string_concat(cfg->server_cache, "/manifest");
+		if (cfg->server_manifest == NULL) {
+			free(cfg->server_root);
+			free(cfg->server_cache);
+			free(cfg->server_index);
+			free(cfg->port);
+			return -1;
+		}
+	}
 	return 0;
 }
 
@@ -0,0 +1,564 @@
+#include "image_helper.h"
+#include <dirent.h>
+
+/* fd of the socket connected to the server, in a helper */
+#define HELPER_FD 3
+/* max variants of a single request, bigger jobs are split */
+#define HELPER_MAX_VARIANTS 16
+/* max fds passed with a request: the source and the destinations */
+#define HELPER_MAX_FDS (HELPER_MAX_VARIANTS + 1)
+/* ms between two polls of the cancellation token while a helper works */
+#define HELPER_POLL_INTERVAL_MS 50
+#define FD_PATH_SIZE 32
+#define ARG_SIZE 32
+
+#define MIN(a, b) ((a < b) ? a : b)
+
+enum helper_op {
+	HELPER_COMPRESS,
+	HELPER_SEARCH
+};
+
+/**
+ * helper_request - request sent to a helper, with the fds of the files
+ * @op: what to do
+ * @n: number of variants, HELPER_COMPRESS only
+ * @quality: quality of every variant
+ * @width: width of every variant
+ * @target: target of the search, HELPER_SEARCH only
+ * the first fd is the source, the others the destinations of the variants.
+ */
+struct helper_request {
+	enum helper_op op;
+	size_t n;
+	int quality[HELPER_MAX_VARIANTS];
+	int width[HELPER_MAX_VARIANTS];
+	struct quality_target target;
+};
+
+/**
+ * helper_reply - reply of a helper
+ * @res: return value of the call
+ * @err: errno after the call
+ * @status: status of every variant, HELPER_COMPRESS only
+ */
+struct helper_reply {
+	int res;
+	int err;
+	int status[HELPER_MAX_VARIANTS];
+};
+
+/**
+ * image_helper - a helper process
+ * @pid: pid of the helper
+ * @sock: socket connected to the helper, -1 if the helper is not running
+ * @busy: true while a request is served
+ */
+struct image_helper {
+	pid_t pid;
+	int sock;
+	bool busy;
+};
+
+/**
+ * helper_pool - helpers of the server
+ * @helpers: the helpers
+ * @n: number of helpers, 0 if the image work is done in-process
+ * @settings: settings the helpers are started with
+ * @mutex: sync access to the pool
+ * @cond: signaled when a helper is released
+ */
+static struct helper_pool {
+	struct image_helper *helpers;
+	int n;
+	struct image_helper_settings settings;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+static ssize_t send_fds(int sock, const void *buf, size_t len, const int *fds, size_t n)
+{
+	struct msghdr msg = {0};
+	struct iovec iov = {0};
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HELPER_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cmsg = NULL;
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (n > 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+	}
+	return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+/**
+ * recv_fds - receive a message and the fds passed with it
+ * @n: max number of fds to receive, then where to store the number received
+ */
+static ssize_t recv_fds(int sock, void *buf, size_t len, int *fds, size_t *n)
+{
+	struct msghdr msg = {0};
+	struct iovec iov = {0};
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HELPER_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cmsg = NULL;
+	size_t max = *n;
+	ssize_t rd = 0;
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	*n = 0;
+	rd = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (rd <= 0)
+		return rd;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		size_t count = 0;
+		int *received = NULL;
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		received = (int *)CMSG_DATA(cmsg);
+		for (size_t i = 0; i < count; ++i) {
+			if (*n < max)
+				fds[(*n)++] = received[i];
+			else
+				close(received[i]);
+		}
+	}
+	return rd;
+}
+
+static void close_fds(const int *fds, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+}
+
+/**
+ * spawn_helper - start a helper process
+ * @helper: where to store the pid and the socket of the helper
+ * the helper is the server executable run again, so that nothing but
+ * async-signal-safe calls happen between fork(2) and execv(3) even if
+ * the server is multi-threaded.
+ */
+static int spawn_helper(struct image_helper *helper)
+{
+	char limit[ARG_SIZE] = {0};
+	char cache_size[ARG_SIZE] = {0};
+	char cache_ttl[ARG_SIZE] = {0};
+	char name[] = "qwhelper";
+	char arg[] = IMAGE_HELPER_ARG;
+	char *argv[] = { name, arg, limit, cache_size, cache_ttl, NULL };
+	int sv[2] = {-1, -1};
+	pid_t pid = 0;
+	snprintf(limit, ARG_SIZE, "%zu", pool.settings.memory_limit);
+	snprintf(cache_size, ARG_SIZE, "%zu", pool.settings.ips.decode_cache_size);
+	snprintf(cache_ttl, ARG_SIZE, "%d", pool.settings.ips.decode_cache_ttl);
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+		return -1;
+	pid = fork();
+	if (pid < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		if (sv[1] == HELPER_FD) {
+			if (fcntl(sv[1], F_SETFD, 0) < 0)
+				_exit(127);
+		} else if (dup2(sv[1], HELPER_FD) < 0) {
+			_exit(127);
+		}
+		execv("/proc/self/exe", argv);
+		_exit(127);
+	}
+	close(sv[1]);
+	helper->pid = pid;
+	helper->sock = sv[0];
+	helper->busy = false;
+	return 0;
+}
+
+/**
+ * kill_helper - stop a helper and reap it
+ * must be called with pool.mutex held.
+ */
+static void kill_helper(struct image_helper *helper)
+{
+	if (helper->sock < 0)
+		return;
+	close(helper->sock);
+	kill(helper->pid, SIGKILL);
+	waitpid(helper->pid, NULL, 0);
+	helper->sock = -1;
+	helper->pid = -1;
+}
+
+int image_helper_pool_start(const struct image_helper_settings *ihs)
+{
+	if (ihs == NULL || ihs->helpers <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	pool.helpers = calloc(ihs->helpers, sizeof(*pool.helpers));
+	if (pool.helpers == NULL)
+		return -1;
+	pool.settings = *ihs;
+	for (int i = 0; i < ihs->helpers; ++i) {
+		pool.helpers[i].sock = -1;
+		if (spawn_helper(&pool.helpers[i]) < 0) {
+			for (int j = 0; j < i; ++j)
+				kill_helper(&pool.helpers[j]);
+			free(pool.helpers);
+			pool.helpers = NULL;
+			return -1;
+		}
+	}
+	pool.n = ihs->helpers;
+	return 0;
+}
+
+void image_helper_pool_stop(void)
+{
+	pthread_mutex_lock(&pool.mutex);
+	for (int i = 0; i < pool.n; ++i)
+		kill_helper(&pool.helpers[i]);
+	free(pool.helpers);
+	pool.helpers = NULL;
+	pool.n = 0;
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+bool image_helper_pool_active(void)
+{
+	return pool.n > 0;
+}
+
+/**
+ * acquire_helper - return an idle helper, waiting for one if all are busy
+ * a helper that could not be restarted is started again here.
+ */
+static struct image_helper *acquire_helper(void)
+{
+	struct image_helper *helper = NULL;
+	pthread_mutex_lock(&pool.mutex);
+	while (helper == NULL) {
+		for (int i = 0; i < pool.n; ++i) {
+			if (!pool.helpers[i].busy) {
+				helper = &pool.helpers[i];
+				break;
+			}
+		}
+		if (helper == NULL)
+			pthread_cond_wait(&pool.cond, &pool.mutex);
+	}
+	if (helper->sock < 0 && spawn_helper(helper) < 0) {
+		pthread_mutex_unlock(&pool.mutex);
+		return NULL;
+	}
+	helper->busy = true;
+	pthread_mutex_unlock(&pool.mutex);
+	return helper;
+}
+
+/**
+ * release_helper - give a helper back to the pool
+ * @broken: the helper crashed, or is still working on a cancelled
+ * request, and must be replaced
+ */
+static void release_helper(struct image_helper *helper, bool broken)
+{
+	pthread_mutex_lock(&pool.mutex);
+	if (broken) {
+		kill_helper(helper);
+		if (spawn_helper(helper) < 0)
+			syslog(LOG_ERR, "%s: %s\n", "can't restart image helper",
+			       strerror(errno));
+	}
+	helper->busy = false;
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+/**
+ * helper_call - send a request to a helper and wait for its reply
+ * return -1 if the helper is broken or the request was cancelled.
+ */
+static int helper_call(struct image_helper *helper,
+		       const struct helper_request *req,
+		       const int *fds,
+		       size_t n_fds,
+		       struct helper_reply *reply,
+		       const struct image_cancel *cancel)
+{
+	struct pollfd pfd = {0};
+	ssize_t rd = 0;
+	int ready = 0;
+	if (send_fds(helper->sock, req, sizeof(*req), fds, n_fds) < 0)
+		return -1;
+	pfd.fd = helper->sock;
+	pfd.events = POLLIN;
+	for (;;) {
+		ready = poll(&pfd, 1, HELPER_POLL_INTERVAL_MS);
+		if (ready < 0 && errno != EINTR)
+			return -1;
+		if (ready > 0)
+			break;
+		if (image_cancelled(cancel)) {
+			errno = ECANCELED;
+			return -1;
+		}
+	}
+	rd = recv(helper->sock, reply, sizeof(*reply), 0);
+	if (rd != sizeof(*reply)) {
+		// a helper killed by a signal or by its rlimit closes the socket
+		if (rd >= 0)
+			errno = EPIPE;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * run_request - run a request on an idle helper
+ * return 0 if the helper replied, -1 otherwise.
+ */
+static int run_request(const struct helper_request *req,
+		       const int *fds,
+		       size_t n_fds,
+		       struct helper_reply *reply,
+		       const struct image_cancel *cancel)
+{
+	struct image_helper *helper = NULL;
+	int res = 0;
+	int err = 0;
+	helper = acquire_helper();
+	if (helper == NULL)
+		return -1;
+	res = helper_call(helper, req, fds, n_fds, reply, cancel);
+	err = errno;
+	if (res < 0 && err != ECANCELED)
+		syslog(LOG_ERR, "%s %d: %s\n", "image helper failed, restarting helper",
+		       (int)helper->pid, strerror(err));
+	release_helper(helper, res < 0);
+	errno = err;
+	return res;
+}
+
+static int compress_chunk(const char *src,
+			  struct image_variant *variants,
+			  size_t n,
+			  const struct image_cancel *cancel)
+{
+	struct helper_request req = {0};
+	struct helper_reply reply = {0};
+	int fds[HELPER_MAX_FDS] = {0};
+	int res = 0;
+	int err = 0;
+	for (size_t i = 0; i < HELPER_MAX_FDS; ++i)
+		fds[i] = -1;
+	fds[0] = open(src, O_RDONLY | O_CLOEXEC);
+	if (fds[0] < 0)
+		return -1;
+	req.op = HELPER_COMPRESS;
+	req.n = n;
+	for (size_t i = 0; i < n; ++i) {
+		fds[i + 1] = open(variants[i].dest,
+				  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fds[i + 1] < 0) {
+			err = errno;
+			close_fds(fds, i + 1);
+			for (size_t j = 0; j < i; ++j)
+				unlink(variants[j].dest);
+			errno = err;
+			return -1;
+		}
+		req.quality[i] = variants[i].quality;
+		req.width[i] = variants[i].width;
+	}
+	res = run_request(&req, fds, n + 1, &reply, cancel);
+	err = errno;
+	if (res == 0) {
+		res = reply.res;
+		err = reply.err;
+	}
+	close_fds(fds, n + 1);
+	for (size_t i = 0; i < n; ++i) {
+		variants[i].status = (res < 0 && reply.res == 0) ? -1 : reply.status[i];
+		if (variants[i].status < 0)
+			unlink(variants[i].dest);
+	}
+	errno = err;
+	return res;
+}
+
+int image_helper_compress(const char *src,
+			  struct image_variant *variants,
+			  size_t n,
+			  const struct image_cancel *cancel)
+{
+	int res = 0;
+	if (src == NULL || variants == NULL || n == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (size_t i = 0; i < n; i += HELPER_MAX_VARIANTS) {
+		if (compress_chunk(src, variants + i, MIN(n - i, HELPER_MAX_VARIANTS),
+				   cancel) == 0)
+			continue;
+		res = -1;
+		if (errno == ECANCELED)
+			break;
+	}
+	return res;
+}
+
+int image_helper_search(const char *src,
+			const struct quality_target *target,
+			const struct image_cancel *cancel)
+{
+	struct helper_request req = {0};
+	struct helper_reply reply = {0};
+	int fd = 0;
+	int res = 0;
+	int err = 0;
+	if (src == NULL || target == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	fd = open(src, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	req.op = HELPER_SEARCH;
+	req.target = *target;
+	res = run_request(&req, &fd, 1, &reply, cancel);
+	err = errno;
+	if (res == 0) {
+		res = reply.res;
+		err = reply.err;
+	}
+	close(fd);
+	errno = err;
+	return res;
+}
+
+/**
+ * close_inherited_fds - close every fd the helper inherited from the
+ * server but the standard ones and the socket
+ */
+static void close_inherited_fds(void)
+{
+	DIR *dir = NULL;
+	struct dirent *entry = NULL;
+	int fd = 0;
+	dir = opendir("/proc/self/fd");
+	if (dir == NULL)
+		return;
+	while ((entry = readdir(dir)) != NULL) {
+		fd = atoi(entry->d_name);
+		if (fd > HELPER_FD && fd != dirfd(dir))
+			close(fd);
+	}
+	closedir(dir);
+}
+
+static void fd_path(char *path, int fd)
+{
+	snprintf(path, FD_PATH_SIZE, "/proc/self/fd/%d", fd);
+}
+
+/**
+ * serve_request - serve a request of the server
+ * the files are reached through /proc/self/fd, so that the helper
+ * needs no access to the root or to the cache of the server.
+ * return -1 when the server closed the socket.
+ */
+static int serve_request(int sock)
+{
+	struct helper_request req = {0};
+	struct helper_reply reply = {0};
+	struct image_variant variants[HELPER_MAX_VARIANTS] = {0};
+	char paths[HELPER_MAX_FDS][FD_PATH_SIZE] = {{0}};
+	int fds[HELPER_MAX_FDS] = {0};
+	size_t n_fds = HELPER_MAX_FDS;
+	ssize_t rd = 0;
+	rd = recv_fds(sock, &req, sizeof(req), fds, &n_fds);
+	if (rd <= 0)
+		return -1;
+	for (size_t i = 0; i < n_fds; ++i)
+		fd_path(paths[i], fds[i]);
+	reply.res = -1;
+	reply.err = EINVAL;
+	if (rd != sizeof(req) || n_fds < 1) {
+		;
+	} else if (req.op == HELPER_COMPRESS && req.n > 0 &&
+		   req.n <= HELPER_MAX_VARIANTS && n_fds == req.n + 1) {
+		for (size_t i = 0; i < req.n; ++i) {
+			variants[i].quality = req.quality[i];
+			variants[i].width = req.width[i];
+			variants[i].dest = paths[i + 1];
+		}
+		reply.res = compress_image_variants(paths[0], variants, req.n, NULL);
+		reply.err = errno;
+		for (size_t i = 0; i < req.n; ++i)
+			reply.status[i] = variants[i].status;
+	} else if (req.op == HELPER_SEARCH) {
+		reply.res = search_image_quality(paths[0], &req.target, NULL);
+		reply.err = errno;
+	}
+	close_fds(fds, n_fds);
+	if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0)
+		return -1;
+	return 0;
+}
+
+int image_helper_main(int argc, char *argv[])
+{
+	struct image_processing_settings ips = {0};
+	struct rlimit rl = {0};
+	size_t limit = 0;
+	if (argc < 5)
+		return EXIT_FAILURE;
+	limit = strtoull(argv[2], NULL, 10);
+	ips.decode_cache_size = strtoull(argv[3], NULL, 10);
+	ips.decode_cache_ttl = atoi(argv[4]);
+	close_inherited_fds();
+	openlog("QWHttpServer", LOG_PID, LOG_USER);
+	if (limit > 0) {
+		rl.rlim_cur = limit;
+		rl.rlim_max = limit;
+		if (setrlimit(RLIMIT_AS, &rl) < 0) {
+			syslog(LOG_ERR, "%s: %s\n", "image helper can't set memory limit",
+			       strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+	if (image_processing_init(&ips) < 0)
+		return EXIT_FAILURE;
+	while (serve_request(HELPER_FD) == 0)
+		;
+	image_processing_cleanup();
+	closelog();
+	return EXIT_SUCCESS;
+}
@@ -1,32 +1,670 @@
 #include "image_processing.h"
+#include "image_helper.h"
+#ifdef HAVE_LIBJPEG
+#include "jpeg_processing.h"
+#endif
 
-int compress_image(char *src, char *dest, int quality)
+/* estimated bytes of a decoded pixel: RGBA with 16 bit per channel */
+#define DECODED_PIXEL_SIZE 8
+/* highest quality the quality search can choose */
+#define MAX_SEARCH_QUALITY 95
+/* side of the windows the SSIM is computed on */
+#define SSIM_WINDOW 8
+
+/**
+ * decoded_image - entry of the decoded image cache
+ * @src: path of the source image
+ * @st: stat of the source when it was decoded, used to detect changes
+ * @wand: decoded image, never modified, only cloned
+ * @bytes: estimated size of the decoded pixels
+ * @last_used: last time the entry was used
+ * @list: LRU list entry, most recently used first
+ */
+struct decoded_image {
+	char *src;
+	struct stat st;
+	MagickWand *wand;
+	size_t bytes;
+	time_t last_used;
+	struct list_head list;
+};
+
+/**
+ * decode_cache - short-lived, size-bounded cache of decoded source images
+ * @lru: list of decoded_image, most recently used first
+ * @bytes: sum of the bytes of all the entries
+ * @max_bytes: max value of bytes
+ * @ttl: seconds an entry is kept after its last use
+ * @mutex: sync access to the cache
+ */
+static struct decode_cache {
+	struct list_head lru;
+	size_t bytes;
+	size_t max_bytes;
+	int ttl;
+	pthread_mutex_t mutex;
+} decode_cache = {
+	.lru = LIST_HEAD_INIT(decode_cache.lru),
+	.mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+int image_processing_init(const struct image_processing_settings *ips)
+{
+	if (ips == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	decode_cache.max_bytes = ips->decode_cache_size;
+	decode_cache.ttl = ips->decode_cache_ttl;
+	MagickWandGenesis();
+	return 0;
+}
+
+static void decoded_image_destroy(struct decoded_image *di)
+{
+	decode_cache.bytes -= di->bytes;
+	list_del(&di->list);
+	DestroyMagickWand(di->wand);
+	free(di->src);
+	free(di);
+}
+
+void image_processing_cleanup(void)
+{
+	struct decoded_image *di = NULL, *tmp = NULL;
+	pthread_mutex_lock(&decode_cache.mutex);
+	list_for_each_entry_safe(di, tmp, &decode_cache.lru, list)
+		decoded_image_destroy(di);
+	pthread_mutex_unlock(&decode_cache.mutex);
+	MagickWandTerminus();
+}
+
+/**
+ * magick_monitor - ImageMagick progress monitor polling a cancellation token
+ * @client_data: the struct image_cancel of the job
+ * ImageMagick stops the running operation when it returns MagickFalse.
+ */
+static MagickBooleanType magick_monitor(const char *text,
+					const MagickOffsetType offset,
+					const MagickSizeType span,
+					void *client_data)
+{
+	(void) text;
+	(void) offset;
+	(void) span;
+	return image_cancelled(client_data) ? MagickFalse : MagickTrue;
+}
+
+static void set_monitor(MagickWand *mw, const struct image_cancel *cancel)
+{
+	if (cancel != NULL)
+		MagickSetProgressMonitor(mw, magick_monitor, (void *)cancel);
+}
+
+static bool same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev &&
+		a->st_ino == b->st_ino &&
+		a->st_size == b->st_size &&
+		a->st_mtime == b->st_mtime;
+}
+
+/**
+ * decode_cache_shrink - drop the expired entries and the least recently
+ * used ones till the cache can hold another needed bytes.
+ * must be called with decode_cache.mutex held.
+ */
+static void decode_cache_shrink(time_t now, size_t needed)
+{
+	struct decoded_image *di = NULL, *tmp = NULL;
+	list_for_each_entry_safe_reverse(di, tmp, &decode_cache.lru, list) {
+		if (di->last_used + decode_cache.ttl > now &&
+		    decode_cache.bytes + needed <= decode_cache.max_bytes)
+			break;
+		decoded_image_destroy(di);
+	}
+}
+
+/**
+ * decode_cache_get - return a copy of the decoded image of src
+ * @src: path of the source image
+ * @st: current stat of src
+ * the returned wand must be destroyed by the caller.
+ */
+static MagickWand *decode_cache_get(const char *src, const struct stat *st)
+{
+	struct decoded_image *di = NULL;
+	MagickWand *mw = NULL;
+	time_t now = 0;
+	now = time(NULL);
+	pthread_mutex_lock(&decode_cache.mutex);
+	decode_cache_shrink(now, 0);
+	list_for_each_entry(di, &decode_cache.lru, list) {
+		if (strcmp(di->src, src) != 0)
+			continue;
+		if (!same_file(&di->st, st)) {
+			// source changed on disk, drop the stale decode
+			decoded_image_destroy(di);
+			break;
+		}
+		di->last_used = now;
+		list_move(&di->list, &decode_cache.lru);
+		mw = CloneMagickWand(di->wand);
+		break;
+	}
+	pthread_mutex_unlock(&decode_cache.mutex);
+	return mw;
+}
+
+/**
+ * decode_cache_add - store a copy of a decoded image
+ * @src: path of the source image
+ * @st: stat of src when it was decoded
+ * @wand: decoded image, it is cloned so the caller keeps its ownership
+ * images bigger than the whole cache are not stored.
+ */
+static void decode_cache_add(const char *src, const struct stat *st, MagickWand *wand)
+{
+	struct decoded_image *di = NULL;
+	size_t bytes = 0;
+	bytes = MagickGetImageWidth(wand) * MagickGetImageHeight(wand) *
+		DECODED_PIXEL_SIZE;
+	if (bytes == 0 || bytes > decode_cache.max_bytes)
+		return;
+	di = malloc(sizeof(*di));
+	if (di == NULL)
+		return;
+	di->src = strdup(src);
+	if (di->src == NULL) {
+		free(di);
+		return;
+	}
+	di->wand = CloneMagickWand(wand);
+	if (di->wand == NULL) {
+		free(di->src);
+		free(di);
+		return;
+	}
+	di->st = *st;
+	di->bytes = bytes;
+	di->last_used = time(NULL);
+	pthread_mutex_lock(&decode_cache.mutex);
+	decode_cache_shrink(di->last_used, bytes);
+	list_add(&di->list, &decode_cache.lru);
+	decode_cache.bytes += bytes;
+	pthread_mutex_unlock(&decode_cache.mutex);
+}
+
+/**
+ * decode_image - return the decoded image of src, from the cache if possible
+ * @src: path of the source image
+ * @cancel: cancellation token, NULL if the decode can't be cancelled
+ */
+static MagickWand *decode_image(const char *src, const struct image_cancel *cancel)
 {
 	MagickWand *mw = NULL;
+	struct stat st = {0};
+	if (stat(src, &st) != 0)
+		return NULL;
+	mw = decode_cache_get(src, &st);
+	if (mw != NULL)
+		return mw;
+	mw = NewMagickWand();
+	if (mw == NULL)
+		return NULL;
+	set_monitor(mw, cancel);
+	if (MagickReadImage(mw, src) == MagickFalse) {
+		DestroyMagickWand(mw);
+		if (image_cancelled(cancel))
+			errno = ECANCELED;
+		return NULL;
+	}
+	// the token lives as long as the job, the cached copy must not keep it
+	MagickSetProgressMonitor(mw, NULL, NULL);
+	decode_cache_add(src, &st, mw);
+	return mw;
+}
+
+/**
+ * prepare_encode - strip the metadata of an image and make jpeg progressive
+ * @mw: image about to be encoded
+ */
+static int prepare_encode(MagickWand *mw)
+{
+	char *format = NULL;
 	MagickBooleanType res = MagickFalse;
+	/* EXIF, ICC profile and comments are dead weight for the client */
+	res = MagickStripImage(mw);
+	if (res == MagickFalse)
+		return -1;
+	format = MagickGetImageFormat(mw);
+	if (format == NULL)
+		return 0;
+	if (strcmp(format, "JPEG") == 0)
+		res = MagickSetImageInterlaceScheme(mw, PlaneInterlace);
+	MagickRelinquishMemory(format);
+	return (res == MagickFalse) ? -1 : 0;
+}
+
+/**
+ * encode_variant - encode and write a single variant of a decoded image
+ * @source: decoded image, it is not modified
+ * @variant: variant to write
+ * @cancel: cancellation token, NULL if the encode can't be cancelled
+ */
+static int encode_variant(MagickWand *source,
+			  struct image_variant *variant,
+			  const struct image_cancel *cancel)
+{
+	MagickWand *mw = NULL;
+	MagickBooleanType res = MagickFalse;
+	size_t width = 0;
+	size_t height = 0;
+	if (variant->dest == NULL || variant->quality < 0 || variant->quality > 100)
+		return -1;
+	mw = CloneMagickWand(source);
+	if (mw == NULL)
+		return -1;
+	set_monitor(mw, cancel);
+	width = MagickGetImageWidth(mw);
+	height = MagickGetImageHeight(mw);
+	if (variant->width > 0 && (size_t)variant->width < width) {
+		height = height * variant->width / width;
+		res = MagickResizeImage(mw, variant->width, height ? height : 1,
+					LanczosFilter, 1.0);
+		if (res == MagickFalse) {
+			DestroyMagickWand(mw);
+			return -1;
+		}
+	}
+	res = MagickSetImageCompressionQuality(mw, variant->quality);
+	if (res == MagickFalse || prepare_encode(mw) < 0) {
+		DestroyMagickWand(mw);
+		return -1;
+	}
+	res = MagickWriteImage(mw, variant->dest);
+	DestroyMagickWand(mw);
+	if (res == MagickFalse && image_cancelled(cancel)) {
+		// an aborted write can leave a truncated file behind
+		remove(variant->dest);
+		errno = ECANCELED;
+	}
+	return (res == MagickFalse) ? -1 : 0;
+}
 
+/**
+ * magick_compress_variants - encode through ImageMagick every variant
+ * not already written
+ */
+static int magick_compress_variants(const char *src,
+				    struct image_variant *variants,
+				    size_t n,
+				    const struct image_cancel *cancel)
+{
+	MagickWand *source = NULL;
+	int res = 0;
+	/* decode once */
+	source = decode_image(src, cancel);
+	if (source == NULL)
+		return -1;
+	/* encode many */
+	for (size_t i = 0; i < n; ++i) {
+		if (variants[i].status == 0)
+			continue;
+		if (image_cancelled(cancel)) {
+			errno = ECANCELED;
+			res = -1;
+			break;
+		}
+		variants[i].status = encode_variant(source, &variants[i], cancel);
+		if (variants[i].status < 0)
+			res = -1;
+	}
+	DestroyMagickWand(source);
+	return res;
+}
+
+int compress_image_variants(const char *src,
+			    struct image_variant *variants,
+			    size_t n,
+			    const struct image_cancel *cancel)
+{
+	if (src == NULL || variants == NULL || n == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (size_t i = 0; i < n; ++i)
+		variants[i].status = -1;
+	if (image_helper_pool_active())
+		return image_helper_compress(src, variants, n, cancel);
+#ifdef HAVE_LIBJPEG
+	/* jpeg to jpeg skips the generic pipeline of ImageMagick,
+	 * which is kept as fallback for what libjpeg can't handle */
+	if (is_jpeg_file(src)) {
+		if (jpeg_compress_variants(src, variants, n, cancel) == 0)
+			return 0;
+		if (errno == ECANCELED)
+			return -1;
+	}
+#endif
+	return magick_compress_variants(src, variants, n, cancel);
+}
+
+int compress_image(char *src, char *dest, int quality)
+{
+	struct image_variant variant = {0};
 	if (src == NULL || dest == NULL|| quality < 0 || quality > 100) {
 		errno = EINVAL;
 		return -1;
 	}
-	MagickWandGenesis();
-	/* Create a wand */
-	mw = NewMagickWand();
+	variant.quality = quality;
+	variant.width = 0;
+	variant.dest = dest;
+	return compress_image_variants(src, &variant, 1, NULL);
+}
+
+/**
+ * luma_ssim - mean SSIM of two 8-bit luma planes of the same size
+ * computed on non-overlapping SSIM_WINDOW x SSIM_WINDOW windows
+ */
+static double luma_ssim(const unsigned char *a, const unsigned char *b,
+			size_t width, size_t height)
+{
+	const double c1 = (0.01 * 255) * (0.01 * 255);
+	const double c2 = (0.03 * 255) * (0.03 * 255);
+	const double n = SSIM_WINDOW * SSIM_WINDOW;
+	double total = 0.0;
+	size_t windows = 0;
+	if (width < SSIM_WINDOW || height < SSIM_WINDOW)
+		return 1.0;
+	for (size_t y = 0; y + SSIM_WINDOW <= height; y += SSIM_WINDOW) {
+		for (size_t x = 0; x + SSIM_WINDOW <= width; x += SSIM_WINDOW) {
+			double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+			double ma = 0, mb = 0, va = 0, vb = 0, cov = 0;
+			for (size_t j = 0; j < SSIM_WINDOW; ++j) {
+				const unsigned char *ra = a + (y + j) * width + x;
+				const unsigned char *rb = b + (y + j) * width + x;
+				for (size_t i = 0; i < SSIM_WINDOW; ++i) {
+					sa += ra[i];
+					sb += rb[i];
+					saa += ra[i] * ra[i];
+					sbb += rb[i] * rb[i];
+					sab += ra[i] * rb[i];
+				}
+			}
+			ma = sa / n;
+			mb = sb / n;
+			va = saa / n - ma * ma;
+			vb = sbb / n - mb * mb;
+			cov = sab / n - ma * mb;
+			total += ((2 * ma * mb + c1) * (2 * cov + c2)) /
+				((ma * ma + mb * mb + c1) * (va + vb + c2));
+			windows++;
+		}
+	}
+	return total / windows;
+}
+
+/**
+ * quality_trial - encode the source at quality and measure the result
+ * @ctx: source specific data
+ * @quality: quality of the trial encode
+ * @bytes: where to store the size of the encode
+ * @ssim: where to store the SSIM of the encode, not computed if NULL
+ */
+typedef int (*quality_trial)(void *ctx, int quality, size_t *bytes, double *ssim);
+
+/**
+ * search_quality - bisect the quality range with at most max_trials encodes
+ * @trial: encode and measure function
+ * @ctx: argument of trial
+ * @src_bytes: size of the source image
+ * @target: what the quality should reach
+ * @cancel: cancellation token, polled before every trial
+ */
+static int search_quality(quality_trial trial, void *ctx, size_t src_bytes,
+			  const struct quality_target *target,
+			  const struct image_cancel *cancel)
+{
+	size_t tried[MAX_SEARCH_QUALITY + 1] = {0};
+	int lo = 0, hi = MAX_SEARCH_QUALITY;
+	int best = -1;
+	double ssim = 0.0;
+	size_t bytes = 0;
+	bool ok = false;
+	bool by_bytes = (target->mode == QUALITY_BYTES);
+	lo = target->min_quality;
+	if (lo < 1 || lo > MAX_SEARCH_QUALITY)
+		lo = 1;
+	for (int i = 0; i < target->max_trials && lo <= hi; ++i) {
+		int mid = (lo + hi) / 2;
+		if (image_cancelled(cancel)) {
+			errno = ECANCELED;
+			return -1;
+		}
+		if (trial(ctx, mid, &bytes, by_bytes ? NULL : &ssim) < 0)
+			return -1;
+		tried[mid] = bytes;
+		if (by_bytes)
+			ok = bytes <= (size_t)(src_bytes * target->ratio);
+		else
+			ok = ssim >= target->min_ssim;
+		/* bytes: highest quality under the size, ssim: lowest above it */
+		if (ok)
+			best = mid;
+		if (ok == by_bytes)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	if (best < 0) {
+		/* target not reached, get as close as possible */
+		best = by_bytes ? target->min_quality : MAX_SEARCH_QUALITY;
+		if (best < 1 || best > MAX_SEARCH_QUALITY)
+			best = 1;
+	}
+	if (tried[best] == 0) {
+		if (trial(ctx, best, &bytes, NULL) < 0)
+			return -1;
+		tried[best] = bytes;
+	}
+	/* a variant bigger than the original is useless */
+	if (tried[best] >= src_bytes)
+		return 0;
+	return best;
+}
+
+/**
+ * magick_trial_ctx - source of the ImageMagick quality trials
+ * @source: decoded source image
+ * @luma: luma plane of source, NULL if the SSIM is not needed
+ * @width: width of the source
+ * @height: height of the source
+ * @cancel: cancellation token of the search
+ */
+struct magick_trial_ctx {
+	MagickWand *source;
+	unsigned char *luma;
+	size_t width;
+	size_t height;
+	const struct image_cancel *cancel;
+};
+
+static unsigned char *magick_export_luma(MagickWand *mw, size_t width, size_t height)
+{
+	unsigned char *luma = NULL;
+	luma = malloc(width * height);
+	if (luma == NULL)
+		return NULL;
+	if (MagickExportImagePixels(mw, 0, 0, width, height,
+				    "I", CharPixel, luma) == MagickFalse) {
+		free(luma);
+		return NULL;
+	}
+	return luma;
+}
+
+static int magick_trial(void *arg, int quality, size_t *bytes, double *ssim)
+{
+	struct magick_trial_ctx *ctx = arg;
+	MagickWand *mw = NULL;
+	MagickWand *decoded = NULL;
+	unsigned char *blob = NULL;
+	unsigned char *luma = NULL;
+	int res = -1;
+	mw = CloneMagickWand(ctx->source);
 	if (mw == NULL)
 		return -1;
-	/* Read the input image */
-	res = MagickReadImage(mw, src);
-	if (res == MagickFalse)
-		return -1;
-	res = MagickSetImageCompressionQuality(mw, quality);
-	if (res == MagickFalse)
+	set_monitor(mw, ctx->cancel);
+	if (MagickSetImageCompressionQuality(mw, quality) == MagickFalse ||
+	    prepare_encode(mw) < 0)
+		goto out;
+	blob = MagickGetImageBlob(mw, bytes);
+	if (blob == NULL)
+		goto out;
+	res = 0;
+	if (ssim == NULL)
+		goto out;
+	res = -1;
+	decoded = NewMagickWand();
+	if (decoded == NULL ||
+	    MagickReadImageBlob(decoded, blob, *bytes) == MagickFalse)
+		goto out;
+	luma = magick_export_luma(decoded, ctx->width, ctx->height);
+	if (luma == NULL)
+		goto out;
+	*ssim = luma_ssim(ctx->luma, luma, ctx->width, ctx->height);
+	res = 0;
+out:
+	free(luma);
+	if (decoded != NULL)
+		DestroyMagickWand(decoded);
+	if (blob != NULL)
+		MagickRelinquishMemory(blob);
+	DestroyMagickWand(mw);
+	return res;
+}
+
+static int magick_search_quality(const char *src, size_t src_bytes,
+				 const struct quality_target *target,
+				 const struct image_cancel *cancel)
+{
+	struct magick_trial_ctx ctx = {0};
+	int res = 0;
+	ctx.cancel = cancel;
+	ctx.source = decode_image(src, cancel);
+	if (ctx.source == NULL)
 		return -1;
-	/* write it */
-	res = MagickWriteImage(mw, dest);
-	if (res == MagickFalse)
+	ctx.width = MagickGetImageWidth(ctx.source);
+	ctx.height = MagickGetImageHeight(ctx.source);
+	if (target->mode == QUALITY_SSIM) {
+		ctx.luma = magick_export_luma(ctx.source, ctx.width, ctx.height);
+		if (ctx.luma == NULL) {
+			DestroyMagickWand(ctx.source);
+			return -1;
+		}
+	}
+	res = search_quality(magick_trial, &ctx, src_bytes, target, cancel);
+	free(ctx.luma);
+	DestroyMagickWand(ctx.source);
+	return res;
+}
+
+#ifdef HAVE_LIBJPEG
+/**
+ * jpeg_trial_ctx - source of the libjpeg quality trials
+ * @source: decoded source image
+ * @luma: luma plane of source, NULL if the SSIM is not needed
+ */
+struct jpeg_trial_ctx {
+	struct jpeg_image source;
+	unsigned char *luma;
+};
+
+static unsigned char *rgb_to_luma(const struct jpeg_image *img)
+{
+	unsigned char *luma = NULL;
+	size_t n = 0;
+	n = (size_t)img->width * img->height;
+	luma = malloc(n);
+	if (luma == NULL)
+		return NULL;
+	if (img->components == 1) {
+		memcpy(luma, img->pixels, n);
+		return luma;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		const unsigned char *px = img->pixels + i * img->components;
+		/* BT.601, as the YCbCr of jpeg */
+		luma[i] = (77 * px[0] + 150 * px[1] + 29 * px[2]) >> 8;
+	}
+	return luma;
+}
+
+static int jpeg_trial(void *arg, int quality, size_t *bytes, double *ssim)
+{
+	struct jpeg_trial_ctx *ctx = arg;
+	struct jpeg_image decoded = {0};
+	unsigned char *buf = NULL;
+	unsigned long size = 0;
+	if (jpeg_encode_mem(&ctx->source, quality, &buf, &size) < 0)
 		return -1;
-	/* Tidy up */
-	mw = DestroyMagickWand(mw);
-	MagickWandTerminus();
+	*bytes = size;
+	if (ssim != NULL) {
+		if (jpeg_decode_gray_mem(buf, size, &decoded) < 0) {
+			free(buf);
+			return -1;
+		}
+		*ssim = luma_ssim(ctx->luma, decoded.pixels,
+				  ctx->source.width, ctx->source.height);
+		jpeg_image_free(&decoded);
+	}
+	free(buf);
 	return 0;
 }
+
+static int jpeg_search_quality(const char *src, size_t src_bytes,
+			       const struct quality_target *target,
+			       const struct image_cancel *cancel)
+{
+	struct jpeg_trial_ctx ctx = {0};
+	int res = 0;
+	if (jpeg_decode(src, 0, &ctx.source) < 0)
+		return -1;
+	if (target->mode == QUALITY_SSIM) {
+		ctx.luma = rgb_to_luma(&ctx.source);
+		if (ctx.luma == NULL) {
+			jpeg_image_free(&ctx.source);
+			return -1;
+		}
+	}
+	res = search_quality(jpeg_trial, &ctx, src_bytes, target, cancel);
+	free(ctx.luma);
+	jpeg_image_free(&ctx.source);
+	return res;
+}
+#endif
+
+int search_image_quality(const char *src,
+			 const struct quality_target *target,
+			 const struct image_cancel *cancel)
+{
+	struct stat st = {0};
+	if (src == NULL || target == NULL || target->mode == QUALITY_QVALUE ||
+	    target->max_trials < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (image_helper_pool_active())
+		return image_helper_search(src, target, cancel);
+	if (stat(src, &st) != 0)
+		return -1;
+#ifdef HAVE_LIBJPEG
+	if (is_jpeg_file(src)) {
+		int res = jpeg_search_quality(src, st.st_size, target, cancel);
+		if (res >= 0 || errno == ECANCELED)
+			return res;
+	}
+#endif
+	return magick_search_quality(src, st.st_size, target, cancel);
+}
@@ -13,12 +13,40 @@ struct config {
 	char *server_root;
 	char *server_cache;
 	char *server_index;
+	char *server_manifest;
 	int thread_number;
 	int backlog;
+	int accept_queue_size;
 	size_t http_max_request_size;
 	size_t http_max_response_size;
 	char *port;
 	int timeout;
+	int keepalive_timeout;
+	int header_timeout;
+	int send_timeout;
+	int request_deadline;
+	int *image_variants;
+	size_t image_variants_n;
+	size_t image_decode_cache_size;
+	int image_decode_cache_ttl;
+	enum quality_mode image_quality_mode;
+	double image_target_ratio;
+	double image_min_ssim;
+	int image_max_trials;
+	int image_min_quality;
+	int image_helpers;
+	int image_degrade_jobs;
+	double image_degrade_utilization;
+	size_t image_helper_memory;
+	struct cache_rule *cache_rules;
+	size_t cache_rules_n;
+	size_t cache_index_memory;
+	int negative_cache_ttl;
+	char *tls_certificate;
+	char *tls_private_key;
+	bool tls_disable_ktls;
+	long tls_session_cache;
+	long tls_session_timeout;
 };
 
 /**
@@ -0,0 +1,85 @@
+#ifndef IMAGE_HELPER_H
+#define IMAGE_HELPER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "image_processing.h"
+
+/* first argument of a process started as image helper */
+#define IMAGE_HELPER_ARG "--image-helper"
+
+/**
+ * image_helper_settings - settings of the image helper pool
+ * @helpers: number of helper processes
+ * @memory_limit: max bytes of address space of a helper, 0 for no limit
+ * @ips: settings of the compression subsystem of the helpers
+ */
+struct image_helper_settings {
+	int helpers;
+	size_t memory_limit;
+	struct image_processing_settings ips;
+};
+
+/**
+ * image_helper_pool_start - start the pool of image helper processes
+ * @ihs: settings of the pool
+ * every helper is the server executable itself, run again through
+ * /proc/self/exe with IMAGE_HELPER_ARG, and talks with the server over
+ * a SOCK_SEQPACKET unix socket. Once started, compress_image_variants()
+ * and search_image_quality() run in the helpers, so that a huge or
+ * hostile image can only exhaust or crash its helper, which is then
+ * restarted.
+ */
+int image_helper_pool_start(const struct image_helper_settings *ihs);
+
+/**
+ * image_helper_pool_stop - stop the helpers started by image_helper_pool_start()
+ */
+void image_helper_pool_stop(void);
+
+/**
+ * image_helper_pool_active - return true if the image work is done by helpers
+ */
+bool image_helper_pool_active(void);
+
+/**
+ * image_helper_compress - compress_image_variants() run by a helper
+ * the destination files are opened by the caller and passed to the
+ * helper, which writes the encodes straight into them. When the job is
+ * cancelled the helper is killed and replaced.
+ */
+int image_helper_compress(const char *src,
+			  struct image_variant *variants,
+			  size_t n,
+			  const struct image_cancel *cancel);
+
+/**
+ * image_helper_search - search_image_quality() run by a helper
+ */
+int image_helper_search(const char *src,
+			const struct quality_target *target,
+			const struct image_cancel *cancel);
+
+/**
+ * image_helper_main - main of a helper process
+ * @argc: argc of main()
+ * @argv: argv of main(), argv[1] is IMAGE_HELPER_ARG
+ * serve the requests of the server till it closes the socket.
+ */
+int image_helper_main(int argc, char *argv[]);
+
+#endif
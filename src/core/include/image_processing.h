@@ -1,13 +1,106 @@
-
 #ifndef IMAGE_PROCESSING_H
 #define IMAGE_PROCESSING_H
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "wand/MagickWand.h"
+#include "list.h"
+
+/**
+ * image_variant - an encoded version of a source image
+ * @quality: quality of the compression
+ * @width: width of the variant, 0 to keep the width of the source
+ * @dest: path of the compressed image
+ * @status: set to 0 if the variant was written, -1 otherwise
+ */
+struct image_variant {
+	int quality;
+	int width;
+	char *dest;
+	int status;
+};
+
+/**
+ * image_cancel - cancellation token of a compression job
+ * @is_cancelled: return true when nobody needs the result of the job anymore
+ * @arg: argument of is_cancelled
+ * the token is polled at the checkpoints of the decode and of the encodes,
+ * a cancelled job stops there and fails with ECANCELED.
+ */
+struct image_cancel {
+	bool (*is_cancelled)(void *arg);
+	void *arg;
+};
+
+/**
+ * quality_mode - how the quality of the variants is chosen
+ * @QUALITY_QVALUE: the quality is the weight sent by the client
+ * @QUALITY_BYTES: the highest quality whose encode is at most a ratio
+ * of the original size
+ * @QUALITY_SSIM: the lowest quality whose encode keeps a minimum SSIM
+ */
+enum quality_mode {
+	QUALITY_QVALUE,
+	QUALITY_BYTES,
+	QUALITY_SSIM
+};
+
+/**
+ * quality_target - target of the quality search
+ * @mode: how the quality is chosen
+ * @ratio: max size of the encode relative to the original (QUALITY_BYTES)
+ * @min_ssim: min SSIM of the encode against the original (QUALITY_SSIM)
+ * @max_trials: max number of trial encodes of a search
+ * @min_quality: lowest quality the search can choose
+ */
+struct quality_target {
+	enum quality_mode mode;
+	double ratio;
+	double min_ssim;
+	int max_trials;
+	int min_quality;
+};
+
+/**
+ * image_processing_settings - settings of the compression subsystem
+ * @decode_cache_size: max bytes of decoded pixels kept in memory
+ * @decode_cache_ttl: seconds a decoded image is kept after its last use
+ */
+struct image_processing_settings {
+	size_t decode_cache_size;
+	int decode_cache_ttl;
+};
+
+/**
+ * image_processing_init - init the compression subsystem
+ * @ips: settings of the subsystem
+ * should be called once before any other call of this module.
+ */
+int image_processing_init(const struct image_processing_settings *ips);
+
+/**
+ * image_processing_cleanup - free all the resource allocated by
+ * image_processing_init() and by the decoded image cache
+ */
+void image_processing_cleanup(void);
+
+/**
+ * image_cancelled - return true if the job owning cancel should stop
+ * @cancel: cancellation token, NULL if the job can't be cancelled
+ */
+static inline bool image_cancelled(const struct image_cancel *cancel)
+{
+	if (cancel == NULL || cancel->is_cancelled == NULL)
+		return false;
+	return cancel->is_cancelled(cancel->arg);
+}
 
 /**
  * compress_image - compress an image given is source and destination file-path
@@ -17,5 +110,39 @@
  */
 int compress_image(char *src, char *dest, int quality);
 
-#endif
+/**
+ * compress_image_variants - encode many variants of the same source
+ * @src: path to the image to compress
+ * @variants: variants to produce
+ * @n: number of element in variants
+ * @cancel: cancellation token, NULL if the job can't be cancelled
+ * the source is decoded only once, and the decoded image is kept for a
+ * short time so that a later miss on the same source skips the decode.
+ * RETURN:
+ * return 0 if every variant was written, -1 otherwise, the outcome of
+ * each variant is stored in its status field. When the job is cancelled
+ * errno is set to ECANCELED.
+ */
+int compress_image_variants(const char *src,
+			    struct image_variant *variants,
+			    size_t n,
+			    const struct image_cancel *cancel);
 
+/**
+ * search_image_quality - search the quality of src reaching target
+ * @src: path to the image
+ * @target: what the quality should reach, target->mode must not
+ * be QUALITY_QVALUE
+ * @cancel: cancellation token, NULL if the search can't be cancelled
+ * the search is a bisection of at most target->max_trials encodes done
+ * in memory. When the target can't be reached the closest quality is
+ * returned.
+ * RETURN:
+ * return the quality found, 0 if every quality tried gives an image
+ * bigger than src, -1 in case of error or if the search was cancelled.
+ */
+int search_image_quality(const char *src,
+			 const struct quality_target *target,
+			 const struct image_cancel *cancel);
+
+#endif
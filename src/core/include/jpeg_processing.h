@@ -0,0 +1,99 @@
+#ifndef JPEG_PROCESSING_H
+#define JPEG_PROCESSING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <setjmp.h>
+
+#include <jpeglib.h>
+
+#include "image_processing.h"
+
+/**
+ * jpeg_image - raw pixels of a decoded jpeg
+ * @pixels: width * height * components bytes, row after row
+ * @width: width of the image
+ * @height: height of the image
+ * @components: 3 for RGB, 1 for grayscale
+ * @color_space: JCS_RGB or JCS_GRAYSCALE
+ */
+struct jpeg_image {
+	unsigned char *pixels;
+	JDIMENSION width;
+	JDIMENSION height;
+	int components;
+	J_COLOR_SPACE color_space;
+};
+
+/**
+ * is_jpeg_file - return true if the file starts with a jpeg SOI marker
+ * @path: path of the file
+ */
+bool is_jpeg_file(const char *path);
+
+/**
+ * jpeg_decode - decode a jpeg file with libjpeg-turbo
+ * @src: path of the jpeg
+ * @min_width: when greater than 0, the image is downscaled in the DCT
+ * domain by the biggest M/8 factor keeping its width >= min_width
+ * @img: where to store the decoded image, free it with jpeg_image_free()
+ * CMYK and YCCK images are not supported and fail with ENOTSUP.
+ */
+int jpeg_decode(const char *src, int min_width, struct jpeg_image *img);
+
+/**
+ * jpeg_decode_gray_mem - decode only the luma of a jpeg stored in memory
+ * @buf: the jpeg
+ * @size: size of buf
+ * @img: where to store the decoded image, free it with jpeg_image_free()
+ */
+int jpeg_decode_gray_mem(const unsigned char *buf, unsigned long size, struct jpeg_image *img);
+
+/**
+ * jpeg_encode - encode raw pixels to a progressive jpeg file
+ * @img: decoded image
+ * @dest: path of the jpeg to write
+ * @quality: quality of the compression, between 0 and 100
+ * no metadata (EXIF, ICC profile, comments) is written.
+ */
+int jpeg_encode(const struct jpeg_image *img, const char *dest, int quality);
+
+/**
+ * jpeg_encode_mem - encode raw pixels to a progressive jpeg in memory
+ * @img: decoded image
+ * @quality: quality of the compression, between 0 and 100
+ * @buf: where to store the malloc(2) allocated jpeg
+ * @size: where to store the size of the jpeg
+ */
+int jpeg_encode_mem(const struct jpeg_image *img, int quality,
+		    unsigned char **buf, unsigned long *size);
+
+/**
+ * jpeg_image_free - free the pixels of an image decoded by jpeg_decode()
+ * @img: decoded image
+ */
+void jpeg_image_free(struct jpeg_image *img);
+
+/**
+ * jpeg_compress_variants - encode many variants of a jpeg source
+ * @src: path of the jpeg
+ * @variants: variants to produce
+ * @n: number of element in variants
+ * @cancel: cancellation token, polled by the libjpeg progress monitor
+ * the source is decoded once for each distinct width, downscaled in the
+ * DCT domain to the nearest M/8 scale not below the width asked, then
+ * resampled to exactly that width.
+ * RETURN:
+ * return 0 if every variant was written, -1 otherwise, the outcome of
+ * each variant is stored in its status field. errno is ECANCELED if the
+ * job was cancelled.
+ */
+int jpeg_compress_variants(const char *src,
+			   struct image_variant *variants,
+			   size_t n,
+			   const struct image_cancel *cancel);
+
+#endif
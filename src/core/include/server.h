@@ -14,18 +14,31 @@
 #include <arpa/inet.h>
 
 #include "connection.h"
+#include "acceptor.h"
 #include "http.h"
+#include "http2.h"
 #include "file_system.h"
 #include "image_processing.h"
+#include "image_helper.h"
+
+struct config;
 
 struct global_server_data {
 	struct content_proxy *cp;
 };
 
+/**
+ * server_data - data of a worker thread
+ * @acceptor: where the worker takes its connections, if NULL the worker
+ * accepts them itself
+ * @worker: index of the worker for the acceptor
+ */
 struct server_data {
 	pthread_t pid;
 	struct global_server_data *data;
 	struct http_session *session;
+	struct acceptor *acceptor;
+	size_t worker;
 };
 
 
@@ -40,11 +53,9 @@ struct server_data *server_data_create(void);
 void server_data_destroy(struct server_data *sd);
 /**
  * create_global_server_data - allocate and init a global_server_data struct
- * @root: root folder path of the content proxy
- * @cache: cache folder path of the content proxy
- * @index: index file, to get retrieved when '/' is asked
+ * @cfg: server configuration, it must outlive the returned struct
  */
-struct global_server_data *create_global_server_data(char *root, char *cache, char *index);
+struct global_server_data *create_global_server_data(const struct config *cfg);
 /**
  * destroy_global_server_data - free all resource allocated by 
  * create_global_server_data_struct()
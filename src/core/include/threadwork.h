@@ -14,7 +14,8 @@
  * threadwork - server work for a single thread
  * @data: struct global_server_data containing the data to start the server work
  * this function will:
- * 1. listen for incoming connection
+ * 1. take the next connection from the acceptor, or accept it
+ *    if there is none
  * 2. execute an http exchange
  * 3. close the connection when the exchange is over
  * 4. repeat 
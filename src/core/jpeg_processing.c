@@ -0,0 +1,439 @@
+#include "jpeg_processing.h"
+
+/**
+ * jpeg_error - libjpeg error manager that jumps back instead of exiting
+ * @mgr: standard libjpeg error manager, must be the first member
+ * @env: where to jump on error
+ * @cancelled: set when the jump is caused by a cancellation
+ */
+struct jpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf env;
+	bool cancelled;
+};
+
+/**
+ * jpeg_progress - libjpeg progress monitor polling a cancellation token
+ * @mgr: standard libjpeg progress manager, must be the first member
+ * @cancel: token to poll
+ */
+struct jpeg_progress {
+	struct jpeg_progress_mgr mgr;
+	const struct image_cancel *cancel;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	struct jpeg_error *err = (struct jpeg_error *)cinfo->err;
+	longjmp(err->env, 1);
+}
+
+static void jpeg_output_message(j_common_ptr cinfo)
+{
+	(void) cinfo;
+	/* warnings of corrupted data are not worth the log */
+}
+
+/* called by libjpeg between scanlines, leaves through the error manager */
+static void jpeg_progress_monitor(j_common_ptr cinfo)
+{
+	struct jpeg_progress *progress = (struct jpeg_progress *)cinfo->progress;
+	struct jpeg_error *err = (struct jpeg_error *)cinfo->err;
+	if (!image_cancelled(progress->cancel))
+		return;
+	err->cancelled = true;
+	longjmp(err->env, 1);
+}
+
+static void set_progress(j_common_ptr cinfo,
+			 struct jpeg_progress *progress,
+			 const struct image_cancel *cancel)
+{
+	if (cancel == NULL)
+		return;
+	memset(progress, 0, sizeof(*progress));
+	progress->mgr.progress_monitor = jpeg_progress_monitor;
+	progress->cancel = cancel;
+	cinfo->progress = &progress->mgr;
+}
+
+bool is_jpeg_file(const char *path)
+{
+	unsigned char soi[3] = {0};
+	FILE *f = NULL;
+	size_t rd = 0;
+	if (path == NULL)
+		return false;
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return false;
+	rd = fread(soi, 1, sizeof(soi), f);
+	fclose(f);
+	return rd == sizeof(soi) && soi[0] == 0xFF && soi[1] == 0xD8 && soi[2] == 0xFF;
+}
+
+/**
+ * get_scale_num - return the smallest M of the M/8 scaling factors
+ * that keeps the width of the image >= min_width
+ */
+static unsigned int get_scale_num(JDIMENSION width, int min_width)
+{
+	unsigned int num = 0;
+	if (min_width <= 0 || (JDIMENSION)min_width >= width)
+		return 8;
+	for (num = 1; num < 8; ++num) {
+		if ((width * num + 7) / 8 >= (JDIMENSION)min_width)
+			break;
+	}
+	return num;
+}
+
+/**
+ * decode - decode a jpeg from a file or from memory
+ * @f: file to read, NULL to read from buf
+ * @buf: jpeg in memory, used only if f is NULL
+ * @size: size of buf
+ * @min_width: see jpeg_decode()
+ * @gray: decode only the luma
+ * @cancel: cancellation token, NULL if the decode can't be cancelled
+ * @img: where to store the decoded image
+ * @src_width: where to store the width before the downscale, can be NULL
+ * @src_height: where to store the height before the downscale, can be NULL
+ */
+static int decode(FILE *f, const unsigned char *buf, unsigned long size,
+		  int min_width, bool gray, const struct image_cancel *cancel,
+		  struct jpeg_image *img, JDIMENSION *src_width, JDIMENSION *src_height)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error err;
+	struct jpeg_progress progress;
+	JSAMPROW row = NULL;
+	size_t stride = 0;
+	memset(img, 0, sizeof(*img));
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpeg_error_exit;
+	err.mgr.output_message = jpeg_output_message;
+	err.cancelled = false;
+	if (setjmp(err.env)) {
+		jpeg_destroy_decompress(&cinfo);
+		jpeg_image_free(img);
+		errno = err.cancelled ? ECANCELED : EIO;
+		return -1;
+	}
+	jpeg_create_decompress(&cinfo);
+	set_progress((j_common_ptr)&cinfo, &progress, cancel);
+	if (f != NULL)
+		jpeg_stdio_src(&cinfo, f);
+	else
+		jpeg_mem_src(&cinfo, buf, size);
+	jpeg_read_header(&cinfo, TRUE);
+	if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+		jpeg_destroy_decompress(&cinfo);
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (gray || cinfo.jpeg_color_space == JCS_GRAYSCALE)
+		cinfo.out_color_space = JCS_GRAYSCALE;
+	else
+		cinfo.out_color_space = JCS_RGB;
+	/* downscale while decoding, the IDCT does the resampling for free */
+	cinfo.scale_num = get_scale_num(cinfo.image_width, min_width);
+	cinfo.scale_denom = 8;
+	cinfo.dct_method = JDCT_ISLOW;
+	jpeg_start_decompress(&cinfo);
+	if (src_width != NULL)
+		*src_width = cinfo.image_width;
+	if (src_height != NULL)
+		*src_height = cinfo.image_height;
+	img->width = cinfo.output_width;
+	img->height = cinfo.output_height;
+	img->components = cinfo.output_components;
+	img->color_space = cinfo.out_color_space;
+	stride = (size_t)img->width * img->components;
+	img->pixels = malloc(stride * img->height);
+	if (img->pixels == NULL) {
+		jpeg_destroy_decompress(&cinfo);
+		errno = ENOMEM;
+		return -1;
+	}
+	while (cinfo.output_scanline < cinfo.output_height) {
+		row = img->pixels + stride * cinfo.output_scanline;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	return 0;
+}
+
+static int decode_file(const char *src, int min_width,
+		       const struct image_cancel *cancel, struct jpeg_image *img,
+		       JDIMENSION *src_width, JDIMENSION *src_height)
+{
+	FILE *f = NULL;
+	int res = 0;
+	f = fopen(src, "rb");
+	if (f == NULL)
+		return -1;
+	res = decode(f, NULL, 0, min_width, false, cancel, img, src_width, src_height);
+	fclose(f);
+	return res;
+}
+
+int jpeg_decode(const char *src, int min_width, struct jpeg_image *img)
+{
+	if (src == NULL || img == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	return decode_file(src, min_width, NULL, img, NULL, NULL);
+}
+
+int jpeg_decode_gray_mem(const unsigned char *buf, unsigned long size, struct jpeg_image *img)
+{
+	if (buf == NULL || img == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	return decode(NULL, buf, size, 0, true, NULL, img, NULL, NULL);
+}
+
+/**
+ * encode - encode raw pixels to a file or to memory
+ * @f: file where to write, NULL to write to *buf
+ * @buf: where to store the malloc(2) allocated jpeg if f is NULL
+ * @size: where to store the size of *buf
+ * @img: image to encode
+ * @quality: quality of the compression
+ * @cancel: cancellation token, NULL if the encode can't be cancelled
+ * the jpeg is progressive and carries no metadata.
+ */
+static int encode(FILE *f, unsigned char **buf, unsigned long *size,
+		  const struct jpeg_image *img, int quality,
+		  const struct image_cancel *cancel)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error err;
+	struct jpeg_progress progress;
+	JSAMPROW row = NULL;
+	size_t stride = 0;
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpeg_error_exit;
+	err.mgr.output_message = jpeg_output_message;
+	err.cancelled = false;
+	if (setjmp(err.env)) {
+		jpeg_destroy_compress(&cinfo);
+		errno = err.cancelled ? ECANCELED : EIO;
+		return -1;
+	}
+	jpeg_create_compress(&cinfo);
+	set_progress((j_common_ptr)&cinfo, &progress, cancel);
+	if (f != NULL)
+		jpeg_stdio_dest(&cinfo, f);
+	else
+		jpeg_mem_dest(&cinfo, buf, size);
+	cinfo.image_width = img->width;
+	cinfo.image_height = img->height;
+	cinfo.input_components = img->components;
+	cinfo.in_color_space = img->color_space;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_simple_progression(&cinfo);
+	cinfo.dct_method = JDCT_ISLOW;
+	cinfo.optimize_coding = TRUE;
+	jpeg_start_compress(&cinfo, TRUE);
+	stride = (size_t)img->width * img->components;
+	while (cinfo.next_scanline < cinfo.image_height) {
+		row = img->pixels + stride * cinfo.next_scanline;
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	return 0;
+}
+
+static int encode_file(const struct jpeg_image *img, const char *dest,
+		       int quality, const struct image_cancel *cancel)
+{
+	FILE *f = NULL;
+	int res = 0;
+	int err = 0;
+	f = fopen(dest, "wb");
+	if (f == NULL)
+		return -1;
+	res = encode(f, NULL, NULL, img, quality, cancel);
+	err = errno;
+	if (fclose(f) != 0 && res == 0) {
+		res = -1;
+		err = errno;
+	}
+	if (res < 0) {
+		remove(dest);
+		errno = err;
+	}
+	return res;
+}
+
+int jpeg_encode(const struct jpeg_image *img, const char *dest, int quality)
+{
+	if (img == NULL || img->pixels == NULL || dest == NULL ||
+	    quality < 0 || quality > 100) {
+		errno = EINVAL;
+		return -1;
+	}
+	return encode_file(img, dest, quality, NULL);
+}
+
+int jpeg_encode_mem(const struct jpeg_image *img, int quality,
+		    unsigned char **buf, unsigned long *size)
+{
+	if (img == NULL || img->pixels == NULL || buf == NULL || size == NULL ||
+	    quality < 0 || quality > 100) {
+		errno = EINVAL;
+		return -1;
+	}
+	*buf = NULL;
+	*size = 0;
+	if (encode(NULL, buf, size, img, quality, NULL) < 0) {
+		free(*buf);
+		*buf = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void jpeg_image_free(struct jpeg_image *img)
+{
+	if (img == NULL)
+		return;
+	free(img->pixels);
+	img->pixels = NULL;
+}
+
+/**
+ * resample_line - resample a line of pixels by averaging the area of
+ * the source each destination pixel covers
+ * @src: first pixel of the source line
+ * @src_len: pixels of the source line
+ * @src_step: bytes between two pixels of the source line
+ * @dst: first pixel of the destination line
+ * @dst_len: pixels of the destination line
+ * @dst_step: bytes between two pixels of the destination line
+ * @components: bytes of a pixel
+ */
+static void resample_line(const unsigned char *src, size_t src_len, size_t src_step,
+			  unsigned char *dst, size_t dst_len, size_t dst_step,
+			  int components)
+{
+	double scale = (double)src_len / dst_len;
+	double start = 0.0, end = 0.0, weight = 0.0;
+	double acc[4] = {0};
+	for (size_t i = 0; i < dst_len; ++i) {
+		start = i * scale;
+		end = start + scale;
+		memset(acc, 0, sizeof(acc));
+		for (size_t j = (size_t)start; j < src_len && j < end; ++j) {
+			weight = ((j + 1 < end) ? j + 1 : end) - ((j > start) ? j : start);
+			for (int c = 0; c < components; ++c)
+				acc[c] += weight * src[j * src_step + c];
+		}
+		for (int c = 0; c < components; ++c) {
+			acc[c] = acc[c] / scale + 0.5;
+			dst[i * dst_step + c] = (acc[c] > 255.0) ? 255 : (unsigned char)acc[c];
+		}
+	}
+}
+
+/**
+ * resample - resize an image to exactly width x height
+ * @img: the image, its pixels are replaced
+ * the DCT downscale only reaches the M/8 factors, this finishes the
+ * job so a variant has the width it is cached for, like the variants
+ * resized by ImageMagick.
+ */
+static int resample(struct jpeg_image *img, JDIMENSION width, JDIMENSION height)
+{
+	unsigned char *tmp = NULL;
+	unsigned char *pixels = NULL;
+	size_t comps = img->components;
+	if (img->width == width && img->height == height)
+		return 0;
+	tmp = malloc((size_t)width * img->height * comps);
+	pixels = malloc((size_t)width * height * comps);
+	if (tmp == NULL || pixels == NULL) {
+		free(tmp);
+		free(pixels);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (JDIMENSION y = 0; y < img->height; ++y)
+		resample_line(img->pixels + (size_t)y * img->width * comps, img->width, comps,
+			      tmp + (size_t)y * width * comps, width, comps, comps);
+	for (JDIMENSION x = 0; x < width; ++x)
+		resample_line(tmp + x * comps, img->height, width * comps,
+			      pixels + x * comps, height, width * comps, comps);
+	free(tmp);
+	free(img->pixels);
+	img->pixels = pixels;
+	img->width = width;
+	img->height = height;
+	return 0;
+}
+
+int jpeg_compress_variants(const char *src,
+			   struct image_variant *variants,
+			   size_t n,
+			   const struct image_cancel *cancel)
+{
+	struct jpeg_image img = {0};
+	JDIMENSION src_width = 0, src_height = 0, height = 0;
+	bool *done = NULL;
+	int res = 0;
+	if (src == NULL || variants == NULL || n == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	done = calloc(n, sizeof(*done));
+	if (done == NULL)
+		return -1;
+	for (size_t i = 0; i < n; ++i)
+		variants[i].status = -1;
+	for (size_t i = 0; i < n; ++i) {
+		if (done[i])
+			continue;
+		/* one decode for every variant of the same width */
+		if (decode_file(src, variants[i].width, cancel, &img,
+				&src_width, &src_height) < 0) {
+			free(done);
+			return -1;
+		}
+		/* same size as the resize of ImageMagick in encode_variant() */
+		if (variants[i].width > 0 && (JDIMENSION)variants[i].width < src_width) {
+			height = (JDIMENSION)((unsigned long long)src_height *
+					      variants[i].width / src_width);
+			if (resample(&img, variants[i].width, height ? height : 1) < 0) {
+				jpeg_image_free(&img);
+				free(done);
+				return -1;
+			}
+		}
+		for (size_t j = i; j < n; ++j) {
+			if (done[j] || variants[j].width != variants[i].width)
+				continue;
+			variants[j].status = encode_file(&img,
+							 variants[j].dest,
+							 variants[j].quality,
+							 cancel);
+			if (variants[j].status < 0)
+				res = -1;
+			done[j] = true;
+			if (res < 0 && errno == ECANCELED) {
+				jpeg_image_free(&img);
+				free(done);
+				return -1;
+			}
+		}
+		jpeg_image_free(&img);
+	}
+	free(done);
+	return res;
+}
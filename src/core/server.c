@@ -1,6 +1,10 @@
 #include "server.h"
+#include "config.h"
 #define ERRNUM_MSG_SIZE 256
 
+/* bytes of a body sent between two restarts of the send deadline */
+#define SEND_CHUNK_SIZE (1024 * 1024)
+
 #define IS_GET(method) ((strcmp(method, "GET")) == 0)
 #define IS_HEAD(method) ((strcmp(method, "HEAD")) == 0)
 
@@ -13,6 +17,8 @@ struct server_data *server_data_create(void)
 	sd->pid = 0;
 	sd->data = NULL;
 	sd->session = NULL;
+	sd->acceptor = NULL;
+	sd->worker = 0;
 	return sd;
 }
 void server_data_destroy(struct server_data *sd)
@@ -22,20 +28,55 @@ void server_data_destroy(struct server_data *sd)
 	free(sd);
 }
 
-struct global_server_data *create_global_server_data(char *root, char *cache, char *index)
+struct global_server_data *create_global_server_data(const struct config *cfg)
 {
 	struct global_server_data *gsd = NULL;
 	struct content_proxy_settings cps = {0};
-	if (root == NULL || cache == NULL)
+	struct image_processing_settings ips = {0};
+	struct image_helper_settings ihs = {0};
+	if (cfg == NULL || cfg->server_root == NULL || cfg->server_cache == NULL)
 		return NULL;
 	gsd = malloc(sizeof(*gsd));
 	if (gsd == NULL)
 		return NULL;
-	cps.root = root;
-	cps.cache = cache;
-	cps.index = index;
+	ips.decode_cache_size = cfg->image_decode_cache_size;
+	ips.decode_cache_ttl = cfg->image_decode_cache_ttl;
+	if (image_processing_init(&ips) < 0) {
+		free(gsd);
+		return NULL;
+	}
+	if (cfg->image_helpers > 0) {
+		ihs.helpers = cfg->image_helpers;
+		ihs.memory_limit = cfg->image_helper_memory;
+		ihs.ips = ips;
+		if (image_helper_pool_start(&ihs) < 0) {
+			image_processing_cleanup();
+			free(gsd);
+			return NULL;
+		}
+	}
+	cps.root = cfg->server_root;
+	cps.cache = cfg->server_cache;
+	cps.index = cfg->server_index;
+	cps.variants = cfg->image_variants;
+	cps.n_variants = cfg->image_variants_n;
+	cps.quality.mode = cfg->image_quality_mode;
+	cps.quality.ratio = cfg->image_target_ratio;
+	cps.quality.min_ssim = cfg->image_min_ssim;
+	cps.quality.max_trials = cfg->image_max_trials;
+	cps.quality.min_quality = cfg->image_min_quality;
+	cps.load.max_jobs = cfg->image_degrade_jobs;
+	cps.load.max_utilization = cfg->image_degrade_utilization;
+	cps.load.workers = cfg->thread_number;
+	cps.cache_rules = cfg->cache_rules;
+	cps.n_cache_rules = cfg->cache_rules_n;
+	cps.index_memory = cfg->cache_index_memory;
+	cps.negative_ttl = cfg->negative_cache_ttl;
+	cps.manifest = cfg->server_manifest;
 	gsd->cp = create_content_proxy(&cps);
 	if (gsd->cp == NULL) {
+		image_helper_pool_stop();
+		image_processing_cleanup();
 		free(gsd);
 		return NULL;
 	}
@@ -47,13 +88,17 @@ void destroy_global_server_data(struct global_server_data *gsd)
 	if (gsd == NULL)
 		return;
 	destroy_content_proxy(gsd->cp);
+	image_helper_pool_stop();
+	image_processing_cleanup();
 	free(gsd);
 }
 
 static int send_header(struct http_session *session,
 		       enum status_code code,
 		       const char *mime,
-		       const char *content_lenght)
+		       const char *content_lenght,
+		       const struct http_header *headers,
+		       size_t n_headers)
 {
 	size_t wr = 0;
 	ssize_t sd = 0;
@@ -61,9 +106,12 @@ static int send_header(struct http_session *session,
 				      session->response_size,
 				      code,
 				      mime,
-				      content_lenght);
+				      content_lenght,
+				      headers,
+				      n_headers);
 	if (wr == 0)
 		return -1;
+	http_session_arm(session, HTTP_PHASE_SEND);
 	sd = csend(session->connection, session->response, wr);
 	if (sd < 0)
 		return -1;
@@ -73,13 +121,45 @@ static int send_header(struct http_session *session,
 	return 0;
 }
 
-static int send_content(CONNECTION *connection, struct file_data *file)
+/**
+ * send_header_block - send a precomputed header block
+ * @session: http_session of the request
+ * @block: header block, only its Date and Expires are patched
+ */
+static int send_header_block(struct http_session *session,
+			     const struct http_header_block *block)
 {
-	ssize_t sd = 0;
-	sd = csendfile(connection, file->path, file->data_size);
-	if (sd < 0)
+	size_t wr = 0;
+	wr = http_header_block_write(block, session->response, session->response_size);
+	if (wr == 0)
 		return -1;
-	return 0;
+	http_session_arm(session, HTTP_PHASE_SEND);
+	if (csend(session->connection, session->response, wr) < 0)
+		return -1;
+	return cflush(session->connection);
+}
+
+/**
+ * send_content - send count bytes of a file starting at offset
+ * the body goes in chunks, each restarting the send deadline, so a
+ * large body has a deadline on progress, not on its whole length.
+ */
+static int send_content(struct http_session *session,
+			struct file_data *file,
+			off_t offset,
+			size_t count)
+{
+	size_t chunk = 0;
+	int res = 0;
+	while (res == 0 && count > 0) {
+		chunk = (count < SEND_CHUNK_SIZE) ? count : SEND_CHUNK_SIZE;
+		http_session_arm(session, HTTP_PHASE_SEND);
+		if (csendfd(session->connection, file->fd, offset, chunk) < 0)
+			res = -1;
+		offset += chunk;
+		count -= chunk;
+	}
+	return res;
 }
 
 static int size_t_to_str(char *buf, size_t buf_size, size_t sz)
@@ -92,45 +172,222 @@ static int size_t_to_str(char *buf, size_t buf_size, size_t sz)
 		return -1;
 	return 0;
 }
-static int get_quality(double weight)
+
+/* headers of the file, plus Content-Range */
+#define MAX_FILE_HEADERS (FILE_DATA_HEADERS + 1)
+/* size of a multipart/byteranges boundary, '\0' included */
+#define BOUNDARY_SIZE 32
+/* size of the headers of a part of a multipart/byteranges body */
+#define PART_HEADER_SIZE 512
+/* size of a Content-Range value */
+#define CONTENT_RANGE_SIZE 96
+
+static void make_boundary(char *boundary)
+{
+	static unsigned long counter = 0;
+	unsigned long n = 0;
+	n = __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+	snprintf(boundary, BOUNDARY_SIZE, "QW%08lx%016lx",
+		 (unsigned long)time(NULL) & 0xffffffffUL, n);
+}
+
+/**
+ * format_part_header - write the delimiter and the headers preceding
+ * a part of a multipart/byteranges body
+ * return the length written, -1 if it doesn't fit in buf.
+ */
+static int format_part_header(char *buf,
+			      size_t buf_size,
+			      const char *boundary,
+			      const char *mime,
+			      const struct byte_range *range,
+			      size_t size)
 {
-	if (weight < 0.0 || weight > 1.0)
+	int len = 0;
+	len = snprintf(buf, buf_size,
+		       CRLF "--%s" CRLF
+		       "Content-Type: %s" CRLF
+		       "Content-Range: bytes %lld-%lld/%zu" CRLF CRLF,
+		       boundary, mime,
+		       (long long)range->first, (long long)range->last, size);
+	if (len < 0 || (size_t)len >= buf_size)
 		return -1;
-	return (int)(weight * 100);
+	return len;
 }
 
+/**
+ * send_ranges - send a multipart/byteranges response
+ * @session: http_session of the request
+ * @content: selected representation
+ * @headers: headers of the response
+ * @n_headers: number of element in headers
+ * @ranges: satisfiable ranges, sorted and not overlapping
+ * @n_ranges: number of element in ranges, at least 2
+ * the file is opened once and every part is sent from its offset.
+ */
+static int send_ranges(struct http_session *session,
+		       struct file_data *content,
+		       const struct http_header *headers,
+		       size_t n_headers,
+		       const struct byte_range *ranges,
+		       size_t n_ranges)
+{
+	char boundary[BOUNDARY_SIZE] = {0};
+	char part[PART_HEADER_SIZE] = {0};
+	char content_type[PART_HEADER_SIZE] = {0};
+	char content_lenght[64] = {0};
+	size_t total = 0;
+	int len = 0;
+	int res = 0;
+	make_boundary(boundary);
+	for (size_t i = 0; i < n_ranges; ++i) {
+		len = format_part_header(part, sizeof(part), boundary, content->mime,
+					 &ranges[i], content->data_size);
+		if (len < 0)
+			return -1;
+		total += len + (ranges[i].last - ranges[i].first + 1);
+	}
+	len = snprintf(part, sizeof(part), CRLF "--%s--" CRLF, boundary);
+	total += len;
+	snprintf(content_type, sizeof(content_type),
+		 "multipart/byteranges; boundary=%s", boundary);
+	if (size_t_to_str(content_lenght, 63, total) < 0)
+		return -1;
+	res = send_header(session,
+			  HTTP_PARTIAL_CONTENT,
+			  content_type,
+			  content_lenght,
+			  headers,
+			  n_headers);
+	for (size_t i = 0; res == 0 && i < n_ranges; ++i) {
+		http_session_arm(session, HTTP_PHASE_SEND);
+		len = format_part_header(part, sizeof(part), boundary, content->mime,
+					 &ranges[i], content->data_size);
+		if (csend(session->connection, part, len) < 0 ||
+		    csendfd(session->connection, content->fd, ranges[i].first,
+			    ranges[i].last - ranges[i].first + 1) < 0)
+			res = -1;
+	}
+	if (res < 0)
+		return -1;
+	len = snprintf(part, sizeof(part), CRLF "--%s--" CRLF, boundary);
+	if (csend(session->connection, part, len) < 0)
+		return -1;
+	return cflush(session->connection);
+}
 
+/**
+ * plan_response - evaluate the conditional and Range headers of the
+ * request against content
+ * @session: http_session of the request
+ * @content: selected representation
+ * @is_get: false for HEAD, which ignores Range
+ * @ranges: where to store the ranges to send, HTTP_MAX_RANGES element
+ * @n_ranges: where to store the number of ranges, -1 for the whole
+ * content, 0 if none is satisfiable
+ * return the status code of the response, HTTP_OK also when ranges
+ * are to be sent.
+ */
+static enum status_code plan_response(struct http_session *session,
+				      struct file_data *content,
+				      bool is_get,
+				      struct byte_range *ranges,
+				      int *n_ranges)
+{
+	enum status_code code = HTTP_OK;
+	*n_ranges = -1;
+	code = http_check_preconditions(&session->req,
+					content->etag,
+					content->last_modified);
+	// Range is defined only for GET (RFC 7233 3.1)
+	if (code == HTTP_OK && is_get && session->req.range != NULL &&
+	    http_if_range_match(&session->req, content->etag, content->last_modified))
+		*n_ranges = http_parse_range(session->req.range, content->data_size, ranges);
+	return code;
+}
 
+/**
+ * send_file - send the response for content
+ * @session: http_session of the request
+ * @content: selected representation
+ * @is_get: if false only the header is sent
+ * the conditional headers of the request are evaluated against the
+ * ETag and Last-Modified of content, a 304 or a 412 is sent without body.
+ * The Range header of a GET is honoured unless If-Range doesn't match.
+ * The 200 and 304 responses use the header blocks of content when it
+ * has them, the others have their header generated.
+ */
 static int send_file(struct http_session *session,
 		     struct file_data *content,
-		     char *content_lenght,
 		     bool is_get)
 {
 	int res = 0;
+	enum status_code code = HTTP_OK;
+	struct http_header headers[MAX_FILE_HEADERS];
+	size_t n_headers = 0;
+	char last_modified[HTTP_DATE_SIZE] = {0};
+	char expires[HTTP_DATE_SIZE] = {0};
+	char content_range[CONTENT_RANGE_SIZE] = {0};
+	char content_lenght[64] = {0};
+	struct byte_range ranges[HTTP_MAX_RANGES];
+	int n_ranges = -1;
+	off_t offset = 0;
+	size_t count = content->data_size;
+	code = plan_response(session, content, is_get, ranges, &n_ranges);
+	if (code == HTTP_PRECONDITION_FAILED)
+		return send_header(session, code, NULL, "0", NULL, 0);
+	if (code == HTTP_NOT_MODIFIED && content->not_modified_header != NULL)
+		return send_header_block(session, content->not_modified_header);
+	if (code == HTTP_OK && n_ranges < 0 && content->ok_header != NULL) {
+		res = send_header_block(session, content->ok_header);
+		goto send_body;
+	}
+	n_headers = file_data_headers(content, headers, last_modified, expires);
+	if (code == HTTP_NOT_MODIFIED)
+		return send_header(session, code, NULL, NULL, headers, n_headers);
+	if (n_ranges == 0) {
+		snprintf(content_range, sizeof(content_range), "bytes */%zu", content->data_size);
+		headers[0].name = "Content-Range";
+		headers[0].value = content_range;
+		return send_header(session, HTTP_RANGE_NOT_SATISFIABLE, NULL, "0", headers, 1);
+	}
+	if (n_ranges > 1)
+		return send_ranges(session, content, headers, n_headers, ranges, n_ranges);
+	if (n_ranges == 1) {
+		code = HTTP_PARTIAL_CONTENT;
+		offset = ranges[0].first;
+		count = ranges[0].last - ranges[0].first + 1;
+		snprintf(content_range, sizeof(content_range), "bytes %lld-%lld/%zu",
+			 (long long)ranges[0].first, (long long)ranges[0].last,
+			 content->data_size);
+		headers[n_headers].name = "Content-Range";
+		headers[n_headers++].value = content_range;
+	}
+	if (size_t_to_str(content_lenght, 63, count) < 0)
+		return -1;
 	res = send_header(session,
-			  HTTP_OK,
+			  code,
 			  content->mime,
-			  content_lenght);
+			  content_lenght,
+			  headers,
+			  n_headers);
+send_body:
 	if (res < 0)
 		return -1;
 	if (is_get) {
-		res = send_content(session->connection,
-				   content);
+		res = send_content(session,
+				   content,
+				   offset,
+				   count);
 		if (res < 0)
 			return -1;
 	}
-		return 0;
+	return 0;
 }
 
-static int get_accept_weight(const char *mime, const char *accept)
+static bool session_cancelled(void *arg)
 {
-	double dweight = 0.0;
-	int weight = 0;
-	if (mime == NULL || accept == NULL)
-		return -1;
-	dweight = search_weight_from_mime(accept, mime);
-	weight = get_quality(dweight);
-	return weight;
+	return http_session_cancelled(arg);
 }
 
 static int _get_internal(struct server_data *data, bool is_get)
@@ -139,27 +396,43 @@ static int _get_internal(struct server_data *data, bool is_get)
 	struct content_proxy *cp = NULL;
 	char *url = NULL;
 	int res = 0;
-	char content_lenght[64] = {0};
 	struct http_request *req = NULL;
+	struct client_hints hints = {0};
+	struct image_cancel cancel = {0};
 	cp = data->data->cp;
 	req = &data->session->req;
 	url = req->url;
-	content = get_content(cp, url, req->accept);
-	if (content == NULL) {
-		res = send_header(data->session, HTTP_NOT_FOUND, NULL, NULL);
-		return res;
-	}
-	res = size_t_to_str(content_lenght, 63, content->data_size);
-	if (res < 0) {
-		send_header(data->session, HTTP_INTERNAL_SERVER_ERROR, NULL, NULL);
-		return res;
+	parse_client_hints(req, &hints);
+	cancel.is_cancelled = session_cancelled;
+	cancel.arg = data->session;
+	// only the lookup and the encode count, as on http2, not the send
+	content_proxy_request_begin(cp);
+	content = get_content(cp,
+			      url,
+			      http_session_accept(data->session),
+			      &hints,
+			      &cancel,
+			      &data->session->arena);
+	content_proxy_request_end(cp);
+	if (content != NULL && content->negotiated &&
+	    !cis_alive(data->session->connection)) {
+		// the client left while its variant was being encoded
+		destroy_file_data(content);
+		errno = ECONNRESET;
+		res = -1;
+		goto out;
 	}
-	res = send_file(data->session, content, content_lenght, is_get);
-	if (res < 0) { // here if failed to send 
-		return res;
+	if (content == NULL) {
+		res = send_header(data->session, HTTP_NOT_FOUND, NULL, NULL, NULL, 0);
+		goto out;
 	}
+	res = send_file(data->session, content, is_get);
 	destroy_file_data(content);
-	return 0;
+	res = (res < 0) ? -1 : 0;
+out:
+	// the response is sent, what the request allocated goes at once
+	arena_reset(&data->session->arena);
+	return res;
 }
 
 static int do_head(struct server_data *data)
@@ -193,6 +466,150 @@ static int do_request(struct server_data *data)
 	}
 }
 
+/* headers of the file, plus Content-Type, Content-Length and Content-Range */
+#define MAX_H2_HEADERS (FILE_DATA_HEADERS + 3)
+
+/**
+ * h2_response - storage of the headers of an HTTP/2 response, released
+ * once they are encoded
+ * @session: session whose arena holds the response
+ * @content: file of the response
+ * @headers: headers of the response
+ */
+struct h2_response {
+	struct http_session *session;
+	struct file_data *content;
+	struct http_header headers[MAX_H2_HEADERS];
+	char last_modified[HTTP_DATE_SIZE];
+	char expires[HTTP_DATE_SIZE];
+	char content_range[CONTENT_RANGE_SIZE];
+	char content_lenght[64];
+};
+
+static void release_h2_response(void *arg)
+{
+	struct h2_response *r = arg;
+	destroy_file_data(r->content);
+	// the streams are answered one at a time, nothing else is in the arena
+	arena_reset(&r->session->arena);
+}
+
+static const struct http_header allow_header[] = {
+	{"Allow", "GET, HEAD"}
+};
+
+/**
+ * h2_file_response - fill resp with the response for content
+ * a multipart/byteranges response is never sent on a stream, a request
+ * of several ranges gets the whole content.
+ */
+static int h2_file_response(struct http_session *session,
+			    struct file_data *content,
+			    bool is_get,
+			    struct http2_response *resp)
+{
+	struct h2_response *r = NULL;
+	struct byte_range ranges[HTTP_MAX_RANGES];
+	int n_ranges = -1;
+	size_t n = 0;
+	off_t offset = 0;
+	size_t count = content->data_size;
+	r = arena_alloc(&session->arena, sizeof(*r));
+	if (r == NULL) {
+		destroy_file_data(content);
+		arena_reset(&session->arena);
+		return -1;
+	}
+	r->session = session;
+	r->content = content;
+	resp->release = release_h2_response;
+	resp->arg = r;
+	resp->headers = r->headers;
+	resp->code = plan_response(session, content, is_get, ranges, &n_ranges);
+	if (resp->code == HTTP_PRECONDITION_FAILED)
+		return 0;
+	n = file_data_headers(content, r->headers, r->last_modified, r->expires);
+	if (resp->code == HTTP_NOT_MODIFIED) {
+		resp->n_headers = n;
+		return 0;
+	}
+	if (n_ranges == 0) {
+		resp->code = HTTP_RANGE_NOT_SATISFIABLE;
+		snprintf(r->content_range, sizeof(r->content_range), "bytes */%zu",
+			 content->data_size);
+		r->headers[0].name = "Content-Range";
+		r->headers[0].value = r->content_range;
+		resp->n_headers = 1;
+		return 0;
+	}
+	if (n_ranges == 1) {
+		resp->code = HTTP_PARTIAL_CONTENT;
+		offset = ranges[0].first;
+		count = ranges[0].last - ranges[0].first + 1;
+		snprintf(r->content_range, sizeof(r->content_range), "bytes %lld-%lld/%zu",
+			 (long long)ranges[0].first, (long long)ranges[0].last,
+			 content->data_size);
+		r->headers[n].name = "Content-Range";
+		r->headers[n++].value = r->content_range;
+	}
+	if (size_t_to_str(r->content_lenght, sizeof(r->content_lenght), count) < 0)
+		return -1;
+	r->headers[n].name = "Content-Type";
+	r->headers[n++].value = content->mime;
+	r->headers[n].name = "Content-Length";
+	r->headers[n++].value = r->content_lenght;
+	resp->n_headers = n;
+	if (!is_get || count == 0)
+		return 0;
+	// the stream closes the file, the content no longer does
+	resp->fd = content->fd;
+	content->fd = -1;
+	resp->offset = offset;
+	resp->count = count;
+	return 0;
+}
+
+/**
+ * serve_h2_request - http2_handler serving the files of the content_proxy
+ * @arg: global_server_data of the server
+ */
+static int serve_h2_request(struct http_session *session,
+			    struct http2_response *resp,
+			    void *arg)
+{
+	struct global_server_data *gsd = arg;
+	struct http_request *req = &session->req;
+	struct file_data *content = NULL;
+	struct client_hints hints = {0};
+	struct image_cancel cancel = {0};
+	bool is_get = IS_GET(req->method);
+	if (!is_get && !IS_HEAD(req->method)) {
+		resp->code = HTTP_METHOD_NOT_ALLOWED;
+		resp->headers = allow_header;
+		resp->n_headers = 1;
+		return 0;
+	}
+	server_write_info_log(session->connection,
+			      is_get ? "client send GET request" : "client send HEAD request");
+	parse_client_hints(req, &hints);
+	cancel.is_cancelled = session_cancelled;
+	cancel.arg = session;
+	content_proxy_request_begin(gsd->cp);
+	content = get_content(gsd->cp,
+			      req->url,
+			      http_session_accept(session),
+			      &hints,
+			      &cancel,
+			      &session->arena);
+	content_proxy_request_end(gsd->cp);
+	if (content == NULL) {
+		arena_reset(&session->arena);
+		resp->code = HTTP_NOT_FOUND;
+		return 0;
+	}
+	return h2_file_response(session, content, is_get, resp);
+}
+
 static bool check_connection(struct http_request *req)
 {
 	if (req->connection == NULL)
@@ -206,6 +623,8 @@ int do_http_session(struct server_data *data)
 	int res = 0;
 	if (data == NULL)
 		return -1;
+	if (cis_alpn(data->session->connection, HTTP2_ALPN_TOKEN))
+		return http2_serve(data->session, serve_h2_request, data->data);
 	while (keep_alive) {
 		errno = 0;
 		res = read_http_request(data->session);
@@ -215,15 +634,21 @@ int do_http_session(struct server_data *data)
 					     (int)errno);
 			return -1;
 		}
+		if (http2_is_preface(data->session))
+			return http2_serve(data->session, serve_h2_request, data->data);
 		errno = 0;
 		res = parse_http_request(data->session->request, &data->session->req);
 		if (res < 0) {
-			send_header(data->session, HTTP_BAD_REQUEST, NULL, NULL);
+			send_header(data->session, HTTP_BAD_REQUEST, NULL, NULL, NULL, 0);
 			server_write_err_log(data->session->connection,
 					     "error parsing http request/bad request",
 					     (int)errno);
 			return -1;
 		}
+		// h2c is only for cleartext, over TLS the Upgrade is ignored
+		if (http2_is_upgrade(&data->session->req) &&
+		    !cis_tls(data->session->connection))
+			return http2_serve(data->session, serve_h2_request, data->data);
 		errno = 0;
 		res = do_request(data);
 		if (res < 0) {
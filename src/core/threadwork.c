@@ -13,8 +13,17 @@ void *threadwork(void *server_data)
 	while (true) {
 		reset_http_session(data->session);
 		server_write_info_log(NULL, "starting new connection");
-		res = http_start_connection(data->session);
+		if (data->acceptor != NULL) {
+			res = acceptor_next(data->acceptor, data->worker);
+			if (res < 0)
+				break;
+			res = http_adopt_connection(data->session, res);
+		} else {
+			res = http_start_connection(data->session);
+		}
 		if (res < 0) {
+			if (data->acceptor != NULL)
+				acceptor_done(data->acceptor, data->worker);
 			server_write_err_log(data->session->connection,
 					     "failed starting connection",
 					     errno);
@@ -26,6 +35,8 @@ void *threadwork(void *server_data)
 		server_write_info_log(data->session->connection,
 				      "closing http session");
 		http_close_connection(data->session);
+		if (data->acceptor != NULL)
+			acceptor_done(data->acceptor, data->worker);
 	}
 	pthread_exit(NULL);
 }
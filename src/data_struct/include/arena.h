@@ -0,0 +1,166 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+/*
+ * Bump allocator for data living as long as a request.
+ *
+ * Allocations are carved from one block and never freed one by one, the
+ * whole arena is emptied at once by arena_reset(). When the block is
+ * full the allocation gets an overflow chunk of its own; the next reset
+ * frees the chunks and grows the block to the peak usage, so once the
+ * arena has seen its largest request it doesn't call malloc(3) anymore.
+ */
+
+/* alignment of every allocation */
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+/**
+ * arena_chunk - overflow chunk, allocated when the block is full
+ * @next: next chunk
+ * @data: memory of the allocation
+ */
+struct arena_chunk {
+	struct arena_chunk *next;
+	max_align_t data[];
+};
+
+/**
+ * arena - bump allocator
+ * @block: memory the allocations are carved from
+ * @size: size of block
+ * @used: bytes of block in use
+ * @chunks: overflow chunks since the last reset
+ * @peak: bytes asked since the last reset, overflow included
+ */
+struct arena {
+	char *block;
+	size_t size;
+	size_t used;
+	struct arena_chunk *chunks;
+	size_t peak;
+};
+
+static inline size_t arena_align(size_t n)
+{
+	return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+/**
+ * arena_init - init an arena with a block of size bytes
+ * @arena: arena to init
+ * @size: initial size of the block, it grows to the peak usage
+ * return 0 in case of success, -1 otherwise and set errno.
+ */
+static inline int arena_init(struct arena *arena, size_t size)
+{
+	if (arena == NULL || size == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	arena->size = arena_align(size);
+	arena->block = malloc(arena->size);
+	if (arena->block == NULL)
+		return -1;
+	arena->used = 0;
+	arena->chunks = NULL;
+	arena->peak = 0;
+	return 0;
+}
+
+static inline void arena_free_chunks(struct arena *arena)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	struct arena_chunk *next = NULL;
+	while (chunk != NULL) {
+		next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena->chunks = NULL;
+}
+
+/**
+ * arena_destroy - free the memory of an arena
+ * @arena: arena initialized by arena_init()
+ */
+static inline void arena_destroy(struct arena *arena)
+{
+	if (arena == NULL)
+		return;
+	arena_free_chunks(arena);
+	free(arena->block);
+	arena->block = NULL;
+	arena->size = 0;
+	arena->used = 0;
+}
+
+/**
+ * arena_alloc - allocate n bytes from the arena
+ * @arena: arena to allocate from
+ * @n: bytes to allocate
+ * the memory is aligned to ARENA_ALIGN and not initialized, it stays
+ * valid till arena_reset().
+ * return NULL if there is no memory left.
+ */
+static inline void *arena_alloc(struct arena *arena, size_t n)
+{
+	struct arena_chunk *chunk = NULL;
+	void *ptr = NULL;
+	n = arena_align((n == 0) ? 1 : n);
+	arena->peak += n;
+	if (n <= arena->size - arena->used) {
+		ptr = arena->block + arena->used;
+		arena->used += n;
+		return ptr;
+	}
+	chunk = malloc(sizeof(*chunk) + n);
+	if (chunk == NULL)
+		return NULL;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	return chunk->data;
+}
+
+/**
+ * arena_strdup - copy s in the arena
+ * @arena: arena to allocate from
+ * @s: string to copy
+ */
+static inline char *arena_strdup(struct arena *arena, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *copy = arena_alloc(arena, len);
+	if (copy != NULL)
+		memcpy(copy, s, len);
+	return copy;
+}
+
+/**
+ * arena_reset - free every allocation of the arena at once
+ * @arena: arena to reset
+ * if the block overflowed since the last reset it is replaced by one
+ * as large as the peak usage, if that fails the old block is kept.
+ */
+static inline void arena_reset(struct arena *arena)
+{
+	char *block = NULL;
+	if (arena->chunks != NULL) {
+		arena_free_chunks(arena);
+		block = malloc(arena->peak);
+		if (block != NULL) {
+			free(arena->block);
+			arena->block = block;
+			arena->size = arena->peak;
+		}
+	}
+	arena->used = 0;
+	arena->peak = 0;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+
+/* number of size classes, from SLAB_MIN_SIZE to SLAB_MAX_SIZE bytes */
+#define SLAB_CLASSES 16
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE 4096
+/* memory carved in objects of a class at once */
+#define SLAB_PAGE_SIZE (64 * 1024)
+/* free objects a thread keeps per class before giving half of them back */
+#define SLAB_THREAD_CACHE 64
+/* max size of the name of a slab, '\0' included */
+#define SLAB_NAME_SIZE 32
+
+/**
+ * slab_stats - usage of a size class of a slab
+ * @size: size of the objects of the class, 0 for the objects larger
+ * than SLAB_MAX_SIZE, which come from malloc(3)
+ * @live: objects allocated and not freed
+ * @bytes: bytes of the live objects, as rounded up by the class
+ * @reserved: bytes taken from the system for the class, free objects
+ * included
+ */
+struct slab_stats {
+	size_t size;
+	size_t live;
+	size_t bytes;
+	size_t reserved;
+};
+
+/**
+ * slab_create - create a slab allocator of fixed-size objects
+ * @name: name of the slab in the logs
+ * @max_bytes: max bytes of live objects, 0 for no limit
+ * a request is served from the smallest size class fitting it. Each
+ * thread keeps a cache of free objects per class, so most allocations
+ * and frees take no lock; the classes get their memory a page at a
+ * time and never give it back, so a long-running process doesn't
+ * fragment its heap with them.
+ * return NULL in case of error and set errno.
+ */
+struct slab *slab_create(const char *name, size_t max_bytes);
+
+/**
+ * slab_destroy - free a slab and all its memory
+ * @slab: slab created by slab_create(), no thread must use it anymore
+ */
+void slab_destroy(struct slab *slab);
+
+/**
+ * slab_alloc - allocate size bytes from the slab
+ * @slab: slab to allocate from
+ * @size: size of the object
+ * the memory is not initialized and is aligned as malloc(3) memory.
+ * return NULL and set errno to ENOSPC if the object would take the live
+ * bytes of the slab over its limit, to ENOMEM if there is no memory.
+ */
+void *slab_alloc(struct slab *slab, size_t size);
+
+/**
+ * slab_free - free an object allocated by slab_alloc()
+ * @slab: slab of the object
+ * @ptr: object to free, can be NULL
+ * @size: size given to slab_alloc() for the object
+ * any thread can free an object, not only the one allocating it.
+ */
+void slab_free(struct slab *slab, void *ptr, size_t size);
+
+/**
+ * slab_strdup - copy s in the slab
+ * @slab: slab to allocate from
+ * @s: string to copy, free the copy with slab_free(slab, copy,
+ * strlen(copy) + 1)
+ */
+char *slab_strdup(struct slab *slab, const char *s);
+
+/**
+ * slab_live_bytes - return the bytes of the live objects of the slab
+ * @slab: slab
+ */
+size_t slab_live_bytes(const struct slab *slab);
+
+/**
+ * slab_get_stats - get the usage of every class of the slab
+ * @slab: slab
+ * @stats: where to store the usage, SLAB_CLASSES + 1 elements, the last
+ * one is for the objects larger than SLAB_MAX_SIZE
+ * the counters of a class are read without stopping the other threads,
+ * each one is exact but they may be from slightly different moments.
+ */
+void slab_get_stats(const struct slab *slab, struct slab_stats *stats);
+
+/**
+ * slab_log_stats - log the usage of the classes of the slab in use
+ * @slab: slab
+ */
+void slab_log_stats(const struct slab *slab);
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+/* size of a cache line, head and tail are kept apart to avoid false sharing */
+#define SPSC_RING_CACHELINE 64
+
+/*
+ * Bounded lock-free ring with a single producer and a single consumer.
+ *
+ * head and tail count the pops and the pushes since the ring was
+ * initialized, so they never wrap in practice and the ring is full when
+ * they are size apart. The producer only writes tail and the consumer
+ * only writes head: the release store of one pairs with the acquire load
+ * of the other, which is all the ordering the slots need.
+ */
+
+/**
+ * spsc_ring - bounded single producer single consumer ring of values
+ * @head: number of values popped, written by the consumer only
+ * @tail: number of values pushed, written by the producer only
+ * @mask: size of the ring minus 1, the size is a power of 2
+ * @slots: values of the ring
+ */
+struct spsc_ring {
+	size_t head __attribute__((aligned(SPSC_RING_CACHELINE)));
+	size_t tail __attribute__((aligned(SPSC_RING_CACHELINE)));
+	size_t mask __attribute__((aligned(SPSC_RING_CACHELINE)));
+	uintptr_t *slots;
+};
+
+/**
+ * spsc_ring_init - init an empty ring
+ * @ring: ring to init
+ * @size: number of slots, rounded up to a power of 2
+ * return 0 in case of success, -1 otherwise and set errno.
+ */
+static inline int spsc_ring_init(struct spsc_ring *ring, size_t size)
+{
+	size_t n = 1;
+	if (ring == NULL || size == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (n < size)
+		n <<= 1;
+	ring->slots = calloc(n, sizeof(*ring->slots));
+	if (ring->slots == NULL)
+		return -1;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->mask = n - 1;
+	return 0;
+}
+
+/**
+ * spsc_ring_free - free the slots of a ring, the values left are dropped
+ * @ring: ring initialized by spsc_ring_init()
+ */
+static inline void spsc_ring_free(struct spsc_ring *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+/**
+ * spsc_ring_push - append a value, called by the producer only
+ * @ring: ring to append to
+ * @value: value to append
+ * return false if the ring is full.
+ */
+static inline bool spsc_ring_push(struct spsc_ring *ring, uintptr_t value)
+{
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (tail - head > ring->mask)
+		return false;
+	ring->slots[tail & ring->mask] = value;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/**
+ * spsc_ring_pop - remove the oldest value, called by the consumer only
+ * @ring: ring to remove from
+ * @value: where to store the value
+ * return false if the ring is empty.
+ */
+static inline bool spsc_ring_pop(struct spsc_ring *ring, uintptr_t *value)
+{
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return false;
+	*value = ring->slots[head & ring->mask];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/**
+ * spsc_ring_count - number of values in the ring
+ * @ring: ring to inspect
+ * exact for the producer and the consumer, a hint for anybody else.
+ */
+static inline size_t spsc_ring_count(const struct spsc_ring *ring)
+{
+	// head first: tail can only have grown since, so the count can't wrap
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	return tail - head;
+}
+
+#endif
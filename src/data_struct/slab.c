@@ -0,0 +1,376 @@
+#include "slab.h"
+
+/* sizes of the classes, multiples of 16 so that every object is aligned */
+static const size_t class_sizes[SLAB_CLASSES] = {
+	16, 32, 48, 64, 96, 128, 192, 256,
+	384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+/**
+ * slab_page - memory carved in the objects of a class
+ * @next: next page of the class
+ * @data: the objects
+ */
+struct slab_page {
+	struct slab_page *next;
+	max_align_t data[];
+};
+
+/**
+ * slab_class - objects of a size class
+ * @mutex: protects free and pages
+ * @free: free objects not cached by a thread, linked by their first word
+ * @pages: pages of the class
+ * @n_pages: number of pages
+ * @live: objects allocated and not freed
+ */
+struct slab_class {
+	pthread_mutex_t mutex;
+	void *free;
+	struct slab_page *pages;
+	size_t n_pages;
+	size_t live;
+};
+
+/**
+ * thread_cache - free objects of a slab kept by a thread
+ * @slab: slab of the objects
+ * @free: free objects of each class, linked by their first word
+ * @n: number of objects in each list of free
+ */
+struct thread_cache {
+	struct slab *slab;
+	void *free[SLAB_CLASSES];
+	size_t n[SLAB_CLASSES];
+};
+
+/**
+ * slab - size-classed allocator
+ * @name: name in the logs
+ * @max_bytes: max bytes of live objects, 0 for no limit
+ * @live_bytes: bytes of live objects, as rounded up by their class
+ * @large_live: live objects larger than SLAB_MAX_SIZE
+ * @large_bytes: bytes of the live objects larger than SLAB_MAX_SIZE
+ * @full: true once the limit was hit, till the live bytes drop under
+ * half of it, so a slab hovering at its limit logs it once
+ * @key: thread_cache of each thread
+ * @classes: size classes
+ */
+struct slab {
+	char name[SLAB_NAME_SIZE];
+	size_t max_bytes;
+	size_t live_bytes;
+	size_t large_live;
+	size_t large_bytes;
+	bool full;
+	pthread_key_t key;
+	struct slab_class classes[SLAB_CLASSES];
+};
+
+static int class_of(size_t size)
+{
+	for (int i = 0; i < SLAB_CLASSES; ++i) {
+		if (size <= class_sizes[i])
+			return i;
+	}
+	return -1;
+}
+
+static void push(void **head, void *obj)
+{
+	*(void **)obj = *head;
+	*head = obj;
+}
+
+static void *pop(void **head)
+{
+	void *obj = *head;
+	if (obj != NULL)
+		*head = *(void **)obj;
+	return obj;
+}
+
+/**
+ * give_back - move n free objects of a class from a thread cache to
+ * the class
+ */
+static void give_back(struct slab *slab, struct thread_cache *cache, int cls, size_t n)
+{
+	struct slab_class *c = &slab->classes[cls];
+	pthread_mutex_lock(&c->mutex);
+	for (; n > 0 && cache->n[cls] > 0; --n) {
+		push(&c->free, pop(&cache->free[cls]));
+		cache->n[cls]--;
+	}
+	pthread_mutex_unlock(&c->mutex);
+}
+
+/**
+ * cache_destructor - give the cache of an exiting thread back to the slab
+ */
+static void cache_destructor(void *arg)
+{
+	struct thread_cache *cache = arg;
+	for (int i = 0; i < SLAB_CLASSES; ++i)
+		give_back(cache->slab, cache, i, cache->n[i]);
+	free(cache);
+}
+
+static struct thread_cache *get_cache(struct slab *slab)
+{
+	struct thread_cache *cache = NULL;
+	cache = pthread_getspecific(slab->key);
+	if (cache != NULL)
+		return cache;
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return NULL;
+	cache->slab = slab;
+	if (pthread_setspecific(slab->key, cache) != 0) {
+		free(cache);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return cache;
+}
+
+struct slab *slab_create(const char *name, size_t max_bytes)
+{
+	struct slab *slab = NULL;
+	int err = 0;
+	int i = 0;
+	if (name == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	slab = calloc(1, sizeof(*slab));
+	if (slab == NULL)
+		return NULL;
+	strncpy(slab->name, name, SLAB_NAME_SIZE - 1);
+	slab->max_bytes = max_bytes;
+	err = pthread_key_create(&slab->key, cache_destructor);
+	if (err != 0) {
+		free(slab);
+		errno = err;
+		return NULL;
+	}
+	for (i = 0; i < SLAB_CLASSES; ++i) {
+		err = pthread_mutex_init(&slab->classes[i].mutex, NULL);
+		if (err != 0)
+			goto error;
+	}
+	return slab;
+error:
+	while (i-- > 0)
+		pthread_mutex_destroy(&slab->classes[i].mutex);
+	pthread_key_delete(slab->key);
+	free(slab);
+	errno = err;
+	return NULL;
+}
+
+void slab_destroy(struct slab *slab)
+{
+	struct slab_page *page = NULL, *next = NULL;
+	if (slab == NULL)
+		return;
+	// the cache of the calling thread, those of the others are lost
+	free(pthread_getspecific(slab->key));
+	pthread_key_delete(slab->key);
+	for (int i = 0; i < SLAB_CLASSES; ++i) {
+		for (page = slab->classes[i].pages; page != NULL; page = next) {
+			next = page->next;
+			free(page);
+		}
+		pthread_mutex_destroy(&slab->classes[i].mutex);
+	}
+	free(slab);
+}
+
+/**
+ * add_page - carve a new page in free objects of a class
+ * must be called with the mutex of the class held.
+ */
+static int add_page(struct slab_class *c, size_t size)
+{
+	struct slab_page *page = NULL;
+	char *obj = NULL;
+	size_t n = 0;
+	page = malloc(SLAB_PAGE_SIZE);
+	if (page == NULL)
+		return -1;
+	page->next = c->pages;
+	c->pages = page;
+	__atomic_add_fetch(&c->n_pages, 1, __ATOMIC_RELAXED);
+	n = (SLAB_PAGE_SIZE - offsetof(struct slab_page, data)) / size;
+	obj = (char *)page->data;
+	for (size_t i = 0; i < n; ++i)
+		push(&c->free, obj + i * size);
+	return 0;
+}
+
+/**
+ * refill - move half a thread cache worth of free objects of a class
+ * to the cache of the thread, carving new pages if needed
+ */
+static int refill(struct slab *slab, struct thread_cache *cache, int cls)
+{
+	struct slab_class *c = &slab->classes[cls];
+	pthread_mutex_lock(&c->mutex);
+	while (cache->n[cls] < SLAB_THREAD_CACHE / 2) {
+		if (c->free == NULL && add_page(c, class_sizes[cls]) < 0)
+			break;
+		push(&cache->free[cls], pop(&c->free));
+		cache->n[cls]++;
+	}
+	pthread_mutex_unlock(&c->mutex);
+	if (cache->n[cls] == 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * reserve - account size more live bytes, fail if over the limit
+ */
+static int reserve(struct slab *slab, size_t size)
+{
+	size_t live = __atomic_add_fetch(&slab->live_bytes, size, __ATOMIC_RELAXED);
+	if (slab->max_bytes == 0 || live <= slab->max_bytes)
+		return 0;
+	__atomic_sub_fetch(&slab->live_bytes, size, __ATOMIC_RELAXED);
+	if (!__atomic_exchange_n(&slab->full, true, __ATOMIC_RELAXED)) {
+		syslog(LOG_WARNING, "slab %s: limit of %zu bytes reached\n",
+		       slab->name, slab->max_bytes);
+		slab_log_stats(slab);
+	}
+	errno = ENOSPC;
+	return -1;
+}
+
+static void unreserve(struct slab *slab, size_t size)
+{
+	size_t live = __atomic_sub_fetch(&slab->live_bytes, size, __ATOMIC_RELAXED);
+	if (slab->max_bytes != 0 && live < slab->max_bytes / 2)
+		__atomic_store_n(&slab->full, false, __ATOMIC_RELAXED);
+}
+
+void *slab_alloc(struct slab *slab, size_t size)
+{
+	struct thread_cache *cache = NULL;
+	void *obj = NULL;
+	int cls = 0;
+	if (slab == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	cls = class_of(size);
+	if (cls < 0) {
+		if (reserve(slab, size) < 0)
+			return NULL;
+		obj = malloc(size);
+		if (obj == NULL) {
+			unreserve(slab, size);
+			return NULL;
+		}
+		__atomic_add_fetch(&slab->large_live, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&slab->large_bytes, size, __ATOMIC_RELAXED);
+		return obj;
+	}
+	if (reserve(slab, class_sizes[cls]) < 0)
+		return NULL;
+	cache = get_cache(slab);
+	if (cache == NULL || (cache->n[cls] == 0 && refill(slab, cache, cls) < 0)) {
+		unreserve(slab, class_sizes[cls]);
+		return NULL;
+	}
+	obj = pop(&cache->free[cls]);
+	cache->n[cls]--;
+	__atomic_add_fetch(&slab->classes[cls].live, 1, __ATOMIC_RELAXED);
+	return obj;
+}
+
+void slab_free(struct slab *slab, void *ptr, size_t size)
+{
+	struct thread_cache *cache = NULL;
+	int cls = 0;
+	if (slab == NULL || ptr == NULL)
+		return;
+	cls = class_of(size);
+	if (cls < 0) {
+		free(ptr);
+		__atomic_sub_fetch(&slab->large_live, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&slab->large_bytes, size, __ATOMIC_RELAXED);
+		unreserve(slab, size);
+		return;
+	}
+	__atomic_sub_fetch(&slab->classes[cls].live, 1, __ATOMIC_RELAXED);
+	unreserve(slab, class_sizes[cls]);
+	cache = get_cache(slab);
+	if (cache == NULL) {
+		// no cache for this thread, straight back to the class
+		pthread_mutex_lock(&slab->classes[cls].mutex);
+		push(&slab->classes[cls].free, ptr);
+		pthread_mutex_unlock(&slab->classes[cls].mutex);
+		return;
+	}
+	push(&cache->free[cls], ptr);
+	cache->n[cls]++;
+	if (cache->n[cls] > SLAB_THREAD_CACHE)
+		give_back(slab, cache, cls, SLAB_THREAD_CACHE / 2);
+}
+
+char *slab_strdup(struct slab *slab, const char *s)
+{
+	size_t len = 0;
+	char *copy = NULL;
+	if (s == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	len = strlen(s) + 1;
+	copy = slab_alloc(slab, len);
+	if (copy != NULL)
+		memcpy(copy, s, len);
+	return copy;
+}
+
+size_t slab_live_bytes(const struct slab *slab)
+{
+	return __atomic_load_n(&slab->live_bytes, __ATOMIC_RELAXED);
+}
+
+void slab_get_stats(const struct slab *slab, struct slab_stats *stats)
+{
+	for (int i = 0; i < SLAB_CLASSES; ++i) {
+		stats[i].size = class_sizes[i];
+		stats[i].live = __atomic_load_n(&slab->classes[i].live, __ATOMIC_RELAXED);
+		stats[i].bytes = stats[i].live * class_sizes[i];
+		stats[i].reserved = __atomic_load_n(&slab->classes[i].n_pages,
+						    __ATOMIC_RELAXED) * SLAB_PAGE_SIZE;
+	}
+	stats[SLAB_CLASSES].size = 0;
+	stats[SLAB_CLASSES].live = __atomic_load_n(&slab->large_live, __ATOMIC_RELAXED);
+	stats[SLAB_CLASSES].bytes = __atomic_load_n(&slab->large_bytes, __ATOMIC_RELAXED);
+	stats[SLAB_CLASSES].reserved = stats[SLAB_CLASSES].bytes;
+}
+
+void slab_log_stats(const struct slab *slab)
+{
+	struct slab_stats stats[SLAB_CLASSES + 1];
+	size_t live = 0;
+	size_t reserved = 0;
+	slab_get_stats(slab, stats);
+	for (int i = 0; i <= SLAB_CLASSES; ++i) {
+		live += stats[i].live;
+		reserved += stats[i].reserved;
+		if (stats[i].live == 0 && stats[i].reserved == 0)
+			continue;
+		syslog(LOG_INFO, "slab %s: size %zu: %zu live, %zu bytes, %zu reserved\n",
+		       slab->name, stats[i].size, stats[i].live, stats[i].bytes,
+		       stats[i].reserved);
+	}
+	syslog(LOG_INFO, "slab %s: %zu live, %zu bytes, %zu reserved\n",
+	       slab->name, live, slab_live_bytes(slab), reserved);
+}
@@ -0,0 +1,282 @@
+#include "cache_index.h"
+#include "http.h"
+
+/**
+ * hash_key - FNV-1a hash of a string
+ */
+static uint64_t hash_key(const char *key)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (; *key != '\0'; ++key) {
+		hash ^= (unsigned char)*key;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static bool same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev &&
+		a->st_ino == b->st_ino &&
+		a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+struct cache_index *cache_index_create(size_t n_buckets, size_t max_bytes)
+{
+	struct cache_index *ci = NULL;
+	if (n_buckets == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	ci = malloc(sizeof(*ci));
+	if (ci == NULL)
+		return NULL;
+	ci->buckets = calloc(n_buckets, sizeof(*ci->buckets));
+	if (ci->buckets == NULL) {
+		free(ci);
+		return NULL;
+	}
+	for (size_t i = 0; i < n_buckets; ++i)
+		INIT_LIST_HEAD(&ci->buckets[i]);
+	ci->n_buckets = n_buckets;
+	ci->slab = slab_create("cache index", max_bytes);
+	if (ci->slab == NULL) {
+		free(ci->buckets);
+		free(ci);
+		return NULL;
+	}
+	if (pthread_mutex_init(&ci->mutex, NULL) != 0) {
+		slab_destroy(ci->slab);
+		free(ci->buckets);
+		free(ci);
+		return NULL;
+	}
+	return ci;
+}
+
+/**
+ * entry_meta_release - cache_meta_release() for the metadata of an
+ * entry, whose mime is in the slab
+ */
+static void entry_meta_release(struct cache_index *ci, struct cache_meta *meta)
+{
+	if (meta->mime != NULL)
+		slab_free(ci->slab, meta->mime, strlen(meta->mime) + 1);
+	meta->mime = NULL;
+	cache_meta_release(meta);
+}
+
+static void cache_entry_destroy(struct cache_index *ci, struct cache_entry *entry)
+{
+	list_del(&entry->list);
+	entry_meta_release(ci, &entry->meta);
+	slab_free(ci->slab, entry->key, strlen(entry->key) + 1);
+	slab_free(ci->slab, entry, sizeof(*entry));
+}
+
+void cache_index_destroy(struct cache_index *ci)
+{
+	struct cache_entry *entry = NULL, *tmp = NULL;
+	if (ci == NULL)
+		return;
+	for (size_t i = 0; i < ci->n_buckets; ++i) {
+		list_for_each_entry_safe(entry, tmp, &ci->buckets[i], list)
+			cache_entry_destroy(ci, entry);
+	}
+	slab_destroy(ci->slab);
+	pthread_mutex_destroy(&ci->mutex);
+	free(ci->buckets);
+	free(ci);
+}
+
+/**
+ * lookup - return the entry of key, NULL if not found
+ * must be called with ci->mutex held.
+ */
+static struct cache_entry *lookup(struct cache_index *ci, const char *key)
+{
+	struct list_head *bucket = NULL;
+	struct cache_entry *entry = NULL;
+	bucket = &ci->buckets[hash_key(key) % ci->n_buckets];
+	list_for_each_entry(entry, bucket, list) {
+		if (strcmp(entry->key, key) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/**
+ * lookup_or_add - return the entry of key, adding it if not found
+ * an entry whose file changed is reset.
+ * must be called with ci->mutex held.
+ */
+static struct cache_entry *lookup_or_add(struct cache_index *ci,
+					 const char *key,
+					 const struct stat *st)
+{
+	struct cache_entry *entry = NULL;
+	entry = lookup(ci, key);
+	if (entry != NULL) {
+		if (!same_file(&entry->st, st)) {
+			entry->st = *st;
+			entry->quality = -1;
+			entry_meta_release(ci, &entry->meta);
+		}
+		return entry;
+	}
+	entry = slab_alloc(ci->slab, sizeof(*entry));
+	if (entry == NULL)
+		return NULL;
+	entry->key = slab_strdup(ci->slab, key);
+	if (entry->key == NULL) {
+		slab_free(ci->slab, entry, sizeof(*entry));
+		return NULL;
+	}
+	entry->st = *st;
+	entry->quality = -1;
+	memset(&entry->meta, 0, sizeof(entry->meta));
+	entry->meta.policy = -1;
+	list_add(&entry->list, &ci->buckets[hash_key(key) % ci->n_buckets]);
+	return entry;
+}
+
+int cache_index_get_quality(struct cache_index *ci, const char *key, const struct stat *st)
+{
+	struct cache_entry *entry = NULL;
+	int quality = -1;
+	if (ci == NULL || key == NULL || st == NULL)
+		return -1;
+	pthread_mutex_lock(&ci->mutex);
+	entry = lookup(ci, key);
+	if (entry != NULL && same_file(&entry->st, st))
+		quality = entry->quality;
+	pthread_mutex_unlock(&ci->mutex);
+	return quality;
+}
+
+int cache_index_set_quality(struct cache_index *ci,
+			    const char *key,
+			    const struct stat *st,
+			    int quality)
+{
+	struct cache_entry *entry = NULL;
+	if (ci == NULL || key == NULL || st == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&ci->mutex);
+	entry = lookup_or_add(ci, key, st);
+	if (entry != NULL)
+		entry->quality = quality;
+	pthread_mutex_unlock(&ci->mutex);
+	return (entry == NULL) ? -1 : 0;
+}
+
+void cache_meta_release(struct cache_meta *meta)
+{
+	if (meta == NULL)
+		return;
+	free(meta->mime);
+	http_header_block_put(meta->ok_header);
+	http_header_block_put(meta->not_modified_header);
+	memset(meta, 0, sizeof(*meta));
+	meta->policy = -1;
+}
+
+int cache_index_get_meta(struct cache_index *ci,
+			 const char *key,
+			 const struct stat *st,
+			 struct cache_meta *meta,
+			 struct arena *arena)
+{
+	struct cache_entry *entry = NULL;
+	int res = -1;
+	if (ci == NULL || key == NULL || st == NULL || meta == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&ci->mutex);
+	entry = lookup(ci, key);
+	if (entry != NULL && entry->meta.mime != NULL && same_file(&entry->st, st)) {
+		*meta = entry->meta;
+		if (arena != NULL)
+			meta->mime = arena_strdup(arena, entry->meta.mime);
+		else
+			meta->mime = strdup(entry->meta.mime);
+		if (meta->mime != NULL) {
+			http_header_block_get(meta->ok_header);
+			http_header_block_get(meta->not_modified_header);
+			res = 0;
+		}
+	}
+	pthread_mutex_unlock(&ci->mutex);
+	return res;
+}
+
+int cache_index_set_meta(struct cache_index *ci,
+			 const char *key,
+			 const struct stat *st,
+			 const struct cache_meta *meta)
+{
+	struct cache_entry *entry = NULL;
+	struct cache_meta old = {0};
+	char *copy = NULL;
+	if (ci == NULL || key == NULL || st == NULL || meta == NULL || meta->mime == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	copy = slab_strdup(ci->slab, meta->mime);
+	if (copy == NULL)
+		return -1;
+	pthread_mutex_lock(&ci->mutex);
+	entry = lookup_or_add(ci, key, st);
+	if (entry != NULL) {
+		old = entry->meta;
+		entry->meta = *meta;
+		entry->meta.mime = copy;
+		http_header_block_get(entry->meta.ok_header);
+		http_header_block_get(entry->meta.not_modified_header);
+	}
+	pthread_mutex_unlock(&ci->mutex);
+	if (entry == NULL) {
+		slab_free(ci->slab, copy, strlen(copy) + 1);
+		return -1;
+	}
+	// dropping the blocks of the old version can free them, not under the lock
+	entry_meta_release(ci, &old);
+	return 0;
+}
+
+/**
+ * is_beneath - return true if key is path or a file in the folder path
+ */
+static bool is_beneath(const char *key, const char *path, size_t len)
+{
+	if (strncmp(key, path, len) != 0)
+		return false;
+	return key[len] == '\0' || key[len] == '/' || (len > 0 && path[len - 1] == '/');
+}
+
+void cache_index_invalidate(struct cache_index *ci, const char *path)
+{
+	struct cache_entry *entry = NULL, *tmp = NULL;
+	size_t len = 0;
+	LIST_HEAD(stale);
+	if (ci == NULL || path == NULL)
+		return;
+	len = strlen(path);
+	pthread_mutex_lock(&ci->mutex);
+	// a folder invalidates all its files, which are hashed anywhere
+	for (size_t i = 0; i < ci->n_buckets; ++i) {
+		list_for_each_entry_safe(entry, tmp, &ci->buckets[i], list) {
+			if (is_beneath(entry->key, path, len))
+				list_move(&entry->list, &stale);
+		}
+	}
+	pthread_mutex_unlock(&ci->mutex);
+	// dropping the header blocks can free them, not under the lock
+	list_for_each_entry_safe(entry, tmp, &stale, list)
+		cache_entry_destroy(ci, entry);
+}
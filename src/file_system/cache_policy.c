@@ -0,0 +1,123 @@
+#include "cache_policy.h"
+
+int cache_rule_parse(const char *str, struct cache_rule *rule)
+{
+	const char *eq = NULL;
+	char *errptr = NULL;
+	long max_age = 0;
+	char value[64] = {0};
+	if (str == NULL || rule == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	eq = strchr(str, '=');
+	if (eq == NULL || eq == str) {
+		errno = EINVAL;
+		return -1;
+	}
+	max_age = strtol(eq + 1, &errptr, 10);
+	if (errptr == eq + 1 || max_age < 0 || max_age > INT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	rule->immutable = false;
+	if (strcmp(errptr, ":immutable") == 0) {
+		rule->immutable = true;
+	} else if (*errptr != '\0') {
+		errno = EINVAL;
+		return -1;
+	}
+	rule->max_age = max_age;
+	if (rule->max_age == 0)
+		snprintf(value, sizeof(value), "no-cache");
+	else
+		snprintf(value, sizeof(value), "public, max-age=%d%s",
+			 rule->max_age, rule->immutable ? ", immutable" : "");
+	rule->pattern = strndup(str, eq - str);
+	if (rule->pattern == NULL)
+		return -1;
+	rule->value = strdup(value);
+	if (rule->value == NULL) {
+		free(rule->pattern);
+		return -1;
+	}
+	return 0;
+}
+
+void cache_rule_free(struct cache_rule *rule)
+{
+	if (rule == NULL)
+		return;
+	free(rule->pattern);
+	free(rule->value);
+}
+
+/**
+ * is_hashed_name - return true if the last path segment of url has a
+ * '.' or '-' separated part of at least CACHE_RULE_HASH_DIGITS hex
+ * digits before its extension
+ */
+static bool is_hashed_name(const char *url)
+{
+	const char *name = NULL;
+	const char *ext = NULL;
+	const char *seg = NULL;
+	size_t len = 0;
+	bool hex = false;
+	name = strrchr(url, '/');
+	name = (name == NULL) ? url : name + 1;
+	ext = strrchr(name, '.');
+	if (ext == NULL)
+		return false;
+	for (seg = name; seg < ext; seg += len + 1) {
+		len = strcspn(seg, ".-");
+		if (seg + len > ext)
+			len = ext - seg;
+		hex = len >= CACHE_RULE_HASH_DIGITS;
+		for (size_t i = 0; hex && i < len; ++i)
+			hex = isxdigit((unsigned char)seg[i]);
+		if (hex)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * mime_match - return true if mime matches pattern, "type/ *" matches
+ * every subtype, parameters of mime are ignored
+ */
+static bool mime_match(const char *pattern, const char *mime)
+{
+	size_t len = 0;
+	size_t mime_len = 0;
+	mime_len = strcspn(mime, "; ");
+	len = strlen(pattern);
+	if (len >= 2 && strcmp(pattern + len - 2, "/*") == 0)
+		return mime_len > len - 1 && strncasecmp(pattern, mime, len - 1) == 0;
+	return mime_len == len && strncasecmp(pattern, mime, len) == 0;
+}
+
+int cache_policy_match(const struct cache_rule *rules,
+		       size_t n,
+		       const char *url,
+		       const char *mime)
+{
+	const char *pattern = NULL;
+	if (rules == NULL || url == NULL || mime == NULL)
+		return -1;
+	for (size_t i = 0; i < n; ++i) {
+		pattern = rules[i].pattern;
+		if (strcmp(pattern, "*") == 0)
+			return i;
+		if (*pattern == '/') {
+			if (strncmp(url, pattern, strlen(pattern)) == 0)
+				return i;
+		} else if (strcmp(pattern, CACHE_RULE_HASHED) == 0) {
+			if (is_hashed_name(url))
+				return i;
+		} else if (mime_match(pattern, mime)) {
+			return i;
+		}
+	}
+	return -1;
+}
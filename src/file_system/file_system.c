@@ -1,19 +1,77 @@
+#define _GNU_SOURCE /* O_PATH */
 #include "file_system.h"
 
+/* buckets of the cache index hash table */
+#define CACHE_INDEX_BUCKETS 4096
+
+/* max threads computing the metadata of the root files for the manifest */
+#define MANIFEST_SCAN_THREADS 8
+
+/* ms between two polls of the cancellation tokens waiting for an encode */
+#define JOB_POLL_INTERVAL_MS 50
+
 /**
- * get_mime_string - get the mime type of a file using the magic number
- * @file: path of the file to get the mime types
+ * job_waiter - request waiting for the result of an encode_job
+ * @cancel: cancellation token of the request, NULL if it can't be cancelled
+ * @list: entry of encode_job waiters
+ */
+struct job_waiter {
+	const struct image_cancel *cancel;
+	struct list_head list;
+};
+
+/**
+ * encode_job - encode of the variants of an original at a given width
+ * @original: path of the original
+ * @width: width of the variants
+ * @cp: content proxy owning the job
+ * @waiters: requests needing the result, the one running the job included
+ * @refs: number of requests holding the job
+ * @done: set when the encode is over
+ * @status: outcome of the encode
+ * @cond: broadcast when done is set
+ * @last_poll: last time the waiters were polled
+ * @cancelled: outcome of the last poll
+ * @list: entry of content_proxy jobs
+ * all the fields but original, width and cp are protected by cp->mutex.
+ */
+struct encode_job {
+	char *original;
+	int width;
+	struct content_proxy *cp;
+	struct list_head waiters;
+	int refs;
+	bool done;
+	int status;
+	pthread_cond_t cond;
+	struct timespec last_poll;
+	bool cancelled;
+	struct list_head list;
+};
+
+/* variants served to clients on slow links or asking to save data */
+#define SLOW_LINK_QUALITY 30
+#define SLOW_LINK_WIDTH 640
+#define SLOW_LINK_DOWNLINK 0.5 /* Mbps */
+#define MEDIUM_LINK_QUALITY 50
+#define MEDIUM_LINK_WIDTH 1024
+#define MEDIUM_LINK_DOWNLINK 2.0 /* Mbps */
+#define SAVE_DATA_QUALITY 50
+#define SAVE_DATA_WIDTH 1024
+
+/**
+ * get_mime - get the mime type of a file using the magic number
+ * @file: path of the file, NULL to use fd
+ * @fd: open file, its offset is left unchanged
  * return a string allocated on the heap with malloc(2)
  */
-char *get_mime_string(const char *file)
+static char *get_mime(const char *file, int fd)
 {
 	magic_t mcp = NULL;
 	const char *tmp = NULL;
 	int err = 0;
 	char *mime_str = NULL;
 	size_t tmp_len = 0;
-	if (file == NULL)
-		return NULL;
 	mcp = magic_open(MAGIC_MIME);
 	if (mcp == NULL)
 		return NULL;
@@ -22,7 +80,10 @@ char *get_mime_string(const char *file)
 		magic_close(mcp);
 		return NULL;
 	}
-	tmp = magic_file(mcp, file);
+	if (file != NULL)
+		tmp = magic_file(mcp, file);
+	else
+		tmp = magic_descriptor(mcp, fd);
 	if (tmp == NULL) {
 		magic_close(mcp);
 		return NULL;
@@ -40,98 +101,477 @@ char *get_mime_string(const char *file)
 }
 
 /**
- * get_file_size - return the size of a file
- * @f: file to mesure size
+ * get_mime_string - get the mime type of a file using the magic number
+ * @file: path of the file to get the mime types
+ * return a string allocated on the heap with malloc(2)
  */
-static long get_file_size(FILE *f)
+char *get_mime_string(const char *file)
 {
-	long fsize = 0;
-	int ret = 0;
-	if (f == NULL)
+	if (file == NULL)
+		return NULL;
+	return get_mime(file, -1);
+}
+
+/**
+ * has_dotdot - return true if a component of path is ".."
+ */
+static bool has_dotdot(const char *path)
+{
+	for (const char *c = path; *c != '\0'; c = strchrnul(c, '/')) {
+		while (*c == '/')
+			++c;
+		if (c[0] == '.' && c[1] == '.' && (c[2] == '/' || c[2] == '\0'))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * open_beneath - open a file relative to a folder without leaving it
+ * @dirfd: the folder
+ * @name: path of the file relative to dirfd, leading slashes are skipped
+ * @flags: flags of open(2), O_CLOEXEC is added
+ * neither ".." nor a symlink can take the resolution out of dirfd, the
+ * kernel fails it with EXDEV. Without openat2(2) (Linux < 5.6) the
+ * names with a ".." component fail with EXDEV and symlinks are followed.
+ */
+static int open_beneath(int dirfd, const char *name, int flags)
+{
+	static bool no_openat2 = false;
+	struct open_how how = {0};
+	int fd = -1;
+	while (*name == '/')
+		++name;
+	if (*name == '\0')
+		name = ".";
+	if (!__atomic_load_n(&no_openat2, __ATOMIC_RELAXED)) {
+		how.flags = flags | O_CLOEXEC;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		fd = syscall(SYS_openat2, dirfd, name, &how, sizeof(how));
+		if (fd >= 0 || errno != ENOSYS)
+			return fd;
+		__atomic_store_n(&no_openat2, true, __ATOMIC_RELAXED);
+	}
+	if (has_dotdot(name)) {
+		errno = EXDEV;
 		return -1;
-	ret = fseek(f, 0, SEEK_END);
-	if (ret < 0)
-		return ret;
-	fsize = ftell(f);
-	if (fsize < 0)
-		return fsize;
-	ret = fseek(f, 0, SEEK_SET);  //same as rewind(f);
-	if (ret < 0)
-		return ret;
-	return fsize;
+	}
+	return openat(dirfd, name, flags | O_CLOEXEC);
 }
 
 /**
- * get_file_size_from_path - return file size from pathname
- * @path: path of the file
- * return -1 in case of error
+ * exists_beneath - return true if name exists inside the folder dirfd
  */
-static long get_file_size_from_path(const char *path)
+static bool exists_beneath(int dirfd, const char *name)
 {
-	FILE *file = NULL;
-	long file_size = 0;
-	if (path == NULL)
+	int fd = open_beneath(dirfd, name, O_PATH);
+	if (fd < 0)
+		return false;
+	close(fd);
+	return true;
+}
+
+/**
+ * open_file - open and stat a file which may be served
+ * @dirfd: folder the file must be in, AT_FDCWD for anywhere
+ * @name: path of the file, relative to dirfd unless dirfd is AT_FDCWD
+ * @st: where to store the stat
+ * only regular files may be served, the others fail with EISDIR or EINVAL.
+ * the file is opened non-blocking, so a fifo can't stall the open, which
+ * changes nothing for a regular file.
+ * return the file descriptor, -1 in case of error.
+ */
+static int open_file(int dirfd, const char *name, struct stat *st)
+{
+	int fd = -1;
+	if (name == NULL)
 		return -1;
-	file = fopen(path, "r");
-	if (file == NULL)
+	if (dirfd == AT_FDCWD)
+		fd = open(name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	else
+		fd = open_beneath(dirfd, name, O_RDONLY | O_NONBLOCK);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, st) != 0) {
+		close(fd);
+		return -1;
+	}
+	if (!S_ISREG(st->st_mode)) {
+		close(fd);
+		errno = S_ISDIR(st->st_mode) ? EISDIR : EINVAL;
 		return -1;
-	file_size = get_file_size(file);
-	fclose(file);
-	return file_size;
+	}
+	return fd;
+}
+
+/**
+ * get_stat_etag - entity-tag of a file made of its inode, size and mtime
+ * @st: stat of the file
+ * @etag: where to store the entity-tag, CACHE_ETAG_SIZE bytes
+ */
+static void get_stat_etag(const struct stat *st, char *etag)
+{
+	unsigned long mtime_ns = 0;
+	mtime_ns = (unsigned long)st->st_mtim.tv_sec * 1000000000UL +
+		(unsigned long)st->st_mtim.tv_nsec;
+	snprintf(etag, CACHE_ETAG_SIZE, "\"%lx-%lx-%lx\"",
+		 (unsigned long)st->st_ino, (unsigned long)st->st_size, mtime_ns);
+}
+
+/**
+ * get_hash_etag - entity-tag of a file made of a FNV-1a hash of its content
+ * @fd: open file, read with pread(2) so its offset is left unchanged
+ * @etag: where to store the entity-tag, CACHE_ETAG_SIZE bytes
+ * the variants of an image are encoded again when evicted, the hash
+ * keeps their entity-tag while their content doesn't change.
+ */
+static int get_hash_etag(int fd, char *etag)
+{
+	unsigned char buf[BUFSIZ];
+	uint64_t hash = 14695981039346656037ULL;
+	ssize_t n = 0;
+	off_t offset = 0;
+	while ((n = pread(fd, buf, sizeof(buf), offset)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (ssize_t i = 0; i < n; ++i) {
+			hash ^= buf[i];
+			hash *= 1099511628211ULL;
+		}
+		offset += n;
+	}
+	snprintf(etag, CACHE_ETAG_SIZE, "\"v-%016llx\"", (unsigned long long)hash);
+	return 0;
+}
+
+/**
+ * alloc_file_data - alloc a file_data
+ * @path: path of the file, it will be copied
+ * @st: stat of the file
+ * @mime: mime of the file, owned by the file_data on success, in arena
+ * if arena is not NULL
+ * @etag: entity-tag of the file
+ * @fd: the open file, owned by the file_data on success
+ * @arena: arena where to allocate the file_data, NULL for the heap
+ */
+static struct file_data *alloc_file_data(const char *path,
+					 const struct stat *st,
+					 char *mime,
+					 const char *etag,
+					 int fd,
+					 struct arena *arena)
+{
+	struct file_data *entry = NULL;
+	if (arena != NULL) {
+		entry = arena_alloc(arena, sizeof(*entry));
+		if (entry == NULL)
+			return NULL;
+		entry->path = arena_strdup(arena, path);
+		if (entry->path == NULL)
+			return NULL;
+	} else {
+		entry = malloc(sizeof(*entry));
+		if (entry == NULL)
+			return NULL;
+		entry->path = strdup(path);
+		if (entry->path == NULL) {
+			free(entry);
+			return NULL;
+		}
+	}
+	entry->arena = arena;
+	entry->fd = fd;
+	entry->mime = mime;
+	entry->data_size = st->st_size;
+	entry->negotiated = false;
+	strncpy(entry->etag, etag, CACHE_ETAG_SIZE - 1);
+	entry->etag[CACHE_ETAG_SIZE - 1] = '\0';
+	entry->last_modified = st->st_mtime;
+	entry->cache_rule = NULL;
+	entry->ok_header = NULL;
+	entry->not_modified_header = NULL;
+	return entry;
 }
 
+static bool is_image(const struct file_data *file)
+{
+	return (strstr(file->mime, "image") != NULL);
+}
+
+size_t file_data_headers(const struct file_data *file,
+			 struct http_header *headers,
+			 char *last_modified,
+			 char *expires)
+{
+	size_t n = 0;
+	if (file == NULL || headers == NULL)
+		return 0;
+	headers[n].name = "ETag";
+	headers[n++].value = file->etag;
+	if (http_format_date(file->last_modified, last_modified) == 0) {
+		headers[n].name = "Last-Modified";
+		headers[n++].value = last_modified;
+	}
+	if (file->cache_rule != NULL) {
+		headers[n].name = "Cache-Control";
+		headers[n++].value = file->cache_rule->value;
+		// for the HTTP/1.0 caches ignoring Cache-Control
+		if (http_format_date(time(NULL) + file->cache_rule->max_age, expires) == 0) {
+			headers[n].name = "Expires";
+			headers[n++].value = expires;
+		}
+	}
+	headers[n].name = "Accept-Ranges";
+	headers[n++].value = "bytes";
+	if (file->negotiated) {
+		headers[n].name = "Vary";
+		headers[n++].value = "Accept, " CLIENT_HINTS;
+		headers[n].name = "Accept-CH";
+		headers[n++].value = CLIENT_HINTS;
+	}
+	return n;
+}
+
+/**
+ * build_header_blocks - build the header blocks of the 200 and of the
+ * 304 responses for file
+ * @file: file_data
+ * @slab: slab to allocate the blocks from, NULL for the heap
+ */
+static int build_header_blocks(struct file_data *file, struct slab *slab)
+{
+	struct http_header headers[FILE_DATA_HEADERS];
+	char last_modified[HTTP_DATE_SIZE] = {0};
+	char expires[HTTP_DATE_SIZE] = {0};
+	char content_lenght[32] = {0};
+	size_t n_headers = 0;
+	int max_age = 0;
+	n_headers = file_data_headers(file, headers, last_modified, expires);
+	if (file->cache_rule != NULL)
+		max_age = file->cache_rule->max_age;
+	snprintf(content_lenght, sizeof(content_lenght), "%zu", file->data_size);
+	file->ok_header = http_header_block_create(slab, HTTP_OK, file->mime, content_lenght,
+						   headers, n_headers, max_age);
+	// a 304 carries the same headers but the ones of the payload
+	file->not_modified_header = http_header_block_create(slab, HTTP_NOT_MODIFIED, NULL,
+							     NULL, headers, n_headers, max_age);
+	if (file->ok_header == NULL || file->not_modified_header == NULL) {
+		http_header_block_put(file->ok_header);
+		http_header_block_put(file->not_modified_header);
+		file->ok_header = NULL;
+		file->not_modified_header = NULL;
+		return -1;
+	}
+	return 0;
+}
 
 struct file_data *create_file_data(const char *path)
 {
 	struct file_data *entry = NULL;
 	struct stat st = {0};
-	if (stat(path, &st) != 0)
+	char etag[CACHE_ETAG_SIZE];
+	char *mime = NULL;
+	int fd = -1;
+	fd = open_file(AT_FDCWD, path, &st);
+	if (fd < 0)
 		return NULL;
-	entry = malloc(sizeof(*entry));
-	if (entry == NULL)
-		return NULL;
-	entry->path = strdup(path);
-	if (entry->path == NULL) {
-		free(entry);
+	mime = get_mime(NULL, fd);
+	if (mime == NULL) {
+		close(fd);
 		return NULL;
 	}
-	entry->mime = get_mime_string(path);
-	if (entry->mime == NULL) {
-		free(entry->path);
-		free(entry);
-		return NULL;
+	get_stat_etag(&st, etag);
+	entry = alloc_file_data(path, &st, mime, etag, fd, NULL);
+	if (entry == NULL) {
+		free(mime);
+		close(fd);
 	}
-	entry->data_size = get_file_size_from_path(path);
-	if (entry->data_size < 0) {
-		free(entry->path);
-		free(entry);
+	return entry;
+}
+
+/**
+ * get_indexed_file_data - create_file_data() through the cache index
+ * @cp: content proxy
+ * @dirfd: folder of the file, the root or the cache
+ * @name: path of the file relative to dirfd
+ * @path: path of the file, key of the cache index
+ * @url: url the file is served for, used to match the caching policy
+ * @hashed: if true the entity-tag is a hash of the content
+ * @arena: arena of the request, NULL for the heap
+ * the mime, the entity-tag, the caching policy and the response header
+ * blocks are computed the first time the file is seen and kept in the
+ * cache index till the file changes, so that the metadata of an
+ * unchanged file is served without reading it. The mime and the
+ * entity-tag of a root file in the manifest are taken from it.
+ */
+static struct file_data *get_indexed_file_data(struct content_proxy *cp,
+					       int dirfd,
+					       const char *name,
+					       const char *path,
+					       const char *url,
+					       bool hashed,
+					       struct arena *arena)
+{
+	struct file_data *entry = NULL;
+	struct stat st = {0};
+	struct cache_meta meta = {0};
+	const char *known = NULL;
+	char *mime = NULL;
+	char *heap_mime = NULL;
+	int fd = -1;
+	fd = open_file(dirfd, name, &st);
+	if (fd < 0)
 		return NULL;
+	if (cache_index_get_meta(cp->cache_index, path, &st, &meta, arena) == 0) {
+		entry = alloc_file_data(path, &st, meta.mime, meta.etag, fd, arena);
+		if (entry == NULL) {
+			if (arena != NULL)
+				meta.mime = NULL;
+			cache_meta_release(&meta);
+			close(fd);
+			return NULL;
+		}
+		if (meta.policy >= 0 && (size_t)meta.policy < cp->n_cache_rules)
+			entry->cache_rule = &cp->cache_rules[meta.policy];
+		entry->negotiated = is_image(entry);
+		// the references taken by cache_index_get_meta() pass to entry
+		entry->ok_header = meta.ok_header;
+		entry->not_modified_header = meta.not_modified_header;
+		return entry;
 	}
+	// the manifest spares libmagic to the first request of a root file
+	if (!hashed)
+		known = manifest_lookup(cp->manifest, name, &st, meta.etag);
+	if (known != NULL) {
+		mime = (arena != NULL) ? arena_strdup(arena, known) : strdup(known);
+		if (mime == NULL)
+			goto error;
+	} else {
+		mime = get_mime(NULL, fd);
+		if (mime == NULL)
+			goto error;
+		// the first request of a file pays the copy, the next ones hit the index
+		if (arena != NULL) {
+			heap_mime = mime;
+			mime = arena_strdup(arena, heap_mime);
+			free(heap_mime);
+			if (mime == NULL)
+				goto error;
+		}
+		if (!hashed)
+			get_stat_etag(&st, meta.etag);
+		else if (get_hash_etag(fd, meta.etag) != 0)
+			goto error;
+	}
+	entry = alloc_file_data(path, &st, mime, meta.etag, fd, arena);
+	if (entry == NULL)
+		goto error;
+	meta.policy = cache_policy_match(cp->cache_rules, cp->n_cache_rules, url, mime);
+	if (meta.policy >= 0)
+		entry->cache_rule = &cp->cache_rules[meta.policy];
+	entry->negotiated = is_image(entry);
+	// the blocks live in the index, the index being full is no error
+	if (build_header_blocks(entry, cp->cache_index->slab) != 0 && errno != ENOSPC)
+		syslog(LOG_WARNING, "can't build the header blocks of %s: %m", path);
+	meta.mime = entry->mime;
+	meta.ok_header = entry->ok_header;
+	meta.not_modified_header = entry->not_modified_header;
+	if (cache_index_set_meta(cp->cache_index, path, &st, &meta) != 0 && errno != ENOSPC)
+		syslog(LOG_WARNING, "can't index the metadata of %s: %m", path);
 	return entry;
+error:
+	if (arena == NULL)
+		free(mime);
+	close(fd);
+	return NULL;
 }
 
 void destroy_file_data(struct file_data *entry)
 {
 	if (entry == NULL)
 		return;
+	http_header_block_put(entry->ok_header);
+	http_header_block_put(entry->not_modified_header);
+	if (entry->fd >= 0)
+		close(entry->fd);
+	if (entry->arena != NULL)
+		return;
 	free(entry->path);
 	free(entry->mime);
 	free(entry);
 }
 
+/**
+ * concat - string_concat() in arena, on the heap if arena is NULL
+ */
+static char *concat(struct arena *arena, const char *s1, const char *s2)
+{
+	if (arena != NULL)
+		return string_arena_concat(arena, s1, s2);
+	return string_concat(s1, s2);
+}
+
+/**
+ * release - free a string returned by concat(), a string in an arena
+ * is freed with the arena
+ */
+static void release(struct arena *arena, char *s)
+{
+	if (arena == NULL)
+		free(s);
+}
+
 /**
  * get_true_file_path - get true file path from the given url
  * @cp: content_proxy which manages file system information
  * @url: url to a given resource
+ * @arena: where to allocate the path, NULL for the heap
  */
-static char *get_true_file_path(struct content_proxy *cp, char *url, bool from_cache)
+static char *get_true_file_path(struct content_proxy *cp,
+				const char *url,
+				bool from_cache,
+				struct arena *arena)
 {
-	char *path = NULL;
 	if (from_cache)
-		path = string_concat(cp->cache, url);
-	else
-		path = string_concat(cp->root, url);
-	return path;
+		return concat(arena, cp->cache, url);
+	return concat(arena, cp->root, url);
+}
+
+/**
+ * get_indexed - get_indexed_file_data() of the file at url in the root
+ * or in the cache folder
+ */
+static struct file_data *get_indexed(struct content_proxy *cp,
+				     const char *name,
+				     bool from_cache,
+				     const char *url,
+				     struct arena *arena)
+{
+	struct file_data *file_data = NULL;
+	char *path = NULL;
+	int dirfd = from_cache ? cp->cache_fd : cp->root_fd;
+	path = get_true_file_path(cp, name, from_cache, arena);
+	if (path == NULL)
+		return NULL;
+	file_data = get_indexed_file_data(cp, dirfd, name, path, url, from_cache, arena);
+	release(arena, path);
+	return file_data;
+}
+
+/**
+ * lookup_file_data - get_file_data() allocating in arena
+ */
+static struct file_data *lookup_file_data(struct content_proxy *cp,
+					  char *url,
+					  bool from_cache,
+					  struct arena *arena)
+{
+	if (strlen(url) == 1 && *url == '/')
+		url = cp->index;
+	return get_indexed(cp, url, from_cache, url, arena);
 }
 
 /**
@@ -144,18 +584,296 @@ static char *get_true_file_path(struct content_proxy *cp, char *url, bool from_c
  */
 struct file_data *get_file_data(struct content_proxy *cp, char *url, bool from_cache)
 {
-	char *path = NULL;
-	struct file_data *file_data = NULL;
 	if (cp == NULL || url == NULL)
 		return NULL;
-	if (strlen(url) == 1 && *url == '/')
-		url = cp->index;
-	path = get_true_file_path(cp, url, from_cache);
-	if (path == NULL)
+	return lookup_file_data(cp, url, from_cache, NULL);
+}
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+		(to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/**
+ * manifest_scan - files of the root whose metadata is computed by
+ * several threads for the manifest
+ * @cp: content proxy
+ * @entries: the files, the mime of those which can't be served stays NULL
+ * @n: number of element in entries
+ * @next: index of the next file to scan
+ */
+struct manifest_scan {
+	struct content_proxy *cp;
+	struct manifest_entry *entries;
+	size_t n;
+	size_t next;
+};
+
+/**
+ * list_files - append to scan the regular files beneath the folder name
+ * of the root, symlinks are not followed
+ * @dirfd: the folder
+ * @name: path of the folder relative to the root, "" for the root
+ */
+static int list_files(struct manifest_scan *scan, int dirfd, const char *name)
+{
+	struct manifest_entry *entries = NULL;
+	struct dirent *ent = NULL;
+	struct stat st = {0};
+	DIR *dir = NULL;
+	char *child = NULL;
+	size_t size = 0;
+	int type = 0;
+	int fd = -1;
+	int res = 0;
+	dir = fdopendir(dirfd);
+	if (dir == NULL) {
+		close(dirfd);
+		return -1;
+	}
+	while (res == 0 && (ent = readdir(dir)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		type = ent->d_type;
+		if (type == DT_UNKNOWN && fstatat(dirfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		if (type != DT_DIR && type != DT_REG)
+			continue;
+		size = strlen(name) + strlen(ent->d_name) + 2;
+		child = malloc(size);
+		if (child == NULL) {
+			res = -1;
+			break;
+		}
+		snprintf(child, size, "%s%s%s", name, (*name != '\0') ? "/" : "", ent->d_name);
+		if (type == DT_DIR) {
+			fd = openat(dirfd, ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			// a folder which can't be read has no file to serve
+			if (fd >= 0)
+				res = list_files(scan, fd, child);
+			free(child);
+			continue;
+		}
+		if ((scan->n & (scan->n - 1)) == 0) {
+			entries = realloc(scan->entries, (scan->n ? scan->n * 2 : 64) * sizeof(*entries));
+			if (entries == NULL) {
+				free(child);
+				res = -1;
+				break;
+			}
+			scan->entries = entries;
+		}
+		memset(&scan->entries[scan->n], 0, sizeof(*scan->entries));
+		scan->entries[scan->n++].name = child;
+	}
+	closedir(dir);
+	return res;
+}
+
+/**
+ * scan_main - compute the metadata of the files of a manifest_scan
+ * till none is left
+ */
+static void *scan_main(void *arg)
+{
+	struct manifest_scan *scan = arg;
+	struct manifest_entry *entry = NULL;
+	size_t i = 0;
+	int fd = -1;
+	while ((i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED)) < scan->n) {
+		entry = &scan->entries[i];
+		fd = open_file(scan->cp->root_fd, entry->name, &entry->st);
+		if (fd < 0)
+			continue;
+		entry->mime = get_mime(NULL, fd);
+		get_stat_etag(&entry->st, entry->etag);
+		close(fd);
+	}
+	return NULL;
+}
+
+/**
+ * build_manifest - scan the root and write its manifest
+ * @cp: content proxy
+ * @path: path of the manifest
+ * @root: stat of the root
+ * the folders are walked by the calling thread, the files, whose mime
+ * costs a read and libmagic, are shared by up to MANIFEST_SCAN_THREADS.
+ */
+static int build_manifest(struct content_proxy *cp, const char *path, const struct stat *root)
+{
+	struct manifest_scan scan = {0};
+	pthread_t threads[MANIFEST_SCAN_THREADS];
+	long n_threads = 0;
+	size_t n = 0;
+	int fd = -1;
+	int res = 0;
+	int err = 0;
+	scan.cp = cp;
+	fd = openat(cp->root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	res = list_files(&scan, fd, "");
+	if (res == 0) {
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+		if (n_threads > MANIFEST_SCAN_THREADS)
+			n_threads = MANIFEST_SCAN_THREADS;
+		for (long i = 0; i < n_threads; ++i) {
+			if (pthread_create(&threads[i], NULL, scan_main, &scan) != 0)
+				n_threads = i;
+		}
+		scan_main(&scan);
+		for (long i = 0; i < n_threads; ++i)
+			pthread_join(threads[i], NULL);
+		// keep the files which can be served
+		for (size_t i = 0; i < scan.n; ++i) {
+			if (scan.entries[i].mime == NULL) {
+				free(scan.entries[i].name);
+				continue;
+			}
+			scan.entries[n++] = scan.entries[i];
+		}
+		scan.n = n;
+		res = manifest_write(path, root, scan.entries, scan.n);
+	}
+	err = errno;
+	for (size_t i = 0; i < scan.n; ++i) {
+		free(scan.entries[i].name);
+		free(scan.entries[i].mime);
+	}
+	free(scan.entries);
+	errno = err;
+	return res;
+}
+
+/**
+ * open_manifest - map the manifest of the root, scanning the root to
+ * write it first if it is missing or invalid
+ * @cp: content proxy
+ * @path: path of the manifest, NULL for none
+ * a file changed since the manifest was written is looked up as if
+ * missing from it, remove the manifest to have the root scanned again.
+ * return NULL if no manifest can be used.
+ */
+static struct manifest *open_manifest(struct content_proxy *cp, const char *path)
+{
+	struct manifest *m = NULL;
+	struct stat root = {0};
+	struct timespec start = {0}, end = {0};
+	if (path == NULL || fstat(cp->root_fd, &root) != 0)
 		return NULL;
-	file_data = create_file_data(path);
+	m = manifest_load(path, &root);
+	if (m != NULL) {
+		syslog(LOG_INFO, "manifest %s: %zu files\n", path, manifest_entries(m));
+		return m;
+	}
+	if (errno != ENOENT)
+		syslog(LOG_INFO, "manifest %s can't be used, scanning %s: %m\n", path, cp->root);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (build_manifest(cp, path, &root) < 0) {
+		syslog(LOG_WARNING, "can't write the manifest %s: %m\n", path);
+		return NULL;
+	}
+	m = manifest_load(path, &root);
+	if (m == NULL) {
+		syslog(LOG_WARNING, "can't load the manifest %s: %m\n", path);
+		return NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	syslog(LOG_INFO, "manifest %s: %zu files scanned in %ld ms\n", path,
+	       manifest_entries(m), elapsed_ms(&start, &end));
+	return m;
+}
+
+/**
+ * remove_tree - remove the file or folder name of dirfd and all its content
+ */
+static void remove_tree(int dirfd, const char *name)
+{
+	struct dirent *ent = NULL;
+	DIR *dir = NULL;
+	int fd = -1;
+	if (unlinkat(dirfd, name, 0) == 0 || errno != EISDIR)
+		return;
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+			remove_tree(fd, ent->d_name);
+	}
+	closedir(dir);
+	// an encode writing in it meanwhile keeps it, its variants are checked
+	unlinkat(dirfd, name, AT_REMOVEDIR);
+}
+
+/**
+ * remove_variants - remove from the cache folder and from the index the
+ * variants of every quality and width of the file or folder name
+ * @name: path relative to the root, "" for the whole root
+ */
+static void remove_variants(struct content_proxy *cp, const char *name)
+{
+	struct dirent *ent = NULL;
+	char *variant = NULL;
+	char *path = NULL;
+	size_t size = 0;
+	DIR *dir = NULL;
+	int fd = -1;
+	fd = openat(cp->cache_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return;
+	}
+	// every sub-folder q=... mirrors the root, see get_cache_filename()
+	while ((ent = readdir(dir)) != NULL) {
+		if (strncmp(ent->d_name, "q=", 2) != 0)
+			continue;
+		size = strlen(ent->d_name) + strlen(name) + 2;
+		variant = malloc(size);
+		if (variant == NULL)
+			break;
+		snprintf(variant, size, "/%s%s", ent->d_name, name);
+		path = get_true_file_path(cp, variant, true, NULL);
+		if (path != NULL)
+			cache_index_invalidate(cp->cache_index, path);
+		free(path);
+		remove_tree(fd, variant + 1);
+		free(variant);
+	}
+	closedir(dir);
+}
+
+/**
+ * root_changed - root_watcher_changed() of the content proxy, forget
+ * everything derived from a file changed in the root
+ * @arg: the content proxy
+ * @name: path of the file or folder changed relative to the root
+ */
+static void root_changed(void *arg, const char *name)
+{
+	struct content_proxy *cp = arg;
+	char *path = NULL;
+	// a new file can answer a url that missed
+	negative_cache_clear(cp->misses);
+	if (name == NULL) {
+		syslog(LOG_WARNING, "%s %s\n", "changes lost, dropping every variant of", cp->root);
+		name = "";
+	}
+	path = get_true_file_path(cp, name, false, NULL);
+	if (path != NULL)
+		cache_index_invalidate(cp->cache_index, path);
 	free(path);
-	return file_data;
+	remove_variants(cp, name);
 }
 
 struct content_proxy *create_content_proxy(struct content_proxy_settings *cps)
@@ -172,93 +890,646 @@ struct content_proxy *create_content_proxy(struct content_proxy_settings *cps)
 	cp->root = cps->root;
 	cp->cache = cps->cache;
 	cp->index = cps->index;
-	res = pthread_mutex_init(&cp->mutex, NULL);
-	if (res < 0) {
+	cp->variants = cps->variants;
+	cp->n_variants = cps->n_variants;
+	cp->quality = cps->quality;
+	cp->load = cps->load;
+	cp->cache_rules = cps->cache_rules;
+	cp->n_cache_rules = cps->n_cache_rules;
+	cp->n_jobs = 0;
+	cp->busy = 0;
+	cp->degraded = false;
+	INIT_LIST_HEAD(&cp->jobs);
+	cp->root_fd = open(cp->root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (cp->root_fd < 0) {
+		syslog(LOG_ERR, "can't open the root %s: %m\n", cp->root);
 		free(cp);
 		return NULL;
 	}
+	cp->cache_fd = open(cp->cache, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (cp->cache_fd < 0) {
+		syslog(LOG_ERR, "can't open the cache %s: %m\n", cp->cache);
+		goto close_root;
+	}
+	cp->cache_index = cache_index_create(CACHE_INDEX_BUCKETS, cps->index_memory);
+	if (cp->cache_index == NULL)
+		goto close_cache;
+	cp->misses = negative_cache_create(cp->root_fd, cps->negative_ttl);
+	if (cp->misses == NULL)
+		goto destroy_index;
+	res = pthread_mutex_init(&cp->mutex, NULL);
+	if (res < 0) {
+		negative_cache_destroy(cp->misses);
+		goto destroy_index;
+	}
+	cp->manifest = open_manifest(cp, cps->manifest);
+	// the index and the misses check the files anyway, the variants don't
+	cp->watcher = root_watcher_start(cp->root, root_changed, cp);
+	if (cp->watcher == NULL)
+		syslog(LOG_WARNING, "can't watch the root %s: %m\n", cp->root);
 	return cp;
+destroy_index:
+	cache_index_destroy(cp->cache_index);
+close_cache:
+	close(cp->cache_fd);
+close_root:
+	close(cp->root_fd);
+	free(cp);
+	return NULL;
 }
 
 void destroy_content_proxy(struct content_proxy *cp)
 {
 	if (cp == NULL)
 		return;
+	root_watcher_stop(cp->watcher);
+	manifest_close(cp->manifest);
 	pthread_mutex_destroy(&cp->mutex);
+	negative_cache_destroy(cp->misses);
+	cache_index_destroy(cp->cache_index);
+	close(cp->cache_fd);
+	close(cp->root_fd);
 	free(cp);
 }
 
+void content_proxy_request_begin(struct content_proxy *cp)
+{
+	if (cp == NULL)
+		return;
+	__atomic_add_fetch(&cp->busy, 1, __ATOMIC_RELAXED);
+}
+
+void content_proxy_request_end(struct content_proxy *cp)
+{
+	if (cp == NULL)
+		return;
+	__atomic_sub_fetch(&cp->busy, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * is_overloaded - return true if a missing variant should not be encoded
+ * the state is evaluated at every call, so the proxy goes back to
+ * exact variants as soon as the load drops. The counters are read
+ * without the mutex, taken only to log a change of state.
+ */
+static bool is_overloaded(struct content_proxy *cp)
+{
+	int n_jobs = __atomic_load_n(&cp->n_jobs, __ATOMIC_RELAXED);
+	int busy = __atomic_load_n(&cp->busy, __ATOMIC_RELAXED);
+	bool overloaded = false;
+	if (cp->load.max_jobs > 0 && n_jobs >= cp->load.max_jobs)
+		overloaded = true;
+	// the worker asking is busy by definition, only the others count
+	if (cp->load.workers > 1 && cp->load.max_utilization > 0.0 &&
+	    busy - 1 >= cp->load.max_utilization * (cp->load.workers - 1))
+		overloaded = true;
+	if (overloaded == __atomic_load_n(&cp->degraded, __ATOMIC_RELAXED))
+		return overloaded;
+	pthread_mutex_lock(&cp->mutex);
+	if (overloaded != cp->degraded) {
+		__atomic_store_n(&cp->degraded, overloaded, __ATOMIC_RELAXED);
+		syslog(LOG_INFO, "%s: %d encodes, %d/%d busy workers\n",
+		       overloaded ? "overloaded, serving cached variants" :
+		       "load dropped, serving exact variants",
+		       n_jobs, busy, cp->load.workers);
+	}
+	pthread_mutex_unlock(&cp->mutex);
+	return overloaded;
+}
+
+/**
+ * get_cache_filename - return the name of a variant inside the cache folder
+ * @url: url of the original content
+ * @quality: quality of the variant
+ * @width: width of the variant, 0 for the width of the original
+ * variants of the same quality and width share a sub-folder mirroring
+ * the root e.g. /img/a.jpg at quality 50 become /q=50/img/a.jpg and
+ * at quality 50 and width 640 /q=50,w=640/img/a.jpg
+ * the name is allocated in arena, on the heap if arena is NULL.
+ */
+static char *get_cache_filename(const char *url, int quality, int width,
+				struct arena *arena)
+{
+	char str_weight[64] = {0};
+	int res = 0;
+	if (width > 0)
+		res = snprintf(str_weight, 63, "/q=%d,w=%d", quality, width);
+	else
+		res = snprintf(str_weight, 63, "/q=%d", quality);
+	if (res < 0 || res > 63)
+		return NULL;
+	return concat(arena, str_weight, url);
+}
+
+/**
+ * make_parent_dirs - create all the missing parent folders of path
+ * @path: path of a file whose folders should exist
+ * @from: index of path where to start creating folders
+ */
+static int make_parent_dirs(char *path, size_t from)
+{
+	char *ptr = NULL;
+	for (ptr = strchr(path + from + 1, '/'); ptr != NULL; ptr = strchr(ptr + 1, '/')) {
+		*ptr = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			*ptr = '/';
+			return -1;
+		}
+		*ptr = '/';
+	}
+	return 0;
+}
+
+/**
+ * nearest_variant - map a weight to the nearest configured quality
+ * @cp: content proxy holding the configured variants
+ * @weight: weight asked by the client
+ * if no variant is configured the weight is used as it is.
+ */
+static int nearest_variant(const struct content_proxy *cp, int weight)
+{
+	int best = weight;
+	int best_diff = INT_MAX;
+	for (size_t i = 0; i < cp->n_variants; ++i) {
+		int diff = abs(cp->variants[i] - weight);
+		if (diff < best_diff ||
+		    (diff == best_diff && cp->variants[i] > best)) {
+			best = cp->variants[i];
+			best_diff = diff;
+		}
+	}
+	return best;
+}
+
+static void free_variants(struct image_variant *variants, char **paths, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		free(variants[i].dest);
+		free(paths[i]);
+	}
+	free(variants);
+	free(paths);
+}
+
+/**
+ * get_temp_path - return the path where a variant is written before being
+ * renamed to dest, so that a variant is never seen half written
+ * @dest: path of the variant
+ * the name keeps the extension of dest, ImageMagick chooses the format by it.
+ */
+static char *get_temp_path(const char *dest)
+{
+	const char *name = NULL;
+	char *tmp = NULL;
+	size_t size = 0;
+	name = strrchr(dest, '/');
+	name = (name != NULL) ? name + 1 : dest;
+	size = strlen(dest) + 32;
+	tmp = malloc(size);
+	if (tmp == NULL)
+		return NULL;
+	snprintf(tmp, size, "%.*s.tmp-%lu-%s", (int)(name - dest), dest,
+		 (unsigned long)pthread_self(), name);
+	return tmp;
+}
+
+/**
+ * add_variant - append a variant of url to variants if not already cached
+ * @paths: where to store the path of the variant, variants are written
+ * to a temporary path
+ * @force: append even if the variant is already in cache
+ */
+static int add_variant(struct content_proxy *cp,
+		       struct image_variant *variants,
+		       char **paths,
+		       size_t *n,
+		       char *url,
+		       int quality,
+		       int width,
+		       bool force)
+{
+	char *cache_filename = NULL;
+	char *dest = NULL;
+	cache_filename = get_cache_filename(url, quality, width, NULL);
+	if (cache_filename == NULL)
+		return -1;
+	if (!force && exists_beneath(cp->cache_fd, cache_filename)) {
+		free(cache_filename);
+		return 0;
+	}
+	dest = get_true_file_path(cp, cache_filename, true, NULL);
+	free(cache_filename);
+	if (dest == NULL)
+		return -1;
+	if (make_parent_dirs(dest, strlen(cp->cache)) < 0) {
+		free(dest);
+		return -1;
+	}
+	variants[*n].dest = get_temp_path(dest);
+	if (variants[*n].dest == NULL) {
+		free(dest);
+		return -1;
+	}
+	variants[*n].quality = quality;
+	variants[*n].width = width;
+	// not written till compress_image_variants() says so
+	variants[*n].status = -1;
+	paths[*n] = dest;
+	(*n)++;
+	return 0;
+}
+
+/**
+ * publish_variants - move the written variants to their path and remove
+ * what is left of the others
+ */
+static void publish_variants(struct image_variant *variants, char **paths, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (variants[i].status == 0 &&
+		    rename(variants[i].dest, paths[i]) == 0)
+			continue;
+		variants[i].status = -1;
+		remove(variants[i].dest);
+	}
+}
+
+/**
+ * unpublish_variants - remove the published variants, encoded from an
+ * original which changed meanwhile
+ */
+static void unpublish_variants(struct image_variant *variants, char **paths, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (variants[i].status == 0)
+			remove(paths[i]);
+		variants[i].status = -1;
+	}
+}
+
+/**
+ * nearest_cached_variant - return the cached variant of url whose quality
+ * is the nearest to weight, among the configured ones of the same width
+ * return NULL if no such variant is in cache.
+ */
+static struct file_data *nearest_cached_variant(struct content_proxy *cp,
+						char *url,
+						int weight,
+						int width,
+						struct arena *arena)
+{
+	char *cache_filename = NULL;
+	struct file_data *content = NULL;
+	int best = -1;
+	int best_diff = INT_MAX;
+	for (size_t i = 0; i < cp->n_variants; ++i) {
+		int quality = cp->variants[i];
+		int diff = abs(quality - weight);
+		if (diff > best_diff || (diff == best_diff && quality < best))
+			continue;
+		cache_filename = get_cache_filename(url, quality, width, arena);
+		if (cache_filename == NULL)
+			continue;
+		if (exists_beneath(cp->cache_fd, cache_filename)) {
+			best = quality;
+			best_diff = diff;
+		}
+		release(arena, cache_filename);
+	}
+	if (best < 0)
+		return NULL;
+	cache_filename = get_cache_filename(url, best, width, arena);
+	if (cache_filename == NULL)
+		return NULL;
+	content = get_indexed(cp, cache_filename, true, url, arena);
+	release(arena, cache_filename);
+	return content;
+}
+
+/**
+ * get_max_quality - return the highest quality a variant of original can have
+ * @cp: content proxy
+ * @original: path of the original content
+ * @cancel: cancellation token of the search
+ * in QUALITY_QVALUE mode there is no limit, otherwise the quality found
+ * by search_image_quality() is stored in the cache index and shared by
+ * all the variants of original.
+ * return 0 if no variant of original should be made, -1 in case of error.
+ */
+static int get_max_quality(struct content_proxy *cp,
+			   const char *original,
+			   const struct image_cancel *cancel)
+{
+	struct stat st = {0};
+	int quality = 0;
+	if (cp->quality.mode == QUALITY_QVALUE)
+		return 100;
+	if (stat(original, &st) != 0)
+		return -1;
+	quality = cache_index_get_quality(cp->cache_index, original, &st);
+	if (quality >= 0)
+		return quality;
+	quality = search_image_quality(original, &cp->quality, cancel);
+	if (quality < 0)
+		return -1;
+	cache_index_set_quality(cp->cache_index, original, &st, quality);
+	return quality;
+}
+
+/**
+ * add_in_cache - encode the variant of url at quality weight and width
+ * every other configured variant of url of the same width missing from
+ * the cache is encoded in the same job, so that the original is decoded
+ * only once.
+ */
 static int add_in_cache(struct content_proxy *cp,
-				      char *url,
-				      char *cache_filename,
-				      int weight)
+			char *url,
+			int weight,
+			int width,
+			const struct image_cancel *cancel)
 {
-	char *entry_path = NULL;
+	struct image_variant *variants = NULL;
+	char **paths = NULL;
+	size_t n = 0;
 	char *original = NULL;
+	char before[CACHE_ETAG_SIZE] = {0};
+	char after[CACHE_ETAG_SIZE] = {0};
+	struct stat st = {0};
+	int max_quality = 0;
 	int res = 0;
-	original = string_concat(cp->root, url);
+	original = get_true_file_path(cp, url, false, NULL);
 	if (original == NULL)
 		return -1;
-	entry_path = string_concat(cp->cache, cache_filename);
-	if (entry_path == NULL) {
+	if (stat(original, &st) != 0) {
 		free(original);
 		return -1;
 	}
-	res = compress_image(original, entry_path, weight);
-	if (res < 0) {
-		free(entry_path);
+	get_stat_etag(&st, before);
+	max_quality = get_max_quality(cp, original, cancel);
+	if (max_quality <= 0) {
+		// no quality makes the original smaller, serve it as it is
 		free(original);
 		return -1;
 	}
-	return 0;
+	variants = calloc(cp->n_variants + 1, sizeof(*variants));
+	paths = calloc(cp->n_variants + 1, sizeof(*paths));
+	if (variants == NULL || paths == NULL) {
+		free(variants);
+		free(paths);
+		free(original);
+		return -1;
+	}
+	res = add_variant(cp, variants, paths, &n, url, weight, width, true);
+	for (size_t i = 0; res == 0 && i < cp->n_variants; ++i) {
+		if (cp->variants[i] == weight)
+			continue;
+		// an extra variant which can't be added is left for later
+		add_variant(cp, variants, paths, &n, url, cp->variants[i], width, false);
+	}
+	for (size_t i = 0; i < n; ++i) {
+		if (variants[i].quality > max_quality)
+			variants[i].quality = max_quality;
+	}
+	// the requested variant is the first, without it nothing is encoded
+	if (res == 0 && n > 0) {
+		compress_image_variants(original, variants, n, cancel);
+		publish_variants(variants, paths, n);
+		/*
+		 * a change of the original before this stat may have been
+		 * seen by the watcher before the variants were published,
+		 * a change after is seen after
+		 */
+		if (stat(original, &st) == 0)
+			get_stat_etag(&st, after);
+		if (strcmp(before, after) != 0)
+			unpublish_variants(variants, paths, n);
+	}
+	// only the outcome of the requested variant matters
+	res = (res == 0 && n > 0) ? variants[0].status : -1;
+	free_variants(variants, paths, n);
+	free(original);
+	return res;
 }
 
-static struct file_data *search_in_cache(struct content_proxy *cp, char *url, int weight)
+/**
+ * job_cancelled - return true when none of the waiters of a job needs
+ * its result anymore
+ * @arg: the encode_job
+ * polled at every checkpoint of the encode, the tokens of the waiters
+ * are checked at most every JOB_POLL_INTERVAL_MS.
+ */
+static bool job_cancelled(void *arg)
 {
-	char *cache_filepath = NULL;
-	char str_weight[64] = {0};
-	struct file_data *content = NULL;
-	int res = 0;
-	res = snprintf(str_weight, 63, "/q=%d", weight);
-	if (res < 0 || res > 63)
+	struct encode_job *job = arg;
+	struct job_waiter *waiter = NULL;
+	struct timespec now = {0};
+	bool cancelled = true;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	pthread_mutex_lock(&job->cp->mutex);
+	if (job->last_poll.tv_sec != 0 &&
+	    elapsed_ms(&job->last_poll, &now) < JOB_POLL_INTERVAL_MS) {
+		cancelled = job->cancelled;
+		pthread_mutex_unlock(&job->cp->mutex);
+		return cancelled;
+	}
+	list_for_each_entry(waiter, &job->waiters, list) {
+		if (!image_cancelled(waiter->cancel)) {
+			cancelled = false;
+			break;
+		}
+	}
+	job->last_poll = now;
+	job->cancelled = cancelled;
+	pthread_mutex_unlock(&job->cp->mutex);
+	return cancelled;
+}
+
+/**
+ * find_job - return the job encoding the variants of original at width
+ * must be called with cp->mutex held.
+ */
+static struct encode_job *find_job(struct content_proxy *cp,
+				   const char *original,
+				   int width)
+{
+	struct encode_job *job = NULL;
+	list_for_each_entry(job, &cp->jobs, list) {
+		if (job->width == width && strcmp(job->original, original) == 0)
+			return job;
+	}
+	return NULL;
+}
+
+/**
+ * create_job - create a job and add it to the jobs of cp
+ * must be called with cp->mutex held.
+ */
+static struct encode_job *create_job(struct content_proxy *cp,
+				     const char *original,
+				     int width)
+{
+	struct encode_job *job = NULL;
+	job = calloc(1, sizeof(*job));
+	if (job == NULL)
 		return NULL;
-	// *url is '/'
-	cache_filepath = string_concat(str_weight, url + 1);
-	if (cache_filepath == NULL)
+	job->original = strdup(original);
+	if (job->original == NULL) {
+		free(job);
 		return NULL;
-	content = get_file_data(cp, cache_filepath, true);
-	if (content != NULL) {
-		free(cache_filepath);
-		return content;
 	}
-	res = add_in_cache(cp, url, cache_filepath, weight);
-	if (res < 0) {
-		free(cache_filepath);
+	if (pthread_cond_init(&job->cond, NULL) != 0) {
+		free(job->original);
+		free(job);
 		return NULL;
 	}
-	content = get_file_data(cp, cache_filepath, true);
-	free(cache_filepath);
-	return content;
+	job->width = width;
+	job->cp = cp;
+	INIT_LIST_HEAD(&job->waiters);
+	list_add(&job->list, &cp->jobs);
+	__atomic_add_fetch(&cp->n_jobs, 1, __ATOMIC_RELAXED);
+	return job;
 }
 
-static bool is_image(const struct file_data *file)
+static void destroy_job(struct encode_job *job)
 {
-	return (strstr(file->mime, "image") != NULL);
+	pthread_cond_destroy(&job->cond);
+	free(job->original);
+	free(job);
+}
+
+/**
+ * wait_job - wait the end of a job or the cancellation of waiter
+ * must be called with cp->mutex held.
+ * return the status of the job, -1 with errno set to ECANCELED if the
+ * waiter was cancelled first.
+ */
+static int wait_job(struct content_proxy *cp,
+		    struct encode_job *job,
+		    const struct job_waiter *waiter)
+{
+	struct timespec ts = {0};
+	while (!job->done) {
+		if (image_cancelled(waiter->cancel)) {
+			errno = ECANCELED;
+			return -1;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += JOB_POLL_INTERVAL_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&job->cond, &cp->mutex, &ts);
+	}
+	return job->status;
 }
 
-static int parse_accept(char *mime, char *accept)
+static void finish_job(struct content_proxy *cp, struct encode_job *job, int status)
+{
+	pthread_mutex_lock(&cp->mutex);
+	job->done = true;
+	job->status = status;
+	list_del(&job->list);
+	__atomic_sub_fetch(&cp->n_jobs, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&cp->mutex);
+}
+
+static void leave_job(struct content_proxy *cp,
+		      struct encode_job *job,
+		      struct job_waiter *waiter)
+{
+	bool last = false;
+	pthread_mutex_lock(&cp->mutex);
+	list_del(&waiter->list);
+	job->refs--;
+	last = (job->refs == 0 && job->done);
+	pthread_mutex_unlock(&cp->mutex);
+	if (last)
+		destroy_job(job);
+}
+
+/**
+ * search_in_cache - return the variant of url at weight and width,
+ * encoding it if missing
+ * @cancel: cancellation token of the request
+ * requests missing variants of the same original and width share one
+ * encode_job: the first runs it, the others wait for its end.
+ */
+static struct file_data *search_in_cache(struct content_proxy *cp,
+					 char *url,
+					 int weight,
+					 int width,
+					 const struct image_cancel *cancel,
+					 struct arena *arena)
+{
+	char *variant = NULL;
+	char *original = NULL;
+	struct file_data *content = NULL;
+	struct encode_job *job = NULL;
+	struct job_waiter waiter = {0};
+	struct image_cancel job_cancel = {0};
+	bool run = false;
+	int res = 0;
+	weight = nearest_variant(cp, weight);
+	variant = get_cache_filename(url, weight, width, arena);
+	original = get_true_file_path(cp, url, false, arena);
+	if (variant == NULL || original == NULL) {
+		release(arena, variant);
+		release(arena, original);
+		return NULL;
+	}
+	waiter.cancel = cancel;
+	while (res == 0) {
+		content = get_indexed(cp, variant, true, url, arena);
+		if (content != NULL || run)
+			break;
+		// under load a near variant beats queueing another encode
+		if (is_overloaded(cp)) {
+			content = nearest_cached_variant(cp, url, weight, width, arena);
+			if (content != NULL)
+				break;
+		}
+		pthread_mutex_lock(&cp->mutex);
+		job = find_job(cp, original, width);
+		if (job == NULL) {
+			// a job may have written it since the last look
+			if (exists_beneath(cp->cache_fd, variant)) {
+				pthread_mutex_unlock(&cp->mutex);
+				content = get_indexed(cp, variant, true, url, arena);
+				break;
+			}
+			job = create_job(cp, original, width);
+			if (job == NULL) {
+				pthread_mutex_unlock(&cp->mutex);
+				break;
+			}
+			run = true;
+		}
+		job->refs++;
+		list_add(&waiter.list, &job->waiters);
+		if (!run)
+			res = wait_job(cp, job, &waiter);
+		pthread_mutex_unlock(&cp->mutex);
+		if (run) {
+			job_cancel.is_cancelled = job_cancelled;
+			job_cancel.arg = job;
+			res = add_in_cache(cp, url, weight, width, &job_cancel);
+			finish_job(cp, job, res);
+		}
+		leave_job(cp, job, &waiter);
+	}
+	release(arena, variant);
+	release(arena, original);
+	return content;
+}
+
+static int parse_accept(const char *mime, const struct accept_list *accept)
 {
-	char *tmp = NULL;
 	double dweight = 0.0;
 	int weight = 0;
-	tmp = strchr(mime, ';');
-	if (tmp == NULL) {
-		dweight = search_weight_from_mime(accept, mime);
-	} else {
-		*tmp = '\0';
-		dweight = search_weight_from_mime(accept, mime);
-		*tmp = ';';
-	}
+	// the most specific range wins, "*/*" is used only as fallback
+	dweight = accept_list_weight(accept, mime);
 	if (dweight > 0.0 && dweight < 1.0)
 		weight = (int)(dweight * 100);
 	else
@@ -266,31 +1537,82 @@ static int parse_accept(char *mime, char *accept)
 	return weight;
 }
 
-struct file_data *get_content(struct content_proxy *cp, char *url, char *accept)
+/**
+ * get_hint_variant - map the network hints of the client to the highest
+ * quality and width of the image variant to send
+ * @hints: client hints, NULL if none
+ * @quality: where to store the quality, 100 if the hints ask for nothing
+ * @width: where to store the width, 0 if the hints ask for nothing
+ */
+static void get_hint_variant(const struct client_hints *hints, int *quality, int *width)
+{
+	*quality = 100;
+	*width = 0;
+	if (hints == NULL)
+		return;
+	if (hints->ect == ECT_SLOW_2G || hints->ect == ECT_2G ||
+	    (hints->downlink >= 0.0 && hints->downlink < SLOW_LINK_DOWNLINK)) {
+		*quality = SLOW_LINK_QUALITY;
+		*width = SLOW_LINK_WIDTH;
+	} else if (hints->ect == ECT_3G ||
+		   (hints->downlink >= 0.0 && hints->downlink < MEDIUM_LINK_DOWNLINK)) {
+		*quality = MEDIUM_LINK_QUALITY;
+		*width = MEDIUM_LINK_WIDTH;
+	}
+	if (hints->save_data) {
+		if (*quality > SAVE_DATA_QUALITY)
+			*quality = SAVE_DATA_QUALITY;
+		if (*width == 0 || *width > SAVE_DATA_WIDTH)
+			*width = SAVE_DATA_WIDTH;
+	}
+}
+
+struct file_data *get_content(struct content_proxy *cp,
+			      char *url,
+			      const struct accept_list *accept,
+			      const struct client_hints *hints,
+			      const struct image_cancel *cancel,
+			      struct arena *arena)
 {
 	struct file_data *content = NULL, *tmp = NULL;
 	int weight = 0;
+	int hint_quality = 0;
+	int width = 0;
 	if (cp == NULL || url == NULL)
 		return NULL;
 	if (*url != '/')
 		return NULL;
-	content = get_file_data(cp, url, false);
-	if (content == NULL)
+	if (strlen(url) == 1)
+		url = cp->index;
+	// a scanner asking the same missing urls again gets its 404 from memory
+	if (negative_cache_contains(cp->misses, url)) {
+		errno = ENOENT;
 		return NULL;
-	if (accept != NULL && is_image(content)) {
-		weight = parse_accept(content->mime, accept);
-		if (weight < 1 || weight > 99) {
-			weight = parse_accept("*/*", accept);
-			if (weight < 1 || weight > 99)
-				return content;
-		}
-		pthread_mutex_lock(&cp->mutex);
-		tmp = search_in_cache(cp, url, weight);
-		if (tmp != NULL) {
-			destroy_file_data(content);
-			content = tmp;
-		}
-		pthread_mutex_unlock(&cp->mutex);
+	}
+	content = lookup_file_data(cp, url, false, arena);
+	if (content == NULL) {
+		if (errno == ENOENT || errno == ENOTDIR || errno == EXDEV ||
+		    errno == EISDIR || errno == EINVAL)
+			negative_cache_add(cp->misses, url);
+		return NULL;
+	}
+	if (!is_image(content))
+		return content;
+	// the response depends on Accept and on the client hints
+	content->negotiated = true;
+	weight = (accept != NULL) ? parse_accept(content->mime, accept) : -1;
+	if (weight < 1 || weight > 99)
+		weight = 100;
+	get_hint_variant(hints, &hint_quality, &width);
+	if (hint_quality < weight)
+		weight = hint_quality;
+	if (weight > 99)
+		return content;
+	tmp = search_in_cache(cp, url, weight, width, cancel, arena);
+	if (tmp != NULL) {
+		destroy_file_data(content);
+		content = tmp;
+		content->negotiated = true;
 	}
 	return content;
 }
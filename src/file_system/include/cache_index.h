@@ -0,0 +1,150 @@
+#ifndef CACHE_INDEX_H
+#define CACHE_INDEX_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "arena.h"
+#include "slab.h"
+
+/* size of an entity-tag, quotes and '\0' included */
+#define CACHE_ETAG_SIZE 64
+
+struct http_header_block;
+
+/**
+ * cache_meta - metadata of a file version, computed once
+ * @mime: mime of the file, NULL if the metadata is unknown
+ * @etag: entity-tag of the file
+ * @policy: index of the caching policy of the file, -1 if none applies
+ * @ok_header: header block of a 200 response, NULL if none
+ * @not_modified_header: header block of a 304 response, NULL if none
+ */
+struct cache_meta {
+	char *mime;
+	char etag[CACHE_ETAG_SIZE];
+	int policy;
+	struct http_header_block *ok_header;
+	struct http_header_block *not_modified_header;
+};
+
+/**
+ * cache_entry - what is known about a file of the content proxy
+ * @key: path of the file
+ * @st: stat of the file when the entry was filled, a file whose current
+ * stat differs is considered changed and its entry stale
+ * @quality: quality chosen for the variants of the file, -1 if unknown
+ * @meta: metadata of the file
+ * @list: hash bucket list entry
+ */
+struct cache_entry {
+	char *key;
+	struct stat st;
+	int quality;
+	struct cache_meta meta;
+	struct list_head list;
+};
+
+/**
+ * cache_index - thread-safe hash table of cache_entry indexed by path
+ * @buckets: array of n_buckets list of cache_entry
+ * @n_buckets: number of buckets
+ * @mutex: sync access to the table
+ * @slab: memory of the entries, their keys and mimes and of the header
+ * blocks they hold, so the memory of the index is measured and capped
+ */
+struct cache_index {
+	struct list_head *buckets;
+	size_t n_buckets;
+	pthread_mutex_t mutex;
+	struct slab *slab;
+};
+
+/**
+ * cache_index_create - alloc and init an empty cache_index
+ * @n_buckets: number of buckets of the hash table
+ * @max_bytes: max bytes of memory of the entries, 0 for no limit; once
+ * reached the files not indexed yet are served without being indexed
+ */
+struct cache_index *cache_index_create(size_t n_buckets, size_t max_bytes);
+
+/**
+ * cache_index_destroy - free the cache_index and all its entries
+ * @ci: cache_index created by cache_index_create()
+ */
+void cache_index_destroy(struct cache_index *ci);
+
+/**
+ * cache_index_get_quality - return the quality stored for a file
+ * @ci: cache_index
+ * @key: path of the file
+ * @st: current stat of the file
+ * return -1 if no quality is stored or if the file changed since.
+ */
+int cache_index_get_quality(struct cache_index *ci, const char *key, const struct stat *st);
+
+/**
+ * cache_index_set_quality - store the quality chosen for a file
+ * @ci: cache_index
+ * @key: path of the file
+ * @st: stat of the file the quality was chosen for
+ * @quality: quality to store
+ */
+int cache_index_set_quality(struct cache_index *ci,
+			    const char *key,
+			    const struct stat *st,
+			    int quality);
+
+/**
+ * cache_index_get_meta - return the metadata stored for a file
+ * @ci: cache_index
+ * @key: path of the file
+ * @st: current stat of the file
+ * @meta: where to store a copy of the metadata, the mime is malloc(3)
+ * allocated and a reference to the header blocks is taken, release
+ * them with cache_meta_release()
+ * @arena: if not NULL the mime is copied in it instead, so only the
+ * header blocks are to be released
+ * return -1 if no metadata is stored or if the file changed since.
+ */
+int cache_index_get_meta(struct cache_index *ci,
+			 const char *key,
+			 const struct stat *st,
+			 struct cache_meta *meta,
+			 struct arena *arena);
+
+/**
+ * cache_index_set_meta - store the metadata of a file
+ * @ci: cache_index
+ * @key: path of the file
+ * @st: stat of the file the metadata was computed for
+ * @meta: metadata of the file, the mime is copied and a reference to
+ * the header blocks is taken
+ */
+int cache_index_set_meta(struct cache_index *ci,
+			 const char *key,
+			 const struct stat *st,
+			 const struct cache_meta *meta);
+
+/**
+ * cache_index_invalidate - remove the entries of a file or of a folder
+ * @ci: cache_index
+ * @path: path of the file or folder, every entry whose key is path or
+ * beneath it is removed
+ * the table is scanned, it is meant for the files changed on disk.
+ */
+void cache_index_invalidate(struct cache_index *ci, const char *path);
+
+/**
+ * cache_meta_release - free the mime and drop the header blocks of meta
+ * @meta: metadata
+ */
+void cache_meta_release(struct cache_meta *meta);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef CACHE_POLICY_H
+#define CACHE_POLICY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+
+/* pattern matching the names carrying a content hash, e.g. app.3f9a1c2b.js */
+#define CACHE_RULE_HASHED "@hashed"
+/* min number of hex digits of the hash of a fingerprinted name */
+#define CACHE_RULE_HASH_DIGITS 8
+
+/**
+ * cache_rule - how long the responses matching a pattern can be cached
+ * @pattern: "/prefix" of the url, "type/subtype" or "type/ *" mime,
+ * CACHE_RULE_HASHED for fingerprinted file names, "*" for anything
+ * @max_age: seconds the response is fresh, 0 to always revalidate
+ * @immutable: true if the response never changes while fresh
+ * @value: value of the Cache-Control header
+ */
+struct cache_rule {
+	char *pattern;
+	int max_age;
+	bool immutable;
+	char *value;
+};
+
+/**
+ * cache_rule_parse - parse a rule written as pattern=max_age[:immutable]
+ * @str: string to parse
+ * @rule: where to store the rule, free it with cache_rule_free()
+ */
+int cache_rule_parse(const char *str, struct cache_rule *rule);
+
+/**
+ * cache_rule_free - free the resources of a rule parsed by cache_rule_parse()
+ * @rule: rule to free
+ */
+void cache_rule_free(struct cache_rule *rule);
+
+/**
+ * cache_policy_match - return the index of the first rule matching a file
+ * @rules: rules in order of priority
+ * @n: number of element in rules
+ * @url: url of the file
+ * @mime: mime of the file
+ * return -1 if no rule matches.
+ */
+int cache_policy_match(const struct cache_rule *rules,
+		       size_t n,
+		       const char *url,
+		       const char *mime);
+
+#endif
@@ -7,36 +7,127 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
 #include <pthread.h>
 #include <magic.h>
 
 #include "http.h"
 #include "image_processing.h"
 #include "string_utils.h"
+#include "cache_index.h"
+#include "cache_policy.h"
+#include "negative_cache.h"
+#include "root_watcher.h"
+#include "manifest.h"
+
+/* client hints the image variants depend on */
+#define CLIENT_HINTS "Save-Data, ECT, Downlink"
+/* max number of headers stored by file_data_headers() */
+#define FILE_DATA_HEADERS 7
 
 /**
  * file_data - rappresent a file
  * @path: path of the file on the filesystem 
  * @data_size: size of the file
- * @list: linked list entry
+ * @mime: mime of the file
+ * @negotiated: true if the content depends on the request headers
+ * @etag: strong entity-tag of the content, quotes included
+ * @last_modified: modification time of the file
+ * @cache_rule: caching policy of the file, NULL if none applies, it is
+ * owned by the content_proxy
+ * @ok_header: header block of a 200 response for the file, NULL if the
+ * header has to be generated
+ * @not_modified_header: header block of a 304 response for the file,
+ * NULL if the header has to be generated
+ * @arena: arena holding the file_data, its path and its mime, NULL if
+ * they are on the heap
+ * @fd: the file opened read-only, the content is sent from it so the
+ * path is walked once per request
  */
 struct file_data {
 	char *path;
 	size_t data_size;
 	char *mime;
+	bool negotiated;
+	char etag[CACHE_ETAG_SIZE];
+	time_t last_modified;
+	const struct cache_rule *cache_rule;
+	struct http_header_block *ok_header;
+	struct http_header_block *not_modified_header;
+	struct arena *arena;
+	int fd;
+};
+
+/**
+ * load_policy - when the content proxy stops encoding missing variants
+ * @max_jobs: encode jobs in flight from which the proxy is overloaded
+ * @max_utilization: fraction of busy workers from which the proxy
+ * is overloaded
+ * @workers: number of workers serving requests
+ * when overloaded, a missing variant is replaced by the nearest variant
+ * already in cache, if any.
+ */
+struct load_policy {
+	int max_jobs;
+	double max_utilization;
+	int workers;
 };
 
 /**
  * content_proxy - thread-safe proxy to access content on file system
  * @root: root on the filesystem where to search the file
  * @cache: where to cache the file
- * @mutex: mutex to sync access to cache
+ * @root_fd: root opened once, the files are looked up beneath it
+ * @cache_fd: cache opened once, the variants are looked up beneath it
+ * @index: file to retrieve when '/' is asked
+ * @variants: qualities of the image variants to keep in cache
+ * @n_variants: number of element in variants
+ * @quality: how the quality of the variants is chosen
+ * @cache_index: what is known about the files, e.g. their chosen quality
+ * @misses: urls recently not found in the root, answered without a lookup
+ * @watcher: watcher of the root, removes the variants of the files
+ * changed, NULL if the root can't be watched
+ * @manifest: mime and entity-tag of the root files, mapped from the
+ * manifest written by the scan of the root, NULL if none
+ * @jobs: image encodes in progress, shared by the requests missing
+ * the same variants
+ * @n_jobs: number of element in jobs, changed with mutex held, read
+ * atomically without it
+ * @load: when to serve cached variants instead of encoding
+ * @cache_rules: caching policies, the first matching a file applies
+ * @n_cache_rules: number of element in cache_rules
+ * @busy: number of requests looking up or encoding content, atomic
+ * @degraded: true while overloaded, changed with mutex held
+ * @mutex: mutex to sync access to jobs and n_jobs and the changes of
+ * degraded
  */
 struct content_proxy {
 	char *root;
 	char *cache;
+	int root_fd;
+	int cache_fd;
 	char *index;
+	int *variants;
+	size_t n_variants;
+	struct quality_target quality;
+	struct cache_index *cache_index;
+	struct negative_cache *misses;
+	struct root_watcher *watcher;
+	struct manifest *manifest;
+	struct list_head jobs;
+	int n_jobs;
+	struct load_policy load;
+	struct cache_rule *cache_rules;
+	size_t n_cache_rules;
+	int busy;
+	bool degraded;
 	pthread_mutex_t mutex;
 };
 
@@ -44,17 +135,45 @@ struct content_proxy_settings {
 	char *root;
 	char *cache;
 	char *index;
+	int *variants;
+	size_t n_variants;
+	struct quality_target quality;
+	struct load_policy load;
+	struct cache_rule *cache_rules;
+	size_t n_cache_rules;
+	size_t index_memory;
+	int negative_ttl;
+	char *manifest;
 };
 
 /**
  * create_file_data - alloc and init a file data struct
  * @path: pathname of the file, it will be copied
- * given a pathname return is size, mime and path
+ * given a pathname return is size, mime, path and an entity-tag made
+ * of its inode, size and modification time. Only regular files have
+ * a file_data.
  */
 struct file_data *create_file_data(const char *path);
+/**
+ * file_data_headers - return the headers describing a file in a response
+ * @file: file_data
+ * @headers: where to store the headers, FILE_DATA_HEADERS element
+ * @last_modified: buffer of HTTP_DATE_SIZE bytes for the Last-Modified value
+ * @expires: buffer of HTTP_DATE_SIZE bytes for the Expires value
+ * the headers are the validators, the caching policy, Accept-Ranges and
+ * the Vary and Accept-CH of negotiated content.
+ * return the number of headers stored.
+ */
+size_t file_data_headers(const struct file_data *file,
+			 struct http_header *headers,
+			 char *last_modified,
+			 char *expires);
+
 /**
  * destroy_file_data - dealloc all the reource allocated by create_file_data()
  * @entry: struct file_data to destroy
+ * a file_data allocated in an arena only drops its header blocks, its
+ * memory goes with the arena.
  */
 void destroy_file_data(struct file_data *entry);
 
@@ -71,20 +190,55 @@ struct content_proxy *create_content_proxy(struct content_proxy_settings *cps);
  */
 void destroy_content_proxy(struct content_proxy *cp);
 
+/**
+ * content_proxy_request_begin - tell the proxy a worker started looking
+ * up the content of a request, used to measure the utilization of the
+ * workers; the send of the content is not counted
+ * @cp: content_proxy
+ */
+void content_proxy_request_begin(struct content_proxy *cp);
+
+/**
+ * content_proxy_request_end - tell the proxy a worker is done with the
+ * request started by content_proxy_request_begin()
+ * @cp: content_proxy
+ */
+void content_proxy_request_end(struct content_proxy *cp);
+
 /**
  * get_file_data - thread-safe content retriever by url
  * @cp: content_proxy, manage the access to the file system
  * @url: url of the requested resource
  * @from_cache: if true look in cache folder instead of root folder
+ * the mime, the entity-tag and the response header blocks of a file are
+ * kept in the cache index, a file unchanged since its last request is
+ * not read. The file is looked up beneath the root or the cache folder,
+ * an url leaving it through ".." or a symlink fails with EXDEV.
  */
 struct file_data *get_file_data(struct content_proxy *cp, char *url, bool from_cache);
 /**
- * get_content - retrieve content by url and accept header
+ * get_content - retrieve content by url, accept header and client hints
  * @cp: content_proxy, manage the access to the file system
  * @url: url of the request resource
- * @accept: accept header value
+ * @accept: parsed accept header, NULL if the request has none
+ * @hints: network hints of the client, NULL if none
+ * @cancel: cancellation token of the request, NULL if it can't be cancelled
+ * @arena: arena of the request, the file_data and the paths looked up on
+ * the way are allocated in it, NULL to allocate them on the heap
+ * images are served as a cached variant of lower quality when the
+ * Accept weight of their mime is below 1, or when the client hints
+ * report a slow link or ask to save data.
+ * A missing variant is encoded once for all the requests asking for it,
+ * the encode stops when every one of them is cancelled. The original is
+ * returned if the variant can't be made in time. Under load the nearest
+ * cached variant is returned instead of encoding a missing one.
  */
-struct file_data *get_content(struct content_proxy *cp, char *url, char *accept);
+struct file_data *get_content(struct content_proxy *cp,
+			      char *url,
+			      const struct accept_list *accept,
+			      const struct client_hints *hints,
+			      const struct image_cancel *cancel,
+			      struct arena *arena);
 
 
 #endif
@@ -0,0 +1,88 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "cache_index.h"
+
+/* first bytes of a manifest file and version of its layout */
+#define MANIFEST_MAGIC "QWMANIF"
+#define MANIFEST_VERSION 1
+
+/**
+ * manifest_entry - metadata of a file of the root, input of manifest_write()
+ * @name: path of the file relative to the root, without leading '/'
+ * @mime: mime of the file
+ * @etag: entity-tag of the file
+ * @st: stat of the file the metadata was computed for
+ */
+struct manifest_entry {
+	char *name;
+	char *mime;
+	char etag[CACHE_ETAG_SIZE];
+	struct stat st;
+};
+
+struct manifest;
+
+/**
+ * manifest_write - write a manifest of the files of a root
+ * @path: path of the manifest, written to a temporary file renamed to
+ * it, so a manifest is never seen half written
+ * @root: stat of the root, a manifest is only loaded for the same root
+ * @entries: metadata of the files
+ * @n: number of element in entries
+ * the manifest is an open addressing hash table of the names, with the
+ * mimes stored once, laid out to be used mapped as it is.
+ * return -1 in case of error and set errno.
+ */
+int manifest_write(const char *path,
+		   const struct stat *root,
+		   const struct manifest_entry *entries,
+		   size_t n);
+
+/**
+ * manifest_load - map a manifest written by manifest_write()
+ * @path: path of the manifest
+ * @root: stat of the root
+ * return NULL if the manifest is missing, invalid or of another root
+ * and set errno.
+ */
+struct manifest *manifest_load(const char *path, const struct stat *root);
+
+/**
+ * manifest_close - unmap a manifest
+ * @m: manifest returned by manifest_load(), can be NULL
+ */
+void manifest_close(struct manifest *m);
+
+/**
+ * manifest_entries - return the number of files in the manifest
+ * @m: manifest
+ */
+size_t manifest_entries(const struct manifest *m);
+
+/**
+ * manifest_lookup - return the mime stored for a file
+ * @m: manifest, can be NULL
+ * @name: path of the file relative to the root, leading slashes are skipped
+ * @st: current stat of the file
+ * @etag: where to store the entity-tag, CACHE_ETAG_SIZE bytes
+ * return a string inside the mapping, NULL if the file is not in the
+ * manifest or changed since it was written.
+ */
+const char *manifest_lookup(const struct manifest *m,
+			    const char *name,
+			    const struct stat *st,
+			    char *etag);
+
+#endif
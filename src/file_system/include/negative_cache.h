@@ -0,0 +1,65 @@
+#ifndef NEGATIVE_CACHE_H
+#define NEGATIVE_CACHE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+
+/* bits of the Bloom filter and number of bits set per key */
+#define NEGATIVE_BLOOM_BITS (1 << 20)
+#define NEGATIVE_BLOOM_HASHES 4
+/* slots of the table of the misses, a new miss replaces the one in its slot */
+#define NEGATIVE_CACHE_SLOTS 4096
+/* size of a key, '\0' included, longer keys are not cached */
+#define NEGATIVE_KEY_SIZE 256
+
+struct negative_cache;
+
+/**
+ * negative_cache_create - create a cache of the urls not found
+ * @dirfd: folder the urls are looked up in, its changes empty the cache
+ * @ttl: seconds a miss is remembered
+ * a Bloom filter in front of a table of the misses: the urls never
+ * missed, the files served, are rejected by the filter without taking
+ * a lock, the misses it lets through are checked against the table,
+ * so a false positive of the filter never hides a file. The filter
+ * is renewed every ttl seconds, so it holds the recent misses only.
+ * return NULL in case of error and set errno.
+ */
+struct negative_cache *negative_cache_create(int dirfd, int ttl);
+
+/**
+ * negative_cache_destroy - free a negative_cache
+ * @nc: negative_cache created by negative_cache_create(), can be NULL
+ */
+void negative_cache_destroy(struct negative_cache *nc);
+
+/**
+ * negative_cache_contains - return true if key missed less than ttl
+ * seconds ago and the folder didn't change since
+ * @nc: negative_cache
+ * @key: url looked up
+ */
+bool negative_cache_contains(struct negative_cache *nc, const char *key);
+
+/**
+ * negative_cache_add - remember that key was not found
+ * @nc: negative_cache
+ * @key: url looked up
+ */
+void negative_cache_add(struct negative_cache *nc, const char *key);
+
+/**
+ * negative_cache_clear - forget every miss, e.g. when files are added
+ * @nc: negative_cache
+ */
+void negative_cache_clear(struct negative_cache *nc);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef ROOT_WATCHER_H
+#define ROOT_WATCHER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+/* milliseconds the watcher waits before checking if it must stop */
+#define ROOT_WATCHER_POLL_MS 500
+
+/**
+ * root_watcher_changed - called by the watcher thread for every change
+ * @arg: argument given to root_watcher_start()
+ * @name: path relative to the root, starting with '/', of the file or
+ * folder changed; NULL if changes were lost and anything may have changed
+ */
+typedef void (*root_watcher_changed)(void *arg, const char *name);
+
+struct root_watcher;
+
+/**
+ * root_watcher_start - watch a folder tree with inotify(7)
+ * @root: path of the folder
+ * @changed: called for every file or folder written, replaced, moved
+ * or removed in the tree
+ * @arg: argument of changed
+ * the folders created or moved in the tree later are watched too,
+ * symlinks are not followed.
+ * return NULL in case of error, e.g. the limit of watches reached, and
+ * set errno.
+ */
+struct root_watcher *root_watcher_start(const char *root,
+					root_watcher_changed changed,
+					void *arg);
+
+/**
+ * root_watcher_stop - stop the thread of the watcher and free it
+ * @rw: watcher started by root_watcher_start(), can be NULL
+ */
+void root_watcher_stop(struct root_watcher *rw);
+
+#endif
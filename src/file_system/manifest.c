@@ -0,0 +1,373 @@
+#include "manifest.h"
+
+/* min number of slots, the table is kept at most half full */
+#define MANIFEST_MIN_SLOTS 16
+
+/**
+ * manifest_header - first bytes of a manifest file
+ * @magic: MANIFEST_MAGIC
+ * @version: MANIFEST_VERSION
+ * @n_slots: slots of the table, a power of two, they follow the header
+ * @n_entries: used slots
+ * @n_mimes: number of mimes
+ * @root_dev: device of the root the manifest was written for
+ * @root_ino: inode of the root the manifest was written for
+ * @mimes_offset: offset of the offsets of the mimes in the strings
+ * @strings_offset: offset of the names and the mimes, '\0' terminated
+ * @size: size of the file
+ */
+struct manifest_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_slots;
+	uint32_t n_entries;
+	uint32_t n_mimes;
+	uint64_t root_dev;
+	uint64_t root_ino;
+	uint64_t mimes_offset;
+	uint64_t strings_offset;
+	uint64_t size;
+};
+
+/**
+ * manifest_slot - a file in the table
+ * @hash: hash of the name, 0 for a free slot
+ * @ino: inode of the file
+ * @size: size of the file
+ * @mtime_sec: modification time of the file, seconds
+ * @mtime_nsec: modification time of the file, nanoseconds
+ * @name: offset of the name in the strings
+ * @mime: index of the mime
+ * @etag: entity-tag of the file
+ */
+struct manifest_slot {
+	uint64_t hash;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t name;
+	uint32_t mime;
+	char etag[CACHE_ETAG_SIZE];
+};
+
+/**
+ * manifest - a mapped manifest file
+ * @map: the mapping
+ * @size: size of the mapping
+ * @header: header of the manifest
+ * @slots: the table
+ * @mimes: offset of every mime in strings
+ * @strings: names and mimes
+ * @strings_size: bytes of strings, the last one is '\0'
+ */
+struct manifest {
+	void *map;
+	size_t size;
+	const struct manifest_header *header;
+	const struct manifest_slot *slots;
+	const uint32_t *mimes;
+	const char *strings;
+	size_t strings_size;
+};
+
+/**
+ * hash_key - FNV-1a hash of a name, never 0 which marks a free slot
+ */
+static uint64_t hash_key(const char *key)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (; *key != '\0'; ++key) {
+		hash ^= (unsigned char)*key;
+		hash *= 1099511628211ULL;
+	}
+	return (hash == 0) ? 1 : hash;
+}
+
+/**
+ * find_mime - return the index of mime in mimes, adding it if missing
+ */
+static uint32_t find_mime(const char **mimes, uint32_t *n_mimes, const char *mime)
+{
+	// a root holds a few tens of mimes at most
+	for (uint32_t i = 0; i < *n_mimes; ++i) {
+		if (strcmp(mimes[i], mime) == 0)
+			return i;
+	}
+	mimes[*n_mimes] = mime;
+	return (*n_mimes)++;
+}
+
+static int write_all(int fd, const char *buf, size_t size)
+{
+	ssize_t n = 0;
+	while (size > 0) {
+		n = write(fd, buf, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/**
+ * write_file - write buf to a temporary file renamed to path
+ */
+static int write_file(const char *path, const char *buf, size_t size)
+{
+	char *tmp = NULL;
+	size_t tmp_size = strlen(path) + 32;
+	int fd = -1;
+	int err = 0;
+	tmp = malloc(tmp_size);
+	if (tmp == NULL)
+		return -1;
+	snprintf(tmp, tmp_size, "%s.tmp-%ld", path, (long)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		free(tmp);
+		return -1;
+	}
+	if (write_all(fd, buf, size) < 0) {
+		err = errno;
+		close(fd);
+		goto error;
+	}
+	if (close(fd) < 0 || rename(tmp, path) < 0) {
+		err = errno;
+		goto error;
+	}
+	free(tmp);
+	return 0;
+error:
+	unlink(tmp);
+	free(tmp);
+	errno = err;
+	return -1;
+}
+
+int manifest_write(const char *path,
+		   const struct stat *root,
+		   const struct manifest_entry *entries,
+		   size_t n)
+{
+	struct manifest_header *header = NULL;
+	struct manifest_slot *slots = NULL;
+	struct manifest_slot *slot = NULL;
+	const char **mimes = NULL;
+	uint32_t *mime_offsets = NULL;
+	uint32_t n_mimes = 0;
+	uint32_t mime = 0;
+	size_t n_slots = MANIFEST_MIN_SLOTS;
+	size_t strings_size = 0;
+	size_t offset = 0;
+	size_t size = 0;
+	uint64_t hash = 0;
+	char *buf = NULL;
+	char *strings = NULL;
+	int res = 0;
+	if (path == NULL || root == NULL || (entries == NULL && n > 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (n_slots < 2 * n)
+		n_slots *= 2;
+	mimes = malloc((n + 1) * sizeof(*mimes));
+	if (mimes == NULL)
+		return -1;
+	for (size_t i = 0; i < n; ++i) {
+		mime = n_mimes;
+		if (find_mime(mimes, &n_mimes, entries[i].mime) == mime)
+			strings_size += strlen(entries[i].mime) + 1;
+		strings_size += strlen(entries[i].name) + 1;
+	}
+	// the offsets in the strings are 32 bits
+	if (n_slots > UINT32_MAX || strings_size >= UINT32_MAX) {
+		free(mimes);
+		errno = EFBIG;
+		return -1;
+	}
+	size = sizeof(*header) + n_slots * sizeof(*slots) +
+		n_mimes * sizeof(*mime_offsets) + strings_size + 1;
+	buf = calloc(1, size);
+	if (buf == NULL) {
+		free(mimes);
+		return -1;
+	}
+	header = (struct manifest_header *)buf;
+	slots = (struct manifest_slot *)(header + 1);
+	mime_offsets = (uint32_t *)(slots + n_slots);
+	strings = (char *)(mime_offsets + n_mimes);
+	memcpy(header->magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+	header->version = MANIFEST_VERSION;
+	header->n_slots = n_slots;
+	header->n_entries = n;
+	header->n_mimes = n_mimes;
+	header->root_dev = root->st_dev;
+	header->root_ino = root->st_ino;
+	header->mimes_offset = (char *)mime_offsets - buf;
+	header->strings_offset = strings - buf;
+	header->size = size;
+	for (uint32_t i = 0; i < n_mimes; ++i) {
+		mime_offsets[i] = offset;
+		strcpy(strings + offset, mimes[i]);
+		offset += strlen(mimes[i]) + 1;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		hash = hash_key(entries[i].name);
+		slot = &slots[hash & (n_slots - 1)];
+		while (slot->hash != 0)
+			slot = (slot == &slots[n_slots - 1]) ? slots : slot + 1;
+		mime = find_mime(mimes, &n_mimes, entries[i].mime);
+		slot->hash = hash;
+		slot->ino = entries[i].st.st_ino;
+		slot->size = entries[i].st.st_size;
+		slot->mtime_sec = entries[i].st.st_mtim.tv_sec;
+		slot->mtime_nsec = entries[i].st.st_mtim.tv_nsec;
+		slot->name = offset;
+		slot->mime = mime;
+		memcpy(slot->etag, entries[i].etag, CACHE_ETAG_SIZE);
+		slot->etag[CACHE_ETAG_SIZE - 1] = '\0';
+		strcpy(strings + offset, entries[i].name);
+		offset += strlen(entries[i].name) + 1;
+	}
+	res = write_file(path, buf, size);
+	free(buf);
+	free(mimes);
+	return res;
+}
+
+/**
+ * is_valid - return true if the header of a mapped manifest is sound,
+ * so that no offset read from it leaves the mapping
+ */
+static bool is_valid(const struct manifest_header *header, size_t size)
+{
+	size_t slots_end = 0;
+	if (size < sizeof(*header) || header->size != size ||
+	    memcmp(header->magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) != 0 ||
+	    header->version != MANIFEST_VERSION)
+		return false;
+	if (header->n_slots == 0 || (header->n_slots & (header->n_slots - 1)) != 0 ||
+	    header->n_entries >= header->n_slots)
+		return false;
+	slots_end = sizeof(*header) + (size_t)header->n_slots * sizeof(struct manifest_slot);
+	if (slots_end > size || header->mimes_offset < slots_end ||
+	    header->mimes_offset % sizeof(uint32_t) != 0 ||
+	    header->mimes_offset > size ||
+	    header->n_mimes > (size - header->mimes_offset) / sizeof(uint32_t) ||
+	    header->strings_offset < header->mimes_offset +
+	    (size_t)header->n_mimes * sizeof(uint32_t) ||
+	    header->strings_offset >= size)
+		return false;
+	// every string ends before the end of the mapping
+	return ((const char *)header)[size - 1] == '\0';
+}
+
+struct manifest *manifest_load(const char *path, const struct stat *root)
+{
+	struct manifest *m = NULL;
+	struct stat st = {0};
+	void *map = NULL;
+	int fd = -1;
+	if (path == NULL || root == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < (off_t)sizeof(struct manifest_header)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	if (!is_valid(map, st.st_size)) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	m = malloc(sizeof(*m));
+	if (m == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	m->map = map;
+	m->size = st.st_size;
+	m->header = map;
+	m->slots = (const struct manifest_slot *)(m->header + 1);
+	m->mimes = (const uint32_t *)((const char *)map + m->header->mimes_offset);
+	m->strings = (const char *)map + m->header->strings_offset;
+	m->strings_size = m->size - m->header->strings_offset;
+	// a manifest of another root, e.g. the root was replaced
+	if (m->header->root_dev != (uint64_t)root->st_dev ||
+	    m->header->root_ino != (uint64_t)root->st_ino) {
+		manifest_close(m);
+		errno = ESTALE;
+		return NULL;
+	}
+	return m;
+}
+
+void manifest_close(struct manifest *m)
+{
+	if (m == NULL)
+		return;
+	munmap(m->map, m->size);
+	free(m);
+}
+
+size_t manifest_entries(const struct manifest *m)
+{
+	return (m == NULL) ? 0 : m->header->n_entries;
+}
+
+const char *manifest_lookup(const struct manifest *m,
+			    const char *name,
+			    const struct stat *st,
+			    char *etag)
+{
+	const struct manifest_slot *slot = NULL;
+	uint64_t hash = 0;
+	uint32_t mask = 0;
+	uint32_t i = 0;
+	if (m == NULL || name == NULL || st == NULL || etag == NULL)
+		return NULL;
+	while (*name == '/')
+		++name;
+	hash = hash_key(name);
+	mask = m->header->n_slots - 1;
+	// the table is never full, the bound only guards a corrupted one
+	for (uint32_t probe = 0; probe < m->header->n_slots; ++probe) {
+		i = (hash + probe) & mask;
+		slot = &m->slots[i];
+		if (slot->hash == 0)
+			return NULL;
+		if (slot->hash == hash && slot->name < m->strings_size &&
+		    strcmp(m->strings + slot->name, name) == 0)
+			break;
+		slot = NULL;
+	}
+	if (slot == NULL || slot->mime >= m->header->n_mimes ||
+	    m->mimes[slot->mime] >= m->strings_size)
+		return NULL;
+	// the file changed since the manifest was written
+	if (slot->ino != (uint64_t)st->st_ino || slot->size != (uint64_t)st->st_size ||
+	    slot->mtime_sec != st->st_mtim.tv_sec || slot->mtime_nsec != st->st_mtim.tv_nsec)
+		return NULL;
+	memcpy(etag, slot->etag, CACHE_ETAG_SIZE);
+	etag[CACHE_ETAG_SIZE - 1] = '\0';
+	return m->strings + m->mimes[slot->mime];
+}
@@ -0,0 +1,221 @@
+#include "negative_cache.h"
+
+/**
+ * negative_slot - a url not found
+ * @expires: when the miss is forgotten, 0 if the slot is free
+ * @key: the url
+ */
+struct negative_slot {
+	time_t expires;
+	char key[NEGATIVE_KEY_SIZE];
+};
+
+/**
+ * negative_cache - Bloom filter in front of a table of misses
+ * @bloom: bits of the filter, read without the mutex, in two generations:
+ * the misses go in the current one and both are tested, so a miss stays
+ * in the filter at least ttl seconds however close to a rotation it came
+ * @current: index in bloom of the current generation
+ * @seed: random seed of the hash, so the slots can't be aimed at
+ * @dirfd: folder the urls are looked up in
+ * @ttl: seconds a miss is remembered
+ * @bloom_expires: when the generations of the filter rotate
+ * @next_check: when the mtime of the folder is checked again
+ * @dir_mtime: mtime of the folder when last checked
+ * @slots: table of the misses, indexed by the hash of their url
+ * @mutex: sync access to everything but bloom
+ */
+struct negative_cache {
+	uint64_t bloom[2][NEGATIVE_BLOOM_BITS / 64];
+	int current;
+	uint64_t seed;
+	int dirfd;
+	int ttl;
+	time_t bloom_expires;
+	time_t next_check;
+	struct timespec dir_mtime;
+	struct negative_slot *slots;
+	pthread_mutex_t mutex;
+};
+
+static time_t now_sec(void)
+{
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+/**
+ * hash_key - seeded FNV-1a hash of key and a second hash derived from it
+ * for the double hashing of the filter
+ */
+static uint64_t hash_key(const struct negative_cache *nc, const char *key, uint64_t *h2)
+{
+	uint64_t hash = 14695981039346656037ULL ^ nc->seed;
+	uint64_t mix = 0;
+	for (; *key != '\0'; ++key) {
+		hash ^= (unsigned char)*key;
+		hash *= 1099511628211ULL;
+	}
+	// splitmix64 finalizer, odd so that the probes never repeat
+	mix = hash + 0x9e3779b97f4a7c15ULL;
+	mix = (mix ^ (mix >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	mix = (mix ^ (mix >> 27)) * 0x94d049bb133111ebULL;
+	*h2 = (mix ^ (mix >> 31)) | 1;
+	return hash;
+}
+
+static bool bloom_test(const uint64_t *bloom, uint64_t h1, uint64_t h2)
+{
+	uint64_t bit = 0;
+	for (int i = 0; i < NEGATIVE_BLOOM_HASHES; ++i) {
+		bit = (h1 + i * h2) % NEGATIVE_BLOOM_BITS;
+		if (!(__atomic_load_n(&bloom[bit / 64], __ATOMIC_RELAXED) &
+		      (1ULL << (bit % 64))))
+			return false;
+	}
+	return true;
+}
+
+static void bloom_set(uint64_t *bloom, uint64_t h1, uint64_t h2)
+{
+	uint64_t bit = 0;
+	for (int i = 0; i < NEGATIVE_BLOOM_HASHES; ++i) {
+		bit = (h1 + i * h2) % NEGATIVE_BLOOM_BITS;
+		__atomic_fetch_or(&bloom[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+	}
+}
+
+static void bloom_clear(uint64_t *bloom)
+{
+	for (size_t i = 0; i < NEGATIVE_BLOOM_BITS / 64; ++i)
+		__atomic_store_n(&bloom[i], 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * clear - forget every miss
+ * must be called with nc->mutex held.
+ */
+static void clear(struct negative_cache *nc)
+{
+	bloom_clear(nc->bloom[0]);
+	bloom_clear(nc->bloom[1]);
+	for (size_t i = 0; i < NEGATIVE_CACHE_SLOTS; ++i)
+		nc->slots[i].expires = 0;
+}
+
+/**
+ * refresh - rotate the generations of the filter every ttl seconds and
+ * forget everything when the folder changed, its mtime is checked at
+ * most once a second
+ * must be called with nc->mutex held.
+ */
+static void refresh(struct negative_cache *nc, time_t now)
+{
+	struct stat st = {0};
+	if (now >= nc->next_check) {
+		nc->next_check = now + 1;
+		if (fstat(nc->dirfd, &st) == 0 &&
+		    (st.st_mtim.tv_sec != nc->dir_mtime.tv_sec ||
+		     st.st_mtim.tv_nsec != nc->dir_mtime.tv_nsec)) {
+			nc->dir_mtime = st.st_mtim;
+			clear(nc);
+		}
+	}
+	if (now >= nc->bloom_expires) {
+		// the oldest generation holds only misses older than ttl
+		bloom_clear(nc->bloom[!nc->current]);
+		__atomic_store_n(&nc->current, !nc->current, __ATOMIC_RELAXED);
+		nc->bloom_expires = now + nc->ttl;
+	}
+}
+
+struct negative_cache *negative_cache_create(int dirfd, int ttl)
+{
+	struct negative_cache *nc = NULL;
+	struct stat st = {0};
+	if (dirfd < 0 || ttl <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (fstat(dirfd, &st) != 0)
+		return NULL;
+	nc = calloc(1, sizeof(*nc));
+	if (nc == NULL)
+		return NULL;
+	nc->slots = calloc(NEGATIVE_CACHE_SLOTS, sizeof(*nc->slots));
+	if (nc->slots == NULL) {
+		free(nc);
+		return NULL;
+	}
+	if (pthread_mutex_init(&nc->mutex, NULL) != 0) {
+		free(nc->slots);
+		free(nc);
+		return NULL;
+	}
+	if (getrandom(&nc->seed, sizeof(nc->seed), GRND_NONBLOCK) != sizeof(nc->seed))
+		nc->seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+	nc->dirfd = dirfd;
+	nc->ttl = ttl;
+	nc->dir_mtime = st.st_mtim;
+	nc->next_check = now_sec() + 1;
+	nc->bloom_expires = now_sec() + ttl;
+	return nc;
+}
+
+void negative_cache_destroy(struct negative_cache *nc)
+{
+	if (nc == NULL)
+		return;
+	pthread_mutex_destroy(&nc->mutex);
+	free(nc->slots);
+	free(nc);
+}
+
+bool negative_cache_contains(struct negative_cache *nc, const char *key)
+{
+	struct negative_slot *slot = NULL;
+	uint64_t h1 = 0, h2 = 0;
+	time_t now = 0;
+	bool found = false;
+	if (nc == NULL || key == NULL || strlen(key) >= NEGATIVE_KEY_SIZE)
+		return false;
+	h1 = hash_key(nc, key, &h2);
+	// the files served are never added, they stop here
+	if (!bloom_test(nc->bloom[0], h1, h2) && !bloom_test(nc->bloom[1], h1, h2))
+		return false;
+	now = now_sec();
+	pthread_mutex_lock(&nc->mutex);
+	refresh(nc, now);
+	slot = &nc->slots[h1 % NEGATIVE_CACHE_SLOTS];
+	found = slot->expires > now && strcmp(slot->key, key) == 0;
+	pthread_mutex_unlock(&nc->mutex);
+	return found;
+}
+
+void negative_cache_add(struct negative_cache *nc, const char *key)
+{
+	struct negative_slot *slot = NULL;
+	uint64_t h1 = 0, h2 = 0;
+	time_t now = 0;
+	if (nc == NULL || key == NULL || strlen(key) >= NEGATIVE_KEY_SIZE)
+		return;
+	h1 = hash_key(nc, key, &h2);
+	now = now_sec();
+	pthread_mutex_lock(&nc->mutex);
+	refresh(nc, now);
+	slot = &nc->slots[h1 % NEGATIVE_CACHE_SLOTS];
+	strcpy(slot->key, key);
+	slot->expires = now + nc->ttl;
+	bloom_set(nc->bloom[nc->current], h1, h2);
+	pthread_mutex_unlock(&nc->mutex);
+}
+
+void negative_cache_clear(struct negative_cache *nc)
+{
+	if (nc == NULL)
+		return;
+	pthread_mutex_lock(&nc->mutex);
+	clear(nc);
+	pthread_mutex_unlock(&nc->mutex);
+}
@@ -0,0 +1,234 @@
+#include "root_watcher.h"
+
+/* what a watched folder reports, the folders are never followed through symlinks */
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+		    IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW | \
+		    IN_EXCL_UNLINK)
+
+/**
+ * root_watcher - thread reading the inotify events of a folder tree
+ * @root: path of the tree
+ * @fd: inotify instance
+ * @dirs: path relative to root of each watched folder, indexed by watch
+ * descriptor, "" for the root
+ * @n_dirs: number of element in dirs
+ * @changed: callback of the changes
+ * @arg: argument of changed
+ * @thread: thread of the watcher
+ * @running: false to stop the thread
+ */
+struct root_watcher {
+	char *root;
+	int fd;
+	char **dirs;
+	size_t n_dirs;
+	root_watcher_changed changed;
+	void *arg;
+	pthread_t thread;
+	bool running;
+};
+
+/**
+ * join_path - return dir/name allocated with malloc(3)
+ */
+static char *join_path(const char *dir, const char *name)
+{
+	size_t size = strlen(dir) + strlen(name) + 2;
+	char *path = malloc(size);
+	if (path != NULL)
+		snprintf(path, size, "%s/%s", dir, name);
+	return path;
+}
+
+/**
+ * watch_dir - add a watch on the folder name of the tree
+ * a folder watched already keeps its watch descriptor, only its name
+ * is updated, e.g. after a move.
+ */
+static int watch_dir(struct root_watcher *rw, const char *name)
+{
+	char **dirs = NULL;
+	char *path = NULL;
+	size_t n = 0;
+	int wd = -1;
+	path = malloc(strlen(rw->root) + strlen(name) + 1);
+	if (path == NULL)
+		return -1;
+	strcpy(path, rw->root);
+	strcat(path, name);
+	wd = inotify_add_watch(rw->fd, path, WATCH_MASK);
+	free(path);
+	if (wd < 0)
+		return -1;
+	if ((size_t)wd >= rw->n_dirs) {
+		n = (rw->n_dirs * 2 > (size_t)wd) ? rw->n_dirs * 2 : (size_t)wd + 1;
+		dirs = realloc(rw->dirs, n * sizeof(*dirs));
+		if (dirs == NULL)
+			return -1;
+		memset(dirs + rw->n_dirs, 0, (n - rw->n_dirs) * sizeof(*dirs));
+		rw->dirs = dirs;
+		rw->n_dirs = n;
+	}
+	free(rw->dirs[wd]);
+	rw->dirs[wd] = strdup(name);
+	if (rw->dirs[wd] == NULL)
+		return -1;
+	return 0;
+}
+
+/**
+ * watch_tree - watch the folder name and every folder beneath it
+ */
+static int watch_tree(struct root_watcher *rw, const char *name)
+{
+	struct dirent *ent = NULL;
+	struct stat st = {0};
+	DIR *dir = NULL;
+	char *child = NULL;
+	int fd = -1;
+	int res = 0;
+	bool is_dir = false;
+	if (watch_dir(rw, name) < 0)
+		return -1;
+	child = malloc(strlen(rw->root) + strlen(name) + 1);
+	if (child == NULL)
+		return -1;
+	strcpy(child, rw->root);
+	strcat(child, name);
+	fd = open(child, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	free(child);
+	// gone since, its parent reports it
+	if (fd < 0)
+		return 0;
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return -1;
+	}
+	while (res == 0 && (ent = readdir(dir)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		is_dir = ent->d_type == DT_DIR;
+		if (ent->d_type == DT_UNKNOWN)
+			is_dir = fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+				S_ISDIR(st.st_mode);
+		if (!is_dir)
+			continue;
+		child = join_path(name, ent->d_name);
+		if (child == NULL) {
+			res = -1;
+			break;
+		}
+		res = watch_tree(rw, child);
+		free(child);
+	}
+	closedir(dir);
+	return res;
+}
+
+static void handle_event(struct root_watcher *rw, const struct inotify_event *ev)
+{
+	char *name = NULL;
+	if (ev->mask & IN_Q_OVERFLOW) {
+		syslog(LOG_WARNING, "%s %s\n", "inotify queue overflow, changes lost in", rw->root);
+		rw->changed(rw->arg, NULL);
+		return;
+	}
+	if (ev->wd < 0 || (size_t)ev->wd >= rw->n_dirs || rw->dirs[ev->wd] == NULL)
+		return;
+	if (ev->mask & IN_IGNORED) {
+		free(rw->dirs[ev->wd]);
+		rw->dirs[ev->wd] = NULL;
+		return;
+	}
+	// an event of the folder itself, its parent reports it with a name
+	if (ev->len == 0)
+		return;
+	name = join_path(rw->dirs[ev->wd], ev->name);
+	if (name == NULL) {
+		rw->changed(rw->arg, NULL);
+		return;
+	}
+	// what is created in it before the watch is added is covered by its name
+	if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+	    watch_tree(rw, name) < 0)
+		syslog(LOG_WARNING, "can't watch %s%s: %m\n", rw->root, name);
+	rw->changed(rw->arg, name);
+	free(name);
+}
+
+static void *watcher_main(void *arg)
+{
+	struct root_watcher *rw = arg;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev = NULL;
+	struct pollfd pfd = {0};
+	ssize_t len = 0;
+	pfd.fd = rw->fd;
+	pfd.events = POLLIN;
+	while (__atomic_load_n(&rw->running, __ATOMIC_RELAXED)) {
+		if (poll(&pfd, 1, ROOT_WATCHER_POLL_MS) <= 0)
+			continue;
+		len = read(rw->fd, buf, sizeof(buf));
+		if (len <= 0)
+			continue;
+		for (char *ptr = buf; ptr < buf + len; ptr += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)ptr;
+			handle_event(rw, ev);
+		}
+	}
+	return NULL;
+}
+
+static void root_watcher_free(struct root_watcher *rw)
+{
+	for (size_t i = 0; i < rw->n_dirs; ++i)
+		free(rw->dirs[i]);
+	free(rw->dirs);
+	if (rw->fd >= 0)
+		close(rw->fd);
+	free(rw->root);
+	free(rw);
+}
+
+struct root_watcher *root_watcher_start(const char *root,
+					root_watcher_changed changed,
+					void *arg)
+{
+	struct root_watcher *rw = NULL;
+	int err = 0;
+	if (root == NULL || changed == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	rw = calloc(1, sizeof(*rw));
+	if (rw == NULL)
+		return NULL;
+	rw->changed = changed;
+	rw->arg = arg;
+	rw->root = strdup(root);
+	rw->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (rw->root == NULL || rw->fd < 0 || watch_tree(rw, "") < 0)
+		goto error;
+	rw->running = true;
+	err = pthread_create(&rw->thread, NULL, watcher_main, rw);
+	if (err != 0) {
+		errno = err;
+		goto error;
+	}
+	return rw;
+error:
+	err = errno;
+	root_watcher_free(rw);
+	errno = err;
+	return NULL;
+}
+
+void root_watcher_stop(struct root_watcher *rw)
+{
+	if (rw == NULL)
+		return;
+	__atomic_store_n(&rw->running, false, __ATOMIC_RELAXED);
+	pthread_join(rw->thread, NULL);
+	root_watcher_free(rw);
+}
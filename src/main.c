@@ -5,9 +5,14 @@
 
 #include "http.h"
 #include "connection.h"
+#include "acceptor.h"
 #include "server.h"
 #include "config.h"
 #include "threadwork.h"
+#include "image_helper.h"
+#ifdef HAVE_OPENSSL
+#include "tls.h"
+#endif
 
 static void close_listening_socket(LISTENER_CONNECTION *listener)
 {
@@ -18,15 +23,48 @@ static void close_listening_socket(LISTENER_CONNECTION *listener)
 	syslog(LOG_INFO, "%s\n", "listening socket successfully closed");
 }
 
+/**
+ * setup_tls - serve TLS on the listener if the config has a certificate
+ * @listener: open listener
+ * @cfg: server configuration
+ */
+static int setup_tls(LISTENER_CONNECTION *listener, const struct config *cfg)
+{
+#ifdef HAVE_OPENSSL
+	struct tls_settings settings = {0};
+	TLS_CONTEXT *tls = NULL;
+#endif
+	if (cfg->tls_certificate == NULL)
+		return 0;
+#ifdef HAVE_OPENSSL
+	settings.certificate = cfg->tls_certificate;
+	// the key can be in the same PEM file of the certificate
+	settings.private_key = (cfg->tls_private_key != NULL) ?
+		cfg->tls_private_key : cfg->tls_certificate;
+	settings.ktls = !cfg->tls_disable_ktls;
+	settings.session_cache_size = cfg->tls_session_cache;
+	settings.session_timeout = cfg->tls_session_timeout;
+	settings.handshake_timeout = cfg->timeout;
+	tls = tls_context_create(&settings);
+	if (tls == NULL)
+		return -1;
+	return lcsettls(listener, tls);
+#else
+	(void) listener;
+	syslog(LOG_CRIT, "%s\n", "built without OpenSSL, tls_certificate can't be used");
+	return -1;
+#endif
+}
 
 /**
  * the main function will:
+ * 0. run as image helper if started by the server with IMAGE_HELPER_ARG
  * 1. initialize the logger
  * 2. load and read the config file given by cmd arguments
  * 3. mask the SIGPIPE signal
- * 4. open a LISTENER_CONNECTION struct
- * 5. init the data shared beetween the threads
- * 6. start the thread
+ * 4. open a LISTENER_CONNECTION struct, over TLS if configured
+ * 5. init the data shared beetween the threads and start the timer service
+ * 6. start the acceptor and the thread
  * 7. wait for them to finish
  * 8. free the allocated resource
  * 9. return
@@ -38,7 +76,11 @@ int main(int argc, char *argv[])
 	struct CONNECTION_attr *attr = NULL;
 	struct server_data **data = NULL;
 	struct global_server_data *global_data = NULL;
+	ACCEPTOR *acceptor = NULL;
+	struct http_timeouts timeouts = {0};
 	int res = 0;
+	if (argc > 1 && strcmp(argv[1], IMAGE_HELPER_ARG) == 0)
+		return image_helper_main(argc, argv);
 	if (argc < 2 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
 		fprintf(stderr, "%s %s\n", *argv,
 			"path-to-config-file");
@@ -70,6 +112,11 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 	syslog(LOG_INFO, "%s\n", "socket succesfully open");
+	if (setup_tls(listener, cfg) < 0) {
+		syslog(LOG_CRIT, "%s\n", "can't set up TLS");
+		close_listening_socket(listener);
+		return EXIT_FAILURE;
+	}
 
 	attr = calloc(1, sizeof(*attr));
 	if (attr == NULL) {
@@ -83,14 +130,27 @@ int main(int argc, char *argv[])
 	attr->addr = NULL;
 	attr->addr_len = NULL;
 	
-	global_data = create_global_server_data(cfg->server_root,
-						cfg->server_cache,
-						cfg->server_index);
+	global_data = create_global_server_data(cfg);
 	if (global_data == NULL) {
 		syslog(LOG_EMERG, "%s\n", "can't create global server data");
 		close_listening_socket(listener);
 		return EXIT_FAILURE;
 	}
+	if (timer_service_start(TIMER_WHEEL_TICK_MS) < 0) {
+		syslog(LOG_EMERG, "%s\n", "can't start the timer service");
+		close_listening_socket(listener);
+		return EXIT_FAILURE;
+	}
+	timeouts.idle = cfg->keepalive_timeout;
+	timeouts.header = cfg->header_timeout;
+	timeouts.send = cfg->send_timeout;
+	acceptor = acceptor_create(listener, cfg->thread_number,
+				   cfg->accept_queue_size);
+	if (acceptor == NULL) {
+		syslog(LOG_EMERG, "%s\n", "can't create the acceptor");
+		close_listening_socket(listener);
+		return EXIT_FAILURE;
+	}
 	data = calloc(cfg->thread_number, sizeof(*data));
 	if (data == NULL) {
 		syslog(LOG_EMERG, "%s\n", "can't create server data");
@@ -103,8 +163,11 @@ int main(int argc, char *argv[])
 			return EXIT_FAILURE;
 		}
 		data[i]->data = global_data;
+		data[i]->acceptor = acceptor;
+		data[i]->worker = i;
 		data[i]->session = http_session_create(attr,
-						       cfg->timeout,
+						       cfg->request_deadline,
+						       &timeouts,
 						       cfg->http_max_request_size,
 						       cfg->http_max_response_size);
 		if (data[i]->session == NULL) {
@@ -113,6 +176,11 @@ int main(int argc, char *argv[])
 			return EXIT_FAILURE;
 		}
 	}
+	if (acceptor_start(acceptor) < 0) {
+		syslog(LOG_EMERG, "%s\n", "can't start the acceptor");
+		close_listening_socket(listener);
+		return EXIT_FAILURE;
+	}
 	syslog(LOG_INFO, "%s %d %s\n", "starting",
 	       cfg->thread_number,
 	       "working server thread");
@@ -133,6 +201,11 @@ int main(int argc, char *argv[])
 			return EXIT_FAILURE;
 		}
 	}
+	acceptor_stop(acceptor);
+	syslog(LOG_INFO, "%s: %llu %s\n", "accept queue overflow",
+	       (unsigned long long)acceptor_overflows(acceptor),
+	       "connections dropped in total");
+	acceptor_destroy(acceptor);
 	close_listening_socket(listener);
 	return EXIT_SUCCESS;
 }
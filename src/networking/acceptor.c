@@ -0,0 +1,223 @@
+#include "acceptor.h"
+
+/**
+ * worker_queue - handoff between the acceptor and a worker
+ * @ring: sockets accepted for the worker
+ * @ready: counts the sockets pushed, the worker sleeps on it when the
+ * ring is empty
+ * @busy: true while the worker serves a connection
+ */
+struct worker_queue {
+	struct spsc_ring ring;
+	sem_t ready;
+	bool busy;
+};
+
+/**
+ * acceptor - thread feeding the workers with the accepted sockets
+ * @listener: listener drained
+ * @queues: a queue per worker
+ * @workers: number of queues
+ * @next: worker the search of the least loaded one starts from, so ties
+ * go round robin
+ * @overflows: connections dropped with every queue full
+ * @thread: thread of the acceptor
+ * @running: false to stop the thread
+ */
+struct acceptor {
+	LISTENER_CONNECTION *listener;
+	struct worker_queue *queues;
+	size_t workers;
+	size_t next;
+	uint64_t overflows;
+	pthread_t thread;
+	bool running;
+};
+
+ACCEPTOR *acceptor_create(LISTENER_CONNECTION *listener,
+			  size_t workers,
+			  size_t queue_size)
+{
+	ACCEPTOR *acceptor = NULL;
+	size_t i = 0;
+	if (listener == NULL || workers == 0 || queue_size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	acceptor = calloc(1, sizeof(*acceptor));
+	if (acceptor == NULL)
+		return NULL;
+	acceptor->queues = calloc(workers, sizeof(*acceptor->queues));
+	if (acceptor->queues == NULL) {
+		free(acceptor);
+		return NULL;
+	}
+	for (i = 0; i < workers; ++i) {
+		if (spsc_ring_init(&acceptor->queues[i].ring, queue_size) < 0)
+			goto error;
+		if (sem_init(&acceptor->queues[i].ready, 0, 0) < 0) {
+			spsc_ring_free(&acceptor->queues[i].ring);
+			goto error;
+		}
+	}
+	acceptor->listener = listener;
+	acceptor->workers = workers;
+	return acceptor;
+error:
+	while (i-- > 0) {
+		spsc_ring_free(&acceptor->queues[i].ring);
+		sem_destroy(&acceptor->queues[i].ready);
+	}
+	free(acceptor->queues);
+	free(acceptor);
+	return NULL;
+}
+
+/**
+ * least_loaded - return the queue of the worker with the lowest load,
+ * NULL if every ring is full
+ */
+static struct worker_queue *least_loaded(ACCEPTOR *acceptor)
+{
+	struct worker_queue *best = NULL;
+	struct worker_queue *queue = NULL;
+	size_t best_load = SIZE_MAX;
+	size_t load = 0;
+	size_t count = 0;
+	size_t best_i = 0;
+	size_t i = 0;
+	for (size_t k = 0; k < acceptor->workers; ++k) {
+		i = (acceptor->next + k) % acceptor->workers;
+		queue = &acceptor->queues[i];
+		count = spsc_ring_count(&queue->ring);
+		if (count > queue->ring.mask)
+			continue;
+		load = count + __atomic_load_n(&queue->busy, __ATOMIC_RELAXED);
+		if (load < best_load) {
+			best = queue;
+			best_load = load;
+			best_i = i;
+			// an idle worker can't be beaten
+			if (load == 0)
+				break;
+		}
+	}
+	if (best != NULL)
+		acceptor->next = (best_i + 1) % acceptor->workers;
+	return best;
+}
+
+/**
+ * dispatch - hand a socket to the least loaded worker, drop it if every
+ * worker is saturated
+ */
+static void dispatch(ACCEPTOR *acceptor, int sock)
+{
+	struct worker_queue *queue = least_loaded(acceptor);
+	uint64_t n = 0;
+	if (queue == NULL || !spsc_ring_push(&queue->ring, sock)) {
+		close(sock);
+		n = __atomic_add_fetch(&acceptor->overflows, 1, __ATOMIC_RELAXED);
+		// log 1, 2, 4, 8... drops, a flood must not flood the log too
+		if ((n & (n - 1)) == 0)
+			syslog(LOG_WARNING, "%s: %llu %s\n", "accept queue overflow",
+			       (unsigned long long)n, "connections dropped");
+		return;
+	}
+	sem_post(&queue->ready);
+}
+
+static void *acceptor_main(void *arg)
+{
+	ACCEPTOR *acceptor = arg;
+	int socks[ACCEPTOR_BATCH];
+	ssize_t n = 0;
+	while (__atomic_load_n(&acceptor->running, __ATOMIC_RELAXED)) {
+		n = lcaccept(acceptor->listener, socks, ACCEPTOR_BATCH,
+			     ACCEPTOR_POLL_MS);
+		if (n < 0) {
+			syslog(LOG_ERR, "%s: %m\n", "accept failed");
+			// out of descriptors, give the workers time to close some
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+				usleep(ACCEPTOR_POLL_MS * 1000);
+			continue;
+		}
+		for (ssize_t i = 0; i < n; ++i)
+			dispatch(acceptor, socks[i]);
+	}
+	return NULL;
+}
+
+int acceptor_start(ACCEPTOR *acceptor)
+{
+	int err = 0;
+	if (acceptor == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	acceptor->running = true;
+	err = pthread_create(&acceptor->thread, NULL, acceptor_main, acceptor);
+	if (err != 0) {
+		acceptor->running = false;
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+void acceptor_stop(ACCEPTOR *acceptor)
+{
+	if (acceptor == NULL || !acceptor->running)
+		return;
+	__atomic_store_n(&acceptor->running, false, __ATOMIC_RELAXED);
+	pthread_join(acceptor->thread, NULL);
+	for (size_t i = 0; i < acceptor->workers; ++i)
+		sem_post(&acceptor->queues[i].ready);
+}
+
+void acceptor_destroy(ACCEPTOR *acceptor)
+{
+	uintptr_t sock = 0;
+	if (acceptor == NULL)
+		return;
+	for (size_t i = 0; i < acceptor->workers; ++i) {
+		while (spsc_ring_pop(&acceptor->queues[i].ring, &sock))
+			close(sock);
+		spsc_ring_free(&acceptor->queues[i].ring);
+		sem_destroy(&acceptor->queues[i].ready);
+	}
+	free(acceptor->queues);
+	free(acceptor);
+}
+
+int acceptor_next(ACCEPTOR *acceptor, size_t worker)
+{
+	struct worker_queue *queue = &acceptor->queues[worker];
+	uintptr_t sock = 0;
+	while (true) {
+		if (sem_wait(&queue->ready) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (spsc_ring_pop(&queue->ring, &sock))
+			break;
+		// woken by acceptor_stop() with nothing left
+		if (!__atomic_load_n(&acceptor->running, __ATOMIC_RELAXED)) {
+			errno = ECANCELED;
+			return -1;
+		}
+	}
+	__atomic_store_n(&queue->busy, true, __ATOMIC_RELAXED);
+	return sock;
+}
+
+void acceptor_done(ACCEPTOR *acceptor, size_t worker)
+{
+	__atomic_store_n(&acceptor->queues[worker].busy, false, __ATOMIC_RELAXED);
+}
+
+uint64_t acceptor_overflows(const ACCEPTOR *acceptor)
+{
+	return __atomic_load_n(&acceptor->overflows, __ATOMIC_RELAXED);
+}
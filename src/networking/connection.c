@@ -1,30 +1,284 @@
+#define _GNU_SOURCE /* accept4 */
 #include "connection.h"
 #include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include "list.h"
+#ifdef HAVE_OPENSSL
+#include "tls.h"
+#endif
 
 
 #define MAX_IP_LEN 256
 
 struct listener_socket {
 	int lsock;     /* socket listening file descriptor */
+	struct tls_context *tls; /* TLS of the accepted connections, NULL if none */
 };
 
+/* buffers kept by a buffer_pool beyond those in use */
+#define BUFFER_POOL_MAX_FREE 1024
+
+/**
+ * buffer_pool - I/O buffers of one size shared by all the connections
+ * @size: size of the buffers
+ * @mutex: protects free and n_free
+ * @free: buffers not in use, linked through their first bytes
+ * @n_free: number of buffers in free
+ * @list: entry of the pools
+ */
+struct buffer_pool {
+	size_t size;
+	pthread_mutex_t mutex;
+	void *free;
+	size_t n_free;
+	struct list_head list;
+};
+
+/* a pool per buffer size, the sizes come from the config so they are few */
+static LIST_HEAD(buffer_pools);
+static pthread_mutex_t buffer_pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 struct buffered_socket {
 	int sock;             /* socket file descriptor */
-	char *write_buf;      /* pointer to writer buffer */
-	size_t write_buf_size;/* size of allocated writer buffer*/
+	char *write_buf;      /* pointer to writer buffer, NULL if empty */
+	struct buffer_pool *write_pool; /* pool of the writer buffer */
 	size_t buffered_write;/* how much is stored in the writer buffer*/
 	sem_t wmutex;         /* mutex to access the writer buffer THREAD-SAFE*/  
-	char *read_buf;       /* buffer to reader buffer */
-	size_t read_buf_size; /* reader buffer size*/
+	char *read_buf;       /* buffer to reader buffer, NULL if empty */
+	struct buffer_pool *read_pool; /* pool of the reader buffer */
 	char *to_read;        /* where to start reading */
 	size_t to_read_size;  /* how much there is to read */
 	sem_t rmutex;         /* mutex to access the reader buffer THREAD-SAFE*/
+	bool thread_safe;     /* true to take rmutex and wmutex, false if single owner */
+#ifndef NDEBUG
+	pthread_t owner;      /* thread of a single owner CONNECTION */
+#endif
+	struct tls_session *tls; /* TLS session, NULL for cleartext */
 };
 
-static int flush(CONNECTION *connect);
+/*
+ * last CONNECTION struct closed by the thread, reused as it is with its
+ * semaphores already initialized. A worker closes its connection before
+ * it opens the next one, so one is all it can reuse, and since the
+ * CONNECTION is served by one thread from copen() to cclose() the cache
+ * needs no lock.
+ */
+static __thread CONNECTION *connection_cache;
+
+static int flush(CONNECTION *connect, int flags);
+
+static ssize_t sock_recv(CONNECTION *connect, void *buf, size_t n)
+{
+#ifdef HAVE_OPENSSL
+	if (connect->tls != NULL)
+		return tls_recv(connect->tls, buf, n);
+#endif
+	return recv(connect->sock, buf, n, 0);
+}
+
+static ssize_t sock_send(CONNECTION *connect, const void *buf, size_t n, int flags)
+{
+#ifdef HAVE_OPENSSL
+	// SSL_write() sends whole records, there is nothing to cork
+	if (connect->tls != NULL)
+		return tls_send(connect->tls, buf, n);
+#endif
+	return send(connect->sock, buf, n, MSG_NOSIGNAL | flags);
+}
+
+/**
+ * sock_pending - return true if data already decrypted is waiting to
+ * be read, the socket itself may have nothing left
+ */
+static bool sock_pending(const CONNECTION *connect)
+{
+#ifdef HAVE_OPENSSL
+	if (connect->tls != NULL)
+		return tls_pending(connect->tls);
+#else
+	(void) connect;
+#endif
+	return false;
+}
 
 #define MIN(a, b) ((a < b) ? a : b)
 
+/*
+ * A single owner CONNECTION is used only by the thread that opened it,
+ * the lock helpers cost nothing then but the ownership check of the
+ * debug builds. Calls that don't touch the buffers, like cabort() and
+ * cis_alive(), stay usable from any thread in both modes.
+ */
+static inline void check_owner(const CONNECTION *connect)
+{
+#ifndef NDEBUG
+	assert(pthread_equal(connect->owner, pthread_self()));
+#endif
+}
+
+static inline void lock_read(CONNECTION *connect)
+{
+	if (connect->thread_safe)
+		sem_wait(&(connect->rmutex));
+	else
+		check_owner(connect);
+}
+
+static inline void unlock_read(CONNECTION *connect)
+{
+	if (connect->thread_safe)
+		sem_post(&(connect->rmutex));
+}
+
+static inline void lock_write(CONNECTION *connect)
+{
+	if (connect->thread_safe)
+		sem_wait(&(connect->wmutex));
+	else
+		check_owner(connect);
+}
+
+static inline void unlock_write(CONNECTION *connect)
+{
+	if (connect->thread_safe)
+		sem_post(&(connect->wmutex));
+}
+
+/**
+ * buffer_pool_get - return the pool of the buffers of size bytes,
+ * created on first use, pools are never freed
+ */
+static struct buffer_pool *buffer_pool_get(size_t size)
+{
+	struct buffer_pool *pool = NULL;
+	pthread_mutex_lock(&buffer_pools_mutex);
+	list_for_each_entry(pool, &buffer_pools, list) {
+		if (pool->size == size)
+			goto out;
+	}
+	pool = malloc(sizeof(*pool));
+	if (pool == NULL)
+		goto out;
+	// a free buffer stores the link to the next one
+	pool->size = (size < sizeof(void *)) ? sizeof(void *) : size;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pool->free = NULL;
+	pool->n_free = 0;
+	list_add(&pool->list, &buffer_pools);
+out:
+	pthread_mutex_unlock(&buffer_pools_mutex);
+	return pool;
+}
+
+static char *buffer_get(struct buffer_pool *pool)
+{
+	void *buf = NULL;
+	pthread_mutex_lock(&pool->mutex);
+	buf = pool->free;
+	if (buf != NULL) {
+		pool->free = *(void **)buf;
+		--pool->n_free;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	if (buf == NULL)
+		buf = malloc(pool->size);
+	return buf;
+}
+
+static void buffer_put(struct buffer_pool *pool, char *buf)
+{
+	if (buf == NULL)
+		return;
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->n_free < BUFFER_POOL_MAX_FREE) {
+		*(void **)buf = pool->free;
+		pool->free = buf;
+		++pool->n_free;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	free(buf);
+}
+
+/**
+ * attach_read_buf - take a reader buffer from the pool
+ * return false if there is no memory left.
+ */
+static bool attach_read_buf(CONNECTION *connect)
+{
+	if (connect->read_buf != NULL)
+		return true;
+	connect->read_buf = buffer_get(connect->read_pool);
+	connect->to_read = connect->read_buf;
+	connect->to_read_size = 0;
+	return connect->read_buf != NULL;
+}
+
+/**
+ * release_read_buf - give the reader buffer back once it's drained
+ */
+static void release_read_buf(CONNECTION *connect)
+{
+	buffer_put(connect->read_pool, connect->read_buf);
+	connect->read_buf = NULL;
+	connect->to_read = NULL;
+	connect->to_read_size = 0;
+}
+
+static bool attach_write_buf(CONNECTION *connect)
+{
+	if (connect->write_buf == NULL)
+		connect->write_buf = buffer_get(connect->write_pool);
+	return connect->write_buf != NULL;
+}
+
+static void release_write_buf(CONNECTION *connect)
+{
+	buffer_put(connect->write_pool, connect->write_buf);
+	connect->write_buf = NULL;
+	connect->buffered_write = 0;
+}
+
+/**
+ * connection_alloc - return a CONNECTION from the thread cache or a new
+ * one with its semaphores initialized
+ */
+static CONNECTION *connection_alloc(void)
+{
+	CONNECTION *connection = connection_cache;
+	if (connection != NULL) {
+		connection_cache = NULL;
+		return connection;
+	}
+	connection = malloc(sizeof(*connection));
+	if (connection == NULL)
+		return NULL;
+	if (sem_init(&(connection->wmutex), 0, 1) < 0) {
+		free(connection);
+		return NULL;
+	}
+	if (sem_init(&(connection->rmutex), 0, 1) < 0) {
+		sem_destroy(&(connection->wmutex));
+		free(connection);
+		return NULL;
+	}
+	connection->read_pool = NULL;
+	connection->write_pool = NULL;
+	return connection;
+}
+
+static void connection_free(CONNECTION *connection)
+{
+	if (connection_cache == NULL) {
+		connection_cache = connection;
+		return;
+	}
+	sem_destroy(&(connection->wmutex));
+	sem_destroy(&(connection->rmutex));
+	free(connection);
+}
+
 LISTENER_CONNECTION *lcopen(char *service, int backlog, socklen_t *addrlen)
 {
 	LISTENER_CONNECTION *lconn = NULL; 
@@ -36,9 +290,32 @@ LISTENER_CONNECTION *lcopen(char *service, int backlog, socklen_t *addrlen)
 		free(lconn);
 		return NULL;
 	}
+	// accept never blocks, so a batch can drain the queue and stop
+	if (fcntl(lconn->lsock, F_SETFL, fcntl(lconn->lsock, F_GETFL) | O_NONBLOCK) < 0) {
+		close(lconn->lsock);
+		free(lconn);
+		return NULL;
+	}
+	lconn->tls = NULL;
 	return lconn;
 }
 
+int lcsettls(LISTENER_CONNECTION *connection, struct tls_context *tls)
+{
+	if (connection == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+#ifndef HAVE_OPENSSL
+	if (tls != NULL) {
+		errno = ENOTSUP;
+		return -1;
+	}
+#endif
+	connection->tls = tls;
+	return 0;
+}
+
 int lcclose(LISTENER_CONNECTION *connection)
 {
 	int res = 0;
@@ -47,79 +324,159 @@ int lcclose(LISTENER_CONNECTION *connection)
 	return res;
 }
 
-CONNECTION *copen(struct CONNECTION_attr *attr)
+/**
+ * connection_create - get a CONNECTION around sock and run the TLS
+ * handshake if the listener of attr has a context
+ * @attr: attributes of the connection
+ * @sock: connected socket, closed in case of failure
+ * the I/O buffers are not attached yet, they are taken from their pool
+ * only while data is in flight, so an idle connection holds none.
+ */
+static CONNECTION *connection_create(struct CONNECTION_attr *attr, int sock)
 {
 	CONNECTION *connection = NULL;
 	int err = 0;
-	if (attr == NULL) {
+	if (attr->read_buffer_size == 0 || attr->write_buffer_size == 0) {
 		errno = EINVAL;
-		return NULL;
+		goto close_sock;
 	}
-	connection = malloc(sizeof(*connection));
+	connection = connection_alloc();
 	if (connection == NULL)
-		return NULL;
-	connection->write_buf = calloc(sizeof(char), attr->write_buffer_size);
-	if (connection->write_buf == NULL) {
-		free(connection);
-		return NULL;
-	}
-	connection->read_buf = calloc(sizeof(char), attr->read_buffer_size);
-	if (connection->read_buf == NULL) {
-		free(connection->write_buf);
-		free(connection);
-		return NULL;
+		goto close_sock;
+	if (connection->read_pool == NULL ||
+	    connection->read_pool->size != attr->read_buffer_size)
+		connection->read_pool = buffer_pool_get(attr->read_buffer_size);
+	if (connection->write_pool == NULL ||
+	    connection->write_pool->size != attr->write_buffer_size)
+		connection->write_pool = buffer_pool_get(attr->write_buffer_size);
+	if (connection->read_pool == NULL || connection->write_pool == NULL)
+		goto free_connection;
+	connection->sock = sock;
+	connection->thread_safe = attr->thread_safe;
+#ifndef NDEBUG
+	connection->owner = pthread_self();
+#endif
+	connection->write_buf = NULL;
+	connection->buffered_write = 0;
+	connection->read_buf = NULL;
+	connection->to_read = NULL;
+	connection->to_read_size = 0;
+	connection->tls = NULL;
+#ifdef HAVE_OPENSSL
+	if (attr->socket_type == ACCEPT && attr->listener->tls != NULL) {
+		connection->tls = tls_accept(attr->listener->tls, connection->sock);
+		if (connection->tls == NULL) {
+			err = errno;
+			cclose(connection, O_RDWR);
+			errno = err;
+			return NULL;
+		}
 	}
-	err = sem_init(&(connection->wmutex), 0, 1);
-	if (err < 0) {
-		free(connection->write_buf);
-		free(connection->read_buf);
-		free(connection);
-		return NULL;
+#endif
+	return connection;
+free_connection:
+	connection_free(connection);
+close_sock:
+	err = errno;
+	close(sock);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * accept_one - wait for a connection on the non-blocking listener and
+ * accept it, the other threads accepting may take it first
+ */
+static int accept_one(struct CONNECTION_attr *attr)
+{
+	struct pollfd pfd = {0};
+	int sock = -1;
+	pfd.fd = attr->listener->lsock;
+	pfd.events = POLLIN;
+	while (true) {
+		sock = accept4(attr->listener->lsock, attr->addr,
+			       attr->addr_len, SOCK_CLOEXEC);
+		if (sock >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return sock;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -1;
 	}
-	err = sem_init(&(connection->rmutex), 0, 1);
-	if (err < 0) {
-		free(connection->write_buf);
-		free(connection->read_buf);
-		free(connection);
+}
+
+CONNECTION *copen(struct CONNECTION_attr *attr)
+{
+	int sock = -1;
+	if (attr == NULL) {
+		errno = EINVAL;
 		return NULL;
 	}
 	if (attr->socket_type == ACCEPT)
-		connection->sock = accept(attr->listener->lsock,
-					  attr->addr,
-					  attr->addr_len);
+		sock = accept_one(attr);
 	else
-		connection->sock = inetConnect(attr->host,
-					       attr->service,
-					       attr->type);
-	if (connection->sock < 0) {
-		free(connection->write_buf);
-		free(connection->read_buf);
-		sem_destroy(&(connection->wmutex));
-		sem_destroy(&(connection->rmutex));
-		free(connection);
+		sock = inetConnect(attr->host,
+				   attr->service,
+				   attr->type);
+	if (sock < 0)
+		return NULL;
+	return connection_create(attr, sock);
+}
+
+CONNECTION *copenfd(struct CONNECTION_attr *attr, int sock)
+{
+	if (attr == NULL || sock < 0) {
+		errno = EINVAL;
 		return NULL;
 	}
-	connection->write_buf_size = attr->write_buffer_size;
-	connection->read_buf_size = attr->read_buffer_size;
-	connection->to_read = connection->read_buf;
-	connection->to_read_size = 0;
-	connection->buffered_write = 0;
-	
-	return connection;
+	return connection_create(attr, sock);
 }
- 
+
+ssize_t lcaccept(LISTENER_CONNECTION *connection, int *socks, size_t n, int timeout)
+{
+	struct pollfd pfd = {0};
+	size_t accepted = 0;
+	int sock = -1;
+	int ready = 0;
+	if (connection == NULL || socks == NULL || n == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	pfd.fd = connection->lsock;
+	pfd.events = POLLIN;
+	ready = poll(&pfd, 1, timeout);
+	if (ready <= 0)
+		return (ready == 0 || errno == EINTR) ? 0 : -1;
+	// the listener is non-blocking, drain it until it's empty
+	while (accepted < n) {
+		sock = accept4(connection->lsock, NULL, NULL, SOCK_CLOEXEC);
+		if (sock >= 0) {
+			socks[accepted++] = sock;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		// the client gave up before being accepted, move on
+		if (errno == ECONNABORTED || errno == EPROTO)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK || accepted > 0)
+			break;
+		return -1;
+	}
+	return accepted;
+}
+
 int cclose(CONNECTION *connection, int how)
 {
 	int res = 0;
 	if (connection == NULL)
 		return 0;
+#ifdef HAVE_OPENSSL
+	tls_close(connection->tls);
+#endif
 	shutdown(connection->sock, how);
 	close(connection->sock);
-	free(connection->write_buf);
-	free(connection->read_buf);
-	sem_destroy(&(connection->wmutex));
-	sem_destroy(&(connection->rmutex));
-	free(connection);
+	release_write_buf(connection);
+	release_read_buf(connection);
+	connection_free(connection);
 	return res;
 }
 
@@ -138,15 +495,13 @@ crecv_notsync(CONNECTION *connect, char *buf, size_t n, int timeout)
 			return n;
 		} else if (connect->to_read_size == n) {
 			memcpy(buf, connect->to_read, n);
-			connect->to_read = connect->read_buf;
-			connect->to_read_size = 0;
+			release_read_buf(connect);
 			return n;
 		} else {
 			memcpy(buf, connect->to_read, connect->to_read_size);
 			n -= connect->to_read_size;
 			buf += connect->to_read_size;
-			connect->to_read = connect->read_buf;
-			connect->to_read_size = 0;
+			release_read_buf(connect);
 		}
 	}
 	// set fd to watch
@@ -156,7 +511,11 @@ crecv_notsync(CONNECTION *connect, char *buf, size_t n, int timeout)
 	/* set timeout val*/
 	tm_out.tv_sec = timeout;
 	tm_out.tv_usec = 0;
-	ready = select(connect->sock + 1, &read_set, NULL, NULL, &tm_out);
+	if (sock_pending(connect))
+		ready = 1;
+	else
+		ready = select(connect->sock + 1, &read_set, NULL, NULL,
+			       (timeout < 0) ? NULL : &tm_out);
 	if (ready == -1)
 		return -1;
 	if (ready) {
@@ -168,16 +527,20 @@ crecv_notsync(CONNECTION *connect, char *buf, size_t n, int timeout)
 		 * skip it and copy it directly to buf
 		 */
 		ssize_t rd = 0;
-		if (connect->read_buf_size > n) {
-			rd = recv(connect->sock,
-				  connect->read_buf,
-				  connect->read_buf_size,
-				  0);
+		if (connect->read_pool->size > n) {
+			// the buffer is attached only now that data is there
+			if (!attach_read_buf(connect))
+				return -1;
+			rd = sock_recv(connect,
+				       connect->read_buf,
+				       connect->read_pool->size);
 			if (rd <= 0) {
+				release_read_buf(connect);
 				return rd;
 			}
 			if ((size_t)rd <= n) {
 				memcpy(buf, connect->read_buf, rd);
+				release_read_buf(connect);
 				return rd;
 			} else {
 				memcpy(buf, connect->read_buf, n);
@@ -186,7 +549,7 @@ crecv_notsync(CONNECTION *connect, char *buf, size_t n, int timeout)
 				return n;
 			}
 		} else {
-			rd = recv(connect->sock, buf, n, 0);
+			rd = sock_recv(connect, buf, n);
 			return rd;
 		}
 	} else {
@@ -199,9 +562,9 @@ crecv_notsync(CONNECTION *connect, char *buf, size_t n, int timeout)
 ssize_t crecv(CONNECTION *connect, char *buf, size_t n, int timeout)
 {
 	ssize_t res = 0;
-	sem_wait(&(connect->rmutex));
+	lock_read(connect);
 	res = crecv_notsync(connect, buf, n, timeout);
-	sem_post(&(connect->rmutex));
+	unlock_read(connect);
 	return res;
 }
 
@@ -216,30 +579,24 @@ static ssize_t csend_notsync(CONNECTION *connect, char *buf, size_t n)
 	 * flush what's inside and send the buffer
 	 * directly without buffering.
 	 */
-	if (n >= connect->write_buf_size) {
+	if (n >= connect->write_pool->size) {
 		int res = 0;
-		res = flush(connect);
+		res = flush(connect, 0);
 		if (res < 0)
 			return -1;
-		wr = send(connect->sock,
-			  buf,
-			  n,
-			  MSG_NOSIGNAL);
+		wr = sock_send(connect, buf, n, 0);
 		return wr;
 	} else {
 		/* if n is less than the buffer
 		 * send through buffered IO
 		 */
-		if (connect->buffered_write + n <= connect->write_buf_size) {
-			memcpy(connect->write_buf + connect->buffered_write,
-			       buf,
-			       n);
-			connect->buffered_write += n;
-		} else {
-			flush(connect);
-			memcpy(connect->write_buf, buf, n);
-			connect->buffered_write += n;
-		}
+		if (connect->buffered_write + n > connect->write_pool->size &&
+		    flush(connect, 0) < 0)
+			return -1;
+		if (!attach_write_buf(connect))
+			return -1;
+		memcpy(connect->write_buf + connect->buffered_write, buf, n);
+		connect->buffered_write += n;
 		return n;
 	}	
 }
@@ -247,24 +604,24 @@ static ssize_t csend_notsync(CONNECTION *connect, char *buf, size_t n)
 ssize_t csend(CONNECTION *connect, char *buf, size_t n)
 {
 	ssize_t res = 0;
-	sem_wait(&(connect->wmutex));
+	lock_write(connect);
 	res = csend_notsync(connect, buf, n);
-	sem_post(&(connect->wmutex));
+	unlock_write(connect);
 	return res;
 }
 
-static int flush(CONNECTION *connect)
+static int flush(CONNECTION *connect, int flags)
 {
 	ssize_t wr = 0;
 	if (connect->buffered_write == 0)
 		return 0;
-	wr = send(connect->sock,
-		  connect->write_buf,
-		  connect->buffered_write,
-		  MSG_NOSIGNAL);
+	wr = sock_send(connect,
+		       connect->write_buf,
+		       connect->buffered_write,
+		       flags);
 	if (wr < 0)
 		return -1;
-	connect->buffered_write = 0;
+	release_write_buf(connect);
 	return 0;
 }
 
@@ -275,17 +632,56 @@ int cflush(CONNECTION *connect)
 		errno = EINVAL;
 		return -1;
 	}
-	sem_wait(&(connect->wmutex));
-	res = flush(connect);
-	sem_post(&(connect->wmutex));
+	lock_write(connect);
+	res = flush(connect, 0);
+	unlock_write(connect);
 	return res;
 }
 
-ssize_t csendfile(CONNECTION *connect, char *fpath, size_t file_size)
+ssize_t csendfd(CONNECTION *connect, int fd, off_t offset, size_t count)
+{
+	ssize_t wr = 0;
+	size_t left = count;
+	if (connect == NULL || fd < 0 || offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	lock_write(connect);
+	// what was buffered by csend() goes first, in the same segment as
+	// the start of the file when it is small, e.g. a frame header
+	if (flush(connect, MSG_MORE) < 0) {
+		unlock_write(connect);
+		return -1;
+	}
+#ifdef HAVE_OPENSSL
+	if (connect->tls != NULL) {
+		wr = tls_sendfile(connect->tls, fd, offset, count);
+		unlock_write(connect);
+		return wr;
+	}
+#endif
+	while (left > 0) {
+		wr = sendfile(connect->sock, fd, &offset, left);
+		if (wr < 0 && errno == EINTR)
+			continue;
+		if (wr <= 0) {
+			// the file was truncated while being sent
+			if (wr == 0)
+				errno = EIO;
+			unlock_write(connect);
+			return -1;
+		}
+		left -= wr;
+	}
+	unlock_write(connect);
+	return count;
+}
+
+ssize_t csendfile(CONNECTION *connect, char *fpath, off_t offset, size_t count)
 {
 	int fd = 0;
 	ssize_t wr = 0;
-	off_t pos = 0;
+	int err = 0;
 	if (connect == NULL || fpath == NULL) {
 		errno = EINVAL;
 		return -1;
@@ -293,31 +689,25 @@ ssize_t csendfile(CONNECTION *connect, char *fpath, size_t file_size)
 	fd = open(fpath, O_RDONLY);
 	if (fd < 0)
 		return -1;
-	while (file_size > 0) {
-		wr = sendfile(connect->sock, fd, &pos,file_size);
-		if (wr < 0)
-			return wr;
-		file_size -= wr;
-	}
+	wr = csendfd(connect, fd, offset, count);
+	err = errno;
 	close(fd);
-	return file_size;
+	errno = err;
+	return wr;
 }
 
-ssize_t crecvline(CONNECTION *connect, char *buf, size_t n, int timeout)
+static ssize_t
+crecvline_notsync(CONNECTION *connect, char *buf, size_t n, int timeout)
 {
 	size_t totRead = 0;
 	ssize_t numRead = 0;
 	char ch = 0;
 
-	if (buf == NULL || n <= 0) {
-		errno = EINVAL;
-		return -1;
-	}
 	totRead = 0;
 	ch = 0;
 	while (ch != '\n') {
 		/* read() one bytes */
-		numRead = crecv(connect, &ch, 1, timeout);
+		numRead = crecv_notsync(connect, &ch, 1, timeout);
 		if (numRead == -1) {
 			if (errno == EINTR) {
 				/* read() interrupted by signal*/
@@ -348,6 +738,79 @@ ssize_t crecvline(CONNECTION *connect, char *buf, size_t n, int timeout)
 	return totRead;
 }
 
+ssize_t crecvline(CONNECTION *connect, char *buf, size_t n, int timeout)
+{
+	ssize_t res = 0;
+	if (connect == NULL || buf == NULL || n <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	// the line is read a byte at a time, lock once for all of them
+	lock_read(connect);
+	res = crecvline_notsync(connect, buf, n, timeout);
+	unlock_read(connect);
+	return res;
+}
+
+bool cis_alive(const CONNECTION *connect)
+{
+	struct pollfd pfd = {0};
+	char byte = 0;
+	ssize_t rd = 0;
+	if (connect == NULL)
+		return false;
+	pfd.fd = connect->sock;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) < 0)
+		return errno == EINTR;
+	if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+		return false;
+	if (!(pfd.revents & POLLIN))
+		return true;
+	/* readable: either a pipelined request or the end of the stream */
+	rd = recv(connect->sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (rd == 0)
+		return false;
+	if (rd < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	return true;
+}
+
+int cabort(CONNECTION *connect, int how)
+{
+	if (connect == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	return shutdown(connect->sock, how);
+}
+
+int csetnodelay(CONNECTION *connect, bool on)
+{
+	int optval = on;
+	if (connect == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	return setsockopt(connect->sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+}
+
+bool cis_tls(const CONNECTION *connect)
+{
+	return connect != NULL && connect->tls != NULL;
+}
+
+bool cis_alpn(const CONNECTION *connect, const char *proto)
+{
+	if (connect == NULL || proto == NULL)
+		return false;
+#ifdef HAVE_OPENSSL
+	if (connect->tls != NULL)
+		return tls_alpn_is(connect->tls, proto);
+#endif
+	return false;
+}
+
 int cgetpeername(const CONNECTION *connection, struct sockaddr *address, socklen_t *address_len)
 {
 	return getpeername(connection->sock, address, address_len);
@@ -0,0 +1,556 @@
+#include "hpack.h"
+
+/* max value of a decoded integer, bigger ones are a compression error */
+#define HPACK_MAX_INT (1UL << 28)
+
+struct hpack_static_field {
+	const char *name;
+	const char *value;
+};
+
+/* static table of RFC 7541 Appendix A, index 1 is the first entry */
+static const struct hpack_static_field static_table[HPACK_STATIC_ENTRIES] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+/* Huffman code of RFC 7541 Appendix B, the last entry is EOS */
+static const uint32_t huffman_codes[HPACK_HUFFMAN_SYMBOLS] = {
+	0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5,
+	0x0fffffe6, 0x0fffffe7, 0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9,
+	0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec, 0x0fffffed, 0x0fffffee,
+	0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+	0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9,
+	0x0ffffffa, 0x0ffffffb, 0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa,
+	0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa, 0x000003fa, 0x000003fb,
+	0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+	0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b,
+	0x0000001c, 0x0000001d, 0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb,
+	0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc, 0x00001ffa, 0x00000021,
+	0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+	0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068,
+	0x00000069, 0x0000006a, 0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e,
+	0x0000006f, 0x00000070, 0x00000071, 0x00000072, 0x000000fc, 0x00000073,
+	0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+	0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005,
+	0x00000025, 0x00000026, 0x00000027, 0x00000006, 0x00000074, 0x00000075,
+	0x00000028, 0x00000029, 0x0000002a, 0x00000007, 0x0000002b, 0x00000076,
+	0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+	0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd,
+	0x00001ffd, 0x0ffffffc, 0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8,
+	0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9, 0x003fffd6, 0x007fffda,
+	0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+	0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1,
+	0x007fffe2, 0x007fffe3, 0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5,
+	0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef, 0x003fffda, 0x001fffdd,
+	0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+	0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf,
+	0x007fffeb, 0x007fffec, 0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2,
+	0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef, 0x000fffea, 0x003fffe2,
+	0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+	0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2,
+	0x003fffe8, 0x01ffffec, 0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde,
+	0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed, 0x0007fff2, 0x001fffe3,
+	0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+	0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3,
+	0x07ffffe4, 0x07ffffe5, 0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6,
+	0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3, 0x003fffea, 0x003fffeb,
+	0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+	0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8,
+	0x07ffffe9, 0x07ffffea, 0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed,
+	0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee, 0x3fffffff,
+};
+
+static const uint8_t huffman_lengths[HPACK_HUFFMAN_SYMBOLS] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+
+/*
+ * decoding tree of the Huffman code: children of internal nodes are
+ * positive node indexes, leaves are -(symbol + 1), the root is node 0
+ */
+static int16_t huffman_tree[HPACK_HUFFMAN_SYMBOLS][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void build_huffman_tree(void)
+{
+	int16_t nodes = 1;
+	int16_t node = 0;
+	int bit = 0;
+	for (int sym = 0; sym < HPACK_HUFFMAN_SYMBOLS; ++sym) {
+		node = 0;
+		for (int i = huffman_lengths[sym] - 1; i > 0; --i) {
+			bit = (huffman_codes[sym] >> i) & 1;
+			if (huffman_tree[node][bit] == 0)
+				huffman_tree[node][bit] = nodes++;
+			node = huffman_tree[node][bit];
+		}
+		huffman_tree[node][huffman_codes[sym] & 1] = -(sym + 1);
+	}
+}
+
+/**
+ * huffman_decode - decode a Huffman encoded string
+ * return the length of the decoded string, -1 if the string is not valid:
+ * it contains EOS or its padding is longer than 7 bits or not made of ones,
+ * or if dest is too small and set errno to ENOBUFS.
+ */
+static ssize_t huffman_decode(const unsigned char *src, size_t len, char *dest, size_t dest_size)
+{
+	size_t out = 0;
+	int16_t node = 0;
+	int16_t next = 0;
+	int pad_bits = 0;
+	bool pad_ones = true;
+	pthread_once(&huffman_once, build_huffman_tree);
+	for (size_t i = 0; i < len; ++i) {
+		for (int b = 7; b >= 0; --b) {
+			int bit = (src[i] >> b) & 1;
+			next = huffman_tree[node][bit];
+			++pad_bits;
+			pad_ones = pad_ones && bit;
+			if (next > 0) {
+				node = next;
+				continue;
+			}
+			if (next == 0 || next == -HPACK_HUFFMAN_SYMBOLS)
+				return -1;
+			if (out >= dest_size) {
+				errno = ENOBUFS;
+				return -1;
+			}
+			dest[out++] = -next - 1;
+			node = 0;
+			pad_bits = 0;
+			pad_ones = true;
+		}
+	}
+	if (pad_bits > 7 || !pad_ones)
+		return -1;
+	return out;
+}
+
+/**
+ * decode_int - decode an integer with a prefix of prefix_bits bits
+ * @pos: position of the first byte, moved after the integer
+ */
+static int decode_int(const unsigned char **pos,
+		      const unsigned char *end,
+		      int prefix_bits,
+		      size_t *value)
+{
+	size_t max_prefix = (1U << prefix_bits) - 1;
+	int shift = 0;
+	if (*pos >= end)
+		return -1;
+	*value = **pos & max_prefix;
+	++(*pos);
+	if (*value < max_prefix)
+		return 0;
+	do {
+		if (*pos >= end || shift > 21)
+			return -1;
+		*value += (size_t)(**pos & 0x7f) << shift;
+		shift += 7;
+	} while (*(*pos)++ & 0x80);
+	if (*value > HPACK_MAX_INT)
+		return -1;
+	return 0;
+}
+
+/**
+ * decode_string - decode a string literal into out
+ * @out: where to store the string, moved after its '\0'
+ * @out_end: end of the storage
+ * @str: where to store the pointer to the decoded string
+ */
+static int decode_string(const unsigned char **pos,
+			 const unsigned char *end,
+			 char **out,
+			 const char *out_end,
+			 const char **str)
+{
+	bool huffman = false;
+	size_t len = 0;
+	ssize_t dec = 0;
+	if (*pos >= end)
+		return -1;
+	huffman = **pos & 0x80;
+	if (decode_int(pos, end, 7, &len) < 0 || len > (size_t)(end - *pos))
+		return -1;
+	if (huffman) {
+		dec = huffman_decode(*pos, len, *out, out_end - *out);
+		if (dec < 0)
+			return -1;
+	} else {
+		if (len >= (size_t)(out_end - *out)) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		memcpy(*out, *pos, len);
+		dec = len;
+	}
+	if (*out + dec >= out_end) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	(*out)[dec] = '\0';
+	*str = *out;
+	*out += dec + 1;
+	*pos += len;
+	return 0;
+}
+
+/**
+ * copy_string - copy src in out, moving out after its '\0'
+ */
+static int copy_string(char **out, const char *out_end, const char *src, const char **str)
+{
+	size_t len = strlen(src);
+	if (len >= (size_t)(out_end - *out)) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	memcpy(*out, src, len + 1);
+	*str = *out;
+	*out += len + 1;
+	return 0;
+}
+
+int hpack_table_init(struct hpack_table *table, size_t limit)
+{
+	if (table == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	// an entry is never smaller than its overhead
+	table->cap = limit / HPACK_ENTRY_OVERHEAD + 1;
+	table->entries = calloc(table->cap, sizeof(*table->entries));
+	if (table->entries == NULL)
+		return -1;
+	table->n = 0;
+	table->first = 0;
+	table->size = 0;
+	table->max_size = limit;
+	table->limit = limit;
+	return 0;
+}
+
+/**
+ * table_get - return the entry at index of the dynamic table, 0 is the newest
+ */
+static struct hpack_entry *table_get(struct hpack_table *table, size_t index)
+{
+	if (index >= table->n)
+		return NULL;
+	return &table->entries[(table->first + index) % table->cap];
+}
+
+static void table_evict(struct hpack_table *table)
+{
+	struct hpack_entry *oldest = NULL;
+	oldest = table_get(table, table->n - 1);
+	table->size -= oldest->size;
+	free(oldest->name);
+	free(oldest->value);
+	oldest->name = NULL;
+	oldest->value = NULL;
+	table->n--;
+}
+
+static void table_resize(struct hpack_table *table, size_t max_size)
+{
+	table->max_size = max_size;
+	while (table->n > 0 && table->size > table->max_size)
+		table_evict(table);
+}
+
+/**
+ * table_add - add an entry to the dynamic table, evicting the oldest ones
+ * an entry bigger than the table empties it and is not added (RFC 7541 4.4).
+ */
+static int table_add(struct hpack_table *table, const char *name, const char *value)
+{
+	struct hpack_entry *entry = NULL;
+	size_t size = 0;
+	size = strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+	while (table->n > 0 && table->size + size > table->max_size)
+		table_evict(table);
+	if (size > table->max_size)
+		return 0;
+	table->first = (table->first + table->cap - 1) % table->cap;
+	entry = &table->entries[table->first];
+	entry->name = strdup(name);
+	entry->value = strdup(value);
+	if (entry->name == NULL || entry->value == NULL) {
+		free(entry->name);
+		free(entry->value);
+		entry->name = NULL;
+		entry->value = NULL;
+		table->first = (table->first + 1) % table->cap;
+		return -1;
+	}
+	entry->size = size;
+	table->size += size;
+	table->n++;
+	return 0;
+}
+
+void hpack_table_free(struct hpack_table *table)
+{
+	if (table == NULL || table->entries == NULL)
+		return;
+	while (table->n > 0)
+		table_evict(table);
+	free(table->entries);
+	table->entries = NULL;
+}
+
+/**
+ * lookup_index - return the name and value at index of the address space
+ * made of the static table followed by the dynamic one
+ */
+static int lookup_index(struct hpack_table *table,
+			size_t index,
+			const char **name,
+			const char **value)
+{
+	struct hpack_entry *entry = NULL;
+	if (index == 0)
+		return -1;
+	if (index <= HPACK_STATIC_ENTRIES) {
+		*name = static_table[index - 1].name;
+		*value = static_table[index - 1].value;
+		return 0;
+	}
+	entry = table_get(table, index - HPACK_STATIC_ENTRIES - 1);
+	if (entry == NULL)
+		return -1;
+	*name = entry->name;
+	*value = entry->value;
+	return 0;
+}
+
+int hpack_decode(struct hpack_table *table,
+		 const unsigned char *block,
+		 size_t len,
+		 char *buf,
+		 size_t buf_size,
+		 struct hpack_field *fields,
+		 size_t max_fields)
+{
+	const unsigned char *pos = block;
+	const unsigned char *end = block + len;
+	const char *buf_end = buf + buf_size;
+	const char *name = NULL;
+	const char *value = NULL;
+	size_t n = 0;
+	size_t index = 0;
+	int prefix = 0;
+	bool indexing = false;
+	if (table == NULL || block == NULL || buf == NULL || fields == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	errno = EPROTO;
+	while (pos < end) {
+		if (*pos & 0x80) {
+			// indexed header field
+			if (decode_int(&pos, end, 7, &index) < 0 ||
+			    lookup_index(table, index, &name, &value) < 0)
+				return -1;
+			// entries of the table can be evicted by the next fields
+			if (copy_string(&buf, buf_end, name, &name) < 0 ||
+			    copy_string(&buf, buf_end, value, &value) < 0)
+				return -1;
+			indexing = false;
+		} else if ((*pos & 0xe0) == 0x20) {
+			// dynamic table size update, only before the first field
+			if (n > 0 || decode_int(&pos, end, 5, &index) < 0 ||
+			    index > table->limit)
+				return -1;
+			table_resize(table, index);
+			continue;
+		} else {
+			// literal, with incremental indexing or not
+			indexing = (*pos & 0xc0) == 0x40;
+			prefix = indexing ? 6 : 4;
+			if (decode_int(&pos, end, prefix, &index) < 0)
+				return -1;
+			if (index == 0) {
+				if (decode_string(&pos, end, &buf, buf_end, &name) < 0)
+					return -1;
+			} else if (lookup_index(table, index, &name, &value) < 0 ||
+				   copy_string(&buf, buf_end, name, &name) < 0) {
+				return -1;
+			}
+			if (decode_string(&pos, end, &buf, buf_end, &value) < 0)
+				return -1;
+		}
+		if (n >= max_fields) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		fields[n].name = name;
+		fields[n].value = value;
+		++n;
+		if (indexing && table_add(table, name, value) < 0)
+			return -1;
+		errno = EPROTO;
+	}
+	return n;
+}
+
+/**
+ * encode_int - encode value with a prefix of prefix_bits bits, the
+ * bits of the first byte above the prefix are taken from first
+ */
+static ssize_t encode_int(unsigned char *buf, size_t buf_size,
+			  unsigned char first, int prefix_bits, size_t value)
+{
+	size_t max_prefix = (1U << prefix_bits) - 1;
+	size_t len = 0;
+	if (buf_size == 0)
+		return -1;
+	if (value < max_prefix) {
+		buf[len++] = first | value;
+		return len;
+	}
+	buf[len++] = first | max_prefix;
+	value -= max_prefix;
+	while (value >= 0x80) {
+		if (len >= buf_size)
+			return -1;
+		buf[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	if (len >= buf_size)
+		return -1;
+	buf[len++] = value;
+	return len;
+}
+
+/**
+ * encode_string - encode a string literal without Huffman coding
+ */
+static ssize_t encode_string(unsigned char *buf, size_t buf_size, const char *str, bool lower)
+{
+	ssize_t len = 0;
+	size_t str_len = strlen(str);
+	len = encode_int(buf, buf_size, 0x00, 7, str_len);
+	if (len < 0 || str_len > buf_size - len)
+		return -1;
+	for (size_t i = 0; i < str_len; ++i)
+		buf[len + i] = lower ? tolower((unsigned char)str[i]) : str[i];
+	return len + str_len;
+}
+
+ssize_t hpack_encode(unsigned char *buf,
+		     size_t buf_size,
+		     const char *name,
+		     const char *value)
+{
+	size_t name_index = 0;
+	ssize_t len = 0, res = 0;
+	if (buf == NULL || name == NULL || value == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (size_t i = 0; i < HPACK_STATIC_ENTRIES; ++i) {
+		if (strcasecmp(static_table[i].name, name) != 0)
+			continue;
+		if (strcmp(static_table[i].value, value) == 0)
+			return encode_int(buf, buf_size, 0x80, 7, i + 1);
+		if (name_index == 0)
+			name_index = i + 1;
+	}
+	// literal header field without indexing
+	len = encode_int(buf, buf_size, 0x00, 4, name_index);
+	if (len < 0)
+		return -1;
+	if (name_index == 0) {
+		res = encode_string(buf + len, buf_size - len, name, true);
+		if (res < 0)
+			return -1;
+		len += res;
+	}
+	res = encode_string(buf + len, buf_size - len, value, false);
+	if (res < 0)
+		return -1;
+	return len + res;
+}
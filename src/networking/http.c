@@ -1,22 +1,45 @@
 
 #include "http.h"
 
+/**
+ * session_expired - timer callback of a session whose phase lasted too long
+ * it runs on the timer service thread with the wheel locked, the
+ * CONNECTION can't be closed meanwhile since closing cancels the timer.
+ */
+static void session_expired(void *arg)
+{
+	struct http_session *session = arg;
+	session->expired = true;
+	cabort(session->connection,
+	       (session->phase == HTTP_PHASE_SEND) ? O_RDWR : O_RDONLY);
+}
 struct http_session *http_session_create(struct CONNECTION_attr *attr,
-					 int timeout,
+					 int request_deadline,
+					 const struct http_timeouts *timeouts,
 					 size_t request_size,
 					 size_t response_size)
 {
 	struct http_session *session = NULL;
-	if (attr == NULL) {
+	if (attr == NULL || timeouts == NULL) {
 		return NULL;
 	}
 	session = malloc(sizeof(*session));
 	if (session == NULL)
 		return NULL;
 	session->attr = attr;
-	session->timeout = timeout;
+	session->request_deadline = request_deadline;
+	session->timeouts = *timeouts;
+	session->connection = NULL;
+	session->phase = HTTP_PHASE_IDLE;
+	session->expired = false;
+	if (timer_wheel_init(&session->wheel, TIMER_WHEEL_TICK_MS) < 0) {
+		free(session);
+		return NULL;
+	}
+	timer_init(&session->timer, session_expired, session);
 	session->request = calloc(request_size, sizeof(char));
 	if (session->request == NULL) {
+		timer_wheel_destroy(&session->wheel);
 		free(session);
 		return NULL;
 	}
@@ -24,10 +47,28 @@ struct http_session *http_session_create(struct CONNECTION_attr *attr,
        	session->response = calloc(response_size, sizeof(char));
 	if (session->response == NULL) {
 		free(session->request);
+		timer_wheel_destroy(&session->wheel);
 		free(session);
 		return NULL;
 	}
 	session->response_size = response_size;
+	session->accept_raw = calloc(request_size, sizeof(char));
+	if (session->accept_raw == NULL) {
+		free(session->response);
+		free(session->request);
+		timer_wheel_destroy(&session->wheel);
+		free(session);
+		return NULL;
+	}
+	if (arena_init(&session->arena, HTTP_SESSION_ARENA_SIZE) < 0) {
+		free(session->accept_raw);
+		free(session->response);
+		free(session->request);
+		timer_wheel_destroy(&session->wheel);
+		free(session);
+		return NULL;
+	}
+	session->accept_valid = false;
 	return session;
 }
 
@@ -35,6 +76,9 @@ void http_session_destroy(struct http_session *session)
 {
 	if (session == NULL)
 		return;
+	timer_wheel_destroy(&session->wheel);
+	arena_destroy(&session->arena);
+	free(session->accept_raw);
 	free(session->response);
 	free(session->request);
 	free(session);
@@ -47,6 +91,21 @@ int http_start_connection(struct http_session *session)
 	session->connection = copen(session->attr);
 	if (session->connection == NULL)
 		return -1;
+	session->expired = false;
+	// parsed Accept header is cached only for the lifetime of a connection
+	session->accept_valid = false;
+	return 0;
+}
+
+int http_adopt_connection(struct http_session *session, int sock)
+{
+	if (session == NULL)
+		return -1;
+	session->connection = copenfd(session->attr, sock);
+	if (session->connection == NULL)
+		return -1;
+	session->expired = false;
+	session->accept_valid = false;
 	return 0;
 }
 
@@ -54,6 +113,7 @@ int http_close_connection(struct http_session *session)
 {
 	if (session == NULL)
 		return -1;
+	http_session_disarm(session);
 	return cclose(session->connection, O_RDWR);
 }
 
@@ -66,6 +126,48 @@ void reset_http_session(struct http_session *session)
 	memset(&session->req, 0, sizeof(session->req));
 }
 
+void http_session_arm(struct http_session *session, enum http_phase phase)
+{
+	int seconds = 0;
+	switch (phase) {
+	case HTTP_PHASE_IDLE:
+		seconds = session->timeouts.idle;
+		break;
+	case HTTP_PHASE_HEADER:
+		seconds = session->timeouts.header;
+		break;
+	case HTTP_PHASE_SEND:
+		seconds = session->timeouts.send;
+		break;
+	}
+	session->phase = phase;
+	timer_arm(&session->wheel, &session->timer, seconds * 1000);
+}
+
+void http_session_disarm(struct http_session *session)
+{
+	timer_cancel(&session->wheel, &session->timer);
+}
+
+void http_session_set_deadline(struct http_session *session)
+{
+	clock_gettime(CLOCK_MONOTONIC, &session->deadline);
+	session->deadline.tv_sec += session->request_deadline;
+}
+
+bool http_session_cancelled(struct http_session *session)
+{
+	struct timespec now = {0};
+	if (session == NULL)
+		return true;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > session->deadline.tv_sec ||
+	    (now.tv_sec == session->deadline.tv_sec &&
+	     now.tv_nsec >= session->deadline.tv_nsec))
+		return true;
+	return !cis_alive(session->connection);
+}
+
 int read_http_request(struct http_session *session)
 {
 	ssize_t rd = 0;
@@ -76,18 +178,26 @@ int read_http_request(struct http_session *session)
 	}
 	read = 0;
 	line = session->request;
+	http_session_arm(session, HTTP_PHASE_IDLE);
 	while (read < session->request_size) {
+		// the deadline armed aborts the wait, not a timeout of the read
 		rd = crecvline(session->connection,
 			       line,
 			       session->request_size - read,
-			       session->timeout);
-		if (rd < 0) {
-			return -1;
-		} else if (rd == 0) {
+			       -1);
+		if (rd <= 0) {
+			if (session->expired)
+				errno = ETIMEDOUT;
 			return -1;
 		} else {
-			if (strcmp(line, CRLF) == 0)
+			if (strcmp(line, CRLF) == 0) {
+				http_session_disarm(session);
+				http_session_set_deadline(session);
 				return 0;
+			}
+			// the request line arrived, the header has its own deadline
+			if (read == 0)
+				http_session_arm(session, HTTP_PHASE_HEADER);
 			read += rd;
 			line += rd;
 		}
@@ -105,9 +215,110 @@ static int parse_request_line(char *request_line, struct http_request *req)
 	req->url = strtok_r(NULL, " ", &saveptr);
 	if (req->url == NULL)
 		return -1;
+	return http_canonicalize_url(req->url, &req->query);
+}
+
+static int hex_value(char ch)
+{
+	if (ch >= '0' && ch <= '9')
+		return ch - '0';
+	if (ch >= 'a' && ch <= 'f')
+		return ch - 'a' + 10;
+	if (ch >= 'A' && ch <= 'F')
+		return ch - 'A' + 10;
+	return -1;
+}
+
+int http_canonicalize_url(char *url, char **query)
+{
+	// the path is written back at w, never ahead of r
+	size_t r = 1, w = 1;
+	size_t segment = 1;
+	int hi = 0, lo = 0;
+	char ch = 0;
+	if (url == NULL || query == NULL || url[0] != '/') {
+		errno = EINVAL;
+		return -1;
+	}
+	*query = NULL;
+	while (true) {
+		ch = url[r];
+		if (ch == '?' || ch == '#') {
+			if (ch == '?')
+				*query = url + r + 1;
+			ch = '\0';
+		} else if (ch == '%') {
+			hi = hex_value(url[r + 1]);
+			lo = (hi < 0) ? -1 : hex_value(url[r + 2]);
+			if (lo < 0 || (hi == 0 && lo == 0)) {
+				errno = EINVAL;
+				return -1;
+			}
+			ch = (char)(hi << 4 | lo);
+			r += 2;
+		}
+		if (ch != '/' && ch != '\0') {
+			url[w++] = ch;
+			++r;
+			continue;
+		}
+		// end of a segment, it spans from segment to w
+		if (w - segment == 1 && url[segment] == '.') {
+			w = segment;
+		} else if (w - segment == 2 && url[segment] == '.' && url[segment + 1] == '.') {
+			w = segment;
+			// drop the previous segment and its slash, the root stays
+			if (w > 1) {
+				for (--w; url[w - 1] != '/'; --w)
+					;
+			}
+			segment = w;
+		} else if (w > segment && ch == '/') {
+			url[w++] = '/';
+			segment = w;
+		}
+		if (ch == '\0')
+			break;
+		++r;
+	}
+	url[w] = '\0';
+	if (*query != NULL)
+		(*query)[strcspn(*query, "#")] = '\0';
 	return 0;
 }
 
+void http_request_set_header(struct http_request *req, const char *name, char *value)
+{
+	// field names are case-insensitive (RFC 7230 3.2)
+	if (strcasecmp(name, "Accept") == 0) {
+		req->accept = value;
+	} else if (strcasecmp(name, "Connection") == 0) {
+		req->connection = value;
+	} else if (strcasecmp(name, "Save-Data") == 0) {
+		req->save_data = value;
+	} else if (strcasecmp(name, "ECT") == 0) {
+		req->ect = value;
+	} else if (strcasecmp(name, "Downlink") == 0) {
+		req->downlink = value;
+	} else if (strcasecmp(name, "If-Match") == 0) {
+		req->if_match = value;
+	} else if (strcasecmp(name, "If-None-Match") == 0) {
+		req->if_none_match = value;
+	} else if (strcasecmp(name, "If-Modified-Since") == 0) {
+		req->if_modified_since = value;
+	} else if (strcasecmp(name, "If-Unmodified-Since") == 0) {
+		req->if_unmodified_since = value;
+	} else if (strcasecmp(name, "Range") == 0) {
+		req->range = value;
+	} else if (strcasecmp(name, "If-Range") == 0) {
+		req->if_range = value;
+	} else if (strcasecmp(name, "Upgrade") == 0) {
+		req->upgrade = value;
+	} else if (strcasecmp(name, "HTTP2-Settings") == 0) {
+		req->http2_settings = value;
+	}
+}
+
 static int parse_header(char *header, struct http_request *req)
 {
 	char *name = NULL;
@@ -122,11 +333,7 @@ static int parse_header(char *header, struct http_request *req)
 	// trim optioal whitespace
 	while (*value != '\0' && *value == ' ')
 		++value;
-	if (strcmp(name, "Accept") == 0) {
-		req->accept = value;
-	} else if (strcmp(name, "Connection") == 0) {
-		req->connection = value;
-	}
+	http_request_set_header(req, name, value);
 	return 0;
 }
 
@@ -147,30 +354,437 @@ int parse_http_request(char *raw, struct http_request *req)
 	return 0;
 }
 
-double search_weight_from_mime(const char *accept, const char *mime)
+static bool is_ows(char ch)
+{
+	return ch == ' ' || ch == '\t';
+}
+
+/**
+ * copy_token - copy in dest the token starting at src and ending at
+ * one of the char in delim or at '\0'
+ * return the pointer to the first char after the token or NULL if
+ * the token does not fit in dest.
+ */
+static const char *copy_token(char *dest, size_t dest_size, const char *src, const char *delim)
+{
+	size_t len = 0;
+	len = strcspn(src, delim);
+	if (len == 0 || len >= dest_size)
+		return NULL;
+	memcpy(dest, src, len);
+	dest[len] = '\0';
+	return src + len;
+}
+
+/**
+ * parse_media_range - parse a single element of the Accept list
+ * @range: string starting with the media range
+ * @mr: where to store the parsed range
+ * return the pointer to the end of the element (',' or '\0'),
+ * set mr->specificity to -1 if the element is malformed.
+ */
+static const char *parse_media_range(const char *range, struct media_range *mr)
 {
-	char *found = NULL;
-	char *column = NULL;
-	char *comma = NULL;
+	const char *ptr = NULL;
 	char *error_ptr = NULL;
-	double weight = 0;
+	mr->specificity = -1;
+	mr->q = 1.0;
+	ptr = copy_token(mr->type, HTTP_MEDIA_TYPE_SIZE, range, "/,; \t");
+	if (ptr == NULL || *ptr != '/')
+		return range + strcspn(range, ",");
+	ptr = copy_token(mr->subtype, HTTP_MEDIA_TYPE_SIZE, ptr + 1, ",; \t");
+	if (ptr == NULL)
+		return range + strcspn(range, ",");
+	// parameters: only q is meaningful, the others are skipped
+	while (*ptr != '\0' && *ptr != ',') {
+		while (is_ows(*ptr) || *ptr == ';')
+			++ptr;
+		if ((*ptr == 'q' || *ptr == 'Q') && ptr[1] == '=') {
+			mr->q = strtod(ptr + 2, &error_ptr);
+			if (error_ptr == ptr + 2 || mr->q < 0.0 || mr->q > 1.0)
+				return ptr + strcspn(ptr, ",");
+			ptr = error_ptr;
+		}
+		ptr += strcspn(ptr, ";,");
+	}
+	if (strcmp(mr->type, "*") == 0) {
+		// "*/subtype" is not a valid media range
+		if (strcmp(mr->subtype, "*") != 0)
+			return ptr;
+		mr->specificity = 0;
+	} else if (strcmp(mr->subtype, "*") == 0) {
+		mr->specificity = 1;
+	} else {
+		mr->specificity = 2;
+	}
+	return ptr;
+}
+
+static int media_range_cmp(const void *a, const void *b)
+{
+	const struct media_range *ma = a;
+	const struct media_range *mb = b;
+	if (ma->specificity != mb->specificity)
+		return mb->specificity - ma->specificity;
+	if (ma->q != mb->q)
+		return (ma->q < mb->q) ? 1 : -1;
+	return 0;
+}
+
+int parse_accept_header(const char *accept, struct accept_list *list)
+{
+	const char *ptr = NULL;
+	struct media_range *mr = NULL;
+	if (accept == NULL || list == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	list->n = 0;
+	ptr = accept;
+	while (*ptr != '\0' && list->n < HTTP_MAX_MEDIA_RANGES) {
+		while (is_ows(*ptr) || *ptr == ',')
+			++ptr;
+		if (*ptr == '\0')
+			break;
+		mr = &list->ranges[list->n];
+		ptr = parse_media_range(ptr, mr);
+		if (mr->specificity >= 0)
+			list->n++;
+	}
+	qsort(list->ranges, list->n, sizeof(*list->ranges), media_range_cmp);
+	return 0;
+}
+
+static bool media_range_match(const struct media_range *mr,
+			      const char *type, size_t type_len,
+			      const char *subtype, size_t subtype_len)
+{
+	if (mr->specificity == 0)
+		return true;
+	if (strlen(mr->type) != type_len ||
+	    strncasecmp(mr->type, type, type_len) != 0)
+		return false;
+	if (mr->specificity == 1)
+		return true;
+	return strlen(mr->subtype) == subtype_len &&
+		strncasecmp(mr->subtype, subtype, subtype_len) == 0;
+}
+
+double accept_list_weight(const struct accept_list *list, const char *mime)
+{
+	const char *subtype = NULL;
+	size_t type_len = 0;
+	size_t subtype_len = 0;
+	if (list == NULL || mime == NULL)
+		return -1;
+	type_len = strcspn(mime, "/");
+	if (mime[type_len] != '/')
+		return -1;
+	subtype = mime + type_len + 1;
+	subtype_len = strcspn(subtype, "; \t");
+	// ranges are sorted, the first match is the most specific one
+	for (size_t i = 0; i < list->n; ++i) {
+		if (media_range_match(&list->ranges[i],
+				      mime, type_len,
+				      subtype, subtype_len))
+			return list->ranges[i].q;
+	}
+	return -1;
+}
+
+double search_weight_from_mime(const char *accept, const char *mime)
+{
+	struct accept_list list;
 	if (accept == NULL || mime == NULL)
 		return -1;
-	found = strstr(accept, mime);
-	if (found == NULL)
+	if (parse_accept_header(accept, &list) < 0)
 		return -1;
-	column = strchr(found, ';');
-	if (column == NULL)
+	return accept_list_weight(&list, mime);
+}
+
+const struct accept_list *http_session_accept(struct http_session *session)
+{
+	size_t len = 0;
+	if (session == NULL || session->req.accept == NULL)
+		return NULL;
+	if (session->accept_valid &&
+	    strcmp(session->accept_raw, session->req.accept) == 0)
+		return &session->accept_list;
+	len = strlen(session->req.accept);
+	if (len >= session->request_size)
+		return NULL;
+	if (parse_accept_header(session->req.accept, &session->accept_list) < 0) {
+		session->accept_valid = false;
+		return NULL;
+	}
+	memcpy(session->accept_raw, session->req.accept, len + 1);
+	session->accept_valid = true;
+	return &session->accept_list;
+}
+
+void parse_client_hints(const struct http_request *req, struct client_hints *hints)
+{
+	char *error_ptr = NULL;
+	if (req == NULL || hints == NULL)
+		return;
+	hints->save_data = false;
+	hints->ect = ECT_UNKNOWN;
+	hints->downlink = -1.0;
+	if (req->save_data != NULL)
+		hints->save_data = strncasecmp(req->save_data, "on", 2) == 0;
+	if (req->ect != NULL) {
+		if (strncasecmp(req->ect, "slow-2g", 7) == 0)
+			hints->ect = ECT_SLOW_2G;
+		else if (strncasecmp(req->ect, "2g", 2) == 0)
+			hints->ect = ECT_2G;
+		else if (strncasecmp(req->ect, "3g", 2) == 0)
+			hints->ect = ECT_3G;
+		else if (strncasecmp(req->ect, "4g", 2) == 0)
+			hints->ect = ECT_4G;
+	}
+	if (req->downlink != NULL) {
+		hints->downlink = strtod(req->downlink, &error_ptr);
+		if (error_ptr == req->downlink || hints->downlink < 0.0)
+			hints->downlink = -1.0;
+	}
+}
+
+int http_format_date(time_t t, char *buf)
+{
+	struct tm tm = {0};
+	if (buf == NULL || gmtime_r(&t, &tm) == NULL)
+		return -1;
+	if (strftime(buf, HTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &tm) == 0)
+		return -1;
+	return 0;
+}
+
+static int parse_month(const char *month)
+{
+	static const char *months[] = {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+	};
+	for (int i = 0; i < 12; ++i) {
+		if (strcmp(month, months[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+int http_parse_date(const char *date, time_t *t)
+{
+	struct tm tm = {0};
+	char month[4] = {0};
+	int n = 0;
+	if (date == NULL || t == NULL)
 		return -1;
-	comma = strchr(found, ',');
-	if (comma != NULL && column > comma)
+	// IMF-fixdate: Sun, 06 Nov 1994 08:49:37 GMT
+	if (sscanf(date, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT%n",
+		   &tm.tm_mday, month, &tm.tm_year,
+		   &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6 && n > 0) {
+		tm.tm_year -= 1900;
+	// rfc850-date: Sunday, 06-Nov-94 08:49:37 GMT
+	} else if (sscanf(date, "%*[A-Za-z], %2d-%3s-%2d %2d:%2d:%2d GMT%n",
+			  &tm.tm_mday, month, &tm.tm_year,
+			  &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6 && n > 0) {
+		// two digit years are taken in the past fifty years (RFC 7231 7.1.1.1)
+		if (tm.tm_year < 70)
+			tm.tm_year += 100;
+	// asctime-date: Sun Nov  6 08:49:37 1994
+	} else if (sscanf(date, "%*3s %3s %2d %2d:%2d:%2d %4d%n",
+			  month, &tm.tm_mday, &tm.tm_hour,
+			  &tm.tm_min, &tm.tm_sec, &tm.tm_year, &n) == 6 && n > 0) {
+		tm.tm_year -= 1900;
+	} else {
 		return -1;
-	if (strncmp(column + 1, "q=", 2) != 0)
+	}
+	tm.tm_mon = parse_month(month);
+	if (tm.tm_mon < 0 || tm.tm_mday < 1 || tm.tm_mday > 31 ||
+	    tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60)
 		return -1;
-	weight = strtod(column + 3, &error_ptr);
-	if (error_ptr == NULL)
+	*t = timegm(&tm);
+	return 0;
+}
+
+/**
+ * etag_list_match - return true if etag is in the entity-tag list of a
+ * conditional header
+ * @list: value of the header, "*" matches any entity-tag
+ * @etag: strong entity-tag of the representation
+ * @weak: if true the weak comparison is used, a "W/" tag in list
+ * matches, otherwise it never does (RFC 7232 2.3.2)
+ */
+static bool etag_list_match(const char *list, const char *etag, bool weak)
+{
+	const char *end = NULL;
+	size_t etag_len = 0;
+	bool is_weak = false;
+	etag_len = strlen(etag);
+	while (*list != '\0') {
+		while (is_ows(*list) || *list == ',')
+			++list;
+		if (*list == '*')
+			return true;
+		is_weak = strncmp(list, "W/", 2) == 0;
+		if (is_weak)
+			list += 2;
+		if (*list != '"')
+			return false;
+		end = strchr(list + 1, '"');
+		if (end == NULL)
+			return false;
+		++end;
+		if ((weak || !is_weak) && (size_t)(end - list) == etag_len &&
+		    strncmp(list, etag, etag_len) == 0)
+			return true;
+		list = end;
+	}
+	return false;
+}
+
+enum status_code http_check_preconditions(const struct http_request *req,
+					  const char *etag,
+					  time_t last_modified)
+{
+	time_t since = 0;
+	bool safe = false;
+	if (req == NULL || etag == NULL)
+		return HTTP_OK;
+	if (req->if_match != NULL) {
+		if (!etag_list_match(req->if_match, etag, false))
+			return HTTP_PRECONDITION_FAILED;
+	} else if (req->if_unmodified_since != NULL &&
+		   http_parse_date(req->if_unmodified_since, &since) == 0) {
+		if (last_modified > since)
+			return HTTP_PRECONDITION_FAILED;
+	}
+	// only GET and HEAD can be answered with 304
+	safe = req->method != NULL &&
+		(strcmp(req->method, "GET") == 0 || strcmp(req->method, "HEAD") == 0);
+	if (req->if_none_match != NULL) {
+		if (etag_list_match(req->if_none_match, etag, true))
+			return safe ? HTTP_NOT_MODIFIED : HTTP_PRECONDITION_FAILED;
+	} else if (safe && req->if_modified_since != NULL &&
+		   http_parse_date(req->if_modified_since, &since) == 0) {
+		if (last_modified <= since)
+			return HTTP_NOT_MODIFIED;
+	}
+	return HTTP_OK;
+}
+
+/**
+ * parse_offset - parse the decimal offset at str
+ * return the pointer to the first char after the digits, NULL if there
+ * is no digit or if the offset overflows.
+ */
+static const char *parse_offset(const char *str, off_t *offset)
+{
+	off_t value = 0;
+	const char *ptr = str;
+	for (; *ptr >= '0' && *ptr <= '9'; ++ptr) {
+		if (value > (INT64_MAX - (*ptr - '0')) / 10)
+			return NULL;
+		value = value * 10 + (*ptr - '0');
+	}
+	if (ptr == str)
+		return NULL;
+	*offset = value;
+	return ptr;
+}
+
+static int byte_range_cmp(const void *a, const void *b)
+{
+	const struct byte_range *ra = a;
+	const struct byte_range *rb = b;
+	if (ra->first < rb->first)
 		return -1;
-	return weight;
+	return ra->first > rb->first;
+}
+
+int http_parse_range(const char *range, off_t size, struct byte_range *ranges)
+{
+	off_t first = 0, last = 0;
+	size_t n = 0, merged = 0;
+	int n_specs = 0;
+	if (range == NULL || ranges == NULL || size < 0)
+		return -1;
+	if (strncasecmp(range, "bytes=", 6) != 0)
+		return -1;
+	range += 6;
+	while (*range != '\0') {
+		while (is_ows(*range))
+			++range;
+		if (*range == ',') {
+			++range;
+			continue;
+		}
+		if (++n_specs > HTTP_MAX_RANGES)
+			return -1;
+		if (*range == '-') {
+			// suffix-byte-range-spec, the last bytes of the file
+			range = parse_offset(range + 1, &last);
+			if (range == NULL)
+				return -1;
+			if (last == 0 || size == 0)
+				continue;
+			first = (last < size) ? size - last : 0;
+			last = size - 1;
+		} else {
+			range = parse_offset(range, &first);
+			if (range == NULL || *range != '-')
+				return -1;
+			++range;
+			last = size - 1;
+			if (*range >= '0' && *range <= '9') {
+				range = parse_offset(range, &last);
+				if (range == NULL)
+					return -1;
+				if (last < first)
+					return -1;
+				if (last >= size)
+					last = size - 1;
+			}
+			if (first >= size)
+				continue;
+		}
+		ranges[n].first = first;
+		ranges[n].last = last;
+		++n;
+		while (is_ows(*range))
+			++range;
+		if (*range != ',' && *range != '\0')
+			return -1;
+	}
+	if (n_specs == 0)
+		return -1;
+	if (n == 0)
+		return 0;
+	qsort(ranges, n, sizeof(*ranges), byte_range_cmp);
+	for (size_t i = 1; i < n; ++i) {
+		if (ranges[i].first <= ranges[merged].last + 1) {
+			if (ranges[i].last > ranges[merged].last)
+				ranges[merged].last = ranges[i].last;
+		} else {
+			ranges[++merged] = ranges[i];
+		}
+	}
+	return merged + 1;
+}
+
+bool http_if_range_match(const struct http_request *req,
+			 const char *etag,
+			 time_t last_modified)
+{
+	time_t date = 0;
+	if (req == NULL || req->if_range == NULL)
+		return true;
+	if (*req->if_range == '"')
+		return etag != NULL && strcmp(req->if_range, etag) == 0;
+	// a date is a strong validator only if it is the exact mtime
+	if (http_parse_date(req->if_range, &date) < 0)
+		return false;
+	return date == last_modified;
 }
 
 bool is_keep_alive(char *connection)
@@ -190,10 +804,20 @@ static char *get_status_line(enum status_code code)
 	switch(code) {
 	case HTTP_OK:
 		return "HTTP/1.1 200 OK\r\n";
+	case HTTP_PARTIAL_CONTENT:
+		return "HTTP/1.1 206 PARTIAL CONTENT\r\n";
+	case HTTP_NOT_MODIFIED:
+		return "HTTP/1.1 304 NOT MODIFIED\r\n";
 	case HTTP_BAD_REQUEST:
-		return "HTTP/1.1 402 BAD REQUEST\r\n";
+		return "HTTP/1.1 400 BAD REQUEST\r\n";
 	case HTTP_NOT_FOUND:
 		return "HTTP/1.1 404 NOT FOUND\r\n";
+	case HTTP_METHOD_NOT_ALLOWED:
+		return "HTTP/1.1 405 METHOD NOT ALLOWED\r\n";
+	case HTTP_PRECONDITION_FAILED:
+		return "HTTP/1.1 412 PRECONDITION FAILED\r\n";
+	case HTTP_RANGE_NOT_SATISFIABLE:
+		return "HTTP/1.1 416 RANGE NOT SATISFIABLE\r\n";
 	case HTTP_INTERNAL_SERVER_ERROR:
 		return "HTTP/1.1 500 INTERNAL SERVER ERROR\r\n";
 	default:
@@ -220,24 +844,28 @@ static ssize_t write_header(char *buf, size_t buf_size, const char *name, const
 	return len;
 }
 
+const char *http_current_date(void)
+{
+	static __thread time_t last = 0;
+	static __thread char date[HTTP_DATE_SIZE];
+	time_t now = 0;
+	now = time(NULL);
+	if (now != last) {
+		if (http_format_date(now, date) < 0)
+			return NULL;
+		last = now;
+	}
+	return date;
+}
+
 static int write_date(char *buf, size_t buf_size)
 {
-	char date[1024] = {0};
-	time_t current_time = 0;
-	struct tm *local = NULL;
-	int err = 0;
-	char *ptr = NULL;
+	const char *date = NULL;
 	if (buf == NULL)
 		return -1;
-	current_time = time(NULL);
-	local = gmtime(&current_time);
-	err = snprintf(date, 1024, "%s", asctime(local));
-	if (err > 1024) // extremely unlikely 
-		return -1;
-	ptr = strchr(date, '\n');
-	if (ptr == NULL) // should never happen
+	date = http_current_date();
+	if (date == NULL)
 		return -1;
-	*ptr = '\0';
 	return write_header(buf, buf_size, "Date", date);
 }
 
@@ -245,7 +873,9 @@ size_t generate_response_header(char *buf,
 				size_t buf_size,
 				enum status_code code,
 				const char *content_type,
-				const char *content_lenght)
+				const char *content_lenght,
+				const struct http_header *headers,
+				size_t n_headers)
 {
 	char *status_line = NULL;
 	size_t len = 0;
@@ -274,12 +904,21 @@ size_t generate_response_header(char *buf,
 	if (content_lenght) {
 		err = write_header(buf + len,
 				   buf_size - len,
-				   "Content-Lenght",
+				   "Content-Length",
 				   content_lenght);
 		if (err < 0)
 			return 0;
 		len += err;
 	}
+	for (size_t i = 0; headers != NULL && i < n_headers; ++i) {
+		err = write_header(buf + len,
+				   buf_size - len,
+				   headers[i].name,
+				   headers[i].value);
+		if (err < 0)
+			return 0;
+		len += err;
+	}
 	// add ending CRLF
 	if (len + CRLF_LEN < buf_size) {
 		strncpy(buf + len, CRLF, CRLF_LEN);
@@ -291,3 +930,93 @@ size_t generate_response_header(char *buf,
 	
 	
 }
+
+static void http_header_block_free(struct http_header_block *block)
+{
+	if (block->slab != NULL)
+		slab_free(block->slab, block, block->size);
+	else
+		free(block);
+}
+
+struct http_header_block *http_header_block_create(struct slab *slab,
+						   enum status_code code,
+						   const char *content_type,
+						   const char *content_lenght,
+						   const struct http_header *headers,
+						   size_t n_headers,
+						   int max_age)
+{
+	struct http_header_block *block = NULL;
+	const char *expires = NULL;
+	size_t size = 0;
+	// status line, Date, names, separators and ending CRLF
+	size = 128;
+	if (content_type != NULL)
+		size += strlen("Content-Type: " CRLF) + strlen(content_type);
+	if (content_lenght != NULL)
+		size += strlen("Content-Length: " CRLF) + strlen(content_lenght);
+	for (size_t i = 0; headers != NULL && i < n_headers; ++i)
+		size += strlen(headers[i].name) + strlen(headers[i].value) + 4;
+	// the buf follows the block, a single object to allocate and free
+	size += sizeof(*block);
+	if (slab != NULL)
+		block = slab_alloc(slab, size);
+	else
+		block = malloc(size);
+	if (block == NULL)
+		return NULL;
+	block->slab = slab;
+	block->size = size;
+	block->buf = (char *)(block + 1);
+	block->len = generate_response_header(block->buf, size - sizeof(*block), code,
+					      content_type, content_lenght, headers, n_headers);
+	if (block->len == 0) {
+		http_header_block_free(block);
+		return NULL;
+	}
+	block->date = strlen(get_status_line(code)) + strlen("Date: ");
+	expires = strstr(block->buf, CRLF "Expires: ");
+	block->expires = (expires != NULL) ? expires + strlen(CRLF "Expires: ") - block->buf : 0;
+	block->max_age = max_age;
+	block->refs = 1;
+	return block;
+}
+
+struct http_header_block *http_header_block_get(struct http_header_block *block)
+{
+	if (block != NULL)
+		__atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+	return block;
+}
+
+void http_header_block_put(struct http_header_block *block)
+{
+	if (block == NULL)
+		return;
+	if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	http_header_block_free(block);
+}
+
+size_t http_header_block_write(const struct http_header_block *block,
+			       char *buf,
+			       size_t buf_size)
+{
+	const char *date = NULL;
+	char expires[HTTP_DATE_SIZE] = {0};
+	if (block == NULL || buf == NULL || block->len > buf_size)
+		return 0;
+	date = http_current_date();
+	if (date == NULL)
+		return 0;
+	memcpy(buf, block->buf, block->len);
+	// an IMF-fixdate has a fixed length, the slots are overwritten in place
+	memcpy(buf + block->date, date, HTTP_DATE_SIZE - 1);
+	if (block->expires > 0) {
+		if (http_format_date(time(NULL) + block->max_age, expires) < 0)
+			return 0;
+		memcpy(buf + block->expires, expires, HTTP_DATE_SIZE - 1);
+	}
+	return block->len;
+}
@@ -0,0 +1,886 @@
+#include "http2.h"
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+/* largest SETTINGS_MAX_FRAME_SIZE a peer can set */
+#define MAX_FRAME_SIZE_LIMIT 0xffffff
+/* size of a setting in a SETTINGS frame */
+#define SETTING_SIZE 6
+/* max size of the HTTP2-Settings header once decoded */
+#define UPGRADE_SETTINGS_SIZE 256
+
+#define UPGRADE_RESPONSE "HTTP/1.1 101 SWITCHING PROTOCOLS\r\n" \
+	"Connection: Upgrade\r\n" \
+	"Upgrade: " HTTP2_UPGRADE_TOKEN "\r\n\r\n"
+
+struct frame_header {
+	uint32_t length;
+	uint8_t type;
+	uint8_t flags;
+	uint32_t stream;
+};
+
+/**
+ * http2_stream - a stream whose response body is being sent
+ * @id: stream identifier
+ * @window: flow control window of the peer for the stream
+ * @remote_closed: true once the peer ended its side of the stream
+ * @fd: file of the body
+ * @offset: offset in fd of the next byte to send
+ * @remaining: bytes of the body still to send
+ * @list: entry of http2_connection streams, or of its free streams
+ * once the body is sent
+ */
+struct http2_stream {
+	uint32_t id;
+	int64_t window;
+	bool remote_closed;
+	int fd;
+	off_t offset;
+	size_t remaining;
+	struct list_head list;
+};
+
+/**
+ * http2_connection - state of an HTTP/2 connection
+ * @session: http_session of the connection
+ * @handler: handler of the requests
+ * @arg: argument of handler
+ * @decoder: HPACK dynamic table of the requests
+ * @streams: streams with a body to send, in the order they are served
+ * @n_streams: number of element in streams
+ * @last_stream: highest stream opened by the peer
+ * @window: flow control window of the peer for the connection
+ * @initial_window: SETTINGS_INITIAL_WINDOW_SIZE of the peer
+ * @max_frame: SETTINGS_MAX_FRAME_SIZE of the peer
+ * @frame: payload of the last frame read
+ * @block: header block being received, then the one being sent
+ * @block_len: size of the header block received so far
+ * @block_stream: stream of the header block, 0 if none is in progress
+ * @block_end_stream: END_STREAM flag of the HEADERS frame of the block
+ * @fields_buf: storage of the decoded fields
+ * @fields: decoded fields of the last request
+ * @goaway: true once the peer sent GOAWAY, no new stream is served
+ * @idle: true while the idle deadline runs, it restarts only with a
+ * new request, so frames like PING can't keep the connection
+ * @error: error of the connection to send in GOAWAY
+ */
+struct http2_connection {
+	struct http_session *session;
+	http2_handler handler;
+	void *arg;
+	struct hpack_table decoder;
+	struct list_head streams;
+	struct list_head free_streams;
+	int n_streams;
+	uint32_t last_stream;
+	int64_t window;
+	uint32_t initial_window;
+	uint32_t max_frame;
+	unsigned char frame[HTTP2_MAX_FRAME_SIZE];
+	unsigned char block[HTTP2_MAX_HEADER_BLOCK];
+	size_t block_len;
+	uint32_t block_stream;
+	bool block_end_stream;
+	char fields_buf[HTTP2_MAX_HEADER_BLOCK];
+	struct hpack_field fields[HTTP2_MAX_FIELDS];
+	bool goaway;
+	bool idle;
+	enum http2_error error;
+};
+
+static uint32_t get32(const unsigned char *buf)
+{
+	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+		((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static void put32(unsigned char *buf, uint32_t value)
+{
+	buf[0] = value >> 24;
+	buf[1] = value >> 16;
+	buf[2] = value >> 8;
+	buf[3] = value;
+}
+
+bool http2_is_preface(const struct http_session *session)
+{
+	if (session == NULL || session->request == NULL)
+		return false;
+	return strncmp(session->request, HTTP2_PREFACE_LINE CRLF,
+		       strlen(HTTP2_PREFACE_LINE CRLF)) == 0;
+}
+
+bool http2_is_upgrade(const struct http_request *req)
+{
+	const char *token = NULL;
+	size_t len = strlen(HTTP2_UPGRADE_TOKEN);
+	if (req == NULL || req->upgrade == NULL || req->http2_settings == NULL)
+		return false;
+	// the header is a list of protocols, h2c has no version
+	for (token = req->upgrade; *token != '\0'; ++token) {
+		if (strncasecmp(token, HTTP2_UPGRADE_TOKEN, len) == 0 &&
+		    (token == req->upgrade || token[-1] == ' ' || token[-1] == ',') &&
+		    (token[len] == '\0' || token[len] == ',' || token[len] == ' '))
+			return true;
+	}
+	return false;
+}
+
+static int send_frame(struct http2_connection *h2,
+		      enum http2_frame_type type,
+		      uint8_t flags,
+		      uint32_t stream,
+		      const unsigned char *payload,
+		      size_t len)
+{
+	unsigned char header[HTTP2_FRAME_HEADER_SIZE];
+	header[0] = len >> 16;
+	header[1] = len >> 8;
+	header[2] = len;
+	header[3] = type;
+	header[4] = flags;
+	put32(header + 5, stream & HTTP2_MAX_WINDOW);
+	if (csend(h2->session->connection, (char *)header, sizeof(header)) < 0)
+		return -1;
+	if (len > 0 && csend(h2->session->connection, (char *)payload, len) < 0)
+		return -1;
+	return 0;
+}
+
+static int send_rst_stream(struct http2_connection *h2, uint32_t stream, enum http2_error error)
+{
+	unsigned char payload[4];
+	put32(payload, error);
+	return send_frame(h2, HTTP2_RST_STREAM, 0, stream, payload, sizeof(payload));
+}
+
+static int send_goaway(struct http2_connection *h2, enum http2_error error)
+{
+	unsigned char payload[8];
+	put32(payload, h2->last_stream);
+	put32(payload + 4, error);
+	if (send_frame(h2, HTTP2_GOAWAY, 0, 0, payload, sizeof(payload)) < 0)
+		return -1;
+	return cflush(h2->session->connection);
+}
+
+static int send_window_update(struct http2_connection *h2, uint32_t stream, uint32_t increment)
+{
+	unsigned char payload[4];
+	put32(payload, increment);
+	return send_frame(h2, HTTP2_WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+static int send_settings(struct http2_connection *h2)
+{
+	unsigned char payload[SETTING_SIZE];
+	payload[0] = 0;
+	payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+	put32(payload + 2, HTTP2_MAX_STREAMS);
+	return send_frame(h2, HTTP2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+static struct http2_stream *find_stream(struct http2_connection *h2, uint32_t id)
+{
+	struct http2_stream *stream = NULL;
+	list_for_each_entry(stream, &h2->streams, list) {
+		if (stream->id == id)
+			return stream;
+	}
+	return NULL;
+}
+
+static void destroy_stream(struct http2_connection *h2, struct http2_stream *stream)
+{
+	close(stream->fd);
+	// kept for the next response, the connection frees them at its end
+	list_move(&stream->list, &h2->free_streams);
+	h2->n_streams--;
+}
+
+/**
+ * apply_settings - apply the settings sent by the peer
+ * return the error of the connection, HTTP2_NO_ERROR if they are valid.
+ */
+static enum http2_error apply_settings(struct http2_connection *h2,
+				       const unsigned char *payload,
+				       size_t len)
+{
+	struct http2_stream *stream = NULL;
+	uint16_t id = 0;
+	uint32_t value = 0;
+	int64_t delta = 0;
+	if (len % SETTING_SIZE != 0)
+		return HTTP2_FRAME_SIZE_ERROR;
+	for (size_t i = 0; i < len; i += SETTING_SIZE) {
+		id = (payload[i] << 8) | payload[i + 1];
+		value = get32(payload + i + 2);
+		switch (id) {
+		case SETTINGS_ENABLE_PUSH:
+			if (value > 1)
+				return HTTP2_PROTOCOL_ERROR;
+			break;
+		case SETTINGS_INITIAL_WINDOW_SIZE:
+			if (value > HTTP2_MAX_WINDOW)
+				return HTTP2_FLOW_CONTROL_ERROR;
+			// the change applies to the windows of the open streams
+			delta = (int64_t)value - h2->initial_window;
+			list_for_each_entry(stream, &h2->streams, list) {
+				stream->window += delta;
+				if (stream->window > HTTP2_MAX_WINDOW)
+					return HTTP2_FLOW_CONTROL_ERROR;
+			}
+			h2->initial_window = value;
+			break;
+		case SETTINGS_MAX_FRAME_SIZE:
+			if (value < HTTP2_MAX_FRAME_SIZE || value > MAX_FRAME_SIZE_LIMIT)
+				return HTTP2_PROTOCOL_ERROR;
+			h2->max_frame = value;
+			break;
+		default:
+			// our encoder never uses the dynamic table, so
+			// SETTINGS_HEADER_TABLE_SIZE needs no action
+			break;
+		}
+	}
+	return HTTP2_NO_ERROR;
+}
+
+/**
+ * base64url_decode - decode the base64url value of HTTP2-Settings
+ * return the size of the decoded value, -1 if it is not valid.
+ */
+static ssize_t base64url_decode(const char *src, unsigned char *dest, size_t dest_size)
+{
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+	const char *ptr = NULL;
+	uint32_t acc = 0;
+	int bits = 0;
+	size_t len = 0;
+	for (; *src != '\0' && *src != '='; ++src) {
+		ptr = strchr(alphabet, *src);
+		if (ptr == NULL)
+			return -1;
+		acc = (acc << 6) | (ptr - alphabet);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (len >= dest_size)
+				return -1;
+			dest[len++] = acc >> bits;
+		}
+	}
+	return len;
+}
+
+/**
+ * send_headers - send the status and the headers of a response
+ * the header block is split in a HEADERS frame and as many CONTINUATION
+ * frames as the max frame size of the peer requires.
+ */
+static int send_headers(struct http2_connection *h2,
+			uint32_t stream,
+			const struct http2_response *resp,
+			bool end_stream)
+{
+	char status[8] = {0};
+	const char *date = NULL;
+	ssize_t len = 0;
+	size_t block_len = 0;
+	size_t sent = 0, chunk = 0;
+	uint8_t flags = 0;
+	snprintf(status, sizeof(status), "%d", resp->code);
+	len = hpack_encode(h2->block, sizeof(h2->block), ":status", status);
+	if (len < 0)
+		return -1;
+	block_len = len;
+	date = http_current_date();
+	if (date != NULL) {
+		len = hpack_encode(h2->block + block_len, sizeof(h2->block) - block_len,
+				   "date", date);
+		if (len < 0)
+			return -1;
+		block_len += len;
+	}
+	for (size_t i = 0; i < resp->n_headers; ++i) {
+		// connection-specific fields are not allowed (RFC 7540 8.1.2.2)
+		if (strcasecmp(resp->headers[i].name, "Connection") == 0 ||
+		    strcasecmp(resp->headers[i].name, "Keep-Alive") == 0 ||
+		    strcasecmp(resp->headers[i].name, "Transfer-Encoding") == 0)
+			continue;
+		len = hpack_encode(h2->block + block_len, sizeof(h2->block) - block_len,
+				   resp->headers[i].name, resp->headers[i].value);
+		if (len < 0)
+			return -1;
+		block_len += len;
+	}
+	do {
+		chunk = block_len - sent;
+		if (chunk > h2->max_frame)
+			chunk = h2->max_frame;
+		flags = (sent + chunk == block_len) ? FLAG_END_HEADERS : 0;
+		if (sent == 0 && end_stream)
+			flags |= FLAG_END_STREAM;
+		if (send_frame(h2, (sent == 0) ? HTTP2_HEADERS : HTTP2_CONTINUATION,
+			       flags, stream, h2->block + sent, chunk) < 0)
+			return -1;
+		sent += chunk;
+	} while (sent < block_len);
+	return 0;
+}
+
+/**
+ * respond - answer the request stored in session->req on a stream
+ * @remote_closed: true if the peer already ended its side of the stream
+ */
+static int respond(struct http2_connection *h2, uint32_t id, bool remote_closed)
+{
+	struct http2_response resp = {0};
+	struct http2_stream *stream = NULL;
+	bool has_body = false;
+	int res = 0;
+	resp.fd = -1;
+	// the request deadline covers the handler, then sending starts
+	http_session_disarm(h2->session);
+	h2->idle = false;
+	http_session_set_deadline(h2->session);
+	if (h2->handler(h2->session, &resp, h2->arg) < 0) {
+		if (resp.release != NULL)
+			resp.release(resp.arg);
+		if (resp.fd >= 0)
+			close(resp.fd);
+		return send_rst_stream(h2, id, HTTP2_INTERNAL_ERROR);
+	}
+	has_body = resp.fd >= 0 && resp.count > 0;
+	http_session_arm(h2->session, HTTP_PHASE_SEND);
+	res = send_headers(h2, id, &resp, !has_body);
+	if (resp.release != NULL)
+		resp.release(resp.arg);
+	if (res < 0 || !has_body) {
+		if (resp.fd >= 0)
+			close(resp.fd);
+		return res;
+	}
+	if (!list_empty(&h2->free_streams)) {
+		stream = list_first_entry(&h2->free_streams, struct http2_stream, list);
+		list_del(&stream->list);
+	} else {
+		stream = malloc(sizeof(*stream));
+	}
+	if (stream == NULL) {
+		close(resp.fd);
+		return send_rst_stream(h2, id, HTTP2_INTERNAL_ERROR);
+	}
+	stream->id = id;
+	stream->window = h2->initial_window;
+	stream->remote_closed = remote_closed;
+	stream->fd = resp.fd;
+	stream->offset = resp.offset;
+	stream->remaining = resp.count;
+	list_add_tail(&stream->list, &h2->streams);
+	h2->n_streams++;
+	return 0;
+}
+
+/**
+ * header_block_done - decode the header block just completed and serve
+ * its request
+ * a block on a stream already opened is a trailer, it is decoded to keep
+ * the decoder in sync and then dropped.
+ */
+static int header_block_done(struct http2_connection *h2)
+{
+	struct http_request *req = &h2->session->req;
+	struct http2_stream *stream = NULL;
+	uint32_t id = h2->block_stream;
+	int n = 0;
+	h2->block_stream = 0;
+	n = hpack_decode(&h2->decoder, h2->block, h2->block_len,
+			 h2->fields_buf, sizeof(h2->fields_buf),
+			 h2->fields, HTTP2_MAX_FIELDS);
+	h2->block_len = 0;
+	if (n < 0) {
+		h2->error = HTTP2_COMPRESSION_ERROR;
+		return -1;
+	}
+	if (id <= h2->last_stream) {
+		stream = find_stream(h2, id);
+		if (stream != NULL && h2->block_end_stream)
+			stream->remote_closed = true;
+		return 0;
+	}
+	h2->last_stream = id;
+	if (h2->goaway || h2->n_streams >= HTTP2_MAX_STREAMS)
+		return send_rst_stream(h2, id, HTTP2_REFUSED_STREAM);
+	memset(req, 0, sizeof(*req));
+	for (int i = 0; i < n; ++i) {
+		if (strcmp(h2->fields[i].name, ":method") == 0)
+			req->method = (char *)h2->fields[i].value;
+		else if (strcmp(h2->fields[i].name, ":path") == 0)
+			req->url = (char *)h2->fields[i].value;
+		else if (h2->fields[i].name[0] != ':')
+			http_request_set_header(req, h2->fields[i].name,
+						(char *)h2->fields[i].value);
+	}
+	if (req->method == NULL || req->url == NULL ||
+	    http_canonicalize_url(req->url, &req->query) < 0)
+		return send_rst_stream(h2, id, HTTP2_PROTOCOL_ERROR);
+	return respond(h2, id, h2->block_end_stream);
+}
+
+static int append_block(struct http2_connection *h2, const unsigned char *data, size_t len)
+{
+	if (len > sizeof(h2->block) - h2->block_len) {
+		h2->error = HTTP2_ENHANCE_YOUR_CALM;
+		return -1;
+	}
+	memcpy(h2->block + h2->block_len, data, len);
+	h2->block_len += len;
+	return 0;
+}
+
+static int process_headers(struct http2_connection *h2, const struct frame_header *hdr)
+{
+	const unsigned char *payload = h2->frame;
+	size_t len = hdr->length;
+	uint8_t pad = 0;
+	if (hdr->stream == 0 || hdr->stream % 2 == 0) {
+		h2->error = HTTP2_PROTOCOL_ERROR;
+		return -1;
+	}
+	if (hdr->flags & FLAG_PADDED) {
+		if (len < 1) {
+			h2->error = HTTP2_FRAME_SIZE_ERROR;
+			return -1;
+		}
+		pad = payload[0];
+		++payload;
+		--len;
+	}
+	if (hdr->flags & FLAG_PRIORITY) {
+		if (len < 5) {
+			h2->error = HTTP2_FRAME_SIZE_ERROR;
+			return -1;
+		}
+		payload += 5;
+		len -= 5;
+	}
+	if (pad > len) {
+		h2->error = HTTP2_PROTOCOL_ERROR;
+		return -1;
+	}
+	len -= pad;
+	h2->block_len = 0;
+	if (append_block(h2, payload, len) < 0)
+		return -1;
+	h2->block_stream = hdr->stream;
+	h2->block_end_stream = hdr->flags & FLAG_END_STREAM;
+	if (hdr->flags & FLAG_END_HEADERS)
+		return header_block_done(h2);
+	return 0;
+}
+
+static int process_window_update(struct http2_connection *h2, const struct frame_header *hdr)
+{
+	struct http2_stream *stream = NULL;
+	uint32_t increment = 0;
+	if (hdr->length != 4) {
+		h2->error = HTTP2_FRAME_SIZE_ERROR;
+		return -1;
+	}
+	increment = get32(h2->frame) & HTTP2_MAX_WINDOW;
+	if (hdr->stream == 0) {
+		h2->window += increment;
+		if (increment == 0 || h2->window > HTTP2_MAX_WINDOW) {
+			h2->error = increment ? HTTP2_FLOW_CONTROL_ERROR : HTTP2_PROTOCOL_ERROR;
+			return -1;
+		}
+		return 0;
+	}
+	stream = find_stream(h2, hdr->stream);
+	if (stream == NULL)
+		return 0;
+	stream->window += increment;
+	if (increment == 0 || stream->window > HTTP2_MAX_WINDOW) {
+		destroy_stream(h2, stream);
+		return send_rst_stream(h2, hdr->stream,
+				       increment ? HTTP2_FLOW_CONTROL_ERROR : HTTP2_PROTOCOL_ERROR);
+	}
+	return 0;
+}
+
+/**
+ * process_frame - process a frame whose payload is in h2->frame
+ * return -1 in case of error of the connection, h2->error tells which.
+ */
+static int process_frame(struct http2_connection *h2, const struct frame_header *hdr)
+{
+	struct http2_stream *stream = NULL;
+	enum http2_error error = HTTP2_NO_ERROR;
+	// a header block can't be interleaved with other frames
+	if (h2->block_stream != 0 &&
+	    (hdr->type != HTTP2_CONTINUATION || hdr->stream != h2->block_stream)) {
+		h2->error = HTTP2_PROTOCOL_ERROR;
+		return -1;
+	}
+	switch (hdr->type) {
+	case HTTP2_DATA:
+		if (hdr->stream == 0 || hdr->stream > h2->last_stream) {
+			h2->error = HTTP2_PROTOCOL_ERROR;
+			return -1;
+		}
+		// request bodies are not used, their window is given back at once
+		stream = find_stream(h2, hdr->stream);
+		if (hdr->length > 0) {
+			if (send_window_update(h2, 0, hdr->length) < 0)
+				return -1;
+			if (stream != NULL && !stream->remote_closed &&
+			    !(hdr->flags & FLAG_END_STREAM) &&
+			    send_window_update(h2, hdr->stream, hdr->length) < 0)
+				return -1;
+		}
+		if (stream != NULL && (hdr->flags & FLAG_END_STREAM))
+			stream->remote_closed = true;
+		return 0;
+	case HTTP2_HEADERS:
+		return process_headers(h2, hdr);
+	case HTTP2_CONTINUATION:
+		if (h2->block_stream == 0) {
+			h2->error = HTTP2_PROTOCOL_ERROR;
+			return -1;
+		}
+		if (append_block(h2, h2->frame, hdr->length) < 0)
+			return -1;
+		if (hdr->flags & FLAG_END_HEADERS)
+			return header_block_done(h2);
+		return 0;
+	case HTTP2_PRIORITY:
+		if (hdr->stream == 0) {
+			h2->error = HTTP2_PROTOCOL_ERROR;
+			return -1;
+		}
+		if (hdr->length != 5) {
+			h2->error = HTTP2_FRAME_SIZE_ERROR;
+			return -1;
+		}
+		return 0;
+	case HTTP2_RST_STREAM:
+		if (hdr->stream == 0 || hdr->stream > h2->last_stream) {
+			h2->error = HTTP2_PROTOCOL_ERROR;
+			return -1;
+		}
+		if (hdr->length != 4) {
+			h2->error = HTTP2_FRAME_SIZE_ERROR;
+			return -1;
+		}
+		stream = find_stream(h2, hdr->stream);
+		if (stream != NULL)
+			destroy_stream(h2, stream);
+		return 0;
+	case HTTP2_SETTINGS:
+		if (hdr->stream != 0) {
+			h2->error = HTTP2_PROTOCOL_ERROR;
+			return -1;
+		}
+		if (hdr->flags & FLAG_ACK) {
+			if (hdr->length != 0) {
+				h2->error = HTTP2_FRAME_SIZE_ERROR;
+				return -1;
+			}
+			return 0;
+		}
+		error = apply_settings(h2, h2->frame, hdr->length);
+		if (error != HTTP2_NO_ERROR) {
+			h2->error = error;
+			return -1;
+		}
+		return send_frame(h2, HTTP2_SETTINGS, FLAG_ACK, 0, NULL, 0);
+	case HTTP2_PUSH_PROMISE:
+		h2->error = HTTP2_PROTOCOL_ERROR;
+		return -1;
+	case HTTP2_PING:
+		if (hdr->stream != 0) {
+			h2->error = HTTP2_PROTOCOL_ERROR;
+			return -1;
+		}
+		if (hdr->length != 8) {
+			h2->error = HTTP2_FRAME_SIZE_ERROR;
+			return -1;
+		}
+		if (hdr->flags & FLAG_ACK)
+			return 0;
+		return send_frame(h2, HTTP2_PING, FLAG_ACK, 0, h2->frame, 8);
+	case HTTP2_GOAWAY:
+		if (hdr->stream != 0) {
+			h2->error = HTTP2_PROTOCOL_ERROR;
+			return -1;
+		}
+		h2->goaway = true;
+		return 0;
+	case HTTP2_WINDOW_UPDATE:
+		return process_window_update(h2, hdr);
+	default:
+		// unknown frames are ignored (RFC 7540 4.1)
+		return 0;
+	}
+}
+
+/**
+ * read_exact - read n bytes from the connection
+ * the deadline of the session armed bounds the wait.
+ * return 0 on success, -1 in case of error or end of the connection.
+ */
+static int read_exact(struct http2_connection *h2, unsigned char *buf, size_t n)
+{
+	ssize_t rd = 0;
+	while (n > 0) {
+		rd = crecv(h2->session->connection, (char *)buf, n, -1);
+		if (rd < 0 && errno == EINTR)
+			continue;
+		if (rd <= 0)
+			return -1;
+		buf += rd;
+		n -= rd;
+	}
+	return 0;
+}
+
+/**
+ * read_frame - read and process a frame
+ * @wait: seconds to wait for the start of a frame, 0 to just poll, -1
+ * to wait till the deadline of the session expires
+ * return 1 if a frame was processed, 0 if none arrived in wait seconds,
+ * -1 in case of error or end of the connection.
+ */
+static int read_frame(struct http2_connection *h2, int wait)
+{
+	unsigned char buf[HTTP2_FRAME_HEADER_SIZE];
+	struct frame_header hdr = {0};
+	ssize_t rd = 0;
+	rd = crecv(h2->session->connection, (char *)buf, sizeof(buf), wait);
+	if (rd < 0 && errno == ETIME)
+		return 0;
+	if (rd <= 0)
+		return -1;
+	if (read_exact(h2, buf + rd, sizeof(buf) - rd) < 0)
+		return -1;
+	hdr.length = (buf[0] << 16) | (buf[1] << 8) | buf[2];
+	hdr.type = buf[3];
+	hdr.flags = buf[4];
+	hdr.stream = get32(buf + 5) & HTTP2_MAX_WINDOW;
+	if (hdr.length > sizeof(h2->frame)) {
+		h2->error = HTTP2_FRAME_SIZE_ERROR;
+		return -1;
+	}
+	if (read_exact(h2, h2->frame, hdr.length) < 0)
+		return -1;
+	if (process_frame(h2, &hdr) < 0)
+		return -1;
+	return 1;
+}
+
+/**
+ * next_stream - return the first stream whose body can be sent now
+ */
+static struct http2_stream *next_stream(struct http2_connection *h2)
+{
+	struct http2_stream *stream = NULL;
+	if (h2->window <= 0)
+		return NULL;
+	list_for_each_entry(stream, &h2->streams, list) {
+		if (stream->window > 0)
+			return stream;
+	}
+	return NULL;
+}
+
+/**
+ * send_data - send a DATA frame of the body of stream
+ * the stream goes to the back of the queue so that the bodies are sent
+ * in turn, a frame at a time.
+ */
+static int send_data(struct http2_connection *h2, struct http2_stream *stream)
+{
+	unsigned char header[HTTP2_FRAME_HEADER_SIZE];
+	size_t chunk = stream->remaining;
+	bool last = false;
+	if ((int64_t)chunk > stream->window)
+		chunk = stream->window;
+	if ((int64_t)chunk > h2->window)
+		chunk = h2->window;
+	if (chunk > h2->max_frame)
+		chunk = h2->max_frame;
+	last = chunk == stream->remaining;
+	header[0] = chunk >> 16;
+	header[1] = chunk >> 8;
+	header[2] = chunk;
+	header[3] = HTTP2_DATA;
+	header[4] = last ? FLAG_END_STREAM : 0;
+	put32(header + 5, stream->id);
+	// the frame header is buffered and flushed by csendfd() before the body
+	if (csend(h2->session->connection, (char *)header, sizeof(header)) < 0)
+		return -1;
+	if (csendfd(h2->session->connection, stream->fd, stream->offset, chunk) < 0)
+		return -1;
+	stream->offset += chunk;
+	stream->remaining -= chunk;
+	stream->window -= chunk;
+	h2->window -= chunk;
+	if (last)
+		destroy_stream(h2, stream);
+	else
+		list_move_tail(&stream->list, &h2->streams);
+	return 0;
+}
+
+/**
+ * start_connection - send the server preface and read the client one
+ * @upgrade: true if the connection is upgraded from HTTP/1.1
+ */
+static int start_connection(struct http2_connection *h2, bool upgrade)
+{
+	unsigned char settings[UPGRADE_SETTINGS_SIZE];
+	unsigned char preface[sizeof(HTTP2_PREFACE) - 1];
+	const char *expected = NULL;
+	ssize_t len = 0;
+	if (upgrade) {
+		len = base64url_decode(h2->session->req.http2_settings, settings, sizeof(settings));
+		if (len < 0 || apply_settings(h2, settings, len) != HTTP2_NO_ERROR)
+			return -1;
+		if (csend(h2->session->connection, UPGRADE_RESPONSE, strlen(UPGRADE_RESPONSE)) < 0)
+			return -1;
+	}
+	if (send_settings(h2) < 0 || cflush(h2->session->connection) < 0)
+		return -1;
+	// the start of the preface may have been read as an HTTP/1.1 request,
+	// after ALPN h2 nothing was read yet
+	expected = http2_is_preface(h2->session) ? HTTP2_PREFACE_TAIL : HTTP2_PREFACE;
+	if (read_exact(h2, preface, strlen(expected)) < 0)
+		return -1;
+	if (memcmp(preface, expected, strlen(expected)) != 0) {
+		h2->error = HTTP2_PROTOCOL_ERROR;
+		return -1;
+	}
+	if (upgrade) {
+		// the upgraded request is the one of stream 1, already ended
+		h2->last_stream = 1;
+		return respond(h2, 1, true);
+	}
+	return 0;
+}
+
+static struct http2_connection *create_connection(struct http_session *session,
+						  http2_handler handler,
+						  void *arg)
+{
+	struct http2_connection *h2 = NULL;
+	h2 = malloc(sizeof(*h2));
+	if (h2 == NULL)
+		return NULL;
+	if (hpack_table_init(&h2->decoder, HPACK_DEFAULT_TABLE_SIZE) < 0) {
+		free(h2);
+		return NULL;
+	}
+	h2->session = session;
+	h2->handler = handler;
+	h2->arg = arg;
+	INIT_LIST_HEAD(&h2->streams);
+	INIT_LIST_HEAD(&h2->free_streams);
+	h2->n_streams = 0;
+	h2->last_stream = 0;
+	h2->window = HTTP2_DEFAULT_WINDOW;
+	h2->initial_window = HTTP2_DEFAULT_WINDOW;
+	h2->max_frame = HTTP2_MAX_FRAME_SIZE;
+	h2->block_len = 0;
+	h2->block_stream = 0;
+	h2->block_end_stream = false;
+	h2->goaway = false;
+	h2->idle = false;
+	h2->error = HTTP2_NO_ERROR;
+	return h2;
+}
+
+static void destroy_connection(struct http2_connection *h2)
+{
+	struct http2_stream *stream = NULL, *tmp = NULL;
+	list_for_each_entry_safe(stream, tmp, &h2->streams, list)
+		destroy_stream(h2, stream);
+	list_for_each_entry_safe(stream, tmp, &h2->free_streams, list)
+		free(stream);
+	hpack_table_free(&h2->decoder);
+	free(h2);
+}
+
+int http2_serve(struct http_session *session, http2_handler handler, void *arg)
+{
+	struct http2_connection *h2 = NULL;
+	struct http2_stream *stream = NULL;
+	int res = 0;
+	int rd = 0;
+	if (session == NULL || handler == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	h2 = create_connection(session, handler, arg);
+	if (h2 == NULL)
+		return -1;
+	// the frames are small and the peer waits for them, e.g. the last
+	// DATA of a window, so they are not held back for coalescing
+	csetnodelay(session->connection, true);
+	http_session_arm(session, HTTP_PHASE_IDLE);
+	h2->idle = true;
+	res = start_connection(h2, http2_is_upgrade(&session->req));
+	while (res == 0) {
+		stream = next_stream(h2);
+		if (stream == NULL && h2->goaway && h2->n_streams == 0)
+			break;
+		if (stream != NULL) {
+			// the frames of the peer, e.g. WINDOW_UPDATE, go first
+			rd = read_frame(h2, 0);
+			if (rd == 0) {
+				// each frame sent restarts the send deadline
+				http_session_arm(session, HTTP_PHASE_SEND);
+				h2->idle = false;
+				res = send_data(h2, stream);
+				continue;
+			}
+		} else {
+			if (!h2->idle) {
+				http_session_arm(session, HTTP_PHASE_IDLE);
+				h2->idle = true;
+			}
+			if (cflush(session->connection) < 0) {
+				res = -1;
+				break;
+			}
+			rd = read_frame(h2, -1);
+			if (rd < 0 && session->expired) {
+				// idle, or stalled by flow control, for too long,
+				// the deadline stopped only the reads
+				send_goaway(h2, HTTP2_NO_ERROR);
+				break;
+			}
+		}
+		if (rd < 0)
+			res = -1;
+	}
+	if (res < 0 && h2->error != HTTP2_NO_ERROR) {
+		syslog(LOG_INFO, "http2 connection error %d\n", h2->error);
+		send_goaway(h2, h2->error);
+	} else if (res == 0) {
+		cflush(session->connection);
+	}
+	destroy_connection(h2);
+	return res;
+}
@@ -0,0 +1,81 @@
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "connection.h"
+#include "spsc_ring.h"
+
+/* max connections accepted by a single wakeup of the acceptor */
+#define ACCEPTOR_BATCH 64
+/* milliseconds the acceptor waits before checking if it must stop */
+#define ACCEPTOR_POLL_MS 500
+
+typedef struct acceptor ACCEPTOR;
+
+/**
+ * acceptor_create - create the acceptor of a listener
+ * @listener: open listener, it must outlive the acceptor
+ * @workers: number of workers fed by the acceptor
+ * @queue_size: sockets waiting for each worker at most
+ * the acceptor owns a thread draining the listener in batches and a ring
+ * per worker, written only by that thread and read only by the worker,
+ * so the handoff takes no lock. Each socket goes to the worker with the
+ * lowest load, the sockets in its ring plus the one it serves.
+ * return NULL in case of error and set errno.
+ */
+ACCEPTOR *acceptor_create(LISTENER_CONNECTION *listener,
+			  size_t workers,
+			  size_t queue_size);
+
+/**
+ * acceptor_start - start the thread of the acceptor
+ * @acceptor: acceptor created by acceptor_create()
+ */
+int acceptor_start(ACCEPTOR *acceptor);
+
+/**
+ * acceptor_stop - stop the thread of the acceptor and wake the workers
+ * @acceptor: acceptor started by acceptor_start()
+ * the workers waiting in acceptor_next() get -1 once their ring is empty.
+ */
+void acceptor_stop(ACCEPTOR *acceptor);
+
+/**
+ * acceptor_destroy - free an acceptor, the sockets not taken are closed
+ * @acceptor: stopped acceptor
+ */
+void acceptor_destroy(ACCEPTOR *acceptor);
+
+/**
+ * acceptor_next - wait for the next socket of a worker
+ * @acceptor: running acceptor
+ * @worker: index of the worker, from 0 to workers - 1, a worker must be
+ * the only one using its index
+ * the worker counts as busy until acceptor_done().
+ * return the socket, -1 if the acceptor stopped and set errno.
+ */
+int acceptor_next(ACCEPTOR *acceptor, size_t worker);
+
+/**
+ * acceptor_done - tell the acceptor the worker finished its connection
+ * @acceptor: running acceptor
+ * @worker: index of the worker
+ */
+void acceptor_done(ACCEPTOR *acceptor, size_t worker);
+
+/**
+ * acceptor_overflows - number of connections dropped because the ring of
+ * every worker was full
+ * @acceptor: acceptor to inspect
+ */
+uint64_t acceptor_overflows(const ACCEPTOR *acceptor);
+
+#endif
@@ -2,6 +2,7 @@
 #define CONNECTION_H
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/select.h>
@@ -13,6 +14,8 @@
 #include <sys/sendfile.h>
 #include <signal.h>
 #include <semaphore.h>
+#include <poll.h>
+#include <netinet/tcp.h>
 #include "inet_sockets.h"
 
 enum socket_type {
@@ -22,10 +25,12 @@ enum socket_type {
 
 typedef struct listener_socket LISTENER_CONNECTION;
 typedef struct buffered_socket CONNECTION;
+struct tls_context;
 
 struct CONNECTION_attr {
 	size_t write_buffer_size;
 	size_t read_buffer_size;
+	bool thread_safe;
 	enum socket_type socket_type;
 	LISTENER_CONNECTION *listener;
 	struct sockaddr *addr;
@@ -59,6 +64,34 @@ LISTENER_CONNECTION *lcopen(char *service, int backlog, socklen_t *addrlen);
  */
 int lcclose(LISTENER_CONNECTION *connection);
 
+/**
+ * lcsettls() - serve the connections accepted from now on over TLS
+ * @connection: open LISTENER_CONNECTION.
+ * @tls: context created by tls_context_create(), NULL for cleartext,
+ * it must outlive the listener.
+ * copen() runs the handshake before returning the CONNECTION, then
+ * every other call encrypts and decrypts transparently.
+ * RETURN:
+ * return 0 in case of success
+ * return -1 and set errno to ENOTSUP if built without OpenSSL.
+ */
+int lcsettls(LISTENER_CONNECTION *connection, struct tls_context *tls);
+
+/**
+ * lcaccept() - accept a batch of connections
+ * @connection: open LISTENER_CONNECTION.
+ * @socks: where to store the sockets accepted.
+ * @n: max number of sockets to accept.
+ * @timeout: milliseconds to wait for a first connection, -1 forever.
+ * once a connection is pending the queue of the listener is drained
+ * without blocking, up to n connections, with one accept4(2) each.
+ * the sockets are close-on-exec and blocking, ready for copenfd().
+ * RETURN:
+ * return the number of sockets accepted, 0 if none came in time.
+ * otherwise return -1 and set errno.
+ */
+ssize_t lcaccept(LISTENER_CONNECTION *connection, int *socks, size_t n, int timeout);
+
 /**
  * copen() - open a CONNECTION given a set of parameters.
  * @attr: CONNECTION_attr struct given socket specific opening parameters
@@ -66,6 +99,10 @@ int lcclose(LISTENER_CONNECTION *connection);
  * value.
  * @write_buffer_size: the size of the buffer for buffering writing
  * @read_buffer_size: the size of the buffer for buffering reading
+ * @thread_safe: false, the default, if the CONNECTION is only used by
+ *   the thread that opens it: the calls take no lock, and builds without
+ *   NDEBUG assert the caller is that thread. true to lock every call so
+ *   several threads can share the CONNECTION.
  * @socket_type: can be two value ACCEPT or CONNECT, indicate
  *   the type of the socket, if should come from an accept(2) or a
  *   connect(2) call.
@@ -86,6 +123,20 @@ int lcclose(LISTENER_CONNECTION *connection);
 */
 CONNECTION *copen(struct CONNECTION_attr *attr);
 
+/**
+ * copenfd() - open a CONNECTION on a socket already accepted
+ * @attr: CONNECTION_attr struct, as for copen() with ACCEPT, only the
+ * buffer sizes and the listener are used.
+ * @sock: socket returned by lcaccept(), owned by the CONNECTION from now
+ * on, it is closed if the call fails.
+ * the TLS handshake runs here if the listener serves TLS, so it is paid
+ * by the thread that will serve the connection.
+ * RETURN:
+ * in case of success return a valid CONNECTION pointer.
+ * otherwise return NULL and set errno.
+ */
+CONNECTION *copenfd(struct CONNECTION_attr *attr, int sock);
+
 /**
  * cclose() - close an open CONNECTION.
  * @connection: open CONNECTION to close
@@ -109,7 +160,8 @@ int cclose(CONNECTION *connection, int how);
  * @connect: open CONNECTION
  * @buf: where to store the data readed
  * @n: size of the data requested
- * @timeout: timer if no data is sent for tot second.
+ * @timeout: timer if no data is sent for tot second, negative to wait
+ * till data arrives or cabort() is called.
  * The read are buffered, however it should be totaly transperent
  * to the caller.
  * RETURN:
@@ -137,18 +189,34 @@ ssize_t crecv(CONNECTION *connect, char *buf, size_t n, int timeout);
 ssize_t csend(CONNECTION *connect, char *buf, size_t n);
 
 /**
- * csendfile() - sent file_size bytes of a file whose path is fpath
+ * csendfd() - send count bytes of an open file starting at offset
  * through a open CONNECTION.
  * @connect: open CONNECTION.
+ * @fd: file descriptor of the file, its file offset is not changed.
+ * @offset: offset of the first byte to send.
+ * @count: number of bytes to send.
+ * the bytes buffered by csend() are flushed before the file, then the
+ * file is sent with sendfile(2), or with tls_sendfile() over TLS.
+ * RETURN:
+ * in case of success return count, otherwise return -1 and set errno,
+ * EIO if the file ends before count bytes.
+ */
+ssize_t csendfd(CONNECTION *connect, int fd, off_t offset, size_t count);
+
+/**
+ * csendfile() - sent count bytes of a file whose path is fpath, starting
+ * at offset, through a open CONNECTION.
+ * @connect: open CONNECTION.
  * @fpath: path to the file.
- * @file_size: size of the file to send.
+ * @offset: offset of the first byte to send.
+ * @count: number of bytes to send.
  * this call uses sendfile(2), so the file are sent with a zero-copy
  * technique, making it faster.
  * RETURN:
  * in case of success return the number of bytes sent,
  * otherwise return -1 and set errno.
  */
-ssize_t csendfile(CONNECTION *connect, char *fpath, size_t file_size);
+ssize_t csendfile(CONNECTION *connect, char *fpath, off_t offset, size_t count);
 
 /**
  * crecvline() - read from a connection a \r\n terminated line and store
@@ -156,7 +224,8 @@ ssize_t csendfile(CONNECTION *connect, char *fpath, size_t file_size);
  * @connect: open CONNECTION
  * @buf: buffer where to store the line readed
  * @n: size of buf
- * @timeout: timeouts in seconds.
+ * @timeout: timeouts in seconds, negative to wait till data arrives or
+ * cabort() is called.
  * this call will read up to n bytes, if no newline is found after reading
  * n bytes, the call fails.
  * if no data are sent for more than timeout seconds, the call will fail
@@ -181,6 +250,45 @@ ssize_t crecvline(CONNECTION *connect, char *buf, size_t n, int timeout);
  */
 int cflush(CONNECTION *connect);
 
+/**
+ * cis_alive() - return false if the peer closed or reset the CONNECTION
+ * @connect: open CONNECTION.
+ * the call never blocks and never consumes data, so it can be used
+ * to poll a CONNECTION owned by another thread.
+ */
+bool cis_alive(const CONNECTION *connect);
+
+/**
+ * cabort() - make the calls blocked on the CONNECTION, and the next
+ * ones, fail at once
+ * @connect: open CONNECTION, it must still be closed with cclose().
+ * @how: as for cclose(), O_RDONLY to stop only the reads, so a last
+ * message can still be sent, O_RDWR to stop the sends too.
+ * it can be called from any thread, e.g. when a deadline expires.
+ */
+int cabort(CONNECTION *connect, int how);
+
+/**
+ * csetnodelay() - disable the Nagle algorithm on the CONNECTION
+ * @connect: open CONNECTION.
+ * @on: true to send the small writes at once
+ */
+int csetnodelay(CONNECTION *connect, bool on);
+
+/**
+ * cis_tls() - return true if the CONNECTION is encrypted with TLS
+ * @connect: open CONNECTION.
+ */
+bool cis_tls(const CONNECTION *connect);
+
+/**
+ * cis_alpn() - return true if proto was selected with ALPN during the
+ * TLS handshake of the CONNECTION
+ * @connect: open CONNECTION.
+ * @proto: protocol id, e.g. "h2"
+ */
+bool cis_alpn(const CONNECTION *connect, const char *proto);
+
 /**
  * cget_ipaddr() - get the ip address of the connection other host
  * @connect: open connection.
@@ -0,0 +1,117 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* entries of the static table */
+#define HPACK_STATIC_ENTRIES 61
+/* symbols of the Huffman code, EOS included */
+#define HPACK_HUFFMAN_SYMBOLS 257
+/* default max size of the dynamic table (RFC 7540 6.5.2) */
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+/* overhead of an entry counted in the size of the table (RFC 7541 4.1) */
+#define HPACK_ENTRY_OVERHEAD 32
+
+/**
+ * hpack_field - a decoded or to be encoded header field
+ * @name: name of the field, lowercase
+ * @value: value of the field
+ */
+struct hpack_field {
+	const char *name;
+	const char *value;
+};
+
+/**
+ * hpack_entry - entry of the dynamic table
+ * @name: name of the field
+ * @value: value of the field
+ * @size: size of the entry as defined by RFC 7541 4.1
+ */
+struct hpack_entry {
+	char *name;
+	char *value;
+	size_t size;
+};
+
+/**
+ * hpack_table - dynamic table of a decoder
+ * @entries: ring of cap entries, the newest is entries[first]
+ * @n: number of entries in the table
+ * @cap: number of element in entries
+ * @first: position of the newest entry
+ * @size: size of the table, sum of the size of its entries
+ * @max_size: max size of the table, set by the encoder
+ * @limit: highest max_size the encoder can set, our SETTINGS_HEADER_TABLE_SIZE
+ */
+struct hpack_table {
+	struct hpack_entry *entries;
+	size_t n;
+	size_t cap;
+	size_t first;
+	size_t size;
+	size_t max_size;
+	size_t limit;
+};
+
+/**
+ * hpack_table_init - init an empty dynamic table
+ * @table: table to init
+ * @limit: max size of the table
+ */
+int hpack_table_init(struct hpack_table *table, size_t limit);
+
+/**
+ * hpack_table_free - free the entries of a table
+ * @table: table initialized by hpack_table_init()
+ */
+void hpack_table_free(struct hpack_table *table);
+
+/**
+ * hpack_decode - decode a complete header block
+ * @table: dynamic table of the connection
+ * @block: the header block, fragments already joined
+ * @len: size of block
+ * @buf: where to store the decoded names and values, '\0' terminated
+ * @buf_size: size of buf
+ * @fields: where to store the fields, pointing into buf
+ * @max_fields: number of element in fields
+ * RETURN:
+ * return the number of fields decoded, -1 otherwise. errno is EPROTO
+ * for a malformed block, which is a COMPRESSION_ERROR of the whole
+ * connection, ENOBUFS if the fields don't fit in buf or fields.
+ */
+int hpack_decode(struct hpack_table *table,
+		 const unsigned char *block,
+		 size_t len,
+		 char *buf,
+		 size_t buf_size,
+		 struct hpack_field *fields,
+		 size_t max_fields);
+
+/**
+ * hpack_encode - encode a header field without touching any dynamic table
+ * @buf: where to write the field
+ * @buf_size: size of buf
+ * @name: name of the field, it is lowercased
+ * @value: value of the field
+ * a field found in the static table is sent as an index, the others as
+ * literals without indexing, so the decoder state never has to be
+ * tracked.
+ * return the number of bytes written, -1 if buf is too small.
+ */
+ssize_t hpack_encode(unsigned char *buf,
+		     size_t buf_size,
+		     const char *name,
+		     const char *value);
+
+#endif
@@ -4,10 +4,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include <syslog.h>
 #include "connection.h"
+#include "timer_wheel.h"
+#include "arena.h"
+#include "slab.h"
 
 #ifndef CRLF
 #define CRLF "\r\n"
@@ -16,40 +21,200 @@
 #define CRLF_LEN 2
 #endif
 
+/* max number of media ranges kept from an Accept header */
+#define HTTP_MAX_MEDIA_RANGES 16
+/* max size of the type and subtype of a media range */
+#define HTTP_MEDIA_TYPE_SIZE 64
+/* size of an IMF-fixdate, '\0' included */
+#define HTTP_DATE_SIZE 30
+/* max number of ranges served in a multipart/byteranges response */
+#define HTTP_MAX_RANGES 16
+/* initial size of the arena of a session, it grows to the largest request */
+#define HTTP_SESSION_ARENA_SIZE 4096
+
+/**
+ * media_range - a single media range of an Accept header
+ * @type: type of the range, "*" for any
+ * @subtype: subtype of the range, "*" for any
+ * @q: weight of the range, 1.0 if not specified
+ * @specificity: 0 for any type, 1 for any subtype, 2 for an exact mime
+ */
+struct media_range {
+	char type[HTTP_MEDIA_TYPE_SIZE];
+	char subtype[HTTP_MEDIA_TYPE_SIZE];
+	double q;
+	int specificity;
+};
+
+/**
+ * accept_list - parsed Accept header
+ * @ranges: media ranges sorted by specificity and then by weight,
+ * so that the first range matching a mime is the one to use
+ * @n: number of valid entry in ranges
+ */
+struct accept_list {
+	struct media_range ranges[HTTP_MAX_MEDIA_RANGES];
+	size_t n;
+};
+
 struct http_request {
 	char *method;
 	char *url;
+	char *query;
 	char *accept;
 	char *connection;
+	char *save_data;
+	char *ect;
+	char *downlink;
+	char *if_match;
+	char *if_none_match;
+	char *if_modified_since;
+	char *if_unmodified_since;
+	char *range;
+	char *if_range;
+	char *upgrade;
+	char *http2_settings;
+};
+
+/**
+ * byte_range - a satisfiable range of a Range header
+ * @first: offset of the first byte
+ * @last: offset of the last byte, included
+ */
+struct byte_range {
+	off_t first;
+	off_t last;
+};
+
+/**
+ * effective_connection_type - value of the ECT client hint
+ */
+enum effective_connection_type {
+	ECT_UNKNOWN,
+	ECT_SLOW_2G,
+	ECT_2G,
+	ECT_3G,
+	ECT_4G
+};
+
+/**
+ * client_hints - network quality hints sent by the client
+ * @save_data: true if the client sent "Save-Data: on"
+ * @ect: effective connection type, ECT_UNKNOWN if not sent
+ * @downlink: estimated bandwidth in Mbps, negative if not sent
+ */
+struct client_hints {
+	bool save_data;
+	enum effective_connection_type ect;
+	double downlink;
+};
+
+/**
+ * http_header - a single header of a response
+ * @name: name of the header
+ * @value: value of the header
+ */
+struct http_header {
+	const char *name;
+	const char *value;
+};
+
+/**
+ * http_header_block - a response header ready to be sent, shared by the
+ * responses for the same file version
+ * @buf: status line, headers and ending CRLF
+ * @len: length of buf
+ * @date: offset in buf of the value of the Date header
+ * @expires: offset in buf of the value of the Expires header, 0 if none
+ * @max_age: seconds between the Date and the Expires values
+ * @refs: number of references, the block is freed when it drops to 0
+ * @slab: slab the block is allocated from, NULL for the heap
+ * @size: bytes allocated for the block and its buf
+ * only the Date and Expires values change between two responses, they
+ * are patched in the copy made by http_header_block_write().
+ */
+struct http_header_block {
+	char *buf;
+	size_t len;
+	size_t date;
+	size_t expires;
+	int max_age;
+	int refs;
+	struct slab *slab;
+	size_t size;
 };
 
 enum status_code {
 	HTTP_OK = 200,
-	HTTP_BAD_REQUEST = 402,
+	HTTP_PARTIAL_CONTENT = 206,
+	HTTP_NOT_MODIFIED = 304,
+	HTTP_BAD_REQUEST = 400,
 	HTTP_NOT_FOUND = 404,
+	HTTP_METHOD_NOT_ALLOWED = 405,
+	HTTP_PRECONDITION_FAILED = 412,
+	HTTP_RANGE_NOT_SATISFIABLE = 416,
 	HTTP_INTERNAL_SERVER_ERROR = 500
 };
 
+/**
+ * http_timeouts - deadlines of the phases of a connection, in seconds;
+ * unlike the timeout of a single read they don't restart when a byte
+ * arrives, so a client trickling data can't hold a worker
+ * @idle: to receive the request line of the next request
+ * @header: to receive the rest of the request header
+ * @send: max time without progress while sending a response
+ */
+struct http_timeouts {
+	int idle;
+	int header;
+	int send;
+};
+
+/**
+ * http_phase - phase of a connection whose deadline is running
+ */
+enum http_phase {
+	HTTP_PHASE_IDLE,
+	HTTP_PHASE_HEADER,
+	HTTP_PHASE_SEND
+};
+
 struct http_session {
 	struct CONNECTION_attr *attr;
 	CONNECTION *connection;
-	int timeout;
+	int request_deadline;
+	struct timespec deadline;
+	struct http_timeouts timeouts;
+	struct timer_wheel wheel;
+	struct timer timer;
+	enum http_phase phase;
+	bool expired;
 	char *request;
 	size_t request_size;
 	struct http_request req;
 	char *response;
 	size_t response_size;
+	struct accept_list accept_list;
+	char *accept_raw;
+	bool accept_valid;
+	struct arena arena;
 };
 /**
  * http_session_create - alloc and init a new http_session struct
  * @attr: CONNECTION_attr struct to create a working CONNECTION
- * @timeout: timeout for the client, if no data is 
- * sent in the last timeout seconds, end the session
+ * @request_deadline: seconds a request can take once read, the work still
+ * running after that is cancelled
+ * @timeouts: deadlines of the phases of a connection, kept on the timer
+ * wheel of the session, which is advanced by the timer service; the
+ * reads wait without a timeout of their own, the deadline ends them
  * @request_size: max size of a request line
  * @response_size: max size of a response line
+ * the session owns an arena for the data of a request, the handler of
+ * the request resets it once the response is sent.
  */
 struct http_session *http_session_create(struct CONNECTION_attr *attr,
-	                                 int timeout,
+					 int request_deadline,
+					 const struct http_timeouts *timeouts,
 					 size_t request_size,
 					 size_t response_size);
 /**
@@ -67,8 +232,18 @@ void http_session_destroy(struct http_session *session);
  */
 int http_start_connection(struct http_session *session);
 
+/**
+ * http_adopt_connection - start the session on a socket already accepted
+ * @session: struct containing http session state,
+ * the struct should not be already connected.
+ * @sock: socket handed over by the acceptor, owned by the session from
+ * now on, it is closed if the call fails.
+ */
+int http_adopt_connection(struct http_session *session, int sock);
+
 /**
  * http_close_connection - close the CONNECTION opened by http_start_connection()
+ * or http_adopt_connection()
  * @session: struct containing http session state, should be
  * already connected.
  */
@@ -77,23 +252,182 @@ int http_close_connection(struct http_session *session);
 /**
  * read_http_request - read an http request line by line till CRLF is found
  * @session: connected http_session struct
+ * the request line must arrive within the idle deadline and the rest of
+ * the header within the header one, errno is ETIMEDOUT when they expire.
+ * The deadline of the request starts when it has been read.
  */
 int read_http_request(struct http_session *session);
 
+/**
+ * http_session_arm - start the deadline of a phase of the connection
+ * @session: connected http_session
+ * @phase: phase starting, its deadline replaces the running one
+ * when the deadline expires the CONNECTION is aborted, so whatever is
+ * blocked on it fails at once: only its reads while waiting for a
+ * request, so a last message can still be sent, its sends too while
+ * sending a response.
+ */
+void http_session_arm(struct http_session *session, enum http_phase phase);
+
+/**
+ * http_session_disarm - stop the deadline of the current phase
+ * @session: connected http_session
+ */
+void http_session_disarm(struct http_session *session);
+
+/**
+ * http_session_set_deadline - start the deadline of the current request
+ * @session: http_session whose request has just been read
+ */
+void http_session_set_deadline(struct http_session *session);
+
+/**
+ * http_session_cancelled - return true if the result of the current
+ * request is not needed anymore
+ * @session: http_session with a request being served
+ * a request is cancelled once its deadline passed or when the client
+ * closed the connection. It can be called by any thread.
+ */
+bool http_session_cancelled(struct http_session *session);
+
 /**
  * parse_http_request - parse a raw http request
  * @raw: string containing an http request
  * @req: struct where to store the information retrieved
+ * the url is canonicalized by http_canonicalize_url(), a request whose
+ * url can't be fails.
  */
 int parse_http_request(char *raw, struct http_request *req);
 
+/**
+ * http_canonicalize_url - rewrite the path of an url in its canonical
+ * form, in place and in a single pass
+ * @url: origin-form url, starting with '/'
+ * @query: where to store the query, the part after '?' left as it is,
+ * NULL if the url has none
+ * the path is percent-decoded, the "." and ".." segments are removed
+ * (RFC 3986 5.2.4, ".." never goes above the root) and consecutive
+ * slashes are merged; a fragment is dropped. "/a%20b.jpg?v=3" and
+ * "/x/../a b.jpg" both become "/a b.jpg", so every cache keys a file
+ * by one name.
+ * return 0 in case of success, -1 and set errno to EINVAL if the url
+ * is not origin-form, has a malformed escape or an escaped '\0'.
+ */
+int http_canonicalize_url(char *url, char **query);
+
+/**
+ * http_request_set_header - store a header field in a request
+ * @req: http request
+ * @name: name of the field, case-insensitive
+ * @value: value of the field, req points to it
+ * fields not used by the server are ignored.
+ */
+void http_request_set_header(struct http_request *req, const char *name, char *value);
+
 /**
  * search_weight_from_mime - given the accept header and a mime, return the weight
  * @accept: value of the header accept
  * @mime: mime value
+ * the header is parsed at every call, prefer parse_accept_header() and
+ * accept_list_weight() when more than one lookup is needed.
  */
 double search_weight_from_mime(const char *accept, const char *mime);
 
+/**
+ * parse_accept_header - parse the value of an Accept header
+ * @accept: value of the header accept
+ * @list: where to store the parsed media ranges
+ * ranges beyond HTTP_MAX_MEDIA_RANGES or malformed are skipped.
+ */
+int parse_accept_header(const char *accept, struct accept_list *list);
+
+/**
+ * accept_list_weight - return the weight of the most specific range
+ * matching mime
+ * @list: parsed Accept header
+ * @mime: mime value, parameters after ';' are ignored
+ * return -1 if no range matches the mime.
+ */
+double accept_list_weight(const struct accept_list *list, const char *mime);
+
+/**
+ * http_session_accept - return the parsed Accept header of the current request
+ * @session: http_session whose request has already been parsed
+ * the parsed form is kept for the whole connection, a request with the
+ * same Accept string of the previous one reuse it without parsing.
+ * return NULL if the request has no Accept header.
+ */
+const struct accept_list *http_session_accept(struct http_session *session);
+
+/**
+ * parse_client_hints - parse the Save-Data, ECT and Downlink headers
+ * @req: parsed http request
+ * @hints: where to store the hints, missing or invalid headers are
+ * stored as not sent
+ */
+void parse_client_hints(const struct http_request *req, struct client_hints *hints);
+
+/**
+ * http_current_date - return the IMF-fixdate of now
+ * the date is formatted once per second by each thread.
+ */
+const char *http_current_date(void);
+
+/**
+ * http_format_date - format a time as an IMF-fixdate (RFC 7231 7.1.1.1)
+ * @t: time to format
+ * @buf: where to store the date, at least HTTP_DATE_SIZE bytes
+ */
+int http_format_date(time_t t, char *buf);
+
+/**
+ * http_parse_date - parse an HTTP-date
+ * @date: IMF-fixdate, or one of the obsolete rfc850 and asctime formats
+ * @t: where to store the parsed time
+ * return -1 if the date is not valid.
+ */
+int http_parse_date(const char *date, time_t *t);
+
+/**
+ * http_check_preconditions - evaluate the conditional headers of a request
+ * @req: parsed http request
+ * @etag: strong entity-tag of the selected representation
+ * @last_modified: modification time of the selected representation
+ * the headers are evaluated in the order of RFC 7232 6, the date
+ * conditions are ignored when the matching entity-tag condition is sent.
+ * return HTTP_OK if the request should be served, HTTP_NOT_MODIFIED or
+ * HTTP_PRECONDITION_FAILED otherwise.
+ */
+enum status_code http_check_preconditions(const struct http_request *req,
+					  const char *etag,
+					  time_t last_modified);
+
+/**
+ * http_parse_range - parse the value of a Range header
+ * @range: value of the header
+ * @size: size of the representation
+ * @ranges: where to store the satisfiable ranges, HTTP_MAX_RANGES element
+ * the ranges are sorted and the overlapping or adjacent ones merged,
+ * so that no byte is sent twice.
+ * RETURN:
+ * return the number of ranges stored, 0 if none is satisfiable, -1 if
+ * the header should be ignored because it is malformed, not in bytes
+ * or has more than HTTP_MAX_RANGES ranges.
+ */
+int http_parse_range(const char *range, off_t size, struct byte_range *ranges);
+
+/**
+ * http_if_range_match - evaluate the If-Range header of a request
+ * @req: parsed http request
+ * @etag: strong entity-tag of the selected representation
+ * @last_modified: modification time of the selected representation
+ * return true if the Range header should be honoured, i.e. when there
+ * is no If-Range or when its validator matches strongly.
+ */
+bool http_if_range_match(const struct http_request *req,
+			 const char *etag,
+			 time_t last_modified);
+
 /**
  * is_keep_alive - given the value of the header Connection,
  * return true if keep-alive is requested.
@@ -109,12 +443,59 @@ bool is_keep_alive(char *connection);
  * @code: status code of the response
  * @content_type: string containing the mime of the resource
  * @content_lenght: the lenght of the resource
+ * @headers: other headers to write, NULL if none
+ * @n_headers: number of element in headers
  */
 size_t generate_response_header(char *response,
 				size_t response_size,
 				enum status_code code,
 				const char *content_type,
-				const char *content_lenght);
+				const char *content_lenght,
+				const struct http_header *headers,
+				size_t n_headers);
+
+/**
+ * http_header_block_create - build a header block with one reference
+ * @slab: slab to allocate the block from, NULL for the heap
+ * @code: status code of the response
+ * @content_type: string containing the mime of the resource, NULL if none
+ * @content_lenght: the lenght of the resource, NULL if none
+ * @headers: other headers, an Expires header among them is kept as
+ * max_age seconds after the Date
+ * @n_headers: number of element in headers
+ * @max_age: seconds from Date to Expires
+ */
+struct http_header_block *http_header_block_create(struct slab *slab,
+						   enum status_code code,
+						   const char *content_type,
+						   const char *content_lenght,
+						   const struct http_header *headers,
+						   size_t n_headers,
+						   int max_age);
+
+/**
+ * http_header_block_get - take a reference to a header block
+ * @block: header block, can be NULL
+ * return block.
+ */
+struct http_header_block *http_header_block_get(struct http_header_block *block);
+
+/**
+ * http_header_block_put - drop a reference to a header block
+ * @block: header block, can be NULL
+ */
+void http_header_block_put(struct http_header_block *block);
+
+/**
+ * http_header_block_write - copy a header block with the current date
+ * @block: header block
+ * @buf: where to copy the block
+ * @buf_size: size of buf
+ * return the length written, 0 if the block doesn't fit in buf.
+ */
+size_t http_header_block_write(const struct http_header_block *block,
+			       char *buf,
+			       size_t buf_size);
 
 /**
  * reset_http_session - reset an http session to a fresh
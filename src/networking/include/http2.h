@@ -0,0 +1,131 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "connection.h"
+#include "http.h"
+#include "hpack.h"
+#include "list.h"
+
+/* request line of the client preface, read by read_http_request() */
+#define HTTP2_PREFACE_LINE "PRI * HTTP/2.0"
+/* rest of the client preface, after the request line and an empty line */
+#define HTTP2_PREFACE_TAIL "SM\r\n\r\n"
+/* whole client preface */
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+/* token of HTTP/2 over cleartext TCP in the Upgrade header */
+#define HTTP2_UPGRADE_TOKEN "h2c"
+/* ALPN id of HTTP/2 over TLS */
+#define HTTP2_ALPN_TOKEN "h2"
+
+#define HTTP2_FRAME_HEADER_SIZE 9
+/* SETTINGS_MAX_FRAME_SIZE we accept, the default one */
+#define HTTP2_MAX_FRAME_SIZE 16384
+/* max size of a header block, CONTINUATION frames included */
+#define HTTP2_MAX_HEADER_BLOCK 65536
+/* max number of fields of a request */
+#define HTTP2_MAX_FIELDS 64
+/* SETTINGS_MAX_CONCURRENT_STREAMS we advertise */
+#define HTTP2_MAX_STREAMS 100
+/* initial size of the flow control windows (RFC 7540 6.9.2) */
+#define HTTP2_DEFAULT_WINDOW 65535
+/* max size of a flow control window */
+#define HTTP2_MAX_WINDOW 0x7fffffff
+
+enum http2_frame_type {
+	HTTP2_DATA = 0x0,
+	HTTP2_HEADERS = 0x1,
+	HTTP2_PRIORITY = 0x2,
+	HTTP2_RST_STREAM = 0x3,
+	HTTP2_SETTINGS = 0x4,
+	HTTP2_PUSH_PROMISE = 0x5,
+	HTTP2_PING = 0x6,
+	HTTP2_GOAWAY = 0x7,
+	HTTP2_WINDOW_UPDATE = 0x8,
+	HTTP2_CONTINUATION = 0x9
+};
+
+enum http2_error {
+	HTTP2_NO_ERROR = 0x0,
+	HTTP2_PROTOCOL_ERROR = 0x1,
+	HTTP2_INTERNAL_ERROR = 0x2,
+	HTTP2_FLOW_CONTROL_ERROR = 0x3,
+	HTTP2_STREAM_CLOSED = 0x5,
+	HTTP2_FRAME_SIZE_ERROR = 0x6,
+	HTTP2_REFUSED_STREAM = 0x7,
+	HTTP2_COMPRESSION_ERROR = 0x9,
+	HTTP2_ENHANCE_YOUR_CALM = 0xb
+};
+
+/**
+ * http2_response - response to a request of a stream
+ * @code: status code of the response
+ * @headers: headers of the response, the names are lowercased on the wire
+ * @n_headers: number of element in headers
+ * @fd: file to send as body, -1 for no body, the stream closes it
+ * @offset: offset of the first byte of the body in fd
+ * @count: size of the body
+ * @release: called once headers has been encoded, NULL if not needed
+ * @arg: argument of release
+ */
+struct http2_response {
+	enum status_code code;
+	const struct http_header *headers;
+	size_t n_headers;
+	int fd;
+	off_t offset;
+	size_t count;
+	void (*release)(void *arg);
+	void *arg;
+};
+
+/**
+ * http2_handler - serve the request stored in session->req
+ * @session: http_session of the connection
+ * @resp: where to store the response
+ * @arg: argument given to http2_serve()
+ * return -1 if the stream should be reset instead of answered.
+ */
+typedef int (*http2_handler)(struct http_session *session,
+			     struct http2_response *resp,
+			     void *arg);
+
+/**
+ * http2_is_preface - return true if the request read by
+ * read_http_request() is the start of the HTTP/2 client preface
+ * @session: http_session with a request read
+ */
+bool http2_is_preface(const struct http_session *session);
+
+/**
+ * http2_is_upgrade - return true if the parsed request asks to upgrade
+ * to HTTP/2 over cleartext TCP
+ * @req: parsed http request
+ */
+bool http2_is_upgrade(const struct http_request *req);
+
+/**
+ * http2_serve - serve an HTTP/2 connection till it ends
+ * @session: http_session of the connection
+ * @handler: called for every request
+ * @arg: argument of handler
+ * when session->req is an h2c upgrade, the 101 response is sent and the
+ * request is answered on stream 1, otherwise the client preface is
+ * expected next, or its rest if read_http_request() read its start.
+ * The streams are served by the calling thread: the requests are
+ * answered as soon as their header is complete, then the bodies are
+ * sent a frame at a time, in turn, as the flow control windows allow,
+ * with sendfile(2).
+ * return 0 when the connection ends cleanly, -1 otherwise.
+ */
+int http2_serve(struct http_session *session, http2_handler handler, void *arg);
+
+#endif
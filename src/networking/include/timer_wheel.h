@@ -0,0 +1,112 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "list.h"
+
+/* slots of a wheel, a power of 2 */
+#define TIMER_WHEEL_SLOTS 512
+/* default length of a tick in milliseconds */
+#define TIMER_WHEEL_TICK_MS 100
+
+/**
+ * timer - a timer armed on a timer_wheel
+ * @list: entry of the slot of the wheel
+ * @expires: tick the timer expires at
+ * @armed: true while the timer is in a slot
+ * @expire: called once the timer expires, with the wheel locked, so it
+ * must be short and must not touch the wheel
+ * @arg: argument of expire
+ */
+struct timer {
+	struct list_head list;
+	uint64_t expires;
+	bool armed;
+	void (*expire)(void *arg);
+	void *arg;
+};
+
+/**
+ * timer_wheel - hashed timing wheel
+ * @slots: timers by expiry tick modulo TIMER_WHEEL_SLOTS, unsorted, a
+ * timer more than a round away waits in its slot for its round
+ * @tick: last tick processed
+ * @tick_ms: length of a tick in milliseconds
+ * @mutex: protects the wheel, the owner arms and cancels while the
+ * timer service advances it
+ * @registered: entry of the wheels advanced by the timer service
+ */
+struct timer_wheel {
+	struct list_head slots[TIMER_WHEEL_SLOTS];
+	uint64_t tick;
+	unsigned int tick_ms;
+	pthread_mutex_t mutex;
+	struct list_head registered;
+};
+
+/**
+ * timer_wheel_init - init an empty wheel and register it to the
+ * timer service
+ * @wheel: wheel to init
+ * @tick_ms: length of a tick, the resolution of the timers
+ */
+int timer_wheel_init(struct timer_wheel *wheel, unsigned int tick_ms);
+
+/**
+ * timer_wheel_destroy - unregister a wheel, its timers are dropped
+ * @wheel: wheel initialized by timer_wheel_init()
+ */
+void timer_wheel_destroy(struct timer_wheel *wheel);
+
+/**
+ * timer_init - init a disarmed timer
+ * @timer: timer to init
+ * @expire: called when the timer expires
+ * @arg: argument of expire
+ */
+void timer_init(struct timer *timer, void (*expire)(void *arg), void *arg);
+
+/**
+ * timer_arm - arm a timer to expire in ms milliseconds, in O(1)
+ * @wheel: wheel of the timer
+ * @timer: timer to arm, if armed it is moved to its new expiry
+ * @ms: milliseconds from now, rounded up to a tick
+ */
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, unsigned int ms);
+
+/**
+ * timer_cancel - disarm a timer in O(1)
+ * @wheel: wheel of the timer
+ * @timer: timer to disarm, nothing happens if it is not armed
+ * once the call returns the expire callback of the timer is not running
+ * and won't run.
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+/**
+ * timer_wheel_advance - expire the timers due up to now
+ * @wheel: wheel to advance
+ * every tick elapsed since the last call is processed, a whole slot at
+ * a time.
+ * return the number of timers expired.
+ */
+size_t timer_wheel_advance(struct timer_wheel *wheel);
+
+/**
+ * timer_service_start - start the thread advancing the registered wheels
+ * @tick_ms: milliseconds between two rounds of the thread
+ */
+int timer_service_start(unsigned int tick_ms);
+
+/**
+ * timer_service_stop - stop the thread started by timer_service_start()
+ */
+void timer_service_stop(void);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/* protocols offered with ALPN, in order of preference */
+#define TLS_ALPN_H2 "h2"
+#define TLS_ALPN_HTTP1 "http/1.1"
+/* size of the plaintext of a full TLS record */
+#define TLS_RECORD_SIZE 16384
+
+typedef struct tls_context TLS_CONTEXT;
+typedef struct tls_session TLS_SESSION;
+
+/**
+ * tls_settings - settings of a TLS_CONTEXT
+ * @certificate: path of the PEM certificate chain
+ * @private_key: path of the PEM private key
+ * @ktls: true to hand the record layer to the kernel when it can
+ * @session_cache_size: max number of sessions kept for resumption
+ * @session_timeout: seconds a session can be resumed
+ * @handshake_timeout: max seconds of a handshake
+ */
+struct tls_settings {
+	const char *certificate;
+	const char *private_key;
+	bool ktls;
+	long session_cache_size;
+	long session_timeout;
+	int handshake_timeout;
+};
+
+/**
+ * tls_context_create - create the context of the TLS connections
+ * @settings: settings of the context
+ * the session cache and the session ticket keys belong to the context,
+ * so every worker accepting with it can resume the sessions of the
+ * others. ALPN selects h2 when the client offers it, http/1.1 otherwise.
+ * return NULL in case of error, the reason is logged.
+ */
+TLS_CONTEXT *tls_context_create(const struct tls_settings *settings);
+
+/**
+ * tls_context_destroy - free a context created by tls_context_create()
+ * @ctx: context to free, the sessions using it must be closed
+ */
+void tls_context_destroy(TLS_CONTEXT *ctx);
+
+/**
+ * tls_accept - run the server side handshake on an accepted socket
+ * @ctx: context of the listener
+ * @sock: connected socket, it stays owned by the caller
+ * after the handshake the record layer is moved to the kernel (kTLS)
+ * if the context allows it and both the kernel and the cipher do.
+ * return NULL if the handshake fails or times out, errno is EPROTO
+ * when the peer is at fault.
+ */
+TLS_SESSION *tls_accept(TLS_CONTEXT *ctx, int sock);
+
+/**
+ * tls_close - send close_notify and free a session
+ * @tls: session returned by tls_accept()
+ */
+void tls_close(TLS_SESSION *tls);
+
+/**
+ * tls_recv - read up to n bytes of plaintext
+ * return the bytes read, 0 at the end of the connection, -1 otherwise.
+ */
+ssize_t tls_recv(TLS_SESSION *tls, void *buf, size_t n);
+
+/**
+ * tls_send - write n bytes of plaintext
+ * return n, -1 in case of error.
+ */
+ssize_t tls_send(TLS_SESSION *tls, const void *buf, size_t n);
+
+/**
+ * tls_sendfile - send count bytes of fd starting at offset
+ * with kTLS the file goes from the page cache to the socket with
+ * SSL_sendfile(), without it the file is read a record at a time and
+ * encrypted in userspace.
+ * return the bytes sent, -1 in case of error.
+ */
+ssize_t tls_sendfile(TLS_SESSION *tls, int fd, off_t offset, size_t count);
+
+/**
+ * tls_pending - return true if plaintext is buffered inside the session,
+ * so that the socket may not be readable while data is available
+ */
+bool tls_pending(const TLS_SESSION *tls);
+
+/**
+ * tls_alpn_is - return true if proto is the protocol selected with ALPN
+ */
+bool tls_alpn_is(const TLS_SESSION *tls, const char *proto);
+
+/**
+ * tls_ktls_send - return true if the kernel encrypts what is sent
+ */
+bool tls_ktls_send(const TLS_SESSION *tls);
+
+#endif
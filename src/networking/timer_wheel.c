@@ -0,0 +1,187 @@
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/**
+ * timer_service - thread advancing every registered wheel
+ * @wheels: registered wheels
+ * @mutex: protects wheels
+ * @tick_ms: sleep between two rounds
+ * @running: false to stop the thread
+ */
+static struct {
+	struct list_head wheels;
+	pthread_mutex_t mutex;
+	pthread_t thread;
+	unsigned int tick_ms;
+	bool running;
+} service = {
+	.wheels = LIST_HEAD_INIT(service.wheels),
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.running = false
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t current_tick(const struct timer_wheel *wheel)
+{
+	return now_ms() / wheel->tick_ms;
+}
+
+int timer_wheel_init(struct timer_wheel *wheel, unsigned int tick_ms)
+{
+	if (wheel == NULL || tick_ms == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (size_t i = 0; i < TIMER_WHEEL_SLOTS; ++i)
+		INIT_LIST_HEAD(&wheel->slots[i]);
+	wheel->tick_ms = tick_ms;
+	wheel->tick = current_tick(wheel);
+	if (pthread_mutex_init(&wheel->mutex, NULL) != 0)
+		return -1;
+	pthread_mutex_lock(&service.mutex);
+	list_add_tail(&wheel->registered, &service.wheels);
+	pthread_mutex_unlock(&service.mutex);
+	return 0;
+}
+
+void timer_wheel_destroy(struct timer_wheel *wheel)
+{
+	struct timer *timer = NULL, *tmp = NULL;
+	if (wheel == NULL)
+		return;
+	pthread_mutex_lock(&service.mutex);
+	list_del(&wheel->registered);
+	pthread_mutex_unlock(&service.mutex);
+	for (size_t i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+		list_for_each_entry_safe(timer, tmp, &wheel->slots[i], list) {
+			list_del(&timer->list);
+			timer->armed = false;
+		}
+	}
+	pthread_mutex_destroy(&wheel->mutex);
+}
+
+void timer_init(struct timer *timer, void (*expire)(void *arg), void *arg)
+{
+	INIT_LIST_HEAD(&timer->list);
+	timer->expires = 0;
+	timer->armed = false;
+	timer->expire = expire;
+	timer->arg = arg;
+}
+
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, unsigned int ms)
+{
+	uint64_t ticks = 0;
+	// a timer never expires early, a partial tick counts as a whole one
+	ticks = (ms + wheel->tick_ms - 1) / wheel->tick_ms;
+	if (ticks == 0)
+		ticks = 1;
+	pthread_mutex_lock(&wheel->mutex);
+	if (timer->armed)
+		list_del(&timer->list);
+	timer->expires = current_tick(wheel) + ticks;
+	timer->armed = true;
+	list_add_tail(&timer->list, &wheel->slots[timer->expires & SLOT_MASK]);
+	pthread_mutex_unlock(&wheel->mutex);
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+	pthread_mutex_lock(&wheel->mutex);
+	if (timer->armed) {
+		list_del(&timer->list);
+		timer->armed = false;
+	}
+	pthread_mutex_unlock(&wheel->mutex);
+}
+
+/**
+ * expire_slot - expire the timers of a slot due at tick
+ * the timers of a later round stay in the slot.
+ */
+static size_t expire_slot(struct list_head *slot, uint64_t tick)
+{
+	struct timer *timer = NULL, *tmp = NULL;
+	size_t n = 0;
+	list_for_each_entry_safe(timer, tmp, slot, list) {
+		if (timer->expires > tick)
+			continue;
+		list_del(&timer->list);
+		timer->armed = false;
+		timer->expire(timer->arg);
+		++n;
+	}
+	return n;
+}
+
+size_t timer_wheel_advance(struct timer_wheel *wheel)
+{
+	uint64_t now = 0;
+	uint64_t tick = 0;
+	size_t n = 0;
+	pthread_mutex_lock(&wheel->mutex);
+	now = current_tick(wheel);
+	// after a whole round every slot has been visited once
+	if (now - wheel->tick > TIMER_WHEEL_SLOTS)
+		wheel->tick = now - TIMER_WHEEL_SLOTS;
+	for (tick = wheel->tick + 1; tick <= now; ++tick)
+		n += expire_slot(&wheel->slots[tick & SLOT_MASK], now);
+	wheel->tick = now;
+	pthread_mutex_unlock(&wheel->mutex);
+	return n;
+}
+
+static void *timer_service_main(void *arg)
+{
+	struct timer_wheel *wheel = NULL;
+	struct timespec tick = {0};
+	(void) arg;
+	tick.tv_sec = service.tick_ms / 1000;
+	tick.tv_nsec = (service.tick_ms % 1000) * 1000000L;
+	while (__atomic_load_n(&service.running, __ATOMIC_RELAXED)) {
+		nanosleep(&tick, NULL);
+		pthread_mutex_lock(&service.mutex);
+		list_for_each_entry(wheel, &service.wheels, registered)
+			timer_wheel_advance(wheel);
+		pthread_mutex_unlock(&service.mutex);
+	}
+	return NULL;
+}
+
+int timer_service_start(unsigned int tick_ms)
+{
+	int err = 0;
+	if (tick_ms == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (service.running) {
+		errno = EALREADY;
+		return -1;
+	}
+	service.tick_ms = tick_ms;
+	service.running = true;
+	err = pthread_create(&service.thread, NULL, timer_service_main, NULL);
+	if (err != 0) {
+		service.running = false;
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+void timer_service_stop(void)
+{
+	if (!service.running)
+		return;
+	__atomic_store_n(&service.running, false, __ATOMIC_RELAXED);
+	pthread_join(service.thread, NULL);
+}
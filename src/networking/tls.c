@@ -0,0 +1,258 @@
+#include "tls.h"
+
+/* ALPN protocol list of the server, length prefixed */
+static const unsigned char alpn_protos[] =
+	"\x02" TLS_ALPN_H2 "\x08" TLS_ALPN_HTTP1;
+/* id of the sessions cached by the server */
+static const unsigned char session_id_context[] = "QWHttpServer";
+
+struct tls_context {
+	SSL_CTX *ctx;
+	int handshake_timeout;
+};
+
+struct tls_session {
+	SSL *ssl;
+	bool ktls_send;
+};
+
+static int log_error(const char *str, size_t len, void *arg)
+{
+	syslog(LOG_ERR, "%s: %.*s\n", (const char *)arg, (int)len, str);
+	return 1;
+}
+
+/**
+ * select_alpn - ALPN callback, select the first protocol of alpn_protos
+ * offered by the client
+ */
+static int select_alpn(SSL *ssl,
+		       const unsigned char **out,
+		       unsigned char *outlen,
+		       const unsigned char *in,
+		       unsigned int inlen,
+		       void *arg)
+{
+	unsigned char *selected = NULL;
+	(void) ssl;
+	(void) arg;
+	if (SSL_select_next_proto(&selected, outlen,
+				  alpn_protos, sizeof(alpn_protos) - 1,
+				  in, inlen) != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+	*out = selected;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+TLS_CONTEXT *tls_context_create(const struct tls_settings *settings)
+{
+	TLS_CONTEXT *tc = NULL;
+	if (settings == NULL || settings->certificate == NULL ||
+	    settings->private_key == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	tc = malloc(sizeof(*tc));
+	if (tc == NULL)
+		return NULL;
+	tc->handshake_timeout = settings->handshake_timeout;
+	tc->ctx = SSL_CTX_new(TLS_server_method());
+	if (tc->ctx == NULL)
+		goto error;
+	SSL_CTX_set_min_proto_version(tc->ctx, TLS1_2_VERSION);
+	// an EOF without close_notify, e.g. once a deadline shut down the
+	// reads, ends the session like one, not with a fatal alert
+	SSL_CTX_set_options(tc->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+	if (settings->ktls)
+		SSL_CTX_set_options(tc->ctx, SSL_OP_ENABLE_KTLS);
+	if (SSL_CTX_use_certificate_chain_file(tc->ctx, settings->certificate) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(tc->ctx, settings->private_key, SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(tc->ctx) != 1)
+		goto error;
+	// sessions by id and by ticket, both shared by the workers of the context
+	SSL_CTX_set_session_cache_mode(tc->ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(tc->ctx, session_id_context,
+				       sizeof(session_id_context) - 1);
+	SSL_CTX_sess_set_cache_size(tc->ctx, settings->session_cache_size);
+	SSL_CTX_set_timeout(tc->ctx, settings->session_timeout);
+	SSL_CTX_set_alpn_select_cb(tc->ctx, select_alpn, NULL);
+	return tc;
+error:
+	ERR_print_errors_cb(log_error, "tls");
+	if (tc->ctx != NULL)
+		SSL_CTX_free(tc->ctx);
+	free(tc);
+	errno = EINVAL;
+	return NULL;
+}
+
+void tls_context_destroy(TLS_CONTEXT *ctx)
+{
+	if (ctx == NULL)
+		return;
+	SSL_CTX_free(ctx->ctx);
+	free(ctx);
+}
+
+static void set_timeout(int sock, int seconds)
+{
+	struct timeval tv = {0};
+	tv.tv_sec = seconds;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+TLS_SESSION *tls_accept(TLS_CONTEXT *ctx, int sock)
+{
+	TLS_SESSION *tls = NULL;
+	int res = 0;
+	if (ctx == NULL || sock < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	tls = malloc(sizeof(*tls));
+	if (tls == NULL)
+		return NULL;
+	tls->ssl = SSL_new(ctx->ctx);
+	if (tls->ssl == NULL || SSL_set_fd(tls->ssl, sock) != 1) {
+		ERR_clear_error();
+		SSL_free(tls->ssl);
+		free(tls);
+		errno = ENOMEM;
+		return NULL;
+	}
+	// a client stalling the handshake can't hold the worker
+	set_timeout(sock, ctx->handshake_timeout);
+	res = SSL_accept(tls->ssl);
+	set_timeout(sock, 0);
+	if (res != 1) {
+		ERR_clear_error();
+		SSL_free(tls->ssl);
+		free(tls);
+		errno = EPROTO;
+		return NULL;
+	}
+	tls->ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+	return tls;
+}
+
+void tls_close(TLS_SESSION *tls)
+{
+	if (tls == NULL)
+		return;
+	// close_notify is best effort, the peer may be gone already
+	SSL_shutdown(tls->ssl);
+	ERR_clear_error();
+	SSL_free(tls->ssl);
+	free(tls);
+}
+
+/**
+ * set_errno - translate the result of a failed SSL call in errno
+ * return 0 if the connection ended cleanly, -1 otherwise.
+ */
+static int set_errno(TLS_SESSION *tls, int res)
+{
+	int err = SSL_get_error(tls->ssl, res);
+	int saved = errno;
+	ERR_clear_error();
+	switch (err) {
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_SYSCALL:
+		// an EOF without close_notify is how most clients leave
+		if (saved == 0)
+			return 0;
+		errno = saved;
+		return -1;
+	default:
+		errno = EPROTO;
+		return -1;
+	}
+}
+
+ssize_t tls_recv(TLS_SESSION *tls, void *buf, size_t n)
+{
+	int rd = 0;
+	if (n > INT32_MAX)
+		n = INT32_MAX;
+	errno = 0;
+	rd = SSL_read(tls->ssl, buf, n);
+	if (rd > 0)
+		return rd;
+	return set_errno(tls, rd);
+}
+
+ssize_t tls_send(TLS_SESSION *tls, const void *buf, size_t n)
+{
+	size_t written = 0;
+	errno = 0;
+	if (n == 0)
+		return 0;
+	if (SSL_write_ex(tls->ssl, buf, n, &written) != 1) {
+		if (set_errno(tls, 0) == 0)
+			errno = EPIPE;
+		return -1;
+	}
+	return written;
+}
+
+ssize_t tls_sendfile(TLS_SESSION *tls, int fd, off_t offset, size_t count)
+{
+	char buf[TLS_RECORD_SIZE];
+	size_t left = count;
+	ssize_t wr = 0;
+	ssize_t rd = 0;
+	while (left > 0) {
+		if (tls->ktls_send) {
+			errno = 0;
+			wr = SSL_sendfile(tls->ssl, fd, offset, left, 0);
+			if (wr < 0 && errno == EINTR)
+				continue;
+			if (wr <= 0) {
+				ERR_clear_error();
+				if (wr == 0)
+					errno = EIO;
+				return -1;
+			}
+		} else {
+			rd = pread(fd, buf, (left < sizeof(buf)) ? left : sizeof(buf), offset);
+			if (rd < 0 && errno == EINTR)
+				continue;
+			if (rd <= 0) {
+				// the file was truncated while being sent
+				if (rd == 0)
+					errno = EIO;
+				return -1;
+			}
+			wr = tls_send(tls, buf, rd);
+			if (wr < 0)
+				return -1;
+		}
+		offset += wr;
+		left -= wr;
+	}
+	return count;
+}
+
+bool tls_pending(const TLS_SESSION *tls)
+{
+	return SSL_pending(tls->ssl) > 0;
+}
+
+bool tls_alpn_is(const TLS_SESSION *tls, const char *proto)
+{
+	const unsigned char *data = NULL;
+	unsigned int len = 0;
+	SSL_get0_alpn_selected(tls->ssl, &data, &len);
+	return data != NULL && len == strlen(proto) && memcmp(data, proto, len) == 0;
+}
+
+bool tls_ktls_send(const TLS_SESSION *tls)
+{
+	return tls->ktls_send;
+}
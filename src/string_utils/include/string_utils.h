@@ -6,6 +6,8 @@
 #include <errno.h>
 #include <limits.h>
 
+#include "arena.h"
+
 char *string_concat(const char *s1, const char *s2);
 /* string_concat() will concat the string s1 and s2
  * in a new malloc(2) allocated string.
@@ -14,6 +16,14 @@ char *string_concat(const char *s1, const char *s2);
  * valid pointer to the new string otherwise.
  */
 
+char *string_arena_concat(struct arena *arena, const char *s1, const char *s2);
+/* string_arena_concat() will concat the string s1 and s2
+ * in a new string allocated in arena, it is freed with the arena.
+ * RETURN:
+ * This function return NULL in case of failure, or a
+ * valid pointer to the new string otherwise.
+ */
+
 char *string_trim(const char *s1, char ch);
 /* string_trim() will trim all occurrence of consecutive ch 
  * from the start and the end of s and save it in a new string.
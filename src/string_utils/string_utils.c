@@ -20,6 +20,25 @@ char *string_concat(const char *s1, const char *s2)
 	return res;
 }
 
+char *string_arena_concat(struct arena *arena, const char *s1, const char *s2)
+{
+	char *res = NULL;
+	size_t len1 = 0;
+	size_t len2 = 0;
+	if (arena == NULL || s1 == NULL || s2 == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	len1 = strlen(s1);
+	len2 = strlen(s2);
+	res = arena_alloc(arena, len1 + len2 + 1);
+	if (res == NULL)
+		return NULL;
+	memcpy(res, s1, len1);
+	memcpy(res + len1, s2, len2 + 1);
+	return res;
+}
+
 size_t string_count_char_occurrence(const char *s, char ch)
 {
 	/* count all occurrence of ch inside s*/
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "hpack.h"
+
+#define MAX_FIELDS 16
+
+/**
+ * hpack_case - a header block and what hpack_decode() should make of it
+ * @name: name of the case
+ * @block: the header block
+ * @len: size of block
+ * @fields: expected fields as name, value pairs, NULL terminated
+ * @err: expected errno, 0 if the block must decode
+ * the cases of a group share the dynamic table, in order.
+ */
+struct hpack_case {
+	const char *name;
+	const unsigned char *block;
+	size_t len;
+	const char *fields[2 * MAX_FIELDS + 1];
+	int err;
+};
+
+#define BLOCK(...) (const unsigned char []){__VA_ARGS__}, \
+	sizeof((const unsigned char []){__VA_ARGS__})
+
+/* RFC 7541 C.3, requests without Huffman coding */
+static const struct hpack_case plain[] = {
+	{"C.3.1", BLOCK(0x82, 0x86, 0x84, 0x41, 0x0f, 0x77, 0x77, 0x77, 0x2e, 0x65,
+			0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x2e, 0x63, 0x6f, 0x6d),
+	 {":method", "GET", ":scheme", "http", ":path", "/",
+	  ":authority", "www.example.com", NULL}, 0},
+	{"C.3.2", BLOCK(0x82, 0x86, 0x84, 0xbe, 0x58, 0x08, 0x6e, 0x6f, 0x2d, 0x63,
+			0x61, 0x63, 0x68, 0x65),
+	 {":method", "GET", ":scheme", "http", ":path", "/",
+	  ":authority", "www.example.com", "cache-control", "no-cache", NULL}, 0},
+	{"C.3.3", BLOCK(0x82, 0x87, 0x85, 0xbf, 0x40, 0x0a, 0x63, 0x75, 0x73, 0x74,
+			0x6f, 0x6d, 0x2d, 0x6b, 0x65, 0x79, 0x0c, 0x63, 0x75, 0x73,
+			0x74, 0x6f, 0x6d, 0x2d, 0x76, 0x61, 0x6c, 0x75, 0x65),
+	 {":method", "GET", ":scheme", "https", ":path", "/index.html",
+	  ":authority", "www.example.com", "custom-key", "custom-value", NULL}, 0},
+	/* a size update after the first field */
+	{"late size update", BLOCK(0x82, 0x3f, 0xe1, 0x1f), {NULL}, EPROTO},
+	/* a size update at the start empties the table, then fills it again */
+	{"size update to 0", BLOCK(0x20, 0x82), {":method", "GET", NULL}, 0},
+	{"evicted index", BLOCK(0xbe), {NULL}, EPROTO},
+	{"size update to the limit", BLOCK(0x3f, 0xe1, 0x1f, 0x82),
+	 {":method", "GET", NULL}, 0},
+	{"size update over the limit", BLOCK(0x3f, 0xe2, 0x1f), {NULL}, EPROTO},
+	{"two size updates", BLOCK(0x20, 0x3f, 0xe1, 0x1f, 0x82),
+	 {":method", "GET", NULL}, 0},
+	{NULL, NULL, 0, {NULL}, 0},
+};
+
+/* RFC 7541 C.4, the same requests with Huffman coding */
+static const struct hpack_case huffman[] = {
+	{"C.4.1", BLOCK(0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2,
+			0x3a, 0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff),
+	 {":method", "GET", ":scheme", "http", ":path", "/",
+	  ":authority", "www.example.com", NULL}, 0},
+	{"C.4.2", BLOCK(0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64,
+			0x9c, 0xbf),
+	 {":method", "GET", ":scheme", "http", ":path", "/",
+	  ":authority", "www.example.com", "cache-control", "no-cache", NULL}, 0},
+	{"C.4.3", BLOCK(0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8, 0x49, 0xe9,
+			0x5b, 0xa9, 0x7d, 0x7f, 0x89, 0x25, 0xa8, 0x49, 0xe9, 0x5b,
+			0xb8, 0xe8, 0xb4, 0xbf),
+	 {":method", "GET", ":scheme", "https", ":path", "/index.html",
+	  ":authority", "www.example.com", "custom-key", "custom-value", NULL}, 0},
+	/* "a" is 00011, padded with ones */
+	{"padding of ones", BLOCK(0x00, 0x81, 0x1f, 0x81, 0x1f), {"a", "a", NULL}, 0},
+	{"padding of zeros", BLOCK(0x00, 0x81, 0x18, 0x00), {NULL}, EPROTO},
+	{"padding of 8 bits", BLOCK(0x00, 0x82, 0x1f, 0xff, 0x00), {NULL}, EPROTO},
+	{"EOS", BLOCK(0x00, 0x84, 0xff, 0xff, 0xff, 0xff, 0x00), {NULL}, EPROTO},
+	{"empty string", BLOCK(0x00, 0x80, 0x80), {"", "", NULL}, 0},
+	{NULL, NULL, 0, {NULL}, 0},
+};
+
+/* integers and indexes */
+static const struct hpack_case integers[] = {
+	{"index 0", BLOCK(0x80), {NULL}, EPROTO},
+	{"index past the tables", BLOCK(0xbe), {NULL}, EPROTO},
+	{"last static index", BLOCK(0xbd), {"www-authenticate", "", NULL}, 0},
+	/* 127 + 127 + 127 * 128 + 127 * 128^2 + 127 * 128^3 > 2^28 */
+	{"integer over 2^28", BLOCK(0xff, 0xff, 0xff, 0xff, 0x7f), {NULL}, EPROTO},
+	{"integer of 6 bytes", BLOCK(0xff, 0x80, 0x80, 0x80, 0x80, 0x00), {NULL}, EPROTO},
+	{"endless integer", BLOCK(0xff, 0xff, 0xff), {NULL}, EPROTO},
+	{"truncated integer", BLOCK(0xff), {NULL}, EPROTO},
+	{"string length over 2^28", BLOCK(0x00, 0x7f, 0xff, 0xff, 0xff, 0x7f), {NULL}, EPROTO},
+	{"string past the block", BLOCK(0x00, 0x05, 0x61), {NULL}, EPROTO},
+	{"missing value", BLOCK(0x00, 0x01, 0x61), {NULL}, EPROTO},
+	{"never indexed", BLOCK(0x10, 0x01, 0x61, 0x01, 0x62), {"a", "b", NULL}, 0},
+	{"not indexed", BLOCK(0xbe), {NULL}, EPROTO},
+	{NULL, NULL, 0, {NULL}, 0},
+};
+
+static int check(struct hpack_table *table, const struct hpack_case *c, size_t buf_size)
+{
+	struct hpack_field fields[MAX_FIELDS];
+	char buf[4096];
+	size_t n = 0;
+	int res = 0;
+	errno = 0;
+	res = hpack_decode(table, c->block, c->len, buf, buf_size, fields, MAX_FIELDS);
+	if (c->err != 0) {
+		if (res >= 0 || errno != c->err) {
+			printf("FAIL %s: returned %d, errno %d, expected errno %d\n",
+			       c->name, res, errno, c->err);
+			return -1;
+		}
+		return 0;
+	}
+	if (res < 0) {
+		printf("FAIL %s: %s\n", c->name, strerror(errno));
+		return -1;
+	}
+	for (n = 0; c->fields[2 * n] != NULL; ++n) {
+		if ((size_t)res <= n ||
+		    strcmp(fields[n].name, c->fields[2 * n]) != 0 ||
+		    strcmp(fields[n].value, c->fields[2 * n + 1]) != 0) {
+			printf("FAIL %s: field %zu is not %s: %s\n", c->name, n,
+			       c->fields[2 * n], c->fields[2 * n + 1]);
+			return -1;
+		}
+	}
+	if ((size_t)res != n) {
+		printf("FAIL %s: %d fields, expected %zu\n", c->name, res, n);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * run_group - decode the cases of a group with a new dynamic table
+ */
+static int run_group(const struct hpack_case *cases, size_t *total)
+{
+	struct hpack_table table;
+	int failed = 0;
+	if (hpack_table_init(&table, HPACK_DEFAULT_TABLE_SIZE) < 0)
+		return 1;
+	for (; cases->name != NULL; ++cases, ++*total) {
+		if (check(&table, cases, 4096) < 0)
+			++failed;
+	}
+	hpack_table_free(&table);
+	return failed;
+}
+
+/**
+ * run_small_buffer - fields which don't fit in the buffer are not an
+ * error of the block
+ */
+static int run_small_buffer(size_t *total)
+{
+	const struct hpack_case c = {"small buffer", BLOCK(0x82, 0x86),
+				     {NULL}, ENOBUFS};
+	const struct hpack_case h = {"small buffer, Huffman",
+				     BLOCK(0x00, 0x81, 0x1f, 0x8c, 0xf1, 0xe3, 0xc2,
+					   0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90,
+					   0xf4, 0xff),
+				     {NULL}, ENOBUFS};
+	struct hpack_table table;
+	int failed = 0;
+	if (hpack_table_init(&table, HPACK_DEFAULT_TABLE_SIZE) < 0)
+		return 1;
+	failed += check(&table, &c, 8) < 0;
+	failed += check(&table, &h, 8) < 0;
+	*total += 2;
+	hpack_table_free(&table);
+	return failed;
+}
+
+int main(void)
+{
+	size_t total = 0;
+	int failed = 0;
+	failed += run_group(plain, &total);
+	failed += run_group(huffman, &total);
+	failed += run_group(integers, &total);
+	failed += run_small_buffer(&total);
+	printf("%zu/%zu passed\n", total - failed, total);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -9,6 +9,7 @@ int main(int argc, char **argv)
 	LISTENER_CONNECTION *listener = NULL;
 	struct http_session *session = NULL;
 	struct CONNECTION_attr attr;
+	struct http_timeouts timeouts = {60, 60, 60};
 	if (argc < 2) {
 		fprintf(stderr, "%s port\n", *argv);
 		return EXIT_FAILURE;
@@ -19,11 +20,12 @@ int main(int argc, char **argv)
 	}
 	attr.write_buffer_size = 64;
 	attr.read_buffer_size = 64;
+	attr.thread_safe = false;
 	attr.socket_type = ACCEPT;
 	attr.listener = listener;
 	attr.addr = NULL;
 	attr.addr_len = NULL;
-	session = http_session_create(&attr, 60, 128, 128);
+	session = http_session_create(&attr, 30, &timeouts, 128, 128);
 	if (session == NULL) {
 		return EXIT_FAILURE;
 	}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jpeg_processing.h"
+
+/*
+ * jpeg_bench - compare the encodes per second, on a single core, of the
+ * full ImageMagick pipeline and of the libjpeg-turbo fast path when
+ * re-encoding a jpeg at a lower quality.
+ * usage: jpeg_bench image.jpg [quality] [iterations] [width]
+ */
+
+#define OUTPUT_PATH "/tmp/jpeg_bench.jpg"
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int magick_encode(const char *src, int quality, int width)
+{
+	MagickWand *mw = NULL;
+	MagickBooleanType res = MagickFalse;
+	size_t height = 0;
+	mw = NewMagickWand();
+	if (mw == NULL)
+		return -1;
+	res = MagickReadImage(mw, src);
+	if (res != MagickFalse && width > 0 &&
+	    (size_t)width < MagickGetImageWidth(mw)) {
+		height = MagickGetImageHeight(mw) * width / MagickGetImageWidth(mw);
+		res = MagickResizeImage(mw, width, height, LanczosFilter, 1.0);
+	}
+	if (res != MagickFalse)
+		res = MagickSetImageCompressionQuality(mw, quality);
+	if (res != MagickFalse)
+		res = MagickWriteImage(mw, OUTPUT_PATH);
+	DestroyMagickWand(mw);
+	return (res == MagickFalse) ? -1 : 0;
+}
+
+static int fast_encode(const char *src, int quality, int width)
+{
+	struct jpeg_image img = {0};
+	int res = 0;
+	res = jpeg_decode(src, width, &img);
+	if (res < 0)
+		return -1;
+	res = jpeg_encode(&img, OUTPUT_PATH, quality);
+	jpeg_image_free(&img);
+	return res;
+}
+
+static double run(const char *name,
+		  int (*encode)(const char *, int, int),
+		  const char *src, int quality, int iterations, int width)
+{
+	struct timespec start = {0};
+	double secs = 0.0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < iterations; ++i) {
+		if (encode(src, quality, width) < 0) {
+			fprintf(stderr, "%s: encode failed at %d-th iteration\n",
+				name, i);
+			return -1.0;
+		}
+	}
+	secs = elapsed(&start);
+	printf("%-12s %6d encodes in %8.3fs: %8.2f encodes/s\n",
+	       name, iterations, secs, iterations / secs);
+	return iterations / secs;
+}
+
+int main(int argc, char **argv)
+{
+	int quality = 50;
+	int iterations = 20;
+	int width = 0;
+	double magick = 0.0;
+	double fast = 0.0;
+	if (argc < 2) {
+		fprintf(stderr, "%s image.jpg [quality] [iterations] [width]\n", *argv);
+		return EXIT_FAILURE;
+	}
+	if (argc > 2)
+		quality = atoi(argv[2]);
+	if (argc > 3)
+		iterations = atoi(argv[3]);
+	if (argc > 4)
+		width = atoi(argv[4]);
+	if (!is_jpeg_file(argv[1])) {
+		fprintf(stderr, "%s: not a jpeg\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	MagickWandGenesis();
+	magick = run("imagemagick", magick_encode, argv[1], quality, iterations, width);
+	fast = run("libjpeg", fast_encode, argv[1], quality, iterations, width);
+	MagickWandTerminus();
+	remove(OUTPUT_PATH);
+	if (magick <= 0.0 || fast <= 0.0)
+		return EXIT_FAILURE;
+	printf("speedup: %.2fx\n", fast / magick);
+	return EXIT_SUCCESS;
+}
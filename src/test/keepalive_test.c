@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "http.h"
+#include "connection.h"
+#include "timer_wheel.h"
+
+#define MAX_STEPS 4
+
+/**
+ * step - data the client sends after a pause
+ * @delay_ms: pause before sending
+ * @data: data to send, NULL ends the steps
+ */
+struct step {
+	int delay_ms;
+	const char *data;
+};
+
+/**
+ * keepalive_case - a client pacing its requests and what
+ * read_http_request() should make of them
+ * @name: name of the case
+ * @idle: keepalive_timeout of the session
+ * @header: header_timeout of the session
+ * @steps: what the client sends
+ * @requests: number of requests that must be read
+ * @err: errno of the read after them, 0 if none is done
+ */
+struct keepalive_case {
+	const char *name;
+	int idle;
+	int header;
+	struct step steps[MAX_STEPS];
+	int requests;
+	int err;
+};
+
+#define REQUEST "GET / HTTP/1.1\r\nHost: a\r\n\r\n"
+
+static const struct keepalive_case cases[] = {
+	/* longer than the timeout of the shipped config, 1 s, used to be */
+	{"idle 2 s of 3", 3, 3, {{0, REQUEST}, {2000, REQUEST}, {0, NULL}}, 2, 0},
+	{"idle past the deadline", 1, 3, {{0, REQUEST}, {0, NULL}}, 1, ETIMEDOUT},
+	{"header in 1 s of 2", 3, 2,
+	 {{0, "GET / HTTP/1.1\r\n"}, {1000, "Host: a\r\n\r\n"}, {0, NULL}}, 1, 0},
+	{"header past the deadline", 3, 1,
+	 {{0, "GET / HTTP/1.1\r\n"}, {2000, "Host: a\r\n\r\n"}, {0, NULL}}, 0, ETIMEDOUT},
+	/* a byte at a time doesn't restart the deadline */
+	{"header trickled", 3, 1,
+	 {{0, "GET / HTTP/1.1\r\n"}, {600, "H"}, {600, "o"}, {600, "st: a\r\n\r\n"}},
+	 0, ETIMEDOUT},
+};
+
+struct client {
+	int sock;
+	const struct step *steps;
+};
+
+static void *client_main(void *arg)
+{
+	struct client *client = arg;
+	struct timespec delay = {0};
+	for (int i = 0; i < MAX_STEPS && client->steps[i].data != NULL; ++i) {
+		delay.tv_sec = client->steps[i].delay_ms / 1000;
+		delay.tv_nsec = (client->steps[i].delay_ms % 1000) * 1000000L;
+		nanosleep(&delay, NULL);
+		send(client->sock, client->steps[i].data,
+		     strlen(client->steps[i].data), MSG_NOSIGNAL);
+	}
+	return NULL;
+}
+
+static int run(struct http_session *session, const struct keepalive_case *c)
+{
+	int i = 0;
+	for (i = 0; i < c->requests; ++i) {
+		reset_http_session(session);
+		if (read_http_request(session) < 0) {
+			printf("FAIL %s: request %d: %s\n", c->name, i, strerror(errno));
+			return -1;
+		}
+	}
+	if (c->err == 0)
+		return 0;
+	reset_http_session(session);
+	errno = 0;
+	if (read_http_request(session) == 0 || errno != c->err) {
+		printf("FAIL %s: request %d: %s, expected %s\n", c->name, i,
+		       strerror(errno), strerror(c->err));
+		return -1;
+	}
+	// the deadline stopped only the reads, an answer can still go
+	if (csend(session->connection, "HTTP/1.1 408 REQUEST TIMEOUT\r\n\r\n", 32) < 0 ||
+	    cflush(session->connection) < 0) {
+		printf("FAIL %s: can't send after the deadline: %s\n", c->name,
+		       strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int check(const struct keepalive_case *c)
+{
+	struct CONNECTION_attr attr = {0};
+	struct http_timeouts timeouts = {c->idle, c->header, 30};
+	struct http_session *session = NULL;
+	struct client client = {0};
+	pthread_t thread;
+	int sv[2] = {-1, -1};
+	int res = 0;
+	attr.write_buffer_size = 64;
+	attr.read_buffer_size = 64;
+	// the socket is connected already, there is no listener
+	attr.socket_type = CONNECT;
+	session = http_session_create(&attr, 30, &timeouts, 128, 128);
+	if (session == NULL)
+		return -1;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 ||
+	    http_adopt_connection(session, sv[0]) < 0) {
+		perror(c->name);
+		http_session_destroy(session);
+		return -1;
+	}
+	client.sock = sv[1];
+	client.steps = c->steps;
+	pthread_create(&thread, NULL, client_main, &client);
+	res = run(session, c);
+	pthread_join(thread, NULL);
+	http_close_connection(session);
+	close(sv[1]);
+	http_session_destroy(session);
+	return res;
+}
+
+int main(void)
+{
+	size_t n = sizeof(cases) / sizeof(*cases);
+	size_t failed = 0;
+	if (timer_service_start(TIMER_WHEEL_TICK_MS) < 0) {
+		perror("timer_service_start");
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		if (check(&cases[i]) < 0)
+			++failed;
+	}
+	timer_service_stop();
+	printf("%zu/%zu passed\n", n - failed, n);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
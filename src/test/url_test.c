@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "http.h"
+
+/**
+ * url_case - an url and what http_canonicalize_url() should make of it
+ * @url: url to canonicalize
+ * @path: expected path, NULL if the url must be rejected
+ * @query: expected query, NULL if none
+ */
+struct url_case {
+	const char *url;
+	const char *path;
+	const char *query;
+};
+
+static const struct url_case cases[] = {
+	{"/", "/", NULL},
+	{"/index.html", "/index.html", NULL},
+	/* ".." never goes above the root */
+	{"/..", "/", NULL},
+	{"/../etc/passwd", "/etc/passwd", NULL},
+	{"/a/../../../etc/passwd", "/etc/passwd", NULL},
+	{"/a/b/../c", "/a/c", NULL},
+	{"/a/./b/.", "/a/b/", NULL},
+	{"/a/b/..", "/a/", NULL},
+	{"/...", "/...", NULL},
+	{"/a..b/..c", "/a..b/..c", NULL},
+	/* dot segments hidden behind escapes are still dot segments */
+	{"/%2e%2e/etc/passwd", "/etc/passwd", NULL},
+	{"/a/%2E%2e/%2e%2E/b", "/b", NULL},
+	{"/a/.%2e/b", "/b", NULL},
+	{"/%2e%2e%2fetc%2fpasswd", "/etc/passwd", NULL},
+	{"/a/b/..%2f..%2f..%2fc", "/c", NULL},
+	/* escapes */
+	{"/a%20b.jpg", "/a b.jpg", NULL},
+	{"/%41%62", "/Ab", NULL},
+	{"/%3f", "/?", NULL},
+	{"/%00", NULL, NULL},
+	{"/a%00b", NULL, NULL},
+	{"/%", NULL, NULL},
+	{"/%4", NULL, NULL},
+	{"/%zz", NULL, NULL},
+	{"/%g0", NULL, NULL},
+	{"/a%2", NULL, NULL},
+	/* slashes */
+	{"//", "/", NULL},
+	{"//a///b//", "/a/b/", NULL},
+	{"/a//..//b", "/b", NULL},
+	/* query and fragment */
+	{"/a.jpg?v=3", "/a.jpg", "v=3"},
+	{"/a.jpg?", "/a.jpg", ""},
+	{"/a.jpg?v=3#top", "/a.jpg", "v=3"},
+	{"/a.jpg#top", "/a.jpg", NULL},
+	{"/a.jpg#top?v=3", "/a.jpg", NULL},
+	{"/x/../a.jpg?p=../b", "/a.jpg", "p=../b"},
+	{"/a%3fb?c", "/a?b", "c"},
+	/* not origin-form */
+	{"", NULL, NULL},
+	{"a/b", NULL, NULL},
+	{"http://host/a", NULL, NULL},
+};
+
+static int check(const struct url_case *c)
+{
+	char url[256] = {0};
+	char *query = NULL;
+	int res = 0;
+	strncpy(url, c->url, sizeof(url) - 1);
+	errno = 0;
+	res = http_canonicalize_url(url, &query);
+	if (c->path == NULL) {
+		if (res == 0 || errno != EINVAL) {
+			printf("FAIL %s: accepted as %s\n", c->url, url);
+			return -1;
+		}
+		return 0;
+	}
+	if (res != 0) {
+		printf("FAIL %s: rejected\n", c->url);
+		return -1;
+	}
+	if (strcmp(url, c->path) != 0) {
+		printf("FAIL %s: path %s, expected %s\n", c->url, url, c->path);
+		return -1;
+	}
+	if ((query == NULL) != (c->query == NULL) ||
+	    (query != NULL && strcmp(query, c->query) != 0)) {
+		printf("FAIL %s: query %s, expected %s\n", c->url,
+		       query ? query : "(none)", c->query ? c->query : "(none)");
+		return -1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	size_t n = sizeof(cases) / sizeof(*cases);
+	size_t failed = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (check(&cases[i]) < 0)
+			++failed;
+	}
+	printf("%zu/%zu passed\n", n - failed, n);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}